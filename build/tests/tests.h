@@ -0,0 +1,198 @@
+void test_audit_shm(void **state) ;
+void test_config_url_maps(void **state) ;
+void test_config_map_value_reorder(void **state) ;
+void test_handle_exits_with_success(void **state) ;
+void test_handle_exits_with_access_denied(void **state) ;
+void test_init_cleanup(void **state) ;
+void test_logging(void **state) ;
+void test_single_request(void **state) ;
+void test_multiple_requests(void **state) ;
+void test_net_keepalive_pool(void **state) ;
+void test_net_keepalive_stale_retry(void **state) ;
+void test_net_recv_deadline(void **state) ;
+void test_net_ssl_stats(void **state) ;
+void test_net_ssl_resume(void **state) ;
+void test_net_async_recv(void **state) ;
+void test_net_recv_benchmark(void **state) ;
+void test_net_pipelined_policy_request(void **state) ;
+void test_net_pipelined_policy_request_closed(void **state) ;
+void test_net_pipelined_policy_request_partial(void **state) ;
+void test_net_resolve_stale_refresh(void **state) ;
+void test_ip6_addresses(void ** state) ;
+void test_ip_ranges(void ** state) ;
+void test_cidr_ip6_notenforced_fetch_attr(void **state) ;
+void test_cidr_ip6_notenforced_get(void **state) ;
+void test_url_notenforced_get(void **state) ;
+void test_deny_url_notenforced_get(void **state) ;
+void test_url_matcher_compiled(void **state) ;
+void test_url_notenforced_inverted_method(void **state) ;
+void test_ip_table(void **state) ;
+void test_ext_notenforced(void **state) ;
+void test_simple_fail(void **state) ;
+void test_simple_notification(void **state) ;
+void test_session_notification_on_policy_cache(void **state) ;
+void test_resource_notification_on_policy_cache(void **state) ;
+void test_pattern_normalisation(void **state) ;
+void test_policy_compare_url(void **state) ;
+void test_compare_pattern_resource(void **state) ;
+void test_am_policy_results(void **state) ;
+void test_policy_select(void **state) ;
+void test_policy_compare_url_benchmark(void **state) ;
+void test_policy_result_reader(void **state) ;
+void test_policy_result_stream_reader(void **state) ;
+void test_policy_cache_simple(void **state) ;
+void test_policy_cache_match(void **state) ;
+void test_policy_cache_index(void **state) ;
+void test_policy_cache_decisions(void **state) ;
+void test_policy_cache_snapshot(void **state) ;
+void test_policy_cache_damaged_cluster(void **state) ;
+void test_policy_cache_status(void **state) ;
+void test_policy_cache_incremental_purge(void **state) ;
+void test_policy_cache_split_records(void **state) ;
+void test_policy_cache_many_resources(void **state) ;
+void test_policy_cache_many_entries(void **state) ;
+void test_policy_cache_sized_for_sessions(void **state) ;
+void test_policy_cache_purge_many_entries(void **state) ;
+void test_policy_cache_purge_during_insert(void **state) ;
+void test_policy_cache_with_many_different_entries_single_session(void **state) ;
+void test_policy_cache_multithread(void **state) ;
+void test_policy_cache_single_flight(void **state) ;
+void test_policy_cache_single_flight_takeover(void **state) ;
+void test_policy_cache_circuit_breaker(void **state) ;
+void test_policy_cache_stale_grace(void **state) ;
+void test_policy_cache_stale_grace_purge(void **state) ;
+void test_policy_cache_resolved_hosts(void **state) ;
+void test_key_creation(void **state) ;
+void test_setup_with_simple_token(void **state) ;
+void test_setup_with_valid_path(void **state) ;
+void test_setup_with_invalid_path(void **state) ;
+void test_setup_with_SAML_token(void **state) ;
+void test_setup_with_resolve_host(void **state) ;
+void test_mem2cpy(void** state) ;
+void test_mem3cpy(void** state) ;
+void test_match(void** state) ;
+void test_match_cached(void** state) ;
+void test_match_cached_threads(void** state) ;
+void test_am_vasprintf(void** state) ;
+void test_am_asprintf(void** state) ;
+void test_am_free(void** state) ;
+void test_am_strldup(void** state) ;
+void test_stristr(void** state) ;
+void test_base64_encode_decode(void** state) ;
+void test_char_count(void** state) ;
+void test_encrypt_decrypt_password(void** state) ;
+void test_xml_entity_escape(void** state) ;
+void test_am_strsep(void** state) ;
+void test_parse_url(void** state) ;
+void test_url_encode_decode(void** state) ;
+void test_url_encode_decode_agent3(void** state) ;
+void test_string_replace(void ** state) ;
+void test_property_map_overrides(void ** state) ;
+void test_property_map_basics(void ** state) ;
+void test_property_map_key_remove(void **state) ;
+void test_copy_file(void **state) ;
+void test_copy_empty_file(void **state) ;
+void test_url_encoding(void **state) ;
+void test_header_value_encoding(void **state) ;
+void test_pathinfo_removal(void **state) ;
+void test_backoff_budget(void **state) ;
+const struct CMUnitTest tests[] = {
+cmocka_unit_test(test_audit_shm),
+cmocka_unit_test(test_config_url_maps),
+cmocka_unit_test(test_config_map_value_reorder),
+cmocka_unit_test(test_handle_exits_with_success),
+cmocka_unit_test(test_handle_exits_with_access_denied),
+cmocka_unit_test(test_init_cleanup),
+cmocka_unit_test(test_logging),
+cmocka_unit_test(test_single_request),
+cmocka_unit_test(test_multiple_requests),
+cmocka_unit_test(test_net_keepalive_pool),
+cmocka_unit_test(test_net_keepalive_stale_retry),
+cmocka_unit_test(test_net_recv_deadline),
+cmocka_unit_test(test_net_ssl_stats),
+cmocka_unit_test(test_net_ssl_resume),
+cmocka_unit_test(test_net_async_recv),
+cmocka_unit_test(test_net_recv_benchmark),
+cmocka_unit_test(test_net_pipelined_policy_request),
+cmocka_unit_test(test_net_pipelined_policy_request_closed),
+cmocka_unit_test(test_net_pipelined_policy_request_partial),
+cmocka_unit_test(test_net_resolve_stale_refresh),
+cmocka_unit_test(test_ip6_addresses),
+cmocka_unit_test(test_ip_ranges),
+cmocka_unit_test(test_cidr_ip6_notenforced_fetch_attr),
+cmocka_unit_test(test_cidr_ip6_notenforced_get),
+cmocka_unit_test(test_url_notenforced_get),
+cmocka_unit_test(test_deny_url_notenforced_get),
+cmocka_unit_test(test_url_matcher_compiled),
+cmocka_unit_test(test_url_notenforced_inverted_method),
+cmocka_unit_test(test_ip_table),
+cmocka_unit_test(test_ext_notenforced),
+cmocka_unit_test(test_simple_fail),
+cmocka_unit_test(test_simple_notification),
+cmocka_unit_test(test_session_notification_on_policy_cache),
+cmocka_unit_test(test_resource_notification_on_policy_cache),
+cmocka_unit_test(test_pattern_normalisation),
+cmocka_unit_test(test_policy_compare_url),
+cmocka_unit_test(test_compare_pattern_resource),
+cmocka_unit_test(test_am_policy_results),
+cmocka_unit_test(test_policy_select),
+cmocka_unit_test(test_policy_compare_url_benchmark),
+cmocka_unit_test(test_policy_result_reader),
+cmocka_unit_test(test_policy_result_stream_reader),
+cmocka_unit_test(test_policy_cache_simple),
+cmocka_unit_test(test_policy_cache_match),
+cmocka_unit_test(test_policy_cache_index),
+cmocka_unit_test(test_policy_cache_decisions),
+cmocka_unit_test(test_policy_cache_snapshot),
+cmocka_unit_test(test_policy_cache_damaged_cluster),
+cmocka_unit_test(test_policy_cache_status),
+cmocka_unit_test(test_policy_cache_incremental_purge),
+cmocka_unit_test(test_policy_cache_split_records),
+cmocka_unit_test(test_policy_cache_many_resources),
+cmocka_unit_test(test_policy_cache_many_entries),
+cmocka_unit_test(test_policy_cache_sized_for_sessions),
+cmocka_unit_test(test_policy_cache_purge_many_entries),
+cmocka_unit_test(test_policy_cache_purge_during_insert),
+cmocka_unit_test(test_policy_cache_with_many_different_entries_single_session),
+cmocka_unit_test(test_policy_cache_multithread),
+cmocka_unit_test(test_policy_cache_single_flight),
+cmocka_unit_test(test_policy_cache_single_flight_takeover),
+cmocka_unit_test(test_policy_cache_circuit_breaker),
+cmocka_unit_test(test_policy_cache_stale_grace),
+cmocka_unit_test(test_policy_cache_stale_grace_purge),
+cmocka_unit_test(test_policy_cache_resolved_hosts),
+cmocka_unit_test(test_key_creation),
+cmocka_unit_test(test_setup_with_simple_token),
+cmocka_unit_test(test_setup_with_valid_path),
+cmocka_unit_test(test_setup_with_invalid_path),
+cmocka_unit_test(test_setup_with_SAML_token),
+cmocka_unit_test(test_setup_with_resolve_host),
+cmocka_unit_test(test_mem2cpy),
+cmocka_unit_test(test_mem3cpy),
+cmocka_unit_test(test_match),
+cmocka_unit_test(test_match_cached),
+cmocka_unit_test(test_match_cached_threads),
+cmocka_unit_test(test_am_vasprintf),
+cmocka_unit_test(test_am_asprintf),
+cmocka_unit_test(test_am_free),
+cmocka_unit_test(test_am_strldup),
+cmocka_unit_test(test_stristr),
+cmocka_unit_test(test_base64_encode_decode),
+cmocka_unit_test(test_char_count),
+cmocka_unit_test(test_encrypt_decrypt_password),
+cmocka_unit_test(test_xml_entity_escape),
+cmocka_unit_test(test_am_strsep),
+cmocka_unit_test(test_parse_url),
+cmocka_unit_test(test_url_encode_decode),
+cmocka_unit_test(test_url_encode_decode_agent3),
+cmocka_unit_test(test_string_replace),
+cmocka_unit_test(test_property_map_overrides),
+cmocka_unit_test(test_property_map_basics),
+cmocka_unit_test(test_property_map_key_remove),
+cmocka_unit_test(test_copy_file),
+cmocka_unit_test(test_copy_empty_file),
+cmocka_unit_test(test_url_encoding),
+cmocka_unit_test(test_header_value_encoding),
+cmocka_unit_test(test_pathinfo_removal),
+cmocka_unit_test(test_backoff_budget),
+};
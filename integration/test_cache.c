@@ -97,6 +97,13 @@ int verify_bucket(struct bucket *bucket)
 
 }
 
+/* thread.c is not linked into this test */
+void am_clock_gettime(struct timespec *ts)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+
+}
+
 static int bucket_identity(void *a, void *b)
 {
     return ((struct bucket *)a)->key == ((struct bucket *)b)->key;
@@ -244,7 +251,7 @@ int main(int argc, char *argv[])
             agent_memory_validate(pid);
 
             t0 = clock();
-            cache_garbage_collect();
+            cache_garbage_collect(0);
             dt = ((double) (clock() - t0)) / CLOCKS_PER_SEC;
 
             cache_stats();
@@ -273,7 +280,7 @@ int main(int argc, char *argv[])
             printf("barrier takes %lf secs\n", dt);
 
             t0 = clock();
-            cache_purge_expired_entries(pid);
+            cache_purge_expired_entries(pid, 0);
             dt = ((double) (clock() - t0)) / CLOCKS_PER_SEC;
 
             printf("expiry scan takes %lf secs\n", dt);
@@ -285,6 +292,45 @@ int main(int argc, char *argv[])
         exit(0);
     }
 
+    if (argc == 2 && strcmp(argv[1], "--probes") == 0)
+    {
+        struct bucket                       bucket;                                   /* report entries compared per lookup, with and without fingerprints */
+        void                               *ptr;
+        uint32_t                            ln, key;
+
+        uint32_t                            n_keys = 0x1ffff;
+
+        initialise_random_buffer();
+
+        for (key = 0; key < n_keys; key++)
+        {
+            write_bucket(key, &bucket);
+
+            cache_add(key, &bucket, offsetof(struct bucket, data) + bucket.ln, time(0) + 60, bucket_identity);
+        }
+
+        cache_stats();
+
+        for (i = 0; i < 8; i++)
+        {
+            for (key = 0; key < n_keys; key++)
+            {
+                bucket.key = key;
+
+                if (cache_get_readlocked_ptr(key, &ptr, &ln, &bucket, time(0), bucket_identity) == 0)
+                {
+                    cache_release_readlocked_ptr(key);
+                }
+            }
+        }
+
+        cache_stats();
+
+        cache_shutdown(1);
+
+        exit(0);
+    }
+
     if (argc == 2 && strcmp(argv[1], "--error") == 0)
     {
         agent_memory_error();                                                         /* one-off trigger global cache reset */
@@ -362,6 +362,26 @@ static void show_version(int argc, char **argv) {
     check_system_resources(AM_TRUE);
 }
 
+/**
+ * print the shared cache statistics of a running agent (AmAgentId, 0 if not set)
+ */
+static void show_cache_status(int argc, char **argv) {
+    int id = argc > 2 ? (int) strtol(argv[2], NULL, 10) : AM_DEFAULT_AGENT_ID;
+    char *report = NULL;
+    int rv = am_cache_status_instance(id, &report);
+
+    if (rv == AM_NOT_FOUND) {
+        fprintf(stdout, "\nThere is no agent cache with id %d (is the agent running?)\n\n", id);
+        exit_status = EXIT_FAILURE;
+    } else if (rv != AM_SUCCESS) {
+        fprintf(stderr, "\nError reading agent cache with id %d: %s\n\n", id, am_strerror(rv));
+        exit_status = EXIT_FAILURE;
+    } else {
+        fprintf(stdout, "\nAgent cache with id %d:\n\n%s\n", id, report);
+    }
+    am_free(report);
+}
+
 static int am_read_instances(const char *path, struct am_conf_entry **list) {
     int ret = 0;
     char buff[AM_PATH_SIZE * 3];
@@ -2498,6 +2518,7 @@ int main(int argc, char **argv) {
         { "--p", password_encrypt },
         { "--d", password_decrypt },
         { "--a", archive_files },
+        { "--t", show_cache_status },
         { NULL }
     };
     
@@ -2681,7 +2702,9 @@ int main(int argc, char **argv) {
             "Encrypt password:\n"
             " agentadmin --p \"key\" \"password\"\n\n"
             "Build and version information:\n"
-            " agentadmin --v\n\n", DESCRIPTION);
+            " agentadmin --v\n\n"
+            "Agent cache statistics (of a running agent):\n"
+            " agentadmin --t [AmAgentId]\n\n", DESCRIPTION);
 
     am_net_options_delete(&net_options);
     return EXIT_SUCCESS;
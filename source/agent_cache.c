@@ -41,18 +41,50 @@
 #include "agent_cache.h"
 #include "rwlock.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FINGERPRINT_SSE2
+#endif
+
 #define STATFILE                            "stats"
 #define LOCKFILE                            "lockfile"
 #define HASHFILE                            "hashtable"
+#define FLIGHTFILE                          "flights"
+#define BREAKERFILE                         "breakers"
+#define RESOLVERFILE                        "resolver"
+
+#define N_LOCKS                             4096                                      /* default and minimum, a power of 2 */
+
+#define MAX_N_LOCKS                         65536
 
-#define N_LOCKS                             4096
+#define HASH_SZ                             6151                                      /* default and minimum */
 
-#define HASH_SZ                             6151
+#define MAX_HASH_SZ                         4194301
+
+#define SLOT_SESSIONS                       4                                         /* sessions per slot, leaving bucket room for their policies */
 
 #define BUCKET_SZ                           256
 
+#define FINGERPRINT_GROUP                   16                                        /* fingerprints compared at once */
+
+#define N_FLIGHTS                           4096                                      /* must be a power of 2 */
+
+#define N_BREAKERS                          64                                        /* must be a power of 2 */
+
+#define BREAKER_URL_SZ                      256                                       /* longer urls get no breaker */
+
+#define N_RESOLVED                          64                                        /* must be a power of 2 */
+
 #define GC_MARKER                           0xa4420810u
 
+#define PURGE_SLICE                         64                                        /* hash table slots purged at a time */
+
+#define N_ATTACHED                          256                                       /* processes tracked as using the cache */
+
+#define SNAPSHOT_MAGIC                      0x414d4353u                               /* AMCS */
+
+#define SNAPSHOT_VERSION                    1
+
 #if defined _WIN32
 
 #define incr(p)                             InterlockedIncrement(p)
@@ -62,6 +94,10 @@
 #define cas(p, old, new)                    (casv(p, old, new) == (old))
 #define yield()                             SwitchToThread()
 
+#define load64(p)                           InterlockedCompareExchange64(p, 0, 0)
+#define store64(p, v)                       InterlockedExchange64(p, v)
+#define cas64(p, old, new)                  (InterlockedCompareExchange64(p, new, old) == (old))
+
 #elif defined(__sun)
 
 #include <sys/atomic.h>
@@ -72,6 +108,10 @@
 #define cas(p, old, new)                    (atomic_cas_32(p, old, new) == (old))
 #define yield()                             sched_yield()
 
+#define load64(p)                           atomic_add_64_nv(p, 0)
+#define store64(p, v)                       atomic_swap_64(p, v)
+#define cas64(p, old, new)                  (atomic_cas_64(p, old, new) == (old))
+
 #else
 
 #define incr(p)                             __sync_fetch_and_add(p, 1)
@@ -81,14 +121,18 @@
 #define cas(p, old, new)                    __sync_bool_compare_and_swap(p, old, new)
 #define yield()                             sched_yield()
 
-#endif
+#define load64(p)                           __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store64(p, v)                       __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define cas64(p, old, new)                  __sync_bool_compare_and_swap(p, old, new)
 
-#ifdef GC_STATS
-#define incr_gc_stat(p)                     incr(p)
-#else
-#define incr_gc_stat(p)
 #endif
 
+/*
+ * the part of a hash not used for picking its hash table slot; entries whose fingerprint differs can't be the same key
+ *
+ */
+#define fingerprint(h)                      ((uint8_t) ((h) / hash_sz))
+
 #ifndef offsetof
 #define offsetof(type, field)               ( (char *)(&((type *)0)->field) - (char *)0 )
 #endif
@@ -115,6 +159,8 @@ struct cache_entry {
 
     volatile uint32_t                       cycles[BUCKET_SZ];
 
+    volatile uint8_t                        fingerprint[BUCKET_SZ];                   /* only valid where bucket[] is set */
+
 };
 
 union cache_stat {
@@ -125,6 +171,14 @@ union cache_stat {
 
 };
 
+union cache_epoch {
+
+    volatile uint64_t                       v;
+
+    uint8_t                                 padding[64];
+
+};
+
 struct cache_gc_stat {
 
     union cache_stat                        leaked, cleared, collected;
@@ -135,25 +189,168 @@ struct stats {
 
     int64_t                                 basetime;
 
+    uint32_t                                hash_sz, n_locks, memory_sz;              /* geometry chosen by the process creating the cache */
+
     union cache_stat                        reads, updates, writes, failures, deletes, expires, lru;
 
+    union cache_stat                        budget;                                   /* requests out of remote call time budget */
+
+    union cache_stat                        trips, stale;                             /* circuit breakers opened, stale entries served */
+
+    union cache_stat                        dns_hits, dns_misses, dns_refreshes;      /* host name resolution cache */
+
+    union cache_stat                        dns_refresh_ms;                           /* total time spent in resolver refreshes */
+
+    union cache_stat                        lookups, probes;                          /* entries compared with the key */
+
+    union cache_stat                        full_probes;                              /* ... without fingerprints (INTEGRATION_TEST) */
+
+    union cache_stat                        hits[CACHE_STAT_TYPES], misses[CACHE_STAT_TYPES];
+
+    union cache_stat                        lock_waits, lock_wait_us;                 /* contended read locks, time spent waiting */
+
+    union cache_stat                        generation;                               /* bumped when cached data is invalidated */
+
+    union cache_epoch                       policy_epoch;                             /* policies created before this are invalid */
+
+    union cache_stat                        recovered;                                /* set when the cache was emptied by recovery */
+
+    union cache_stat                        purge_cursor, gc_cursor;                  /* next slice of the expiry and gc sweeps */
+
     struct cache_gc_stat                    cache, data;
 
+    volatile pid_t                          attached[N_ATTACHED];                     /* processes using the cache, 0 is free */
+
+};
+
+/*
+ * remote call in progress (single-flight), key 0 is a free slot
+ *
+ */
+struct flight {
+
+    volatile uint64_t                       key;
+
+    volatile uint32_t                       expires;
+
+};
+
+/*
+ * circuit breaker for a remote (naming) url, key 0 is a free slot and ~0 one which is being taken over; the slot
+ * belongs to the url, key is just its hash. opened is the time the breaker was opened or a half-open probe call was
+ * let through
+ *
+ */
+struct breaker {
+
+    volatile uint32_t                       key, state, failures, opened;
+
+    char                                    url[BREAKER_URL_SZ];
+
+};
+
+struct breaker_table {
+
+    volatile uint32_t                       grace;                                    /* seconds expired entries are kept for */
+
+    struct breaker                          slot[N_BREAKERS];
+
+};
+
+/*
+ * snapshot file: a header, then a record header followed by the entry data for each valid entry; expiry times are
+ * absolute and an entry is placed by its hash table slot and fingerprint (which depend on the hash table size)
+ *
+ */
+struct snapshot_header {
+
+    uint32_t                                magic, version, hash_sz, reserved;
+
+    uint64_t                                policy_epoch;
+
+    int64_t                                 saved;
+
+};
+
+struct snapshot_record {
+
+    uint32_t                                hash, fingerprint;
+
+    int64_t                                 expires;
+
+    uint32_t                                ln, reserved;
+
+};
+
+/*
+ * resolved addresses of a host, key 0 is a free slot; seq is odd while the entry is being written and
+ * refreshing is the time a refresh was claimed (0 when there is none)
+ *
+ */
+struct resolved {
+
+    volatile uint64_t                       key;
+
+    volatile uint32_t                       key_ln, seq, expires, refreshing;
+
+    uint32_t                                ln;
+    uint8_t                                 data[RESOLVED_DATA_SZ];
+
 };
 
 static const size_t                         user_hdr_sz = offsetof(struct user_entry, data);
 
 static struct stats                        *stats = 0;
 
+static uint32_t                             hash_sz = HASH_SZ, n_locks = N_LOCKS, memory_sz = MAX_CACHE_MEMORY_SZ;
+
+static int                                  created = 0;                              /* this process created the cache */
+
 static struct readlock                     *locks = 0;
 
 static offset                              *hashtable = 0;
 
-static am_shm_t                            *stats_pool = 0, *locks_pool = 0, *hashtable_pool = 0;
+static struct flight                       *flights = 0;
+
+static struct breaker_table                *breakers = 0;
+
+static struct resolved                     *resolved = 0;
+
+static am_shm_t                            *stats_pool = 0, *locks_pool = 0, *hashtable_pool = 0, *flights_pool = 0;
+
+static am_shm_t                            *breakers_pool = 0, *resolved_pool = 0;
+
 
+#define lock_for_hash(h)                    (locks + ((h) & (n_locks - 1)))
 
-#define lock_for_hash(h)                    (locks + ((h) & (N_LOCKS - 1)))
 
+/*
+ * microsecond clock, for timing waits
+ *
+ */
+static uint64_t clock_us() {
+#ifdef _WIN32
+    LARGE_INTEGER                           c, f;
+
+    QueryPerformanceCounter(&c);
+    QueryPerformanceFrequency(&f);
+    return (uint64_t) (c.QuadPart / (f.QuadPart / 1000000.0));
+#else
+    struct timeval                          tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static void add_stat(volatile uint32_t *p, uint32_t n) {
+
+    uint32_t                                v;
+
+    while ((v = *p), !cas(p, v, v + n))
+        ;
+
+}
 
 static void reset_stats(void *cbdata, void *p) {
 
@@ -164,7 +361,12 @@ static void reset_stats(void *cbdata, void *p) {
     memset(stats, 0, sizeof(struct stats));
 
     stats->basetime = time(0);
-    
+    stats->hash_sz = hash_sz;
+    stats->n_locks = n_locks;
+    stats->memory_sz = memory_sz;
+
+    created = 1;
+
     AM_LOG_DEBUG(0, "%s cache stats reset", thisfunc);
 }
 
@@ -176,13 +378,47 @@ static void reset_hashtable(void *cbdata, void *p) {
 
     int                                     i;
 
-    for (i = 0; i < HASH_SZ; i++) {
+    for (i = 0; i < hash_sz; i++) {
         table[i] = ~ 0;
     }
 
     AM_LOG_DEBUG(0, "%s cache hashtable reset", thisfunc);
 }
 
+static void reset_flights(void *cbdata, void *p) {
+
+    static const char                      *thisfunc = "reset_flights():";
+
+    struct flight                          *table = p;
+
+    int                                     i;
+
+    for (i = 0; i < N_FLIGHTS; i++) {
+        table[i].key = 0;
+        table[i].expires = ~ 0;
+    }
+
+    AM_LOG_DEBUG(0, "%s cache flights reset", thisfunc);
+}
+
+static void reset_breakers(void *cbdata, void *p) {
+
+    static const char                      *thisfunc = "reset_breakers():";
+
+    memset(p, 0, sizeof(struct breaker_table));
+
+    AM_LOG_DEBUG(0, "%s cache breakers reset", thisfunc);
+}
+
+static void reset_resolved(void *cbdata, void *p) {
+
+    static const char                      *thisfunc = "reset_resolved():";
+
+    memset(p, 0, sizeof(struct resolved) * N_RESOLVED);
+
+    AM_LOG_DEBUG(0, "%s cache resolver reset", thisfunc);
+}
+
 static void reset_locks(void *cbdata, void *p) {
 
     static const char                      *thisfunc = "reset_locks():";
@@ -191,7 +427,7 @@ static void reset_locks(void *cbdata, void *p) {
 
     int                                     i;
 
-    for (i = 0; i < N_LOCKS; i++) {
+    for (i = 0; i < n_locks; i++) {
         locks[i] = readlock_init;
     }
 
@@ -226,7 +462,36 @@ uint32_t prev_pow_2(uint32_t v) {
 }
 
 /*
- * the agent cache memory size can be constrained by the AGENT_CACHE_SIZE environment variable
+ * the number of sessions the cache is expected to hold, from the AM_SESSION_CACHE_ENTRIES environment variable
+ * (0 when it is not set)
+ *
+ */
+static uint32_t cache_expected_sessions() {
+
+    static const char                      *thisfunc = "cache_expected_sessions():";
+
+    char                                   *env = getenv("AM_SESSION_CACHE_ENTRIES");
+
+    if (env) {
+        char                               *endp = 0;
+        uint32_t                            v = strtoul(env, &endp, 0);
+
+        if (env < endp && *endp == '\0' && 0 < v) {
+            return v;
+        }
+        AM_LOG_DEBUG(0, "%s cache entries spec %s not used", thisfunc, LOGEMPTY(env));
+    }
+
+    return 0;
+
+}
+
+/*
+ * the agent cache memory size can be constrained by the AM_MAX_SESSION_CACHE_SIZE environment variable; the expected
+ * number of sessions (AM_SESSION_CACHE_ENTRIES) only sizes the hash table and locks (see cache_geometry), it never
+ * makes the memory smaller than the default
+ *
+ * NOTE: the memory is shared by all agent instances, there are no per instance quotas
  *
  */
 uint32_t cache_memory_size() {
@@ -251,32 +516,162 @@ uint32_t cache_memory_size() {
 
 }
 
+/*
+ * hash table slots and read locks for the expected number of sessions, never less than the defaults; the
+ * collision buckets are fixed in size, so a bigger table is what keeps them from filling up
+ *
+ */
+static void cache_geometry(uint32_t sessions, uint32_t *slots, uint32_t *nlocks) {
+
+    uint32_t                                n = sessions / SLOT_SESSIONS;
+
+    if (n < HASH_SZ) {
+        n = HASH_SZ;
+    } else if (n > MAX_HASH_SZ) {
+        n = MAX_HASH_SZ;
+    }
+    *slots = n | 1;
+
+    n = prev_pow_2(*slots);
+    *nlocks = n < N_LOCKS ? N_LOCKS : (n > MAX_N_LOCKS ? MAX_N_LOCKS : n);
+
+}
+
+/*
+ * record a process as using the cache, reusing the slot of a process that has gone when the table is full
+ *
+ */
+static void cache_attach(pid_t pid) {
+
+    int                                     i;
+
+    for (i = 0; i < N_ATTACHED; i++) {
+        if (stats->attached[i] == pid) {
+            return;
+        }
+    }
+    for (i = 0; i < N_ATTACHED; i++) {
+        if (cas(&stats->attached[i], 0, pid)) {
+            return;
+        }
+    }
+    for (i = 0; i < N_ATTACHED; i++) {
+        pid_t                               p = stats->attached[i];
+
+        if (process_dead(p) && cas(&stats->attached[i], p, pid)) {
+            return;
+        }
+    }
+
+}
+
+/*
+ * the hash table and lock geometry is chosen by the process creating the cache segments and recorded in the stats
+ * segment, processes attaching later use that; so a change of AM_SESSION_CACHE_ENTRIES (or AM_MAX_SESSION_CACHE_SIZE)
+ * takes effect when the agent is restarted with all its processes stopped, or after the cache is removed
+ *
+ */
 int cache_initialise(int id) {
+    static const char *thisfunc = "cache_initialise():";
     int rv;
     uint32_t sz = cache_memory_size();
+    uint32_t slots, nlocks;
 
     rv = agent_memory_initialise(sz, id);
     if (rv != AM_SUCCESS)
         return rv;
 
+    cache_geometry(cache_expected_sessions(), &slots, &nlocks);
+    hash_sz = slots;
+    n_locks = nlocks;
+    memory_sz = sz;
+    created = 0;
+
     rv = get_memory_segment(&stats_pool, STATFILE, sizeof (struct stats), reset_stats, NULL, id);
     if (rv != AM_SUCCESS)
         return rv;
     stats = stats_pool->base_ptr;
+    cache_attach(getpid());
+
+    if (stats->hash_sz && stats->n_locks) {
+        hash_sz = stats->hash_sz;
+        n_locks = stats->n_locks;
+        memory_sz = stats->memory_sz;
+    }
+    if (hash_sz != slots || n_locks != nlocks) {
+        AM_LOG_WARNING(0, "%s cache in use has %u slots, %u locks (%u slots, %u locks configured, used after restart)",
+                thisfunc, hash_sz, n_locks, slots, nlocks);
+    } else {
+        AM_LOG_DEBUG(0, "%s cache has %u slots, %u locks", thisfunc, hash_sz, n_locks);
+    }
 
-    rv = get_memory_segment(&locks_pool, LOCKFILE, sizeof (struct readlock) * N_LOCKS, reset_locks, NULL, id);
+    rv = get_memory_segment(&locks_pool, LOCKFILE, sizeof (struct readlock) * n_locks, reset_locks, NULL, id);
     if (rv != AM_SUCCESS)
         return rv;
     locks = locks_pool->base_ptr;
 
-    rv = get_memory_segment(&hashtable_pool, HASHFILE, sizeof (offset) * HASH_SZ, reset_hashtable, NULL, id);
+    rv = get_memory_segment(&hashtable_pool, HASHFILE, sizeof (offset) * hash_sz, reset_hashtable, NULL, id);
     if (rv != AM_SUCCESS)
         return rv;
     hashtable = hashtable_pool->base_ptr;
 
+    rv = get_memory_segment(&flights_pool, FLIGHTFILE, sizeof (struct flight) * N_FLIGHTS, reset_flights, NULL, id);
+    if (rv != AM_SUCCESS)
+        return rv;
+    flights = flights_pool->base_ptr;
+
+    rv = get_memory_segment(&breakers_pool, BREAKERFILE, sizeof (struct breaker_table), reset_breakers, NULL, id);
+    if (rv != AM_SUCCESS)
+        return rv;
+    breakers = breakers_pool->base_ptr;
+
+    rv = get_memory_segment(&resolved_pool, RESOLVERFILE, sizeof (struct resolved) * N_RESOLVED, reset_resolved, NULL, id);
+    if (rv != AM_SUCCESS)
+        return rv;
+    resolved = resolved_pool->base_ptr;
+
     return AM_SUCCESS;
 }
 
+/*
+ * whether the cache segments were created (rather than attached to) by the last cache_initialise
+ *
+ */
+int cache_created() {
+
+    return created;
+
+}
+
+/*
+ * stop recording this process as using the cache; returns 1 when no other live process is using it, so that
+ * this is the last process to leave
+ *
+ */
+int cache_detach() {
+
+    pid_t                                   pid = getpid();
+
+    int                                     i, last = 1;
+
+    if (stats == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < N_ATTACHED; i++) {
+        pid_t                               p = stats->attached[i];
+
+        if (p == pid) {
+            cas(&stats->attached[i], p, 0);
+        } else if (p != 0 && !process_dead(p)) {
+            last = 0;
+        }
+    }
+
+    return last;
+
+}
+
 int is_agent_cache_ready() {
     static const char *thisfunc = "is_agent_cache_ready():";
     if (stats == NULL) {
@@ -298,6 +693,8 @@ void cache_reinitialise() {
 
     reset_hashtable(0, hashtable);
 
+    cache_generation_bump();
+
 }
 
 int cache_shutdown(int destroy) {
@@ -308,6 +705,20 @@ int cache_shutdown(int destroy) {
 
     remove_memory_segment(&hashtable_pool, destroy);
 
+    remove_memory_segment(&flights_pool, destroy);
+
+    remove_memory_segment(&breakers_pool, destroy);
+
+    remove_memory_segment(&resolved_pool, destroy);
+
+    /* the network code checks for these before using them */
+    stats = NULL;
+    locks = NULL;
+    hashtable = NULL;
+    flights = NULL;
+    breakers = NULL;
+    resolved = NULL;
+
     agent_memory_shutdown(destroy);
 
     return 0;
@@ -327,6 +738,15 @@ int cache_cleanup(int id) {
     if (delete_memory_segment(HASHFILE, id))
         errors++;
 
+    if (delete_memory_segment(FLIGHTFILE, id))
+        errors++;
+
+    if (delete_memory_segment(BREAKERFILE, id))
+        errors++;
+
+    if (delete_memory_segment(RESOLVERFILE, id))
+        errors++;
+
     if (agent_memory_cleanup(id))
         errors++;
 
@@ -334,9 +754,29 @@ int cache_cleanup(int id) {
 
 }
 
+/*
+ * read lock, with an uncontended attempt first so that only the locks which had to wait are timed
+ *
+ */
 int cache_readlock_p(uint32_t hash, pid_t pid) {
 
-    return read_lock(lock_for_hash(hash), pid);
+    struct readlock                        *lock = lock_for_hash(hash);
+
+    uint64_t                                start;
+
+    int                                     rv;
+
+    if (lock->barrier == 0 && read_lock_try(lock, pid, 1)) {
+        return 1;
+    }
+
+    start = clock_us();
+    rv = read_lock(lock, pid);
+
+incr(&stats->lock_waits.v);
+    add_stat(&stats->lock_wait_us.v, (uint32_t) (clock_us() - start));
+
+    return rv;
 
 }
 
@@ -374,7 +814,7 @@ void cache_readlock_total_barrier(pid_t pid) {
     int i;
     if (locks == NULL)
         return;
-    for (i = 0; i < N_LOCKS; i++) {
+    for (i = 0; i < n_locks; i++) {
         wait_for_barrier(locks + i, pid);
     }
 }
@@ -383,13 +823,13 @@ int cache_readlock_block_all(pid_t pid) {
 
     int                                     i;
 
-    for (i = 0; i < N_LOCKS; i++) {
+    for (i = 0; i < n_locks; i++) {
         if (read_block(locks + i, pid) == 0) {
             break;
         }
     }
 
-    if (i == N_LOCKS) {
+    if (i == n_locks) {
         return 0;
     }
 
@@ -403,7 +843,7 @@ int cache_readlock_block_all(pid_t pid) {
 
 void cache_readlock_unblock_all(pid_t pid) {
 
-    int                                     i = N_LOCKS;
+    int                                     i = n_locks;
 
     while (i--) {
         read_unblock(locks + i, pid);
@@ -421,6 +861,18 @@ static uint32_t relative_time(int64_t t) {
 
 }
 
+/*
+ * relative time less a grace period (in seconds), so that entries which expired within the grace period still look valid
+ *
+ */
+static uint32_t stale_time(int64_t t, uint32_t grace) {
+
+    uint32_t                                rt = relative_time(t);
+
+    return rt > grace ? rt - grace : 0;
+
+}
+
 static void unlink_entry(pid_t pid, uint32_t hash, struct cache_entry *e, int i, offset ofs) {
 
     if (cas(e->bucket + i, ofs, ~ 0)) {
@@ -428,9 +880,9 @@ static void unlink_entry(pid_t pid, uint32_t hash, struct cache_entry *e, int i,
             agent_memory_free(pid, agent_memory_ptr(ofs));                            /* failures here can be gc'd later */
 
             cache_readlock_release_unique(hash);
-incr_gc_stat(&stats->data.cleared.v);
+incr(&stats->data.cleared.v);
         } else {
-incr_gc_stat(&stats->data.leaked.v);
+incr(&stats->data.leaked.v);
         }
 
         uint32_t                            ex = e->expires[i];                       /* expiry time high to avoid immediate expiry when created */
@@ -442,19 +894,66 @@ incr_gc_stat(&stats->data.leaked.v);
 
 }
 
+#ifdef INTEGRATION_TEST
 /*
- * remove cach entries that are the same as callers' data 
- *
- * this doesn't ensure that other entries are not added concurrently
+ * count the entries a lookup ending at entry i would have compared with the key without fingerprints, that is every
+ * entry in use up to i - for comparison with the probes stat
  *
  */
-static void purge_identical_entries(pid_t pid, uint32_t hash, struct cache_entry *e, int i, void *data, int (*identity)(void *, void *)) {
+static void count_full_probes(struct cache_entry *e, int i) {
 
-    while (i < BUCKET_SZ) {
-        offset                              ofs = e->bucket[i];
+    uint32_t                                n = 0;
+    int                                     j;
 
-        if (~ ofs) {
-            struct user_entry              *p = agent_memory_ptr(ofs);
+    for (j = 0; j <= i && j < BUCKET_SZ; j++) {
+        if (~ e->bucket[j])
+            n++;
+    }
+    add_stat(&stats->full_probes.v, n);
+
+}
+#define incr_full_probe_stat(e, i)          count_full_probes(e, i)
+#else
+#define incr_full_probe_stat(e, i)
+#endif
+
+/*
+ * bit mask of the entries in the group (of FINGERPRINT_GROUP, starting at i) with fingerprint fp, so that only those
+ * entries need to be compared with the key
+ *
+ */
+static uint32_t fingerprint_group(struct cache_entry *e, int i, uint8_t fp) {
+
+#ifdef FINGERPRINT_SSE2
+    __m128i                                 v = _mm_loadu_si128((const __m128i *) (const void *) (e->fingerprint + i));
+
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char) fp)));
+#else
+    uint32_t                                m = 0;
+    int                                     j;
+
+    for (j = 0; j < FINGERPRINT_GROUP; j++) {
+        if (e->fingerprint[i + j] == fp)
+            m |= 1u << j;
+    }
+    return m;
+#endif
+
+}
+
+/*
+ * remove cach entries that are the same as callers' data 
+ *
+ * this doesn't ensure that other entries are not added concurrently
+ *
+ */
+static void purge_identical_entries(pid_t pid, uint32_t hash, struct cache_entry *e, int i, uint8_t fp, void *data, int (*identity)(void *, void *)) {
+
+    while (i < BUCKET_SZ) {
+        offset                              ofs = e->bucket[i];
+
+        if (~ ofs && e->fingerprint[i] == fp) {
+            struct user_entry              *p = agent_memory_ptr(ofs);
 
             if (identity(data, p->data)) {
                 unlink_entry(pid, hash, e, i, ofs);
@@ -498,14 +997,14 @@ static int low_recent_usage(uint32_t cycles) {
 }
 
 /*
- * remove expired entries from a cache collision list
+ * remove entries which expired more than grace seconds ago from a cache collision list
  *
  */
-static int purge_expired_entries(pid_t pid, uint32_t hash, struct cache_entry *e, int64_t now) {
+static int purge_expired_entries(pid_t pid, uint32_t hash, struct cache_entry *e, int64_t now, uint32_t grace) {
 
     int                                     i, n = 0;
 
-    uint32_t                                t = relative_time(now);
+    uint32_t                                t = stale_time(now, grace);
 
     for (i = 0; i < BUCKET_SZ; i++) {
         offset                              ofs = e->bucket[i];
@@ -534,25 +1033,83 @@ incr(&stats->lru.v);
 }
 
 /*
- * remove expired cache entries, all in one go
+ * claim the next slice of a sweep, unless the sweep has reached limit; the cursor is shared, so that concurrent
+ * sweeps (in any process) take different slices, and a sweep carries on from where the last one stopped
+ *
+ */
+static int claim_slice(volatile uint32_t *cursor, uint32_t limit, uint32_t *slice) {
+
+    uint32_t                                v;
+
+    do {
+        v = *cursor;
+        if ((int32_t) (v - limit) >= 0) {
+            return 0;
+        }
+    } while (cas(cursor, v, v + 1) == 0);
+
+    *slice = v;
+    return 1;
+
+}
+
+/*
+ * seconds expired entries are kept for: the stale grace period (see cache_set_stale_grace), but only while a circuit
+ * breaker is open or half-open, as the entries are not tied to the url they were fetched from
  *
- * NOTE: this could be done in multiple threads, but the performance problem issue would only be the dispersed memory access
+ */
+static uint32_t purge_grace() {
+
+    int                                     i;
+
+    if (breakers == NULL || breakers->grace == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < N_BREAKERS; i++) {
+        if (breakers->slot[i].key != 0 && breakers->slot[i].state != CACHE_BREAKER_CLOSED) {
+            return breakers->grace;
+        }
+    }
+    return 0;
+
+}
+
+/*
+ * remove expired cache entries, a slice of the hash table at a time, for up to budget_ms (0 for no limit) and at most
+ * once round the table
  *
  */
-void cache_purge_expired_entries(pid_t pid) {
+void cache_purge_expired_entries(pid_t pid, uint32_t budget_ms) {
     static const char *thisfunc = "cache_purge_expired_entries():";
     int n = 0;
     offset ofs;
-    int i;
+    uint32_t i, slice, slices, limit, end, grace;
+    uint64_t deadline = clock_us() + (uint64_t) budget_ms * 1000;
 
     if (hashtable == NULL)
         return;
-    for (i = 0; i < HASH_SZ; i++) {
-        if (cache_readlock_p(i, pid)) {
-            if (~(ofs = hashtable[i])) {
-                n += purge_expired_entries(pid, i, agent_memory_ptr(ofs), time(0));
+
+    grace = purge_grace();
+
+    slices = (hash_sz + PURGE_SLICE - 1) / PURGE_SLICE;
+    limit = stats->purge_cursor.v + slices;
+
+    while (claim_slice(&stats->purge_cursor.v, limit, &slice)) {
+        i = (slice % slices) * PURGE_SLICE;
+        end = i + PURGE_SLICE < hash_sz ? i + PURGE_SLICE : hash_sz;
+
+        for (; i < end; i++) {
+            if (cache_readlock_p(i, pid)) {
+                if (~(ofs = hashtable[i])) {
+                    n += purge_expired_entries(pid, i, agent_memory_ptr(ofs), time(0), grace);
+                }
+                cache_readlock_release_p(i, pid);
             }
-            cache_readlock_release_p(i, pid);
+        }
+
+        if (budget_ms && clock_us() >= deadline) {
+            break;
         }
     }
 
@@ -584,7 +1141,8 @@ int cache_add(uint32_t h, void *data, size_t ln, int64_t expires, int (*identity
 
     pid_t                                   pid = getpid();
 
-    uint32_t                                hash = h % HASH_SZ;
+    uint32_t                                hash = h % hash_sz;
+    uint8_t                                 fp = fingerprint(h);
     uint32_t                                seed = agent_memory_seed();               /* use seed to direct user to new memory cluster */
 
     agent_memory_validate(pid);
@@ -622,6 +1180,7 @@ incr(&stats->failures.v);
         for (i = 0; i < BUCKET_SZ; i++) e->bucket[i] = ~ 0;
         for (i = 0; i < BUCKET_SZ; i++) e->expires[i] = 0;
         for (i = 0; i < BUCKET_SZ; i++) e->cycles[i] = ~ 0;
+        for (i = 0; i < BUCKET_SZ; i++) e->fingerprint[i] = 0;
 
         hashtable[hash] = agent_memory_offset(e);
     } else {
@@ -634,9 +1193,10 @@ incr(&stats->failures.v);
         offset                              v = casv(e->bucket + i, ~ 0, new);
 
         if (v == ~ 0) {
+            e->fingerprint[i] = fp;
 incr(&stats->writes.v);
             break;
-        } else {
+        } else if (e->fingerprint[i] == fp) {
             struct user_entry              *p = agent_memory_ptr(v);
 
             if (identity(data, p->data)) {
@@ -649,9 +1209,9 @@ incr(&stats->writes.v);
                         agent_memory_free(pid, agent_memory_ptr(v));
 
                         cache_readlock_release_unique(hash);
-incr_gc_stat(&stats->data.cleared.v);
+incr(&stats->data.cleared.v);
                     } else {
-incr_gc_stat(&stats->data.leaked.v);
+incr(&stats->data.leaked.v);
                     }
 incr(&stats->updates.v);
                 }
@@ -675,7 +1235,7 @@ incr(&stats->updates.v);
             cycles = e->cycles[i];
         }
 
-        purge_identical_entries(pid, hash, e, i + 1, data, identity);
+        purge_identical_entries(pid, hash, e, i + 1, fp, data, identity);
     } else {
                                                                               /* out of space in cache bucket */
     }
@@ -694,7 +1254,7 @@ void cache_delete(uint32_t h, void *data, int (*identity)(void *, void *)) {
 
     pid_t                                   pid = getpid();
 
-    uint32_t                                hash = h % HASH_SZ;
+    uint32_t                                hash = h % hash_sz;
 
     agent_memory_validate(pid);
 
@@ -702,7 +1262,7 @@ void cache_delete(uint32_t h, void *data, int (*identity)(void *, void *)) {
         offset                              ofs = hashtable[hash];
 
         if (~ ofs) {
-            purge_identical_entries(pid, hash, agent_memory_ptr(ofs), 0, data, identity);
+            purge_identical_entries(pid, hash, agent_memory_ptr(ofs), 0, fingerprint(h), data, identity);
         }
         cache_readlock_release_p(hash, pid);
 incr(&stats->deletes.v);
@@ -715,13 +1275,11 @@ incr(&stats->deletes.v);
  * release this read lock.
  *
  */
-int cache_get_readlocked_ptr(uint32_t h, void **addr, uint32_t *ln, void *data, int64_t now, int (*identity)(void *, void *)) {
+static int get_readlocked_ptr(uint32_t h, void **addr, uint32_t *ln, void *data, uint32_t t, int (*identity)(void *, void *)) {
 
     pid_t                                   pid = getpid();
 
-    uint32_t                                hash = h % HASH_SZ;
-
-    uint32_t                                t = relative_time(now);
+    uint32_t                                hash = h % hash_sz;
 
     offset                                  ofs;
    
@@ -733,19 +1291,111 @@ int cache_get_readlocked_ptr(uint32_t h, void **addr, uint32_t *ln, void *data,
 
     ofs = hashtable[hash];
 
+incr(&stats->lookups.v);
     if (~ ofs) {
-        int                                 i;
+        int                                 g, i;
         struct cache_entry                 *e = agent_memory_ptr(ofs);
+        uint8_t                             fp = fingerprint(h);
 
-        for (i = 0; i < BUCKET_SZ; i++) {
-            offset                          u = e->bucket[i];
+        for (g = 0; g < BUCKET_SZ; g += FINGERPRINT_GROUP) {
+            uint32_t                        m = fingerprint_group(e, g, fp);
+
+            for (; m; m &= m - 1) {
+                i = g + bits((m & - m) - 1);                                          /* lowest candidate first */
+
+                offset                      u = e->bucket[i];
+
+                if (~ u) {
+                    struct user_entry      *p = agent_memory_ptr(u);
+incr(&stats->probes.v);
+
+                    if (identity(data, p->data)) {
+incr_full_probe_stat(e, i);
+                        if (e->expires[i] < t)
+                            goto not_found;
+
+                        uint32_t            cycles = e->cycles[i];
+
+                        while ((cycles & 0x80000000) == 0) {
+                            if (cas(e->cycles + i, cycles, cycles | 0x80000000))
+                                break;
+
+                            cycles = e->cycles[i];
+                        }
+
+                        *addr = p->data;
+                        *ln = p->ln;
+incr(&stats->reads.v);
+                        return 0;
+                    }
+                }
+            }
+        }
+incr_full_probe_stat(e, BUCKET_SZ);
+    }
+
+not_found:
+    cache_readlock_release_p(hash, pid);
+
+    return 1;
+
+}
+
+int cache_get_readlocked_ptr(uint32_t h, void **addr, uint32_t *ln, void *data, int64_t now, int (*identity)(void *, void *)) {
+
+    return get_readlocked_ptr(h, addr, ln, data, relative_time(now), identity);
+
+}
+
+/*
+ * as cache_get_readlocked_ptr, but an entry which expired at most grace seconds ago is also returned
+ *
+ * NOTE: expired entries are only kept for the grace period set with cache_set_stale_grace, while a circuit breaker is
+ * not closed (see purge_grace)
+ *
+ */
+int cache_get_stale_readlocked_ptr(uint32_t h, void **addr, uint32_t *ln, void *data, int64_t now, uint32_t grace, int (*identity)(void *, void *)) {
+
+    if (get_readlocked_ptr(h, addr, ln, data, stale_time(now, grace), identity)) {
+        return 1;
+    }
+    if (stats != NULL) {
+incr(&stats->stale.v);
+    }
+    return 0;
+
+}
+
+/*
+ * call each() for every entry in collision list hash that matches data and is valid at (relative) time t; the caller
+ * holds the read lock. stops early when each() returns non-zero
+ *
+ */
+static int get_each_locked(uint32_t h, uint32_t hash, void *data, uint32_t t, int (*identity)(void *, void *),
+        int (*each)(void *, void *, uint32_t), void *arg) {
+
+    offset                                  ofs = hashtable[hash];
+
+    int                                     n = 0;
+
+    if (~ ofs) {
+        int                                 g, i;
+        struct cache_entry                 *e = agent_memory_ptr(ofs);
+        uint8_t                             fp = fingerprint(h);
+
+        for (g = 0; g < BUCKET_SZ; g += FINGERPRINT_GROUP) {
+            uint32_t                        m = fingerprint_group(e, g, fp);
+
+            for (; m; m &= m - 1) {
+                i = g + bits((m & - m) - 1);
 
-            if (~ u) {
-                struct user_entry          *p = agent_memory_ptr(u);
+                offset                      u = e->bucket[i];
 
-                if (identity(data, p->data)) {
-                    if (e->expires[i] < t)
-                        break;
+                if (~ u) {
+                    struct user_entry      *p = agent_memory_ptr(u);
+
+                    if (e->expires[i] < t || identity(data, p->data) == 0)
+                        continue;
 
                     uint32_t                cycles = e->cycles[i];
 
@@ -756,132 +1406,1122 @@ int cache_get_readlocked_ptr(uint32_t h, void **addr, uint32_t *ln, void *data,
                         cycles = e->cycles[i];
                     }
 
-                    *addr = p->data;
-                    *ln = p->ln;
+                    n++;
 incr(&stats->reads.v);
-                    return 0;
+                    if (each(arg, p->data, p->ln))
+                        return n;
                 }
             }
         }
     }
 
+    return n;
+
+}
+
+/*
+ * call each() for every entry in the collision list that matches data (and has not expired more than grace seconds ago),
+ * all under a single read lock; stops early when each() returns non-zero
+ *
+ * returns the number of entries visited
+ *
+ */
+int cache_get_each_readlocked(uint32_t h, void *data, int64_t now, uint32_t grace, int (*identity)(void *, void *),
+        int (*each)(void *, void *, uint32_t), void *arg) {
+
+    pid_t                                   pid = getpid();
+
+    uint32_t                                hash = h % hash_sz;
+
+    int                                     n;
+
+    agent_memory_validate(pid);
+
+    if (cache_readlock_p(hash, pid) == 0) {
+        return 0;
+    }
+
+    n = get_each_locked(h, hash, data, stale_time(now, grace), identity, each, arg);
+
     cache_readlock_release_p(hash, pid);
 
-    return 1;
+    return n;
 
 }
 
-void cache_release_readlocked_ptr(uint32_t h) {
+struct get_all {
+
+    void                                   *data[BUCKET_SZ];
+    uint32_t                                ln[BUCKET_SZ];
+
+    int                                     n;
+
+};
+
+static int get_all_each(void *arg, void *data, uint32_t ln) {
+
+    struct get_all                         *all = arg;
+
+    if (all->n == BUCKET_SZ) {
+        all->n = -1;                                                                  /* more than fit, see below */
+        return 1;
+    }
+
+    all->data[all->n] = data;
+    all->ln[all->n++] = ln;
+
+    return 0;
+
+}
+
+/*
+ * as cache_get_each_readlocked, but all of the matching entries are handed to all() at once (still under the read lock),
+ * so that it can look at them together
+ *
+ * returns the number of entries found, or -1 (and all() is not called) when there are more than BUCKET_SZ of them
+ *
+ */
+int cache_get_all_readlocked(uint32_t h, void *data, int64_t now, uint32_t grace, int (*identity)(void *, void *),
+        void (*all)(void *, int, void **, uint32_t *), void *arg) {
 
     pid_t                                   pid = getpid();
 
-    uint32_t                                hash = h % HASH_SZ;
+    uint32_t                                hash = h % hash_sz;
+
+    struct get_all                          found;
+
+    found.n = 0;
+
+    agent_memory_validate(pid);
+
+    if (cache_readlock_p(hash, pid) == 0) {
+        return 0;
+    }
+
+    if (get_each_locked(h, hash, data, stale_time(now, grace), identity, get_all_each, &found) && found.n > 0) {
+        all(arg, found.n, found.data, found.ln);
+    }
 
     cache_readlock_release_p(hash, pid);
 
+    return found.n;
+
 }
 
-static int cache_object_reachable(void *data, uint32_t hash) {
+void cache_release_readlocked_ptr(uint32_t h) {
 
-    const offset                            target = agent_memory_offset(data);
+    pid_t                                   pid = getpid();
 
-    return target == hashtable[hash];
+    uint32_t                                hash = h % hash_sz;
+
+    cache_readlock_release_p(hash, pid);
 
 }
 
-static int user_object_reachable(void *data, uint32_t hash) {
+/*
+ * expiry time of the entry with data (as returned by a get for hash h), while the read lock for it is held; 0 when
+ * there is no such entry
+ *
+ */
+int64_t cache_readlocked_expires(uint32_t h, void *data) {
 
-    const offset                            target = agent_memory_offset(data);
+    uint32_t                                hash = h % hash_sz;
 
     offset                                  ofs = hashtable[hash];
 
     if (~ ofs) {
+        int                                 g, i;
         struct cache_entry                 *e = agent_memory_ptr(ofs);
-        int                                 i;
+        uint8_t                             fp = fingerprint(h);
 
-        for (i = 0; i < BUCKET_SZ; i++) {
-            if (target == e->bucket[i]) {
-                return 1;
+        for (g = 0; g < BUCKET_SZ; g += FINGERPRINT_GROUP) {
+            uint32_t                        m = fingerprint_group(e, g, fp);
+
+            for (; m; m &= m - 1) {
+                i = g + bits((m & - m) - 1);
+
+                offset                      u = e->bucket[i];
+
+                if (~ u && (void *) ((struct user_entry *) agent_memory_ptr(u))->data == data)
+                    return stats->basetime + e->expires[i];
             }
         }
     }
+
     return 0;
 
 }
 
 /*
- * NOTE: this is called when the memory cluster of p is locked, so we know that it is safe to get the hash code
- * of p, although it could be changing
+ * single-flight: claim the slot for a remote call identified by key, so that concurrent callers (in any
+ * process) wanting the same data can wait for it to land in the cache instead of making the same call.
  *
- * NOTE: if the hash code has not yet been set, we can't tell whether the block is in use or not - it can be
- * in-progress. So we will record in gcdata a marker to indicate that it has been observed, and if the hash is
- * still uninitialised in a subsequent gc sweep (when the marker has been set) then it can be released.
+ * returns 0 when the caller should make the call (and cache_flight_end it afterwards), or 1 when the same call
+ * is already in progress. A slot that is taken by a different key does not stop the caller, and a slot which
+ * has not been released within timeout seconds (caller gone) is taken over - by the one caller which gets to
+ * move its expiry on, the others see it taken.
  *
  */
-static int cache_garbage_checker(void *cbdata, pid_t pid, int32_t type, void *p) {
-    uint32_t                                hash;
+int cache_flight_begin(uint64_t key, int timeout) {
 
-    switch (type) {
-        case USER:
-            hash = ((struct user_entry *)p)->hash;                            /* this is called when the memory cluster is locked */
-            if (hash != ~ ((struct user_entry *)p)->check) {
-                if (((struct user_entry *)p)->gcdata == (hash ^ GC_MARKER)) {
-                    return 1;                                                 /* this has been seen in a prior gc sweep, let it go */
-                }
-                ((struct user_entry *)p)->gcdata = hash ^ GC_MARKER;
-                return 0;                                                     /* this might still be in use, the hash not yet assigned */
-            }
+    struct flight                          *f;
 
-            if (cache_readlock_try_p(hash, pid, 10)) {
-                if (user_object_reachable(p, hash) == 0) {
-                    if (cache_readlock_try_unique(hash)) {
-                        cache_readlock_release_all_p(hash, pid);
-incr_gc_stat(&stats->data.collected.v);
-                        
-                        return 1;                                             /* no new threads can reach this block, and it isn't being read */
-                    }
-                }
-                cache_readlock_release_p(hash, pid);
-            }
-            break;
+    uint64_t                                k;
 
-        case CACHE:
-            hash = ((struct cache_entry *)p)->hash;
-            if (hash != ~ ((struct cache_entry *)p)->check) {
-                if (((struct cache_entry *)p)->gcdata == (hash ^ GC_MARKER)) {/* as above: wait until its been seen before in this state */
-                    return 1;
-                }
-                ((struct cache_entry *)p)->gcdata = hash ^ GC_MARKER;
-                return 0;
-            }
+    uint32_t                                t, ex;
 
-            if (cache_readlock_try_p(hash, pid, 10)) {
-                if (cache_object_reachable(p, hash) == 0) {
-                    if (cache_readlock_try_unique(hash)) {
-                        cache_readlock_release_all_p(hash, pid);
-incr_gc_stat(&stats->cache.collected.v);
+    if (flights == NULL || stats == NULL) {
+        return 0;
+    }
 
-                        return 1;                                             /* no new threads can reach this block, and it isn't being read */
-                    }
-                }
-                cache_readlock_release_p(hash, pid);
+    if (key == 0) {
+        key = 1;
+    }
+
+    f = flights + (key & (N_FLIGHTS - 1));
+    t = relative_time(time(0));
+
+    for (;;) {
+        k = load64(&f->key);
+
+        if (k == 0) {
+            if (cas64(&f->key, 0, key)) {
+                f->expires = t + timeout;                                            /* was ~0 while free */
+                return 0;
             }
-            break;
+            continue;
         }
 
-    return 0;
+        ex = f->expires;
+        if (ex < t) {
+            if (cas(&f->expires, ex, t + timeout)) {
+                store64(&f->key, key);
+                return 0;
+            }
+            continue;
+        }
+        return k == key;
+    }
 
 }
 
-void cache_garbage_collect() {
+void cache_flight_end(uint64_t key) {
 
-    agent_memory_scan(getpid(), cache_garbage_checker, 0);
+    struct flight                          *f;
 
-}
+    if (flights == NULL) {
+        return;
+    }
 
-static uint32_t get_and_reset(volatile uint32_t *p) {
+    if (key == 0) {
+        key = 1;
+    }
 
-    return reset(p);
+    f = flights + (key & (N_FLIGHTS - 1));
+
+    if (load64(&f->key) == key) {
+        f->expires = ~ 0;                                                              /* so that the slot doesn't look stale to a new owner */
+        cas64(&f->key, key, 0);
+    }
+
+}
+
+/*
+ * wait (at most wait_ms milliseconds) for a call in progress to complete
+ *
+ * returns 0 when the call has completed, 1 on timeout
+ *
+ */
+int cache_flight_wait(uint64_t key, int wait_ms) {
+
+    struct flight                          *f;
+
+    int                                     waited = 0;
+
+    if (flights == NULL) {
+        return 0;
+    }
+
+    if (key == 0) {
+        key = 1;
+    }
+
+    f = flights + (key & (N_FLIGHTS - 1));
+
+    while (load64(&f->key) == key) {
+        if (waited >= wait_ms) {
+            return 1;
+        }
+#ifdef _WIN32
+        Sleep(10);
+#else
+        nanosleep((const struct timespec[]) {
+            {0, 10000000L}
+        }, NULL);
+#endif
+        waited += 10;
+    }
+
+    return 0;
+
+}
+
+/*
+ * circuit breaker: find the slot for url (key is its hash), taking over a slot which is closed and has not seen a
+ * failure; a url which only has the same hash as the one a slot is in use by does not get it
+ *
+ */
+static struct breaker *breaker_slot(uint32_t key, const char *url) {
+
+    struct breaker                         *b;
+
+    uint32_t                                k;
+
+    size_t                                  ln;
+
+    if (breakers == NULL || stats == NULL || url == NULL || (ln = strlen(url)) >= BREAKER_URL_SZ) {
+        return NULL;
+    }
+
+    if (key == 0 || key == ~ 0) {
+        key = 1;
+    }
+
+    b = breakers->slot + (key & (N_BREAKERS - 1));
+
+    for (;;) {
+        k = b->key;
+
+        if (k == ~ 0) {
+            return NULL;                                                              /* being taken over */
+        }
+        if (k == key && strcmp(b->url, url) == 0) {
+            return b;
+        }
+        if (k != 0 && (b->state != CACHE_BREAKER_CLOSED || b->failures != 0)) {
+            return NULL;                                                              /* slot is in use by another url */
+        }
+        if (cas(&b->key, k, ~ 0)) {
+            memcpy(b->url, url, ln + 1);
+            b->failures = 0;
+            cas(&b->key, ~ 0, key);
+            return b;
+        }
+    }
+
+}
+
+/*
+ * circuit breaker: should a call to the remote url (key is its hash) go ahead?
+ *
+ * returns CACHE_BREAKER_CLOSED when it should, CACHE_BREAKER_OPEN when the breaker is open and the call should
+ * fail fast. Once the breaker has been open for cooldown seconds, a single caller gets CACHE_BREAKER_HALF_OPEN
+ * and makes a probe call; its result (cache_breaker_report) closes or re-opens the breaker.
+ *
+ */
+int cache_breaker_allow(uint32_t key, const char *url, int cooldown) {
+
+    struct breaker                         *b = breaker_slot(key, url);
+
+    uint32_t                                state, opened, t;
+
+    if (b == NULL) {
+        return CACHE_BREAKER_CLOSED;
+    }
+
+    state = b->state;
+    if (state == CACHE_BREAKER_CLOSED) {
+        return CACHE_BREAKER_CLOSED;
+    }
+
+    t = relative_time(time(0));
+    opened = b->opened;
+
+    if (t - opened < (uint32_t) cooldown || !cas(&b->opened, opened, t)) {
+        return CACHE_BREAKER_OPEN;
+    }
+    cas(&b->state, state, CACHE_BREAKER_HALF_OPEN);
+    return CACHE_BREAKER_HALF_OPEN;
+
+}
+
+/*
+ * circuit breaker: record the outcome of a call to the remote url (key is its hash); the breaker opens after
+ * threshold consecutive failures, and closes on the first success
+ *
+ * returns the new breaker state when it has changed, -1 otherwise
+ *
+ */
+int cache_breaker_report(uint32_t key, const char *url, int failed, int threshold) {
+
+    struct breaker                         *b = breaker_slot(key, url);
+
+    uint32_t                                state;
+
+    if (b == NULL) {
+        return -1;
+    }
+
+    state = b->state;
+
+    if (!failed) {
+        if (b->failures != 0) {                                                       /* reported on every call */
+            b->failures = 0;
+        }
+        if (state != CACHE_BREAKER_CLOSED && cas(&b->state, state, CACHE_BREAKER_CLOSED)) {
+            return CACHE_BREAKER_CLOSED;
+        }
+        return -1;
+    }
+
+incr(&b->failures);
+    if (state == CACHE_BREAKER_OPEN || (state == CACHE_BREAKER_CLOSED && b->failures < (uint32_t) threshold)) {
+        return -1;
+    }
+
+    b->opened = relative_time(time(0));
+    if (cas(&b->state, state, CACHE_BREAKER_OPEN)) {
+incr(&stats->trips.v);
+        return CACHE_BREAKER_OPEN;
+    }
+    return -1;
+
+}
+
+/*
+ * keep expired entries for grace seconds, so that they can be served while the remote service is unavailable
+ *
+ */
+void cache_set_stale_grace(uint32_t grace) {
+
+    if (breakers == NULL) {
+        return;
+    }
+
+    if (breakers->grace != grace) {
+        breakers->grace = grace;
+    }
+
+}
+
+/*
+ * resolver cache: look up the (opaque) resolved address data for a host, identified by key (a 64 bit hash of the
+ * host name) and key_ln (the length of the name), copying at most *ln bytes into data
+ *
+ * returns 0 and sets *ln and *expired when found, 1 when not
+ *
+ */
+int cache_resolved_get(uint64_t key, uint32_t key_ln, void *data, uint32_t *ln, int *expired) {
+
+    struct resolved                        *r;
+
+    uint32_t                                seq, sz, expires;
+
+    if (resolved == NULL || stats == NULL) {
+        return 1;
+    }
+
+    if (key == 0) {
+        key = 1;
+    }
+
+    r = resolved + (key & (N_RESOLVED - 1));
+
+    for (;;) {
+        seq = casv(&r->seq, 0, 0);                                                    /* read with a barrier */
+        if (seq & 1) {
+            yield();
+            continue;
+        }
+        if (r->key != key || r->key_ln != key_ln) {
+            if (casv(&r->seq, 0, 0) != seq) {
+                continue;
+            }
+incr(&stats->dns_misses.v);
+            return 1;
+        }
+        sz = r->ln < *ln ? r->ln : *ln;
+        memcpy(data, r->data, sz);
+        expires = r->expires;
+        if (casv(&r->seq, 0, 0) == seq) {
+            break;
+        }
+    }
+
+incr(&stats->dns_hits.v);
+    *ln = sz;
+    *expired = expires <= relative_time(time(0));
+    return 0;
+
+}
+
+/*
+ * claim the refresh of an (expired) resolver cache entry, so that only one caller (in any process) makes it;
+ * a claim which is not followed by cache_resolved_set within timeout seconds is given up
+ *
+ * returns 0 when the caller should refresh the entry, 1 otherwise
+ *
+ */
+int cache_resolved_refresh(uint64_t key, uint32_t key_ln, int timeout) {
+
+    struct resolved                        *r;
+
+    uint32_t                                t, refreshing;
+
+    if (resolved == NULL || stats == NULL) {
+        return 1;
+    }
+
+    if (key == 0) {
+        key = 1;
+    }
+
+    r = resolved + (key & (N_RESOLVED - 1));
+    t = relative_time(time(0)) | 1;                                             /* 0 means "not refreshing" */
+    refreshing = r->refreshing;
+
+    if (load64(&r->key) != key || r->key_ln != key_ln || (refreshing != 0 && refreshing + timeout >= t)) {
+        return 1;
+    }
+    return cas(&r->refreshing, refreshing, t) ? 0 : 1;
+
+}
+
+/*
+ * store (or refresh) the resolved address data for key (see cache_resolved_get) for ttl seconds; ms is how long the
+ * resolution took
+ *
+ */
+void cache_resolved_set(uint64_t key, uint32_t key_ln, const void *data, uint32_t ln, int ttl, uint32_t ms) {
+
+    struct resolved                        *r;
+
+    uint32_t                                seq;
+
+    if (resolved == NULL || stats == NULL || ln > RESOLVED_DATA_SZ) {
+        return;
+    }
+
+    if (key == 0) {
+        key = 1;
+    }
+
+    r = resolved + (key & (N_RESOLVED - 1));
+
+    for (;;) {
+        seq = r->seq;
+        if ((seq & 1) == 0 && cas(&r->seq, seq, seq + 1)) {
+            break;
+        }
+        yield();
+    }
+
+    store64(&r->key, key);
+    r->key_ln = key_ln;
+    memcpy(r->data, data, ln);
+    r->ln = ln;
+    r->expires = time(0) + ttl > stats->basetime ? relative_time(time(0) + ttl) : 0;
+    r->refreshing = 0;
+
+    incr(&r->seq);
+
+incr(&stats->dns_refreshes.v);
+    add_stat(&stats->dns_refresh_ms.v, ms);
+
+}
+
+static int cache_object_reachable(void *data, uint32_t hash) {
+
+    const offset                            target = agent_memory_offset(data);
+
+    return target == hashtable[hash];
+
+}
+
+static int user_object_reachable(void *data, uint32_t hash) {
+
+    const offset                            target = agent_memory_offset(data);
+
+    offset                                  ofs = hashtable[hash];
+
+    if (~ ofs) {
+        struct cache_entry                 *e = agent_memory_ptr(ofs);
+        int                                 i;
+
+        for (i = 0; i < BUCKET_SZ; i++) {
+            if (target == e->bucket[i]) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+
+}
+
+/*
+ * NOTE: this is called when the memory cluster of p is locked, so we know that it is safe to get the hash code
+ * of p, although it could be changing
+ *
+ * NOTE: if the hash code has not yet been set, we can't tell whether the block is in use or not - it can be
+ * in-progress. So we will record in gcdata a marker to indicate that it has been observed, and if the hash is
+ * still uninitialised in a subsequent gc sweep (when the marker has been set) then it can be released.
+ *
+ */
+static int cache_garbage_checker(void *cbdata, pid_t pid, int32_t type, void *p) {
+    uint32_t                                hash;
+
+    switch (type) {
+        case USER:
+            hash = ((struct user_entry *)p)->hash;                            /* this is called when the memory cluster is locked */
+            if (hash != ~ ((struct user_entry *)p)->check) {
+                if (((struct user_entry *)p)->gcdata == (hash ^ GC_MARKER)) {
+                    return 1;                                                 /* this has been seen in a prior gc sweep, let it go */
+                }
+                ((struct user_entry *)p)->gcdata = hash ^ GC_MARKER;
+                return 0;                                                     /* this might still be in use, the hash not yet assigned */
+            }
+
+            if (cache_readlock_try_p(hash, pid, 10)) {
+                if (user_object_reachable(p, hash) == 0) {
+                    if (cache_readlock_try_unique(hash)) {
+                        cache_readlock_release_all_p(hash, pid);
+incr(&stats->data.collected.v);
+                        
+                        return 1;                                             /* no new threads can reach this block, and it isn't being read */
+                    }
+                }
+                cache_readlock_release_p(hash, pid);
+            }
+            break;
+
+        case CACHE:
+            hash = ((struct cache_entry *)p)->hash;
+            if (hash != ~ ((struct cache_entry *)p)->check) {
+                if (((struct cache_entry *)p)->gcdata == (hash ^ GC_MARKER)) {/* as above: wait until its been seen before in this state */
+                    return 1;
+                }
+                ((struct cache_entry *)p)->gcdata = hash ^ GC_MARKER;
+                return 0;
+            }
+
+            if (cache_readlock_try_p(hash, pid, 10)) {
+                if (cache_object_reachable(p, hash) == 0) {
+                    if (cache_readlock_try_unique(hash)) {
+                        cache_readlock_release_all_p(hash, pid);
+incr(&stats->cache.collected.v);
+
+                        return 1;                                             /* no new threads can reach this block, and it isn't being read */
+                    }
+                }
+                cache_readlock_release_p(hash, pid);
+            }
+            break;
+        }
+
+    return 0;
+
+}
+
+/*
+ * garbage collect a memory cluster at a time, for up to budget_ms (0 for no limit) and at most once round the clusters
+ *
+ */
+void cache_garbage_collect(uint32_t budget_ms) {
+    static const char *thisfunc = "cache_garbage_collect():";
+    pid_t pid = getpid();
+    int c = 0, n;
+    uint32_t slice, clusters = agent_memory_clusters(), limit;
+    uint64_t deadline = clock_us() + (uint64_t) budget_ms * 1000;
+
+    if (stats == NULL || clusters == 0)
+        return;
+
+    limit = stats->gc_cursor.v + clusters;
+
+    while (claim_slice(&stats->gc_cursor.v, limit, &slice)) {
+        if ((n = agent_memory_scan_cluster(pid, slice % clusters, cache_garbage_checker, 0)) > 0) {
+            c += n;
+        }
+
+        if (budget_ms && clock_us() >= deadline) {
+            break;
+        }
+    }
+
+    if (c) {
+        AM_LOG_DEBUG(0, "%s blocks released: %d", thisfunc, c);
+    }
+}
+
+static uint32_t get_and_reset(volatile uint32_t *p) {
+
+    return reset(p);
+
+}
+
+/*
+ * count a lookup of a type of cached data (CACHE_STAT_SESSION, ...)
+ *
+ */
+void cache_stat_lookup(int type, int hit) {
+
+    if (stats == NULL || type < 0 || type >= CACHE_STAT_TYPES)
+        return;
+
+    if (hit) {
+incr(&stats->hits[type].v);
+    } else {
+incr(&stats->misses[type].v);
+    }
+
+}
+
+/*
+ * number of entries in each hash table slot, as a histogram indexed by the number of entries
+ *
+ */
+static void bucket_occupancy(pid_t pid, uint32_t histogram[BUCKET_SZ + 1]) {
+
+    uint32_t                                l, i;
+
+    int                                     j, n;
+
+    for (j = 0; j <= BUCKET_SZ; j++) {
+        histogram[j] = 0;
+    }
+
+    for (l = 0; l < n_locks; l++) {
+        read_lock(locks + l, pid);
+
+        for (i = l; i < hash_sz; i += n_locks) {
+            offset                          ofs = hashtable[i];
+
+            n = 0;
+            if (~ ofs) {
+                struct cache_entry         *e = agent_memory_ptr(ofs);
+
+                for (j = 0; j < BUCKET_SZ; j++) {
+                    if (~ e->bucket[j])
+                        n++;
+                }
+            }
+            histogram[n]++;
+        }
+
+        read_release(locks + l, pid);
+    }
+
+}
+
+/*
+ * append to the status report, which is freed (and set to NULL) if memory runs out
+ *
+ */
+static void status_printf(char **report, size_t *ln, const char *fmt, ...) {
+
+    va_list                                 args;
+
+    char                                   *p;
+
+    int                                     n;
+
+    if (*report == NULL && *ln) {
+        return;                                                                       /* out of memory earlier */
+    }
+
+    va_start(args, fmt);
+    n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    if (n < 0 || (p = realloc(*report, *ln + n + 1)) == NULL) {
+        free(*report);
+        *report = NULL;
+        *ln = 1;
+        return;
+    }
+
+    va_start(args, fmt);
+    vsnprintf(p + *ln, n + 1, fmt, args);
+    va_end(args);
+
+    *report = p;
+    *ln += n;
+
+}
+
+/*
+ * render the shared cache statistics as text, one "name: value" per line; the counters are cumulative since the cache
+ * was created and are left as they are. the slot histogram and memory usage are only added when scan is set, as they
+ * take every cache lock and walk every memory cluster
+ *
+ */
+int cache_status(char **report, int scan) {
+
+    static const char                      *types[CACHE_STAT_TYPES] = { "session", "pdp", "epoch", "decision", "index" };
+
+    pid_t                                   pid = getpid();
+
+    uint32_t                                histogram[BUCKET_SZ + 1], fill[10];
+
+    uint32_t                                used, free, contiguous, lookups, waits;
+
+    size_t                                  ln = 0;
+
+    int                                     i;
+
+    *report = NULL;
+
+    if (stats == NULL || (scan && (locks == NULL || hashtable == NULL))) {
+        return AM_ERROR;
+    }
+
+    lookups = stats->lookups.v;
+    waits = stats->lock_waits.v;
+
+    status_printf(report, &ln, "uptime: %"PR_L64"\n"
+            "slots: %u\n"
+            "locks: %u\n"
+            "memory size: %u\n"
+            "generation: %u\n"
+            "reads: %u\n"
+            "writes: %u\n"
+            "updates: %u\n"
+            "deletes: %u\n"
+            "failures: %u\n"
+            "expires: %u\n"
+            "lru: %u\n"
+            "probes: %u (%.2f per lookup)\n"
+            "lock waits: %u (%.1f us each)\n"
+            "budget exhausted: %u\n"
+            "breaker trips: %u\n"
+            "stale: %u\n"
+            "dns hits: %u\n"
+            "dns misses: %u\n"
+            "dns refreshes: %u (%u ms)\n"
+            "cache objects leaked: %u\n"
+            "cache objects cleared: %u\n"
+            "cache objects collected: %u\n"
+            "data objects leaked: %u\n"
+            "data objects cleared: %u\n"
+            "data objects collected: %u\n",
+            (int64_t) (time(0) - stats->basetime), hash_sz, n_locks, memory_sz, stats->generation.v,
+            stats->reads.v, stats->writes.v, stats->updates.v, stats->deletes.v, stats->failures.v, stats->expires.v, stats->lru.v,
+            stats->probes.v, lookups ? (double) stats->probes.v / lookups : 0.0,
+            waits, waits ? (double) stats->lock_wait_us.v / waits : 0.0,
+            stats->budget.v, stats->trips.v, stats->stale.v,
+            stats->dns_hits.v, stats->dns_misses.v, stats->dns_refreshes.v, stats->dns_refresh_ms.v,
+            stats->cache.leaked.v, stats->cache.cleared.v, stats->cache.collected.v,
+            stats->data.leaked.v, stats->data.cleared.v, stats->data.collected.v);
+
+    for (i = 0; i < CACHE_STAT_TYPES; i++) {
+        status_printf(report, &ln, "%s hits: %u\n%s misses: %u\n", types[i], stats->hits[i].v, types[i], stats->misses[i].v);
+    }
+
+    if (!scan) {
+        return *report != NULL ? AM_SUCCESS : AM_ENOMEM;                              /* counters only */
+    }
+
+    bucket_occupancy(pid, histogram);
+    for (i = 0; i <= BUCKET_SZ; i++) {
+        if (histogram[i]) {
+            status_printf(report, &ln, "slots with %d entries: %u\n", i, histogram[i]);
+        }
+    }
+
+    if (agent_memory_usage(pid, &used, &free, &contiguous, fill) == 0) {
+        status_printf(report, &ln, "memory used: %u\n"
+                "memory free: %u\n"
+                "memory fragmentation: %.1f%%\n", used, free, free ? 100.0 - 100.0 * contiguous / free : 0.0);
+
+        for (i = 0; i < 10; i++) {
+            status_printf(report, &ln, "clusters %d-%d%% full: %u\n", i * 10, i * 10 + 10, fill[i]);
+        }
+    }
+
+    return *report != NULL ? AM_SUCCESS : AM_ENOMEM;
+
+}
+
+/*
+ * the counters of the cache of agent instance id, as cache_status without scan, for a process which is not using that
+ * cache (agentadmin): only the stats segment is mapped, read only, and nothing is created when it does not exist
+ *
+ * returns AM_NOT_FOUND when there is no such cache (no agent is running)
+ *
+ */
+int cache_status_readonly(int id, char **report) {
+
+    am_shm_t                               *shm = am_shm_open_readonly(get_global_name(STATFILE, id));
+
+    struct stats                           *own = stats;
+
+    uint32_t                                own_hash_sz = hash_sz, own_n_locks = n_locks, own_memory_sz = memory_sz;
+
+    int                                     rv;
+
+    *report = NULL;
+
+    if (shm == NULL) {
+        return AM_NOT_FOUND;
+    }
+
+    stats = shm->base_ptr;
+    hash_sz = stats->hash_sz;
+    n_locks = stats->n_locks;
+    memory_sz = stats->memory_sz;
+
+    rv = cache_status(report, AM_FALSE);
+
+    stats = own;                                                                      /* of a cache this process uses */
+    hash_sz = own_hash_sz;
+    n_locks = own_n_locks;
+    memory_sz = own_memory_sz;
+    am_shm_close_readonly(shm);
+
+    return rv;
+
+}
+
+/*
+ * generation of the cached data; process local copies of it are only used while this is unchanged
+ *
+ */
+uint32_t cache_generation() {
+
+    return stats != NULL ? stats->generation.v : 0;
+
+}
+
+void cache_generation_bump() {
+
+    if (stats != NULL) {
+        incr(&stats->generation.v);
+    }
+
+}
+
+/*
+ * policy change epoch (0 when there was no policy change), read and set with a single atomic load/store
+ *
+ */
+uint64_t cache_policy_epoch() {
+
+    return stats != NULL ? load64(&stats->policy_epoch.v) : 0;
+
+}
+
+int cache_set_policy_epoch(uint64_t epoch) {
+
+    if (stats == NULL) {
+        return 1;
+    }
+    store64(&stats->policy_epoch.v, epoch);
+    return 0;
+
+}
+
+/*
+ * whether the cache was emptied by recovery since the last call
+ *
+ */
+int cache_take_recovered() {
+
+    return stats != NULL && reset(&stats->recovered.v) != 0;
+
+}
+
+/*
+ * write valid entries to a snapshot file; the file is written under a temporary name and then renamed, so that a
+ * snapshot is either complete or not there
+ *
+ */
+int cache_snapshot_save(const char *path, uint32_t *count) {
+
+    static const char                      *thisfunc = "cache_snapshot_save():";
+
+    char                                    tmp[AM_PATH_SIZE];
+
+    FILE                                   *f;
+
+    int                                     fd;
+
+    pid_t                                   pid = getpid();
+
+    int64_t                                 now = time(0);
+
+    struct snapshot_header                  hdr = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, hash_sz, 0, 0, now };
+
+    uint32_t                                i, t;
+
+    int                                     j, err;
+
+    *count = 0;
+
+    if (stats == NULL || hashtable == NULL) {
+        return 1;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) pid);
+#ifdef _WIN32
+    fd = _open(tmp, _O_CREAT | _O_WRONLY | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+    if (fd == -1 || ( f = _fdopen(fd, "wb") ) == NULL) {
+#else
+    fd = open(tmp, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);                  /* session data, owner only */
+    if (fd == -1 || ( f = fdopen(fd, "wb") ) == NULL) {
+#endif
+        AM_LOG_ERROR(0, "%s unable to create %s (error: %d)", thisfunc, tmp, errno);
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp);
+        }
+        return 1;
+    }
+
+    hdr.policy_epoch = cache_policy_epoch();
+    err = fwrite(&hdr, sizeof(hdr), 1, f) != 1;
+
+    t = relative_time(now);
+
+    for (i = 0; i < hash_sz && !err; i++) {
+        offset                              ofs;
+
+        if (cache_readlock_p(i, pid) == 0) {
+            continue;
+        }
+
+        if (~(ofs = hashtable[i])) {
+            struct cache_entry             *e = agent_memory_ptr(ofs);
+
+            for (j = 0; j < BUCKET_SZ && !err; j++) {
+                offset                      v = e->bucket[j];
+
+                if (~ v && e->expires[j] >= t) {
+                    struct user_entry      *u = agent_memory_ptr(v);
+                    struct snapshot_record  rec = { i, e->fingerprint[j], stats->basetime + e->expires[j], u->ln, 0 };
+
+                    err = fwrite(&rec, sizeof(rec), 1, f) != 1 || (u->ln && fwrite(u->data, u->ln, 1, f) != 1);
+                    (*count)++;
+                }
+            }
+        }
+
+        cache_readlock_release_p(i, pid);
+    }
+
+    if (fclose(f)) {
+        err = 1;
+    }
+
+#ifdef _WIN32
+    if (err || !MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING)) {
+#else
+    if (err || rename(tmp, path)) {
+#endif
+        AM_LOG_ERROR(0, "%s unable to write %s", thisfunc, path);
+        unlink(tmp);
+        return 1;
+    }
+
+    return 0;
+
+}
+
+/*
+ * add the entries of a snapshot file which have not expired yet, and restore the policy epoch; a snapshot taken with
+ * another hash table size is not used
+ *
+ */
+int cache_snapshot_load(const char *path, int (*identity)(void *, void *), uint32_t *count) {
+
+    static const char                      *thisfunc = "cache_snapshot_load():";
+
+    FILE                                   *f;
+
+    struct snapshot_header                  hdr;
+
+    struct snapshot_record                  rec;
+
+    int64_t                                 now = time(0);
+
+    void                                   *data = NULL;
+
+    uint32_t                                data_sz = 0;
+
+    int                                     err = 0;
+
+    *count = 0;
+
+    if (stats == NULL || hashtable == NULL) {
+        return 1;
+    }
+
+    if (( f = fopen(path, "rb") ) == NULL) {
+        return 1;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION) {
+        AM_LOG_WARNING(0, "%s %s is not a cache snapshot", thisfunc, path);
+        fclose(f);
+        return 1;
+    }
+
+    if (hdr.hash_sz != hash_sz) {
+        AM_LOG_WARNING(0, "%s %s was taken with %u hash table slots, not %u", thisfunc, path, hdr.hash_sz, hash_sz);
+        fclose(f);
+        return 1;
+    }
+
+    if (hdr.policy_epoch > cache_policy_epoch()) {
+        cache_set_policy_epoch(hdr.policy_epoch);
+    }
+
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+
+        if (rec.hash >= hash_sz || rec.fingerprint > 0xff || rec.ln == 0 || rec.ln >= MAX_CACHE_MEMORY_SZ) {
+            err = 1;
+            break;
+        }
+
+        if (rec.ln > data_sz) {
+            void                           *p = realloc(data, rec.ln);
+
+            if (p == NULL) {
+                err = 1;
+                break;
+            }
+            data = p;
+            data_sz = rec.ln;
+        }
+
+        if (fread(data, rec.ln, 1, f) != 1) {
+            err = 1;
+            break;
+        }
+
+        if (rec.expires <= now) {
+            continue;
+        }
+
+        if (cache_add(rec.fingerprint * hash_sz + rec.hash, data, rec.ln, rec.expires, identity) == 0) {
+            (*count)++;
+        }
+    }
+
+    if (err) {
+        AM_LOG_WARNING(0, "%s %s is truncated or corrupt, %u entries loaded", thisfunc, path, *count);
+    }
+
+    free(data);
+    fclose(f);
+    return err;
+
+}
+
+void cache_stat_budget_exhausted() {
+
+    if (stats != NULL) {
+incr(&stats->budget.v);
+    }
 
 }
 
@@ -898,8 +2538,20 @@ void cache_stats() {
     printf("failures:%u\n", get_and_reset(&stats->failures.v));
     printf("expires: %u\n", get_and_reset(&stats->expires.v));
     printf("lru:     %u\n", get_and_reset(&stats->lru.v));
+    printf("budget:  %u\n", get_and_reset(&stats->budget.v));
+    printf("trips:   %u\n", get_and_reset(&stats->trips.v));
+    printf("stale:   %u\n", get_and_reset(&stats->stale.v));
+    printf("dns hits:%u\n", get_and_reset(&stats->dns_hits.v));
+    printf("dns miss:%u\n", get_and_reset(&stats->dns_misses.v));
+    printf("dns refresh: %u (%u ms)\n", get_and_reset(&stats->dns_refreshes.v), get_and_reset(&stats->dns_refresh_ms.v));
+
+    uint32_t                                lookups = get_and_reset(&stats->lookups.v);
+    uint32_t                                probes = get_and_reset(&stats->probes.v);
+    uint32_t                                full_probes = get_and_reset(&stats->full_probes.v);
+
+    printf("probes:  %u (%.2f per lookup)\n", probes, lookups ? (double) probes / lookups : 0.0);
+    printf("without fingerprints: %u (%.2f per lookup)\n", full_probes, lookups ? (double) full_probes / lookups : 0.0);
 
-#ifdef GC_STATS
     printf("cache objects:\n");
     printf("leaked: %u\n", get_and_reset(&stats->cache.leaked.v));
     printf("cleared: %u\n", get_and_reset(&stats->cache.cleared.v));
@@ -909,14 +2561,81 @@ void cache_stats() {
     printf("leaked: %u\n", get_and_reset(&stats->data.leaked.v));
     printf("cleared: %u\n", get_and_reset(&stats->data.cleared.v));
     printf("collected: %u\n", get_and_reset(&stats->data.collected.v));
-#endif /* GC_STATS */
 #endif /* INTEGRATION_TEST */
 }
 
+/*
+ * drop everything in the hashtable that refers to a damaged memory cluster, one lock at a time, so that the damaged
+ * clusters can be reset while the rest of the cache stays in service
+ *
+ */
+static int cache_unlink_damaged(pid_t pid, uint32_t *slots, uint32_t *entries) {
+
+    uint32_t                                l, i;
+
+    int                                     j;
+
+    *slots = *entries = 0;
+
+    for (l = 0; l < n_locks; l++) {
+        if (read_block(locks + l, pid) == 0) {
+            return 1;
+        }
+
+        for (i = l; i < hash_sz; i += n_locks) {
+            offset                          ofs = hashtable[i];
+
+            if (~ ofs) {
+                struct cache_entry         *e = agent_memory_ptr(ofs);
+
+                if (agent_memory_damaged(ofs)) {
+                    hashtable[i] = ~ 0;                                               /* healthy user entries are gc'd later */
+                    (*slots)++;
+                    continue;
+                }
+
+                for (j = 0; j < BUCKET_SZ; j++) {
+                    offset                  v = e->bucket[j];
+
+                    if (~ v && agent_memory_damaged(v)) {
+                        e->bucket[j] = ~ 0;
+                        e->expires[j] = ~ 0;
+                        (*entries)++;
+                    }
+                }
+            }
+        }
+
+        read_unblock(locks + l, pid);
+    }
+
+    return 0;
+
+}
+
 int master_recovery_process(pid_t pid) {
 
     static const char                      *thisfunc = "master_recovery_process():";
 
+    uint32_t                                slots, entries;
+
+    int                                     damaged = agent_memory_damaged_clusters();
+
+    if (damaged) {
+        AM_LOG_DEBUG(0, "%s unlinking cache entries in %d damaged clusters", thisfunc, damaged);
+        if (cache_unlink_damaged(pid, &slots, &entries) == 0) {
+            AM_LOG_WARNING(0, "%s dropped %u cache slots and %u cache entries, resetting %d damaged clusters",
+                    thisfunc, slots, entries, damaged);
+            agent_memory_reset_damaged(pid);
+
+            cache_generation_bump();                                                  /* per-process caches may hold copies of dropped entries */
+
+            return 0;
+        }
+
+        AM_LOG_WARNING(0, "%s unable to unlink cache entries in damaged clusters, resetting the whole cache", thisfunc);
+    }
+
     AM_LOG_DEBUG(0, "%s blocking cache locks", thisfunc);
     if (cache_readlock_block_all(pid)) {
         return 1;
@@ -924,6 +2643,7 @@ int master_recovery_process(pid_t pid) {
 
     AM_LOG_DEBUG(0, "%s reinitialising cache", thisfunc);
     cache_reinitialise();
+    incr(&stats->recovered.v);
 
     AM_LOG_DEBUG(0, "%s resetting memory clusters", thisfunc);
     agent_memory_reset(pid);
@@ -17,10 +17,25 @@
 #ifndef AGENT_CACHE_H
 #define AGENT_CACHE_H
 
+#define CACHE_BREAKER_CLOSED    0
+#define CACHE_BREAKER_OPEN      1
+#define CACHE_BREAKER_HALF_OPEN 2
+
+#define CACHE_STAT_SESSION      0
+#define CACHE_STAT_PDP          1
+#define CACHE_STAT_EPOCH        2
+#define CACHE_STAT_DECISION     3
+#define CACHE_STAT_INDEX        4
+#define CACHE_STAT_TYPES        5
+
+#define RESOLVED_DATA_SZ        256 /* most resolved address data kept for a host */
+
 int cache_initialise(int id);
 int cache_shutdown(int destroy);
 int cache_cleanup(int id);
 
+int cache_created();
+int cache_detach();
 int is_agent_cache_ready();
 int is_agent_memory_ready();
 
@@ -29,13 +44,46 @@ int cache_add(uint32_t hash, void *data, size_t ln, int64_t expires, int (*ident
 void cache_delete(uint32_t hash, void *data, int (*identity)(void *, void *));
 
 int cache_get_readlocked_ptr(uint32_t hash, void **addr, uint32_t *ln, void *data, int64_t now, int (*identity)(void *, void *));
+int cache_get_stale_readlocked_ptr(uint32_t hash, void **addr, uint32_t *ln, void *data, int64_t now, uint32_t grace, int (*identity)(void *, void *));
+int cache_get_each_readlocked(uint32_t hash, void *data, int64_t now, uint32_t grace, int (*identity)(void *, void *),
+        int (*each)(void *, void *, uint32_t), void *arg);
+int cache_get_all_readlocked(uint32_t hash, void *data, int64_t now, uint32_t grace, int (*identity)(void *, void *),
+        void (*all)(void *, int, void **, uint32_t *), void *arg);
 void cache_release_readlocked_ptr(uint32_t hash);
+int64_t cache_readlocked_expires(uint32_t hash, void *data);
+
+int cache_flight_begin(uint64_t key, int timeout);
+void cache_flight_end(uint64_t key);
+int cache_flight_wait(uint64_t key, int wait_ms);
+
+int cache_breaker_allow(uint32_t key, const char *url, int cooldown);
+int cache_breaker_report(uint32_t key, const char *url, int failed, int threshold);
+void cache_set_stale_grace(uint32_t grace);
+
+int cache_resolved_get(uint64_t key, uint32_t key_ln, void *data, uint32_t *ln, int *expired);
+int cache_resolved_refresh(uint64_t key, uint32_t key_ln, int timeout);
+void cache_resolved_set(uint64_t key, uint32_t key_ln, const void *data, uint32_t ln, int ttl, uint32_t ms);
+
+void cache_purge_expired_entries(pid_t pid, uint32_t budget_ms);
+
+void cache_garbage_collect(uint32_t budget_ms);
+
+uint32_t cache_generation();
+void cache_generation_bump();
+
+uint64_t cache_policy_epoch();
+int cache_set_policy_epoch(uint64_t epoch);
 
-void cache_purge_expired_entries(pid_t pid);
+int cache_take_recovered();
+int cache_snapshot_save(const char *path, uint32_t *count);
+int cache_snapshot_load(const char *path, int (*identity)(void *, void *), uint32_t *count);
 
-void cache_garbage_collect();
+void cache_stat_budget_exhausted();
 
 void cache_stats();
+void cache_stat_lookup(int type, int hit);
+int cache_status(char **report, int scan);
+int cache_status_readonly(int id, char **report);
 
 void cache_readlock_total_barrier(pid_t pid);
 
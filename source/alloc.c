@@ -111,6 +111,7 @@ typedef struct {
     align_win(64) volatile uint32_t seed align_attr(64);
     align_win(64) volatile int32_t error align_attr(64);
     align_win(64) volatile pid_t checker align_attr(64);
+    align_win(64) volatile uint32_t damaged[CLUSTERS / 32] align_attr(64); /* clusters which failed validation */
 } ctl_header_t;
 
 
@@ -277,6 +278,14 @@ void agent_memory_validate(pid_t pid) {
 
 }
 
+/*
+ * number of memory clusters
+ *
+ */
+int agent_memory_clusters() {
+     return ctlblock != NULL ? (int) ctlblock->number_of_clusters : 0;
+}
+
 /*
  * get new seed for memory operations, distributing operations to clusters on round-robin basis
  *
@@ -827,6 +836,52 @@ static int validate_cluster_format(unsigned cluster) {
 
 }
 
+/*
+ * record a cluster as damaged, so that recovery can be limited to the damaged clusters
+ *
+ */
+void agent_memory_mark_damaged(unsigned cluster) {
+
+    volatile uint32_t                      *w = ctlblock->damaged + cluster / 32;
+
+    uint32_t                                v;
+
+    do {
+        v = *w;
+    } while (cas(w, v, v | (1u << (cluster % 32))) == 0);
+
+}
+
+/*
+ * number of damaged clusters
+ *
+ */
+int agent_memory_damaged_clusters() {
+
+    int                                     n = 0;
+
+    for (unsigned cluster = 0; cluster < ctlblock->number_of_clusters; cluster++) {
+        if (ctlblock->damaged[cluster / 32] & (1u << (cluster % 32))) {
+            n++;
+        }
+    }
+
+    return n;
+
+}
+
+/*
+ * whether a block is in a damaged cluster
+ *
+ */
+int agent_memory_damaged(offset ofs) {
+
+    unsigned                                cluster = ofs / ctlblock->cluster_capacity;
+
+    return (ctlblock->damaged[cluster / 32] & (1u << (cluster % 32))) != 0;
+
+}
+
 /*
  * validation - scan all clusters, blocks and freelists, check consistency and some reporting
  *
@@ -867,6 +922,7 @@ int agent_memory_check(pid_t pid, int verbose, int clearup) {
                                  thisfunc, cluster, (int64_t)locker);
 
                 if (validate_cluster_format(cluster)) {
+                    agent_memory_mark_damaged(cluster);                                            /* stays locked until recovery resets it */
                     err = 1;
                 } else if (cas(&cluster_lock(cluster), VALIDATION_LOCK, 0)) {
                     AM_LOG_DEBUG(0, "%s cluster %u: unlocking cluster", thisfunc, cluster);
@@ -881,46 +937,82 @@ int agent_memory_check(pid_t pid, int verbose, int clearup) {
 
 }
 
+/*
+ * wait for any locker of a cluster to complete and reset its block structure and free lists
+ *
+ */
+static void reset_cluster(pid_t pid, unsigned cluster) {
+    static const char                      *thisfunc = "reset_cluster():";
+
+    pid_t                                   locker;
+
+    int                                     i;
+
+    offset                                  ofs = cluster * ctlblock->cluster_capacity;
+    block_header_t                         *h = HDR(ofs);
+
+    while (( locker = casv(&cluster_lock(cluster), 0, pid) )) {
+        if (locker == VALIDATION_LOCK) {
+            if (cas(&cluster_lock(cluster), locker, pid)) {
+                break;
+            }
+        } else if (process_dead(locker)) {
+            AM_LOG_DEBUG(0, "%s memory barrier: locking process %"PR_L64" is dead", thisfunc, (int64_t)locker);
+            if (cas(&cluster_lock(cluster), locker, pid)) {
+                break;
+            }
+        } else {
+            AM_LOG_DEBUG(0, "%s memory barrier: locking process %"PR_L64" is active", thisfunc, (int64_t)locker);
+            yield();
+        }
+    }
+
+    *h = (block_header_t) { .locks = 0, .size = ctlblock->cluster_capacity, .u.free = { ~ 0u, ~ 0u } };
+
+    for (i = 0; i < CLUSTER_FREELISTS; i++)
+        cluster_free_lists(cluster)[i] = ~ 0;
+
+    push_free_ptr(cluster_free_lists(cluster) + free_list_offset_for_size(h->size), ofs);
+
+    spinlock_unlock(&cluster_lock(cluster));
+}
+
 /*
  * for all clusters, wait for any locker to complete and reset the block structure and free lists
  *
  */
 void agent_memory_reset(pid_t pid) {
-    static const char                      *thisfunc = "agent_memory_reset():";
 
     unsigned                                cluster;
-    pid_t                                   locker;
 
     for (cluster = 0; cluster < ctlblock->number_of_clusters; cluster++) {
-        while (( locker = casv(&cluster_lock(cluster), 0, pid) )) {
-            if (locker == VALIDATION_LOCK) {
-                if (cas(&cluster_lock(cluster), locker, pid)) {
-                    break;
-                }
-            } else if (process_dead(locker)) {
-                AM_LOG_DEBUG(0, "%s memory barrier: locking process %"PR_L64" is dead", thisfunc, (int64_t)locker);
-                if (cas(&cluster_lock(cluster), locker, pid)) {
-                    break;
-                }
-            } else {
-                AM_LOG_DEBUG(0, "%s memory barrier: locking process %"PR_L64" is active", thisfunc, (int64_t)locker);
-                yield();
-            }
-        }
+        reset_cluster(pid, cluster);
+    }
 
-        int                                 i;
+    for (cluster = 0; cluster < CLUSTERS / 32; cluster++) {
+        ctlblock->damaged[cluster] = 0;
+    }
+}
 
-        offset                              ofs = cluster * ctlblock->cluster_capacity;
-        block_header_t                     *h = HDR(ofs);
+/*
+ * reset damaged clusters only; nothing may refer to blocks in them any more
+ *
+ */
+void agent_memory_reset_damaged(pid_t pid) {
 
-        *h = (block_header_t) { .locks = 0, .size = ctlblock->cluster_capacity, .u.free = { ~ 0u, ~ 0u } };
+    unsigned                                cluster;
 
-        for (i = 0; i < CLUSTER_FREELISTS; i++)
-            cluster_free_lists(cluster)[i] = ~ 0;
+    for (cluster = 0; cluster < ctlblock->number_of_clusters; cluster++) {
+        volatile uint32_t                  *w = ctlblock->damaged + cluster / 32;
+        uint32_t                            bit = 1u << (cluster % 32), v;
 
-        push_free_ptr(cluster_free_lists(cluster) + free_list_offset_for_size(h->size), ofs);
+        if (*w & bit) {
+            reset_cluster(pid, cluster);
 
-        spinlock_unlock(&cluster_lock(cluster));
+            do {
+                v = *w;
+            } while (cas(w, v, v & ~ bit) == 0);
+        }
     }
 }
 
@@ -928,6 +1020,35 @@ void agent_memory_reset(pid_t pid) {
  * garbage collection, where the caller determines whether blocks can be straightforwardly freed
  *
  */
+static int scan_cluster(pid_t pid, unsigned cluster, int (*checker)(void *cbdata, pid_t pid, int32_t type, void *p), void *cbdata,
+        uint32_t *free) {
+
+    const offset base = cluster * ctlblock->cluster_capacity, end = base + ctlblock->cluster_capacity;
+    offset ofs = base;
+    int c = 0;
+
+    while (ofs != end) {
+        block_header_t *h = HDR(ofs);
+
+        if (h->locks) {
+            if (checker(cbdata, pid, h->locks, USR(ofs))) {
+                h->size += coalesce(cluster_free_lists(cluster), ofs, end);
+                h->locks = 0;
+
+                push_free_ptr(cluster_free_lists(cluster) + free_list_offset_for_size(h->size), ofs);
+                c++;
+            }
+        }
+
+        if (h->locks == 0) {
+            *free += h->size;
+        }
+
+        ofs += h->size;
+    }
+    return c;
+}
+
 void agent_memory_scan(pid_t pid, int (*checker)(void *cbdata, pid_t pid, int32_t type, void *p), void *cbdata) {
     static const char *thisfunc = "agent_memory_scan():";
     unsigned cluster;
@@ -938,34 +1059,14 @@ void agent_memory_scan(pid_t pid, int (*checker)(void *cbdata, pid_t pid, int32_
         return;
 
     for (cluster = 0; cluster < ctlblock->number_of_clusters; cluster++) {
-        const offset base = cluster * ctlblock->cluster_capacity, end = base + ctlblock->cluster_capacity;
-        offset ofs = base;
-
         if (spinlock_lock(&cluster_lock(cluster), pid)) {
             AM_LOG_ERROR(0, "%s unable to scan cluster %u, abandoning gc scan", thisfunc, cluster);
 
             return;
         }
 
-        while (ofs != end) {
-            block_header_t *h = HDR(ofs);
-
-            if (h->locks) {
-                if (checker(cbdata, pid, h->locks, USR(ofs))) {
-                    h->size += coalesce(cluster_free_lists(cluster), ofs, end);
-                    h->locks = 0;
-
-                    push_free_ptr(cluster_free_lists(cluster) + free_list_offset_for_size(h->size), ofs);
-                    c++;
-                }
-            }
-
-            if (h->locks == 0) {
-                free += h->size;
-            }
+        c += scan_cluster(pid, cluster, checker, cbdata, &free);
 
-            ofs += h->size;
-        }
         spinlock_unlock(&cluster_lock(cluster));
     }
 
@@ -973,16 +1074,43 @@ void agent_memory_scan(pid_t pid, int (*checker)(void *cbdata, pid_t pid, int32_
             (float) free / (float) (ctlblock->number_of_clusters * ctlblock->cluster_capacity));
 }
 
+/*
+ * scan one cluster, so that a scan can be spread over time (and threads); returns the number of blocks released
+ * or -1 if the cluster could not be locked
+ *
+ */
+int agent_memory_scan_cluster(pid_t pid, unsigned cluster, int (*checker)(void *cbdata, pid_t pid, int32_t type, void *p), void *cbdata) {
+    static const char *thisfunc = "agent_memory_scan_cluster():";
+    uint32_t free = 0;
+    int c;
+
+    if (ctlblock == NULL || cluster >= ctlblock->number_of_clusters)
+        return -1;
+
+    if (spinlock_lock(&cluster_lock(cluster), pid)) {
+        AM_LOG_ERROR(0, "%s unable to scan cluster %u", thisfunc, cluster);
+
+        return -1;
+    }
+
+    c = scan_cluster(pid, cluster, checker, cbdata, &free);
+
+    spinlock_unlock(&cluster_lock(cluster));
+
+    return c;
+}
+
 /*
  * print agent memory
  *
  */
-static void analyse_cluster(int cluster, uint32_t *use_ptr, uint32_t *free_ptr, uint32_t *block_ptr, uint32_t *freelists) {
+static void analyse_cluster(int cluster, uint32_t *use_ptr, uint32_t *free_ptr, uint32_t *block_ptr, uint32_t *largest_ptr,
+        uint32_t *freelists, int verbose) {
     static const char                      *thisfunc = "analyse_cluster():";
 
     offset                                  base = cluster * ctlblock->cluster_capacity, end = base + ctlblock->cluster_capacity;
 
-    uint32_t                                used = 0, free = 0, blocks = 0;
+    uint32_t                                used = 0, free = 0, blocks = 0, largest = 0;
 
     uint32_t                                locks[4] = { 0, 0, 0, 0 }, overflows = 0;
 
@@ -994,6 +1122,9 @@ static void analyse_cluster(int cluster, uint32_t *use_ptr, uint32_t *free_ptr,
             free += sz;
             locks[lock]++;
 
+            if (sz > largest)
+                largest = sz;
+
             freelists[free_list_offset_for_size(sz)]++;
         } else if (lock < 4) {
             used += sz;
@@ -1005,12 +1136,15 @@ static void analyse_cluster(int cluster, uint32_t *use_ptr, uint32_t *free_ptr,
         blocks++;
     }
 
-    AM_LOG_DEBUG(0, "%s cluster %5u: used %8u, free %8u, blocks %5u locks types [%5u, %5u, %5u, %5u, (%u)]",
+    if (verbose) {
+        AM_LOG_DEBUG(0, "%s cluster %5u: used %8u, free %8u, blocks %5u locks types [%5u, %5u, %5u, %5u, (%u)]",
                       thisfunc, cluster, used, free, blocks, locks[0], locks[1], locks[2], locks[3], overflows);
+    }
 
     *use_ptr += used;
     *free_ptr += free;
     *block_ptr += blocks;
+    *largest_ptr = largest;
 
 }
 
@@ -1021,7 +1155,7 @@ static void analyse_cluster(int cluster, uint32_t *use_ptr, uint32_t *free_ptr,
 void agent_memory_print(pid_t pid) {
     static const char                      *thisfunc = "agent_memory_print():";
 
-    uint32_t                                used = 0, free = 0, blocks = 0;
+    uint32_t                                used = 0, free = 0, blocks = 0, largest;
 
     uint32_t                                freelists[CLUSTER_FREELISTS];
 
@@ -1036,7 +1170,7 @@ void agent_memory_print(pid_t pid) {
             break;
         }
 
-        analyse_cluster(cluster, &used, &free, &blocks, freelists);
+        analyse_cluster(cluster, &used, &free, &blocks, &largest, freelists, 1);
 
         spinlock_unlock(&cluster_lock(cluster));
     }
@@ -1048,6 +1182,46 @@ void agent_memory_print(pid_t pid) {
 
 }
 
+/*
+ * memory usage over all clusters: bytes used and free, the sum over clusters of their largest free block (which is
+ * all of the free memory when it is not fragmented) and the number of clusters by how full they are, in tenths
+ *
+ */
+int agent_memory_usage(pid_t pid, uint32_t *used, uint32_t *free, uint32_t *contiguous, uint32_t fill[10]) {
+    static const char                      *thisfunc = "agent_memory_usage():";
+
+    uint32_t                                blocks = 0, largest;
+
+    uint32_t                                freelists[CLUSTER_FREELISTS] = { 0 };
+
+    *used = *free = *contiguous = 0;
+    for (int i = 0; i < 10; i++) {
+        fill[i] = 0;
+    }
+
+    for (unsigned cluster = 0; cluster < ctlblock->number_of_clusters; cluster++) {
+        uint32_t                            u = *used, tenths;
+
+        if (spinlock_lock(&cluster_lock(cluster), pid)) {
+            AM_LOG_ERROR(0, "%s abandoning scan of cluster %u", thisfunc, cluster);
+
+            return 1;
+        }
+
+        analyse_cluster(cluster, used, free, &blocks, &largest, freelists, 0);
+
+        spinlock_unlock(&cluster_lock(cluster));
+
+        *contiguous += largest;
+
+        tenths = (uint32_t) ((uint64_t) (*used - u) * 10 / ctlblock->cluster_capacity);
+        fill[tenths > 9 ? 9 : tenths]++;
+    }
+
+    return 0;
+
+}
+
 offset agent_memory_offset(void *ptr) {
 
     return (offset)(((char *)ptr) - (char *)cluster_base);
@@ -48,11 +48,19 @@ int agent_memory_free(pid_t pid, void *ptr);
 
 int agent_memory_check(pid_t pid, int verbose, int cleanup);
 void agent_memory_scan(pid_t pid, int (*checker)(void *cbdata, pid_t pid, int32_t type, void *p), void *cbdata);
+int agent_memory_scan_cluster(pid_t pid, unsigned cluster, int (*checker)(void *cbdata, pid_t pid, int32_t type, void *p), void *cbdata);
 
 void agent_memory_barrier(pid_t pid);
 void agent_memory_validate(pid_t pid);
 
 void agent_memory_reset(pid_t pid);
+void agent_memory_reset_damaged(pid_t pid);
+
+int agent_memory_usage(pid_t pid, uint32_t *used, uint32_t *free, uint32_t *contiguous, uint32_t fill[10]);
+
+void agent_memory_mark_damaged(unsigned cluster);
+int agent_memory_damaged_clusters();
+int agent_memory_damaged(offset ofs);
 
 void agent_memory_error();
 
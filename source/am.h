@@ -83,6 +83,58 @@ typedef enum {
 #define AM_NET_CONNECT_TIMEOUT      4 /* seconds */
 #endif
 
+#ifndef AM_NET_KEEPALIVE_SIZE
+#define AM_NET_KEEPALIVE_SIZE       8 /* max idle connections kept per naming url */
+#endif
+
+#ifndef AM_NET_KEEPALIVE_TIMEOUT
+#define AM_NET_KEEPALIVE_TIMEOUT    15 /* seconds */
+#endif
+
+#ifndef AM_NET_IO_THREADS
+#define AM_NET_IO_THREADS           8 /* most per process I/O threads started when asked for one per CPU */
+#endif
+
+#ifndef AM_NET_BUDGET
+#define AM_NET_BUDGET               6000 /* milliseconds a request may spend in remote calls and retries */
+#endif
+
+#ifndef AM_NET_BACKOFF
+#define AM_NET_BACKOFF              100 /* milliseconds, initial retry back-off */
+#endif
+
+#ifndef AM_NET_BACKOFF_MAX
+#define AM_NET_BACKOFF_MAX          800 /* milliseconds */
+#endif
+
+#ifndef AM_NET_BREAKER_FAILURES
+#define AM_NET_BREAKER_FAILURES     5 /* consecutive connection failures/timeouts which open the circuit breaker for a url */
+#endif
+
+#ifndef AM_NET_BREAKER_COOLDOWN
+#define AM_NET_BREAKER_COOLDOWN     10 /* seconds calls to a url fail fast before a probe call is let through */
+#endif
+
+#ifndef AM_NET_DNS_TTL
+#define AM_NET_DNS_TTL              60 /* seconds resolved host addresses are used before they are refreshed (in the background) */
+#endif
+
+#ifndef AM_DECISION_CACHE_SIZE
+#define AM_DECISION_CACHE_SIZE      256 /* session/policy data of recent decisions kept in each process (0 disables it) */
+#endif
+
+#ifndef AM_POLICY_INDEX_CACHE_SIZE
+#define AM_POLICY_INDEX_CACHE_SIZE  64 /* subtree mode policy indexes (of recent tokens) kept in each process (0 disables it) */
+#endif
+
+#ifndef AM_DECISION_CACHE_TTL
+#define AM_DECISION_CACHE_TTL       3 /* seconds a decision cache entry is used for without looking at the shared cache */
+#endif
+
+#ifndef AM_POLICY_FLIGHT_WAIT
+#define AM_POLICY_FLIGHT_WAIT       5 /* seconds to wait for a concurrent session/policy request for the same token and resource */
+#endif
+
 #ifndef AM_MAX_THREADS_POOL
 #define AM_MAX_THREADS_POOL         AM_MAX_INSTANCES
 #endif
@@ -331,6 +383,8 @@ int am_configuration_shutdown();
 int am_cache_init(int id);
 int am_cache_shutdown();
 void am_cache_destroy();
+int am_cache_status(char **report, int scan);
+int am_cache_status_instance(int id, char **report);
 
 void am_restart_workers();
 int am_log_init(int id);
@@ -479,6 +479,23 @@ struct am_action_decision *am_action_decision_deserialise(struct cache_object_ct
     return list;
 }
 
+static struct am_policy_result *policy_result_deserialise(struct cache_object_ctx *ctx) {
+    struct am_policy_result *r = malloc(sizeof (struct am_policy_result));
+    if (r == NULL) {
+        ctx->error = AM_ENOMEM;
+        return NULL;
+    }
+    cache_object_read_u64(ctx, &r->created);
+    cache_object_read_s32(ctx, &r->index);
+    cache_object_read_s32(ctx, &r->scope);
+    cache_object_read_str(ctx, &r->resource, NULL);
+    r->response_attributes = am_name_value_deserialise(ctx);
+    r->response_decisions = am_name_value_deserialise(ctx);
+    r->action_decisions = am_action_decision_deserialise(ctx);
+    r->next = NULL;
+    return r;
+}
+
 struct am_policy_result *am_policy_result_deserialise(struct cache_object_ctx *ctx) {
     struct am_policy_result *list = NULL;
     uint32_t count = 0;
@@ -486,32 +503,187 @@ struct am_policy_result *am_policy_result_deserialise(struct cache_object_ctx *c
     cache_object_read_array(ctx, &count);
 
     while (count--) {
-        struct am_policy_result *r = malloc(sizeof (struct am_policy_result));
+        struct am_policy_result *r = policy_result_deserialise(ctx);
         if (r == NULL) {
-            ctx->error = AM_ENOMEM;
             break;
         }
-        cache_object_read_u64(ctx, &r->created);
-        cache_object_read_s32(ctx, &r->index);
-        cache_object_read_s32(ctx, &r->scope);
-        cache_object_read_str(ctx, &r->resource, NULL);
-        r->response_attributes = am_name_value_deserialise(ctx);
-        r->response_decisions = am_name_value_deserialise(ctx);
-        r->action_decisions = am_action_decision_deserialise(ctx);
-        r->next = NULL;
         AM_LIST_INSERT(list, r);
     }
     return list;
 }
 
-int am_policy_epoch_deserialise(struct cache_object_ctx *ctx, uint64_t *time_addr) {
-    cache_object_read_u64(ctx, time_addr);
-    return ctx->error;
+/* move reader past the string, without copying it out; string data is returned in place */
+static int cache_object_skip_str(struct cache_object_ctx *ctx, const char **data, uint32_t *size) {
+    uint32_t sz = 0;
+
+    if (cache_object_read_str_size(ctx, &sz) != 0 || ctx->data_size < (ctx->offset + sz)) {
+        ctx->error = AM_ERROR;
+        return -1;
+    }
+    if (data != NULL) {
+        *data = (const char *) ctx->data + ctx->offset;
+    }
+    if (size != NULL) {
+        *size = sz;
+    }
+    ctx->offset += sz;
+    return 0;
+}
+
+/* move reader past the map of strings */
+static int cache_object_skip_map(struct cache_object_ctx *ctx) {
+    uint32_t count = 0;
+
+    if (cache_object_read_map(ctx, &count) != 0) {
+        return -1;
+    }
+    while (count--) {
+        if (cache_object_skip_str(ctx, NULL, NULL) != 0 || cache_object_skip_str(ctx, NULL, NULL) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* move reader past the policy result entry, returning its scope and resource (in place) */
+static int policy_result_skip(struct cache_object_ctx *ctx, int32_t *scope, const char **resource, uint32_t *resource_sz) {
+    uint64_t u64;
+    int32_t s32;
+    uint32_t count = 0;
+
+    if (cache_object_read_u64(ctx, &u64) != 0 || cache_object_read_s32(ctx, &s32) != 0 ||
+            cache_object_read_s32(ctx, scope) != 0 || cache_object_skip_str(ctx, resource, resource_sz) != 0 ||
+            cache_object_skip_map(ctx) != 0 || cache_object_skip_map(ctx) != 0 ||
+            cache_object_read_array(ctx, &count) != 0) {
+        ctx->error = AM_ERROR;
+        return -1;
+    }
+    while (count--) {
+        if (cache_object_read_u64(ctx, &u64) != 0 || cache_object_read_s32(ctx, &s32) != 0 ||
+                cache_object_read_s32(ctx, &s32) != 0 || cache_object_skip_map(ctx) != 0) {
+            ctx->error = AM_ERROR;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct policy_result_ref {
+    int ctx;
+    size_t start;
+    size_t end;
+    const char *resource;
+    uint32_t resource_sz;
+};
+
+/**
+ * deserialise only those policy results which select(arg, count, scopes, resources, status) marks
+ * as matching (status other than AM_NO_MATCH). Scopes and resources of all the entries are read
+ * where they are (ie. in the shared memory) and handed over at once, so that the caller can index
+ * them; nothing is allocated for the entries which do not match.
+ */
+struct am_policy_result *am_policy_result_deserialise_match(struct cache_object_ctx *ctx,
+        int (*select)(void *, int, const int *, const char **, char *), void *arg) {
+    return am_policy_result_deserialise_match_all(ctx, 1, select, arg);
 }
 
-int am_policy_epoch_serialise(struct cache_object_ctx *ctx, uint64_t time) {
-    cache_object_write_u64(ctx, time);
-    return ctx->error;
+/**
+ * as am_policy_result_deserialise_match, for the policy results of n records (contexts) at once -
+ * select() is called just the once, with the entries of all of them.
+ */
+struct am_policy_result *am_policy_result_deserialise_match_all(struct cache_object_ctx *ctx, int n,
+        int (*select)(void *, int, const int *, const char **, char *), void *arg) {
+    struct am_policy_result *list = NULL;
+    struct policy_result_ref *ref;
+    const char **resources;
+    int *scopes;
+    char *status, *arena;
+    uint32_t one, *counts, count = 0, i, j;
+    size_t arena_sz = 0;
+    int k;
+
+    counts = n == 1 ? &one : malloc(n * sizeof (uint32_t));
+    if (counts == NULL) {
+        ctx->error = AM_ENOMEM;
+        return NULL;
+    }
+    for (k = 0; k < n; k++) {
+        counts[k] = 0;
+        if (cache_object_read_array(ctx + k, counts + k) != 0) {
+            counts[k] = 0;
+        } else if (counts[k] > ctx[k].data_size) {
+            ctx[k].error = AM_ERROR;
+            counts[k] = 0;
+        }
+        count += counts[k];
+    }
+    if (count == 0) {
+        if (counts != &one) free(counts);
+        return NULL;
+    }
+    ref = malloc(count * (sizeof (struct policy_result_ref) + sizeof (char *) + sizeof (int) + 1));
+    if (ref == NULL) {
+        ctx->error = AM_ENOMEM;
+        if (counts != &one) free(counts);
+        return NULL;
+    }
+    resources = (const char **) (ref + count);
+    scopes = (int *) (resources + count);
+    status = (char *) (scopes + count);
+
+    for (k = 0, i = 0; k < n; k++) {
+        for (j = 0; j < counts[k]; j++, i++) {
+            int32_t scope = 0;
+            ref[i].ctx = k;
+            ref[i].start = ctx[k].offset;
+            if (policy_result_skip(ctx + k, &scope, &ref[i].resource, &ref[i].resource_sz) != 0) {
+                if (counts != &one) free(counts);
+                free(ref);
+                return NULL;
+            }
+            ref[i].end = ctx[k].offset;
+            scopes[i] = scope;
+            status[i] = AM_NO_MATCH;
+            arena_sz += ref[i].resource_sz + 1;
+        }
+    }
+    if (counts != &one) free(counts);
+
+    /* resources are not null terminated in the record */
+    arena = malloc(arena_sz);
+    if (arena == NULL) {
+        ctx->error = AM_ENOMEM;
+        free(ref);
+        return NULL;
+    }
+    for (i = 0, arena_sz = 0; i < count; i++) {
+        memcpy(arena + arena_sz, ref[i].resource, ref[i].resource_sz);
+        arena[arena_sz + ref[i].resource_sz] = 0;
+        resources[i] = arena + arena_sz;
+        arena_sz += ref[i].resource_sz + 1;
+    }
+
+    if (select(arg, (int) count, scopes, resources, status) > 0) {
+        for (i = 0; i < count; i++) {
+            struct am_policy_result *r;
+            if (status[i] == AM_NO_MATCH) {
+                continue;
+            }
+            ctx[ref[i].ctx].offset = ref[i].start;
+            r = policy_result_deserialise(ctx + ref[i].ctx);
+            if (r == NULL) {
+                break;
+            }
+            AM_LIST_INSERT(list, r);
+        }
+    }
+    for (i = 0; i < count; i++) {
+        ctx[ref[i].ctx].offset = ref[i].end;
+    }
+
+    free(arena);
+    free(ref);
+    return list;
 }
 
 
@@ -154,7 +154,15 @@ enum {
     AM_CONF_PROXY_USER,
     AM_CONF_PROXY_PASSWORD,
     AM_CONF_CDSSO_DENY_CLEANUP_DISABLE,
-    AM_CONF_POLICY_EVAL_APP
+    AM_CONF_POLICY_EVAL_APP,
+    AM_CONF_NET_BUDGET,
+    AM_CONF_STALE_GRACE,
+    AM_CONF_PLL_PIPELINE,
+    AM_CONF_STATUS_URL,
+    AM_CONF_KEEPALIVE_SIZE,
+    AM_CONF_KEEPALIVE_TIMEOUT,
+    AM_CONF_NET_IO_THREADS,
+    AM_CONF_STATUS_IP
 };
 
 struct am_instance {
@@ -271,6 +279,9 @@ void remove_agent_instance_byname(const char *name) {
     struct am_instance *instance_data;
     int ret;
 
+    /* decisions cached by the processes were made with the configuration being removed */
+    am_cache_invalidate();
+
     ret = am_shm_lock(conf);
     if (ret != AM_SUCCESS) {
         return;
@@ -436,6 +447,23 @@ static int am_create_instance_entry_data(uint32_t h, am_config_t *c, char all) {
         if (c->retry_wait > 0) {
             SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_RETRY_WAIT, 0), c->retry_wait);
         }
+        if (c->net_budget > 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_NET_BUDGET, 0), c->net_budget);
+        }
+        if (c->stale_grace > 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_STALE_GRACE, 0), c->stale_grace);
+        }
+        if (c->pll_pipeline > 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_PLL_PIPELINE, 0), c->pll_pipeline);
+        }
+        if (ISVALID(c->status_url)) {
+            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_STATUS_URL, 0), c->status_url);
+        }
+        if (c->status_ip_sz > 0 && c->status_ip != NULL) {
+            for (i = 0; i < c->status_ip_sz; i++) {
+                SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_STATUS_IP, c->status_ip_sz), c->status_ip[i]);
+            }
+        }
     }
 
     if (all == AM_CONF_ALL || all == AM_CONF_REMOTE) {
@@ -517,6 +545,15 @@ static int am_create_instance_entry_data(uint32_t h, am_config_t *c, char all) {
         if (c->keepalive_disable > 0) {
             SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_KEEPALIVE_DISABLE, 0), c->keepalive_disable);
         }
+        if (c->keepalive_size > 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_KEEPALIVE_SIZE, 0), c->keepalive_size);
+        }
+        if (c->keepalive_timeout > 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_KEEPALIVE_TIMEOUT, 0), c->keepalive_timeout);
+        }
+        if (c->net_io_threads != 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_NET_IO_THREADS, 0), c->net_io_threads);
+        }
         if (c->persistent_cookie_enable > 0) {
             SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_PERSISTENT_COOKIE_ENABLE, 0), c->persistent_cookie_enable);
         }
@@ -946,6 +983,26 @@ static am_config_t *am_get_stored_agent_config(struct am_instance_entry *c) {
             case AM_CONF_RETRY_WAIT:
                 r->retry_wait = i->num_value;
                 break;
+            case AM_CONF_NET_BUDGET:
+                r->net_budget = i->num_value;
+                break;
+            case AM_CONF_STALE_GRACE:
+                r->stale_grace = i->num_value;
+                break;
+            case AM_CONF_PLL_PIPELINE:
+                r->pll_pipeline = i->num_value;
+                break;
+            case AM_CONF_STATUS_URL:
+                r->status_url = strndup(i->value, i->size[0]);
+                break;
+            case AM_CONF_STATUS_IP:
+                if (r->status_ip_sz == 0) {
+                    r->status_ip = malloc(sz * sizeof (char *));
+                }
+                if (r->status_ip != NULL && r->status_ip_sz < sz) {
+                    r->status_ip[r->status_ip_sz++] = strndup(i->value, i->size[0]);
+                }
+                break;
             case AM_CONF_AGENT_URI:
                 r->agenturi = strndup(i->value, i->size[0]);
                 break;
@@ -1055,6 +1112,15 @@ static am_config_t *am_get_stored_agent_config(struct am_instance_entry *c) {
             case AM_CONF_KEEPALIVE_DISABLE:
                 r->keepalive_disable = i->num_value;
                 break;
+            case AM_CONF_KEEPALIVE_SIZE:
+                r->keepalive_size = i->num_value;
+                break;
+            case AM_CONF_KEEPALIVE_TIMEOUT:
+                r->keepalive_timeout = i->num_value;
+                break;
+            case AM_CONF_NET_IO_THREADS:
+                r->net_io_threads = i->num_value;
+                break;
             case AM_CONF_PERSISTENT_COOKIE_ENABLE:
                 r->persistent_cookie_enable = i->num_value;
                 break;
@@ -1545,6 +1611,9 @@ static int am_set_agent_config(unsigned long instance_id, const char *xml,
                 bc->audit_level = cf->audit_level;
                 bc->audit = cf->audit;
                 cf->keepalive_disable = bc->keepalive_disable;
+                cf->keepalive_size = bc->keepalive_size;
+                cf->keepalive_timeout = bc->keepalive_timeout;
+                cf->net_io_threads = bc->net_io_threads;
                 cf->secure_channel_disable = bc->secure_channel_disable;
                 cf->proxy_port = bc->proxy_port;
                 cf->proxy_password_sz = bc->proxy_password_sz;
@@ -1583,8 +1652,9 @@ int am_get_agent_config(unsigned long instance_id, const char *config_file, am_c
     int rv = AM_ERROR, in_progress = AM_FALSE;
     char *profile_xml = NULL;
     size_t profile_xml_sz = 0;
-    int max_retry = 3;
-    unsigned int retry = 3, retry_wait = 2;
+    int max_retry = 3, attempt = 0;
+    unsigned int retry = 3, budget = AM_NET_BUDGET, budget_left;
+    am_timer_t budget_timer;
 
     if (instance_id == 0 || cnf == NULL || ISINVALID(config_file)) {
         return AM_EINVAL;
@@ -1596,6 +1666,7 @@ int am_get_agent_config(unsigned long instance_id, const char *config_file, am_c
     }
 
     max_retry++;
+    am_timer_start(&budget_timer);
     do {
 
         am_shm_lock(conf);
@@ -1618,9 +1689,17 @@ int am_get_agent_config(unsigned long instance_id, const char *config_file, am_c
 
             if (in_progress) {
                 am_agent_instance_init_unlock();
-                AM_LOG_WARNING(instance_id, "%s retry %d",
-                        thisfunc, (retry - max_retry) + 1);
-                sleep(retry_wait);
+                budget_left = am_timer_budget_left(&budget_timer, budget);
+                if (budget_left == 0) {
+                    AM_LOG_ERROR(instance_id, "%s configuration fetch in progress (time budget of %u ms exhausted)",
+                            thisfunc, budget);
+                    am_net_budget_exhausted();
+                    return AM_RETRY_ERROR;
+                }
+                AM_LOG_DEBUG(instance_id, "%s waiting for configuration fetch in progress", thisfunc);
+                /* waiting for the other fetch is bounded by the time budget, not the number of retries */
+                am_backoff(attempt++, budget_left);
+                max_retry++;
                 continue;
             }
 
@@ -1635,8 +1714,13 @@ int am_get_agent_config(unsigned long instance_id, const char *config_file, am_c
                 return AM_FILE_ERROR; /* fatal */
             }
 
+            if (ac->net_budget > 0) {
+                budget = ac->net_budget;
+            }
+
             am_net_options_create(ac, &net_options, NULL);
             net_options.notif_enable = AM_TRUE; /* agent token notifications are always enabled */
+            net_options.deadline = am_timer_deadline(am_timer_budget_left(&budget_timer, budget));
 
             memset(&r, 0, sizeof (am_request_t));
             r.conf = ac;
@@ -1683,7 +1767,14 @@ int am_get_agent_config(unsigned long instance_id, const char *config_file, am_c
             if (should_retry) {
                 am_agent_init_set_value(instance_id, AM_FALSE);
                 am_agent_instance_init_unlock();
-                sleep(retry_wait);
+                budget_left = am_timer_budget_left(&budget_timer, budget);
+                if (budget_left == 0) {
+                    AM_LOG_ERROR(instance_id, "%s failed to fetch instance configuration %ld data (time budget of %u ms exhausted)",
+                            thisfunc, instance_id, budget);
+                    am_net_budget_exhausted();
+                    return AM_RETRY_ERROR;
+                }
+                am_backoff(attempt++, budget_left);
                 continue;
             }
 
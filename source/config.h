@@ -97,6 +97,13 @@ typedef struct {
     int retry_max;
     int retry_wait;
 
+    int net_budget;
+    int stale_grace; /* seconds */
+    int pll_pipeline;
+    char *status_url; /* GET requests for this url are answered with the cache statistics */
+    int status_ip_sz;
+    char **status_ip; /* address ranges allowed to read the status url, loopback only when empty */
+
     /* other options */
 
     char *agenturi;
@@ -240,6 +247,9 @@ typedef struct {
     int path_info_ignore;
     int path_info_ignore_not_enforced;
     int keepalive_disable;
+    int keepalive_size; /* idle connections kept per naming url */
+    int keepalive_timeout; /* seconds */
+    int net_io_threads; /* per process I/O threads receiving responses, 0 - none (default), -1 - one per CPU */
     int persistent_cookie_enable;
 
     int skip_post_url_map_sz;
@@ -294,7 +304,16 @@ typedef struct {
 #define AM_AGENTS_CONFIG_RETRY_MAX "com.forgerock.agents.init.retry.max"
 #define AM_AGENTS_CONFIG_RETRY_WAIT "com.forgerock.agents.init.retry.wait"
 
+#define AM_AGENTS_CONFIG_NET_BUDGET "com.forgerock.agents.config.connect.budget"
+#define AM_AGENTS_CONFIG_STALE_GRACE "com.forgerock.agents.config.cache.stale.grace"
+#define AM_AGENTS_CONFIG_PLL_PIPELINE "com.forgerock.agents.config.pll.pipeline"
+#define AM_AGENTS_CONFIG_STATUS_URL "com.forgerock.agents.config.status.url"
+#define AM_AGENTS_CONFIG_STATUS_IP "com.forgerock.agents.config.status.ip"
+
 #define AM_AGENTS_CONFIG_KEEPALIVE_DISABLE "org.forgerock.agents.config.keepalive.disable"
+#define AM_AGENTS_CONFIG_KEEPALIVE_SIZE "org.forgerock.agents.config.keepalive.size"
+#define AM_AGENTS_CONFIG_KEEPALIVE_TIMEOUT "org.forgerock.agents.config.keepalive.timeout"
+#define AM_AGENTS_CONFIG_NET_IO_THREADS "org.forgerock.agents.config.net.io.threads"
 
 /* other options */
 
@@ -457,11 +457,20 @@ am_config_t *am_get_config_file(unsigned long instance_id, const char *filename)
         parse_config_value(instance_id, line, AM_AGENTS_CONFIG_RETRY_MAX, CONF_NUMBER, NULL, &conf->retry_max, NULL);
         parse_config_value(instance_id, line, AM_AGENTS_CONFIG_RETRY_WAIT, CONF_NUMBER, NULL, &conf->retry_wait, NULL);
 
+        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_NET_BUDGET, CONF_NUMBER, NULL, &conf->net_budget, NULL);
+        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_STALE_GRACE, CONF_NUMBER, NULL, &conf->stale_grace, NULL);
+        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_PLL_PIPELINE, CONF_NUMBER, NULL, &conf->pll_pipeline, NULL);
+        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_STATUS_URL, CONF_STRING, NULL, &conf->status_url, NULL);
+        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_STATUS_IP, CONF_STRING_LIST, &conf->status_ip_sz, &conf->status_ip, AM_COMMA_CHAR);
+
         parse_config_value(instance_id, line, AM_AGENTS_CONFIG_NOTIF_ENABLE, CONF_NUMBER, NULL, &conf->notif_enable, NULL);
         parse_config_value(instance_id, line, AM_AGENTS_CONFIG_NOTIF_URL, CONF_STRING, NULL, &conf->notif_url, NULL);
 
         parse_config_value(instance_id, line, AM_AGENTS_CONFIG_LB_ENABLE, CONF_NUMBER, NULL, &conf->lb_enable, NULL);
         parse_config_value(instance_id, line, AM_AGENTS_CONFIG_KEEPALIVE_DISABLE, CONF_NUMBER, NULL, &conf->keepalive_disable, NULL);
+        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_KEEPALIVE_SIZE, CONF_NUMBER, NULL, &conf->keepalive_size, NULL);
+        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_KEEPALIVE_TIMEOUT, CONF_NUMBER, NULL, &conf->keepalive_timeout, NULL);
+        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_NET_IO_THREADS, CONF_NUMBER, NULL, &conf->net_io_threads, NULL);
         
         parse_config_value(instance_id, line, AM_AGENTS_CONFIG_SCHANNEL_DISABLE, CONF_NUMBER, NULL, &conf->secure_channel_disable, NULL);
         
@@ -647,10 +656,11 @@ void am_config_free(am_config_t **cp) {
                 c->client_hostname_header, c->url_check_regex, c->multi_attr_separator,
                 c->pdp_sess_mode, c->pdp_sess_value, c->pdp_uri_prefix, c->logout_url_regex,
                 c->audit_file_remote, c->audit_file_disposition, c->unauthenticated_user,
-                c->proxy_host, c->proxy_user, c->proxy_password, c->policy_eval_app);
+                c->proxy_host, c->proxy_user, c->proxy_password, c->policy_eval_app, c->status_url);
 
         AM_CONF_FREE(c->naming_url_sz, c->naming_url);
         AM_CONF_FREE(c->hostmap_sz, c->hostmap);
+        AM_CONF_FREE(c->status_ip_sz, c->status_ip);
         AM_CONF_MAP_FREE(c->login_url_sz, c->login_url);
         AM_CONF_MAP_FREE(c->profile_attr_map_sz, c->profile_attr_map);
         AM_CONF_MAP_FREE(c->session_attr_map_sz, c->session_attr_map);
@@ -435,8 +435,17 @@ static void end_element(void * userData, const char * name) {
     parse_config_value(ctx, AM_AGENTS_CONFIG_RETRY_MAX, CONF_NUMBER, NULL, &ctx->conf->retry_max, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_RETRY_WAIT, CONF_NUMBER, NULL, &ctx->conf->retry_wait, val, len);
 
+    parse_config_value(ctx, AM_AGENTS_CONFIG_NET_BUDGET, CONF_NUMBER, NULL, &ctx->conf->net_budget, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_STALE_GRACE, CONF_NUMBER, NULL, &ctx->conf->stale_grace, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_PLL_PIPELINE, CONF_NUMBER, NULL, &ctx->conf->pll_pipeline, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_STATUS_URL, CONF_STRING, NULL, &ctx->conf->status_url, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_STATUS_IP, CONF_STRING_LIST, &ctx->conf->status_ip_sz, &ctx->conf->status_ip, val, len);
+
     parse_config_value(ctx, AM_AGENTS_CONFIG_LB_ENABLE, CONF_NUMBER, NULL, &ctx->conf->lb_enable, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_KEEPALIVE_DISABLE, CONF_NUMBER, NULL, &ctx->conf->keepalive_disable, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_KEEPALIVE_SIZE, CONF_NUMBER, NULL, &ctx->conf->keepalive_size, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_KEEPALIVE_TIMEOUT, CONF_NUMBER, NULL, &ctx->conf->keepalive_timeout, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_NET_IO_THREADS, CONF_NUMBER, NULL, &ctx->conf->net_io_threads, val, len);
 
     parse_config_value(ctx, AM_AGENTS_CONFIG_PROXY_HOST, CONF_STRING, NULL, &ctx->conf->proxy_host, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_PROXY_PORT, CONF_NUMBER, NULL, &ctx->conf->proxy_port, val, len);
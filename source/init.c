@@ -33,6 +33,8 @@ int am_init(int id) {
 #ifndef _WIN32
     do {
         am_net_init();
+        am_regex_cache_init();
+        am_not_enforced_init();
         am_worker_pool_init_main();
         rv = am_log_init(id);
         if (rv != 0)
@@ -63,6 +65,8 @@ int am_init_worker(int id) {
     do {
 #ifdef _WIN32
         am_net_init();
+        am_regex_cache_init();
+        am_not_enforced_init();
         am_worker_pool_init();
         rv = am_log_init(id);
         if (rv != 0)
@@ -97,6 +101,8 @@ int am_shutdown(int id) {
     am_cache_shutdown();
     am_configuration_shutdown();
     am_log_shutdown(id);
+    am_not_enforced_shutdown();
+    am_regex_cache_shutdown();
     am_net_shutdown();
     return 0;
 }
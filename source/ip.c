@@ -18,8 +18,6 @@
 #include "am.h"
 #include "utility.h"
 
-#define IP6_32BIT_COMPONENTS 4
-
 #ifndef s6_addr32
 #ifdef __sun
 #define s6_addr32   _S6_un._S6_u32
@@ -194,102 +192,6 @@ int ipv4_pton(const char * p, struct in_addr * n) {
     return -1;                                  /* ip v4 part fails */
 }
 
-/**
- * Test equivalence masked bits in two ipv4 addresses in network form
- * 
- * @return AM_TRUE if addr is within the masked ip v4 address range in net
- */
-static am_bool_t cidr_match(const struct in_addr * addr, const struct in_addr * net, int bits) {
-    if (bits == 0) {
-        /* the range is all inclusive - uint32_t << 32 is undefined */
-        return AM_TRUE;
-    }
-
-    /* here and in the function below, we are comparing quads (uint32_t) represented in the network byte
-     * order. xor (^) is used to identify differences between the quads, and then << is used to remove the
-     * differences outside of the network masks number of bits.
-     */
-
-    if ((addr->s_addr ^ net->s_addr) & htonl(0xFFFFFFFFu << (32 - bits)))
-        return AM_FALSE;
-
-    return AM_TRUE;
-}
-
-/**
- * Test masked bits in two ipv6 addresses in network form
- * 
- * @return AM_TRUE if addr is within the masked ip v6 address range in net
- */
-static am_bool_t cidr6_match(const struct in6_addr * addr, const struct in6_addr * net, int bits) {
-    const uint32_t * a = addr->s6_addr32;
-    const uint32_t * n = net->s6_addr32;
-
-    int quads = bits >> 5; /* number of whole quads masked = bits/32 */
-    int remainder = bits & 0x1F; /* number of bits masked in the subsequent quad = bits%32 */
-
-    if (quads) {
-        if (memcmp(a, n, quads * sizeof (uint32_t))) {
-            return AM_FALSE;
-        }
-    }
-
-    if (remainder) {
-        if ((a [quads] ^ n [quads]) & htonl(0xFFFFFFFFu << (32 - remainder))) {
-            return AM_FALSE;
-        }
-    }
-    return AM_TRUE;
-}
-
-/**
- * Tests whether the first argument is in the (inclusive) range of v6 addresses from adr_lo to addr_hi
- * 
- * @return 0 if the address is in the range
- */
-static signed int cmp_ip_range(const struct in_addr * addr, const struct in_addr * addr_lo,
-        const struct in_addr * addr_hi) {
-    const uint32_t a = addr->s_addr;
-    const uint32_t lo = addr_lo->s_addr;
-    const uint32_t hi = addr_hi->s_addr;
-    return ntohl(a) < ntohl(lo) ? -1 : ntohl(hi) < ntohl(a) ? 1 : 0;
-}
-
-/**
- *  Compares two uint32 arrays in network format (requiring ntohl translation)
- * 
- *  @return negative if a < b, positive if a > b, 0 if they are equal
- */
-static signed int cmp_net(const uint32_t * a, const uint32_t * b) {
-    int i, c = 0;
-    for (i = IP6_32BIT_COMPONENTS; 0 < i--;) {
-        uint32_t ha = ntohl(a [i]), hb = ntohl(b [i]);
-        c = CMP(ha, hb);
-        if (c) {
-            break;
-        }
-    }
-    return c;
-}
-
-/**
- * Tests whether the first argument is in the (inclusive) range of v6 addresses from adr_lo to addr_hi
- * 
- * @return 0 if the address is in the range, negative if below the range, positive if its above
- */
-static signed int cmp_ip6_range(const struct in6_addr * addr, const struct in6_addr * addr_lo, const struct in6_addr * addr_hi) {
-    int c;
-    c = cmp_net(addr_lo->s6_addr32, addr->s6_addr32);
-    if (0 < c) {
-        return -1;
-    }
-    c = cmp_net(addr->s6_addr32, addr_hi->s6_addr32);
-    if (0 < c) {
-        return 1;
-    }
-    return 0;
-}
-
 /**
  * Initialize and read an ipv4 presentation, returning in bpits the number of bits
  * 
@@ -346,74 +248,106 @@ static am_bool_t read_full_ip6(const char * ip, struct in6_addr * p) {
     return AM_FALSE;
 }
 
-/**
- * Test whether an ip address falls within two inclusive boundaries, ensuring that
- * all addresses are of the same family, v4 or v6, and are not ranges.
- *
- * @return AM_TRUE for success, false on address parse error or out of bounds
- */
-static am_bool_t test_within_bounds(const char * addr_p, const char * lo_p, const char * hi_p) {
-    struct in_addr addr;
-    struct in6_addr addr6;
-    if (read_full_ip(addr_p, &addr)) {
-        struct in_addr lo, hi;
-        if (read_full_ip(lo_p, &lo) && read_full_ip(hi_p, &hi)) {
-            return cmp_ip_range(&addr, &lo, &hi) == 0;
-        }
-    } else if (read_full_ip6(addr_p, &addr6)) {
-        struct in6_addr lo6, hi6;
-        if (read_full_ip6(lo_p, &lo6) && read_full_ip6(hi_p, &hi6)) {
-            return cmp_ip6_range(&addr6, &lo6, &hi6) == 0;
+static void ip_set(am_ip_t *ip, int family, const unsigned char *b, size_t sz) {
+    size_t i;
+    ip->family = family;
+    ip->hi = ip->lo = 0;
+    for (i = 0; i < sz; i++) {
+        if (i + 8 < sz) {
+            ip->hi = (ip->hi << 8) | b[i];
+        } else {
+            ip->lo = (ip->lo << 8) | b[i];
         }
     }
-    return AM_FALSE;
+}
+
+static void ip_set4(am_ip_t *ip, const struct in_addr *n) {
+    ip_set(ip, AF_INET, (const unsigned char *) &n->s_addr, 4);
+}
+
+static void ip_set6(am_ip_t *ip, const struct in6_addr *n) {
+    ip_set(ip, AF_INET6, n->s6_addr, 16);
+}
+
+static int ip_cmp(const am_ip_t *a, const am_ip_t *b) {
+    int c = CMP(a->hi, b->hi);
+    return c != 0 ? c : CMP(a->lo, b->lo);
 }
 
 /**
- * Parse a <LO>-<HI> ip address range, and test that an ip address is in that range
- * 
- * @return 0 on success
+ * Parse a (full, not CIDR) ip v4 or v6 address.
+ *
+ * @return AM_TRUE if the address could be parsed
  */
-static am_status_t get_in_bounded_range_status(const char * addr, const char * range) {
-    int c;
-    char *lo_p, *hi_p;
-    char *p = strchr(range, '-');
-    if (p == NULL) {
-        return AM_ENOMEM;
+am_bool_t am_ip_parse(const char *p, am_ip_t *ip) {
+    struct in_addr addr;
+    struct in6_addr addr6;
+    if (p == NULL || ip == NULL) {
+        return AM_FALSE;
     }
-    lo_p = strndup(range, p - range);
-    hi_p = strdup(p + 1);
-    if (lo_p && hi_p) {
-        c = test_within_bounds(addr, lo_p, hi_p) ? AM_SUCCESS : AM_NOT_FOUND;
-    } else {
-        c = AM_ENOMEM;
+    if (read_full_ip(p, &addr)) {
+        ip_set4(ip, &addr);
+        return AM_TRUE;
+    }
+    if (read_full_ip6(p, &addr6)) {
+        ip_set6(ip, &addr6);
+        return AM_TRUE;
     }
-    am_free(lo_p);
-    am_free(hi_p);
-    return c;
+    return AM_FALSE;
 }
 
 /**
- * Test that an ip address is within a range specified by a CIDR in the same address family (v4 or v6).
+ * Parse an address range rule, either <LO>-<HI> (both ends of the same family, inclusive) or
+ * CIDR notation (192.168.1.1/24), into the lowest and highest address it covers.
+ * Anything else (including a single address) is not a range.
  *
- * @return AM_SUCCESS on match else NOT_FOUND
+ * @return AM_SUCCESS, AM_EINVAL if the rule is not a valid range or AM_ENOMEM
  */
-static am_status_t get_in_masked_range_status(const char * addr, const char * range) {
-    struct in_addr addr4;
-    struct in6_addr addr6;
-    int bits;
-    if (read_full_ip(addr, &addr4)) {
-        struct in_addr cidr;
-        if (read_ip(range, &cidr, &bits)) {
-            return cidr_match(&addr4, &cidr, bits) ? AM_SUCCESS : AM_NOT_FOUND;
+static am_status_t ip_rule_parse(const char *rule, am_ip_t *lo, am_ip_t *hi) {
+    const char *hp = strchr(rule, '-');
+    const char *fs = strchr(rule, '/');
+
+    if (hp != NULL && fs == NULL) {
+        /* address range: 192.168.1.1-192.168.2.3 */
+        char *lo_p = strndup(rule, hp - rule);
+        am_status_t status = AM_EINVAL;
+        if (lo_p == NULL) {
+            return AM_ENOMEM;
         }
-    } else if (read_full_ip6(addr, &addr6)) {
-        struct in6_addr cidr;
-        if (read_ip6(range, &cidr, &bits)) {
-            return cidr6_match(&addr6, &cidr, bits) ? AM_SUCCESS : AM_NOT_FOUND;
+        if (am_ip_parse(lo_p, lo) && am_ip_parse(hp + 1, hi) && lo->family == hi->family &&
+                ip_cmp(lo, hi) <= 0) {
+            status = AM_SUCCESS;
         }
+        free(lo_p);
+        return status;
     }
-    return AM_NOT_FOUND;
+
+    if (hp == NULL && fs != NULL) {
+        /* cidr spec: 192.168.1.1/24 */
+        struct in_addr addr;
+        struct in6_addr addr6;
+        int bits;
+        if (read_ip(rule, &addr, &bits)) {
+            uint64_t host = (uint64_t) 0xFFFFFFFFu >> bits;
+            ip_set4(lo, &addr);
+            lo->lo &= ~host;
+            *hi = *lo;
+            hi->lo |= host;
+            return AM_SUCCESS;
+        }
+        if (read_ip6(rule, &addr6, &bits)) {
+            uint64_t host_hi = bits >= 64 ? 0 : ~(uint64_t) 0 >> bits;
+            uint64_t host_lo = bits <= 64 ? ~(uint64_t) 0 : (bits == 128 ? 0 : ~(uint64_t) 0 >> (bits - 64));
+            ip_set6(lo, &addr6);
+            lo->hi &= ~host_hi;
+            lo->lo &= ~host_lo;
+            *hi = *lo;
+            hi->hi |= host_hi;
+            hi->lo |= host_lo;
+            return AM_SUCCESS;
+        }
+    }
+    return AM_EINVAL;
 }
 
 /**
@@ -423,29 +357,140 @@ static am_status_t get_in_masked_range_status(const char * addr, const char * ra
  */
 am_status_t ip_address_match(const char *ip, const char **list, unsigned int listsize, unsigned long instance_id) {
     unsigned int i;
+    am_ip_t addr, lo, hi;
+
     if (ip == NULL || list == NULL || listsize == 0) {
         return AM_EINVAL;
     }
+    if (!am_ip_parse(ip, &addr)) {
+        return AM_NOT_FOUND;
+    }
 
     for (i = 0; i < listsize; i++) {
-        const char *hp = strchr(list[i], '-');
-        const char *fs = strchr(list[i], '/');
-
-        if (hp != NULL && fs == NULL) {
-            /* make sure we get address range here: 192.168.1.1-192.168.2.3 */
-            if (get_in_bounded_range_status(ip, list[i]) == AM_SUCCESS) {
-                AM_LOG_INFO(instance_id, "ip_address_match(): found ip address %s in address range %s", ip, list[i]);
-                return AM_SUCCESS;
-            }
+        if (list[i] != NULL && ip_rule_parse(list[i], &lo, &hi) == AM_SUCCESS && lo.family == addr.family &&
+                ip_cmp(&lo, &addr) <= 0 && ip_cmp(&addr, &hi) <= 0) {
+            AM_LOG_INFO(instance_id, "ip_address_match(): found ip address %s in address range %s", ip, list[i]);
+            return AM_SUCCESS;
         }
+    }
+    return AM_NOT_FOUND;
+}
+
+/*
+ * Address range rules parsed once (per configuration) into sorted tables of non-overlapping
+ * intervals, one for each address family, searched with a binary search.
+ */
 
-        if (hp == NULL && fs != NULL) {
-            /* and cidr spec here: 192.168.1.1/24 */
-            if (get_in_masked_range_status(ip, list[i]) == AM_SUCCESS) {
-                AM_LOG_INFO(instance_id, "ip_address_match(): found ip address %s in address range %s", ip, list[i]);
-                return AM_SUCCESS;
+struct ip_interval {
+    am_ip_t lo;
+    am_ip_t hi;
+};
+
+struct am_ip_table {
+    struct ip_interval *interval[2]; /* ip v4, ip v6 */
+    int size[2];
+};
+
+static int interval_cmp(const void *a, const void *b) {
+    return ip_cmp(&((const struct ip_interval *) a)->lo, &((const struct ip_interval *) b)->lo);
+}
+
+/**
+ * sort and merge overlapping (or adjacent) intervals
+ */
+static int merge_intervals(struct ip_interval *iv, int size) {
+    int i, n = 0;
+    if (size == 0) {
+        return 0;
+    }
+    qsort(iv, size, sizeof (struct ip_interval), interval_cmp);
+    for (i = 1; i < size; i++) {
+        am_ip_t next = iv[n].hi;
+        if (++next.lo == 0) next.hi++;
+        if (ip_cmp(&iv[i].lo, &next) <= 0 || (next.hi == 0 && next.lo == 0)) {
+            /* overlaps or follows on (or the previous one goes all the way to the top) */
+            if (ip_cmp(&iv[i].hi, &iv[n].hi) > 0) {
+                iv[n].hi = iv[i].hi;
             }
+        } else {
+            iv[++n] = iv[i];
         }
     }
-    return AM_NOT_FOUND;
+    return n + 1;
+}
+
+/**
+ * Parse address range rules (<LO>-<HI> or CIDR notation) into an address table. Rules which are
+ * not valid ranges are skipped, as ip_address_match would never match them.
+ *
+ * @return the table, NULL if out of memory
+ */
+am_ip_table_t *am_ip_table_create(unsigned long instance_id, const char **list, unsigned int listsize) {
+    am_ip_table_t *t = calloc(1, sizeof (am_ip_table_t));
+    unsigned int i;
+    int f;
+
+    if (t == NULL) {
+        return NULL;
+    }
+    if (listsize > 0) {
+        t->interval[0] = malloc(listsize * sizeof (struct ip_interval));
+        t->interval[1] = malloc(listsize * sizeof (struct ip_interval));
+        if (t->interval[0] == NULL || t->interval[1] == NULL) {
+            am_ip_table_free(t);
+            return NULL;
+        }
+    }
+    for (i = 0; i < listsize; i++) {
+        am_ip_t lo, hi;
+        am_status_t status = list[i] != NULL ? ip_rule_parse(list[i], &lo, &hi) : AM_EINVAL;
+        if (status == AM_ENOMEM) {
+            am_ip_table_free(t);
+            return NULL;
+        }
+        if (status != AM_SUCCESS) {
+            AM_LOG_DEBUG(instance_id, "am_ip_table_create(): %s is not an address range", LOGEMPTY(list[i]));
+            continue;
+        }
+        f = lo.family == AF_INET ? 0 : 1;
+        t->interval[f][t->size[f]].lo = lo;
+        t->interval[f][t->size[f]].hi = hi;
+        t->size[f]++;
+    }
+    for (f = 0; f < 2; f++) {
+        t->size[f] = merge_intervals(t->interval[f], t->size[f]);
+    }
+    return t;
+}
+
+void am_ip_table_free(am_ip_table_t *t) {
+    if (t != NULL) {
+        AM_FREE(t->interval[0], t->interval[1]);
+        free(t);
+    }
+}
+
+/**
+ * Is the (parsed) address in any of the ranges?
+ */
+am_bool_t am_ip_table_match(am_ip_table_t *t, const am_ip_t *ip) {
+    struct ip_interval *iv;
+    int lo = 0, hi;
+
+    if (t == NULL || ip == NULL) {
+        return AM_FALSE;
+    }
+    iv = t->interval[ip->family == AF_INET ? 0 : 1];
+    hi = t->size[ip->family == AF_INET ? 0 : 1] - 1;
+
+    /* last interval starting at or below the address */
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ip_cmp(&iv[mid].lo, ip) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return hi >= 0 && ip_cmp(ip, &iv[hi].hi) <= 0;
 }
@@ -90,6 +90,11 @@ char *log_header(int log_level, int *header_sz, const char *file, int line);
         printf(format"\n", ##__VA_ARGS__);\
     } while (0)
 
+#define AM_LOG_WARNING(instance, format, ...) \
+    do {\
+        printf(format"\n", ##__VA_ARGS__);\
+    } while (0)
+
 #endif /* INTEGRATION_TEST */
 
 #endif /* LOG_H */ 
@@ -20,14 +20,16 @@
 #include "platform.h"
 #include "am.h"
 #include "utility.h"
+#include "agent_cache.h"
 #include "net_client.h"
 #include "list.h"
+#include "thread.h"
 
 #ifndef INVALID_SOCKET
 #define INVALID_SOCKET -1
 #endif
 
-#define RECV_BUFFER_SZ 1024
+#define RECV_BUFFER_SZ 16384 /* one TLS record */
 
 enum {
     HEADER_NONE = 0,
@@ -100,6 +102,12 @@ int wnet_write(am_net_t *net, const char *buf, int len);
 void wnet_read(am_net_t *net);
 void wnet_close_ssl(am_net_t *net);
 #endif
+static void net_pool_init();
+static void net_pool_shutdown();
+static void net_io_init();
+static void net_io_shutdown();
+static void net_refresh_init();
+static void net_refresh_shutdown();
 
 void am_net_init() {
 #ifdef _WIN32
@@ -113,9 +121,15 @@ void am_net_init() {
     if (openssl_init) {
         net_init_ssl();
     }
+    net_pool_init();
+    net_io_init();
+    net_refresh_init();
 }
 
 void am_net_shutdown() {
+    net_refresh_shutdown();
+    net_io_shutdown();
+    net_pool_shutdown();
 #ifdef _WIN32
     WSACleanup();
 #endif
@@ -283,6 +297,9 @@ static int on_headers_complete_cb(http_parser *parser) {
         n->num_headers = n->num_header_values = 0;
     }
     n->header_state = HEADER_NONE;
+    if (n->on_headers && (parser->flags & F_CHUNKED) == 0 && parser->content_length != (uint64_t) -1) {
+        n->on_headers(n->data, parser->content_length);
+    }
     if (n->proxy == AM_PROXY_CONNECTED) {
         /* Special case for http_parser, handling responses to a CONNECT request, 
          * that it should not expect neither a body nor any further responses on this connection */
@@ -311,6 +328,10 @@ void am_net_options_create(am_config_t *conf, am_net_options_t *options, void (*
     options->net_timeout = conf->net_timeout;
     options->cert_trust = conf->cert_trust;
     options->keepalive = !conf->keepalive_disable;
+    options->keepalive_size = conf->keepalive_size;
+    options->keepalive_timeout = conf->keepalive_timeout;
+    options->io_threads = conf->net_io_threads;
+    options->pll_pipeline = conf->pll_pipeline;
     options->cert_key_pass_sz = conf->cert_key_pass_sz;
     options->server_id = NULL; /* server_id is set on request */
     options->notif_url = ISVALID(conf->notif_url) ? strdup(conf->notif_url) : NULL;
@@ -412,6 +433,207 @@ static int poll_with_interrupt(POLLFD fds[], int nfds, int msec) {
     return ev;
 }
 
+/**
+ * pack the TCP addresses from an addrinfo list as resolver cache data:
+ * a sequence of (length byte, sockaddr) records
+ */
+static uint32_t net_resolved_pack(struct addrinfo *ra, uint8_t *data, uint32_t size) {
+    struct addrinfo *rp;
+    uint32_t ln = 0;
+    for (rp = ra; rp != NULL; rp = rp->ai_next) {
+        if ((rp->ai_family != AF_INET && rp->ai_family != AF_INET6) || rp->ai_socktype != SOCK_STREAM) continue;
+        if (ln + 1 + rp->ai_addrlen > size) break;
+        data[ln++] = (uint8_t) rp->ai_addrlen;
+        memcpy(data + ln, rp->ai_addr, rp->ai_addrlen);
+        ln += (uint32_t) rp->ai_addrlen;
+    }
+    return ln;
+}
+
+/**
+ * make an addrinfo list (single allocation, released with free) out of resolver cache data
+ */
+static struct addrinfo *net_resolved_unpack(const uint8_t *data, uint32_t ln, int port) {
+    struct resolved_addrinfo {
+        struct addrinfo ai;
+        struct sockaddr_storage addr;
+    } *ra;
+    uint32_t i, count = 0;
+
+    for (i = 0; i < ln; i += data[i] + 1) {
+        count++;
+    }
+    if (count == 0 || (ra = calloc(count, sizeof (struct resolved_addrinfo))) == NULL) {
+        return NULL;
+    }
+    for (i = 0, count = 0; i < ln; i += data[i] + 1, count++) {
+        struct addrinfo *ai = &ra[count].ai;
+        memcpy(&ra[count].addr, data + i + 1, data[i] > sizeof (struct sockaddr_storage) ?
+                sizeof (struct sockaddr_storage) : data[i]);
+        ai->ai_addr = (struct sockaddr *) &ra[count].addr;
+        ai->ai_addrlen = data[i];
+        ai->ai_family = ai->ai_addr->sa_family;
+        ai->ai_socktype = SOCK_STREAM;
+        ai->ai_protocol = IPPROTO_TCP;
+        if (ai->ai_family == AF_INET) {
+            ((struct sockaddr_in *) ai->ai_addr)->sin_port = htons(port);
+        } else {
+            ((struct sockaddr_in6 *) ai->ai_addr)->sin6_port = htons(port);
+        }
+        if (count > 0) {
+            ra[count - 1].ai.ai_next = ai;
+        }
+    }
+    return &ra[0].ai;
+}
+
+/**
+ * resolve host name and update the resolver cache
+ */
+static int net_resolve_refresh(const char *host, const char *port, struct addrinfo *hints, struct addrinfo **ra) {
+    static const char *thisfunc = "net_resolve_refresh():";
+    uint8_t data[RESOLVED_DATA_SZ];
+    uint64_t start, end;
+    int err;
+
+    am_timer(&start);
+    err = getaddrinfo(host, port, hints, ra);
+    am_timer(&end);
+    if (err != 0) {
+        AM_LOG_WARNING(0, "%s unable to resolve %s (%s)", thisfunc, host, gai_strerror(err));
+        return err;
+    }
+    am_net_resolved_set(host, data, net_resolved_pack(*ra, data, sizeof (data)), (uint32_t) ((end - start) / 1000));
+    return 0;
+}
+
+static void net_resolve_worker(void *arg) {
+    struct addrinfo hints, *ra = NULL;
+    char *host = (char *) arg;
+
+    memset(&hints, 0, sizeof (struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    if (net_resolve_refresh(host, NULL, &hints, &ra) == 0) {
+        freeaddrinfo(ra);
+    }
+    free(host);
+}
+
+/**
+ * Background refresh while the worker pool is not running: a single thread per process
+ * at a time, joined on shutdown (or before the next one is started). When it is still busy
+ * with another host the refresh is skipped, the resolver cache lets a caller claim it again
+ * once the claim has timed out.
+ */
+
+static am_mutex_t net_refresh_mutex;
+static am_bool_t net_refresh_enabled = AM_FALSE;
+static am_thread_t net_refresh_thr;
+static pid_t net_refresh_pid = 0; /* the process net_refresh_thr is to be joined in, 0 - none */
+static volatile am_bool_t net_refresh_busy = AM_FALSE;
+
+static void *net_refresh_thread(void *arg) {
+    net_resolve_worker(arg);
+    net_refresh_busy = AM_FALSE;
+    return NULL;
+}
+
+static void net_refresh_join() {
+    if (net_refresh_pid == getpid()) {
+        AM_THREAD_JOIN(net_refresh_thr);
+#ifdef _WIN32
+        CloseHandle(net_refresh_thr);
+#endif
+    }
+    net_refresh_pid = 0;
+}
+
+static int net_refresh_start(char *host) {
+    int status = AM_EAGAIN;
+    am_bool_t created;
+    if (!net_refresh_enabled) {
+        return AM_ENOTSTARTED;
+    }
+    AM_MUTEX_LOCK(&net_refresh_mutex);
+    if (net_refresh_pid != getpid()) {
+        net_refresh_pid = 0; /* not inherited by a forked child process */
+        net_refresh_busy = AM_FALSE;
+    }
+    if (!net_refresh_busy) {
+        net_refresh_join(); /* done already */
+        net_refresh_busy = AM_TRUE;
+#ifdef _WIN32
+        AM_THREAD_CREATE(net_refresh_thr, net_refresh_thread, host);
+        created = net_refresh_thr != NULL;
+#else
+        created = AM_THREAD_CREATE(net_refresh_thr, net_refresh_thread, host) == 0;
+#endif
+        if (created) {
+            net_refresh_pid = getpid();
+            status = AM_SUCCESS;
+        } else {
+            net_refresh_busy = AM_FALSE;
+            status = AM_ERROR;
+        }
+    }
+    AM_MUTEX_UNLOCK(&net_refresh_mutex);
+    return status;
+}
+
+static void net_refresh_init() {
+    if (net_refresh_enabled) return;
+    AM_MUTEX_INIT(&net_refresh_mutex);
+    net_refresh_pid = 0;
+    net_refresh_busy = AM_FALSE;
+    net_refresh_enabled = AM_TRUE;
+}
+
+static void net_refresh_shutdown() {
+    if (!net_refresh_enabled) return;
+    AM_MUTEX_LOCK(&net_refresh_mutex);
+    net_refresh_join();
+    net_refresh_enabled = AM_FALSE;
+    AM_MUTEX_UNLOCK(&net_refresh_mutex);
+    AM_MUTEX_DESTROY(&net_refresh_mutex);
+}
+
+/**
+ * resolve host name (through the resolver cache, shared by all agent processes) into n->ra;
+ * expired cache entries are still used while the worker pool (or, when it is not running, a
+ * thread of its own) refreshes them, so that only the very first connection to a host waits
+ * for the resolver
+ */
+static int net_resolve(am_net_t *n, const char *host, const char *port, struct addrinfo *hints) {
+    static const char *thisfunc = "net_resolve():";
+    uint8_t data[RESOLVED_DATA_SZ];
+    uint32_t ln = sizeof (data);
+    int expired = 0;
+
+    n->ra_cached = AM_FALSE;
+    if (hints->ai_flags & AI_NUMERICHOST) {
+        return getaddrinfo(host, port, hints, &n->ra);
+    }
+
+    if (am_net_resolved_get(host, data, &ln, &expired) == 0 &&
+            (n->ra = net_resolved_unpack(data, ln, n->uv.port)) != NULL) {
+        n->ra_cached = AM_TRUE;
+        if (expired && am_net_resolved_refresh(host) == 0) {
+            char *h = strdup(host);
+            if (h != NULL && am_worker_dispatch(net_resolve_worker, h) != AM_SUCCESS &&
+                    net_refresh_start(h) != AM_SUCCESS) {
+                /* no one to refresh it now; it is claimed again once the claim times out */
+                AM_LOG_DEBUG(n->instance_id, "%s not refreshing %s now", thisfunc, host);
+                free(h);
+            }
+        }
+        return 0;
+    }
+
+    return net_resolve_refresh(host, port, hints, &n->ra);
+}
+
 /**
  * create a non-blocking socket and connect to remote server
  */
@@ -436,7 +658,7 @@ static void sync_connect(am_net_t *n) {
             char *sep = strchr(n->options->hostmap[i], '|');
             if (sep != NULL &&
                     strncasecmp(n->options->hostmap[i], n->uv.host, sep - n->options->hostmap[i]) == 0) {
-                ip_address = sep++;
+                ip_address = sep + 1;
                 AM_LOG_DEBUG(n->instance_id, "%s found host '%s' (%s) entry in "AM_AGENTS_CONFIG_HOST_MAP,
                         thisfunc, n->uv.host, ip_address);
                 break;
@@ -468,7 +690,7 @@ static void sync_connect(am_net_t *n) {
 
     /* do network address and service translation */
     am_timer_start(&tmr);
-    if ((err = getaddrinfo(ip_address, port, &hints, &n->ra)) != 0) {
+    if ((err = net_resolve(n, ip_address, port, &hints)) != 0) {
         n->error = AM_EHOSTUNREACH;
         am_timer_stop(&tmr);
         am_timer_report(n->instance_id, &tmr, "getaddrinfo");
@@ -754,25 +976,61 @@ int am_net_write(am_net_t *n, const char *data, size_t data_sz) {
 #endif
 }
 
+/**
+ * read what is available on a (readable) socket and feed it to the http parser
+ *
+ * returns AM_TRUE when there is nothing more to read for the current response -
+ * the message is complete, the connection was closed or there was an error
+ */
+static am_bool_t net_read_available(am_net_t *n) {
+    static AM_THREAD_LOCAL char buffer[RECV_BUFFER_SZ]; /* reused by all reads in this thread */
+    int got = 0;
+    int error = 0;
+    SOCKLEN_T errlen = sizeof (error);
+    if (getsockopt(n->sock, SOL_SOCKET, SO_ERROR, (void *) &error, &errlen) == 0 && error != 0) {
+        net_log_error(n->instance_id, error);
+        n->error = error;
+        return AM_TRUE;
+    }
+    got = recv(n->sock, buffer, RECV_BUFFER_SZ, 0);
+    n->recv_calls++;
+    if (n->ssl.on) {
+        error = net_read_ssl(n, buffer, got);
+        if (error != AM_SUCCESS) {
+            if (error != AM_EAGAIN) {
+                if (n->on_close) n->on_close(n->data, 0);
+                return AM_TRUE;
+            }
+        }
+    } else {
+        if (got < 0) {
+            if (!net_in_progress(net_error())) {
+                if (n->on_close) n->on_close(n->data, 0);
+                return AM_TRUE;
+            }
+        } else if (got == 0) {
+            if (n->on_close) n->on_close(n->data, 0);
+            return AM_TRUE;
+        } else {
+            http_parser_execute(n->hp, n->hs, buffer, got);
+        }
+    }
+    /* message is complete here */
+    return n->is_complete(n->data);
+}
+
 /**
  * receive and parse http message, returning when message http message is complete
  */
-static void am_net_sync_recv_internal(am_net_t *n, int timeout_secs) {
+static void am_net_sync_recv_internal(am_net_t *n, int timeout_msec) {
     int ev = 0;
-    int poll_msec = timeout_secs * 1000;
+    int poll_msec = timeout_msec;
     POLLFD fds[1];
-    char *buffer;
 
     if (n == NULL) {
         return;
     }
 
-    buffer = malloc(RECV_BUFFER_SZ);
-    if (buffer == NULL) {
-        n->error = AM_ENOMEM;
-        return;
-    }
-
     memset(fds, 0, sizeof (fds));
     n->reset_complete(n->data);
 
@@ -799,64 +1057,361 @@ static void am_net_sync_recv_internal(am_net_t *n, int timeout_secs) {
             break;
         }
         if (ev == 1 && fds[0].revents & read_avail_ev) {
-            /* read an output from a remote side */
-            int got = 0;
-            int error = 0;
-            SOCKLEN_T errlen = sizeof (error);
-            if (getsockopt(n->sock, SOL_SOCKET, SO_ERROR, (void *) &error, &errlen) == 0 && error != 0) {
-                net_log_error(n->instance_id, error);
-                n->error = error;
+            if (net_read_available(n)) {
                 break;
             }
-            memset(buffer, 0, RECV_BUFFER_SZ);
-            got = recv(n->sock, buffer, RECV_BUFFER_SZ, 0);
-            if (n->ssl.on) {
-                error = net_read_ssl(n, buffer, got);
-                if (error != AM_SUCCESS) {
-                    if (error != AM_EAGAIN) {
-                        if (n->on_close) n->on_close(n->data, 0);
-                        break;
-                    }
-                }
+        }
+    }
+}
+
+#ifdef __linux__
+
+/**
+ * Asynchronous receive.
+ *
+ * When enabled (org.forgerock.agents.config.net.io.threads, -1 for one per CPU up to
+ * AM_NET_IO_THREADS; off by default) a few I/O threads per process, started on first use, each wait
+ * on an epoll set for responses to all requests in flight. A request thread writes
+ * its request as before, then submits the connection to an I/O thread and waits
+ * on a completion event. The I/O thread reads the socket and drives the http parser
+ * (and with it the on_data/on_complete callbacks) until the response is complete,
+ * the connection is closed or nothing has been received for timeout seconds.
+ */
+
+#define NET_IO_EVENTS 64
+
+struct net_io_request {
+    am_net_t *n;
+    am_event_t *done;
+    int timeout_msec;
+    uint64_t deadline; /* usec, see am_timer */
+    struct net_io_request *next;
+};
+
+struct net_io {
+    int epfd;
+    int evfd; /* wakes the I/O thread up when a request is submitted or on shutdown */
+    volatile int stop;
+    am_thread_t thr;
+    am_mutex_t lock;
+    struct net_io_request *list;
+};
+
+static struct net_io *net_io = NULL;
+static int net_io_count = 0;
+static unsigned int net_io_next = 0;
+static pid_t net_io_pid = 0;
+static am_mutex_t net_io_mutex;
+static am_bool_t net_io_enabled = AM_FALSE;
+
+/**
+ * unlink completed request and wake its submitter up - the request must not be touched afterwards
+ */
+static void net_io_complete(struct net_io *io, struct net_io_request *req) {
+    struct net_io_request *e, *t, *prev = NULL;
+
+    AM_MUTEX_LOCK(&io->lock);
+    AM_LIST_FOR_EACH(io->list, e, t) {
+        if (e == req) {
+            if (prev == NULL) {
+                io->list = t;
             } else {
-                if (got < 0) {
-                    if (!net_in_progress(net_error())) {
-                        if (n->on_close) n->on_close(n->data, 0);
-                        break;
-                    }
-                } else if (got == 0) {
-                    if (n->on_close) n->on_close(n->data, 0);
-                    break;
-                } else {
-                    http_parser_execute(n->hp, n->hs, buffer, got);
+                prev->next = t;
+            }
+            break;
+        }
+        prev = e;
+    }
+    epoll_ctl(io->epfd, EPOLL_CTL_DEL, req->n->sock, NULL);
+    /* signalled under the lock: the waiter takes it before releasing the event (see net_io_recv) */
+    set_event(req->done);
+    AM_MUTEX_UNLOCK(&io->lock);
+}
+
+/**
+ * complete requests which have not received anything within their timeout;
+ * returns the number of milliseconds until the next request times out (-1 when there are none)
+ */
+static int net_io_expire(struct net_io *io) {
+    struct net_io_request *e, *t, *expired = NULL;
+    uint64_t now, next = 0;
+
+    am_timer(&now);
+
+    AM_MUTEX_LOCK(&io->lock);
+    AM_LIST_FOR_EACH(io->list, e, t) {
+        if (e->deadline <= now) {
+            if (expired == NULL) {
+                expired = e;
+            }
+        } else if (next == 0 || e->deadline < next) {
+            next = e->deadline;
+        }
+    }
+    AM_MUTEX_UNLOCK(&io->lock);
+
+    if (expired != NULL) {
+        AM_LOG_WARNING(expired->n->instance_id,
+                "am_net_sync_recv(): timeout waiting for a response from a server");
+        expired->n->error = AM_ETIMEDOUT;
+        net_io_complete(io, expired);
+        return 0; /* there might be more */
+    }
+    return next == 0 ? -1 : (int) ((next - now + 999) / 1000);
+}
+
+static void *net_io_thread(void *arg) {
+    struct net_io *io = (struct net_io *) arg;
+    struct epoll_event ev[NET_IO_EVENTS];
+    uint64_t now;
+    int i, nfds;
+
+    while (!io->stop) {
+        nfds = epoll_wait(io->epfd, ev, NET_IO_EVENTS, net_io_expire(io));
+        if (nfds < 0) {
+            if (net_error() != EINTR) {
+                net_log_error(0, net_error());
+            }
+            continue;
+        }
+
+        for (i = 0; i < nfds; i++) {
+            struct net_io_request *req = (struct net_io_request *) ev[i].data.ptr;
+
+            if (req == NULL) {
+                uint64_t v;
+                if (read(io->evfd, &v, sizeof (v)) < 0) {
+                    /* nothing to drain */
                 }
+                continue;
+            }
+            if (ev[i].events & EPOLLERR) {
+                if (req->n->on_close) req->n->on_close(req->n->data, 0);
+                net_io_complete(io, req);
+                continue;
             }
-            /* message is complete here */
-            if (n->is_complete(n->data)) {
+            if (net_read_available(req->n)) {
+                net_io_complete(io, req);
+                continue;
+            }
+            am_timer(&now);
+            req->deadline = now + (uint64_t) req->timeout_msec * 1000;
+        }
+    }
+    return NULL;
+}
+
+static void net_io_stop(struct net_io *io) {
+    uint64_t v = 1;
+    io->stop = AM_TRUE;
+    if (write(io->evfd, &v, sizeof (v)) < 0) {
+        net_log_error(0, net_error());
+    }
+    AM_THREAD_JOIN(io->thr);
+    close(io->epfd);
+    close(io->evfd);
+    AM_MUTEX_DESTROY(&io->lock);
+}
+
+static void net_io_init() {
+    if (net_io_enabled) return;
+    AM_MUTEX_INIT(&net_io_mutex);
+    net_io_enabled = AM_TRUE;
+}
+
+static void net_io_shutdown() {
+    int i;
+    if (!net_io_enabled) return;
+    AM_MUTEX_LOCK(&net_io_mutex);
+    if (net_io != NULL && net_io_pid == getpid()) {
+        for (i = 0; i < net_io_count; i++) {
+            net_io_stop(&net_io[i]);
+        }
+        free(net_io);
+    }
+    net_io = NULL;
+    net_io_count = 0;
+    net_io_pid = 0;
+    net_io_enabled = AM_FALSE;
+    AM_MUTEX_UNLOCK(&net_io_mutex);
+    AM_MUTEX_DESTROY(&net_io_mutex);
+}
+
+/**
+ * number of I/O threads to start in a process: none unless configured, as configured, or (-1) one per CPU.
+ * The request thread still waits for its response either way, so they only pay off with many requests
+ * in flight at once
+ */
+static int net_io_threads(am_net_options_t *options) {
+    long cpus;
+    int count = options != NULL ? options->io_threads : 0;
+    if (count >= 0) {
+        return count;
+    }
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    return cpus < AM_NET_IO_THREADS ? (int) cpus : AM_NET_IO_THREADS;
+}
+
+/**
+ * get an I/O thread to submit a request to, starting them in this process when needed.
+ * Returns NULL when asynchronous receive is disabled (or not available).
+ */
+static struct net_io *net_io_get(am_net_options_t *options) {
+    static const char *thisfunc = "net_io_get():";
+    struct net_io *io = NULL;
+    struct epoll_event ev;
+    pid_t pid = getpid();
+    int i, count;
+
+    if (!net_io_enabled) {
+        return NULL;
+    }
+
+    AM_MUTEX_LOCK(&net_io_mutex);
+    if (net_io_pid != pid) {
+        /* threads (and their epoll sets) are not inherited by a forked child process */
+        net_io = NULL;
+        net_io_count = 0;
+        net_io_pid = pid;
+
+        count = net_io_threads(options);
+        if (count > 0) {
+            net_io = calloc(count, sizeof (struct net_io));
+        }
+        for (i = 0; net_io != NULL && i < count; i++) {
+            io = &net_io[i];
+            io->epfd = epoll_create1(EPOLL_CLOEXEC);
+            io->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            memset(&ev, 0, sizeof (ev));
+            ev.events = EPOLLIN;
+            ev.data.ptr = NULL;
+            if (io->epfd == -1 || io->evfd == -1 || epoll_ctl(io->epfd, EPOLL_CTL_ADD, io->evfd, &ev) != 0) {
+                net_log_error(0, net_error());
+                if (io->epfd != -1) close(io->epfd);
+                if (io->evfd != -1) close(io->evfd);
                 break;
             }
+            AM_MUTEX_INIT(&io->lock);
+            AM_THREAD_CREATE(io->thr, net_io_thread, io);
+            net_io_count++;
         }
+        if (net_io != NULL && net_io_count == 0) {
+            AM_FREE(net_io);
+            net_io = NULL;
+        }
+        AM_LOG_DEBUG(0, "%s started %d I/O thread(s)", thisfunc, net_io_count);
+        io = NULL;
+    }
+    if (net_io_count > 0) {
+        io = &net_io[net_io_next++ % net_io_count];
     }
-    AM_FREE(buffer);
+    AM_MUTEX_UNLOCK(&net_io_mutex);
+    return io;
+}
+
+/**
+ * submit connection to an I/O thread and wait for the response;
+ * returns AM_FALSE when the request could not be submitted (caller should receive it synchronously)
+ */
+static am_bool_t net_io_recv(am_net_t *n, int timeout_msec) {
+    struct net_io *io = net_io_get(n->options);
+    struct net_io_request req;
+    struct epoll_event ev;
+    uint64_t now, v = 1;
+
+    if (io == NULL || n->sock == INVALID_SOCKET) {
+        return AM_FALSE;
+    }
+
+    req.n = n;
+    req.done = create_event();
+    if (req.done == NULL) {
+        return AM_FALSE;
+    }
+    req.timeout_msec = timeout_msec;
+    am_timer(&now);
+    req.deadline = now + (uint64_t) req.timeout_msec * 1000;
+
+    n->reset_complete(n->data);
+
+    memset(&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &req;
+
+    AM_MUTEX_LOCK(&io->lock);
+    req.next = io->list;
+    io->list = &req;
+    if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, n->sock, &ev) != 0) {
+        io->list = req.next;
+        AM_MUTEX_UNLOCK(&io->lock);
+        net_log_error(n->instance_id, net_error());
+        close_event(&req.done);
+        return AM_FALSE;
+    }
+    AM_MUTEX_UNLOCK(&io->lock);
+
+    /* let the I/O thread take the new deadline into account */
+    if (write(io->evfd, &v, sizeof (v)) < 0) {
+        net_log_error(n->instance_id, net_error());
+    }
+
+    wait_for_event(req.done, 0);
+    /* set_event may still be returning in the I/O thread */
+    AM_MUTEX_LOCK(&io->lock);
+    AM_MUTEX_UNLOCK(&io->lock);
+    close_event(&req.done);
+    return AM_TRUE;
+}
+
+#else
+
+static void net_io_init() {
 }
 
-void am_net_sync_recv(am_net_t *n, int timeout_secs) {
+static void net_io_shutdown() {
+}
+
+static am_bool_t net_io_recv(am_net_t *n, int timeout_msec) {
+    return AM_FALSE;
+}
+
+#endif /* __linux__ */
+
+void am_net_sync_recv(am_net_t *n, int timeout_msec) {
 #ifdef _WIN32
     if (n->uv.ssl && n->options != NULL && !n->options->secure_channel_disable) {
         wnet_read(n);
         return;
     }
-    am_net_sync_recv_internal(n, timeout_secs);
+    am_net_sync_recv_internal(n, timeout_msec);
 #else
-    am_net_sync_recv_internal(n, timeout_secs);
+    if (n == NULL || !net_io_recv(n, timeout_msec)) {
+        am_net_sync_recv_internal(n, timeout_msec);
+    }
 #endif
 }
 
+static void delete_response_headers(am_net_t *n) {
+    int i;
+    for (i = 0; i < n->num_headers; i++) {
+        char *field = n->header_fields[i];
+        char *value = n->header_values[i];
+        AM_FREE(field, value);
+    }
+    AM_FREE(n->header_fields, n->header_values);
+    n->header_fields = NULL;
+    n->header_values = NULL;
+    n->num_headers = n->num_header_values = 0;
+    n->header_state = HEADER_NONE;
+}
+
 /**
  * close connection and clear resources
  */
 int am_net_close(am_net_t *n) {
-    int i;
     if (n == NULL) {
         return AM_EINVAL;
     }
@@ -874,9 +1429,14 @@ int am_net_close(am_net_t *n) {
     n->sock = INVALID_SOCKET;
 
     if (n->ra != NULL) {
-        freeaddrinfo(n->ra);
+        if (n->ra_cached) {
+            free(n->ra);
+        } else {
+            freeaddrinfo(n->ra);
+        }
     }
     n->ra = NULL;
+    n->ra_cached = AM_FALSE;
 
     AM_FREE(n->req_headers);
     n->req_headers = NULL;
@@ -885,14 +1445,229 @@ int am_net_close(am_net_t *n) {
     n->hs = NULL;
     n->hp = NULL;
 
-    for (i = 0; i < n->num_headers; i++) {
-        char *field = n->header_fields[i];
-        char *value = n->header_values[i];
-        AM_FREE(field, value);
-    }
-    AM_FREE(n->header_fields, n->header_values);
-    n->header_fields = NULL;
-    n->header_values = NULL;
-    n->num_headers = n->num_header_values = 0;
+    delete_response_headers(n);
     return AM_SUCCESS;
 }
+
+/**
+ * Keep-alive connection pool.
+ *
+ * Connections which completed their last response cleanly and which the server
+ * did not ask to close are parked here, keyed by agent instance and naming url,
+ * and handed out again to the next request to the same server. This saves a
+ * TCP connect (and SSL handshake) per policy, session, login and audit request.
+ */
+
+struct net_pool_entry {
+    unsigned long instance_id;
+    char *url;
+    time_t ts; /* time connection became idle */
+    int timeout; /* seconds it may stay idle */
+    am_net_t *n;
+    struct net_pool_entry *next;
+};
+
+static struct net_pool_entry *net_pool = NULL;
+static am_mutex_t net_pool_mutex;
+static am_bool_t net_pool_enabled = AM_FALSE;
+
+static void net_pool_delete_entry(struct net_pool_entry *e) {
+    if (e == NULL) return;
+    am_net_close(e->n);
+    AM_FREE(e->n, e->url, e);
+}
+
+static void net_pool_init() {
+    if (net_pool_enabled) return;
+    AM_MUTEX_INIT(&net_pool_mutex);
+    net_pool = NULL;
+    net_pool_enabled = AM_TRUE;
+}
+
+static void net_pool_shutdown() {
+    struct net_pool_entry *e, *t, *list;
+    if (!net_pool_enabled) return;
+    AM_MUTEX_LOCK(&net_pool_mutex);
+    list = net_pool;
+    net_pool = NULL;
+    net_pool_enabled = AM_FALSE;
+    AM_MUTEX_UNLOCK(&net_pool_mutex);
+    AM_MUTEX_DESTROY(&net_pool_mutex);
+
+    AM_LIST_FOR_EACH(list, e, t) {
+        net_pool_delete_entry(e);
+    }
+}
+
+/**
+ * check whether an idle connection is still usable - there must be nothing
+ * to read on it, otherwise the server has closed it (or sent something we did not ask for)
+ */
+static am_bool_t net_pool_is_alive(am_net_t *n) {
+    POLLFD fds[1];
+    if (n->sock == INVALID_SOCKET || n->hp == NULL || n->hs == NULL) {
+        return AM_FALSE;
+    }
+    memset(fds, 0, sizeof (fds));
+    fds[0].fd = n->sock;
+    fds[0].events = read_ev;
+    fds[0].revents = 0;
+    return sockpoll(fds, 1, 0) == 0;
+}
+
+/**
+ * get an idle keep-alive connection to the url from the pool.
+ * Returns NULL when there is none available; caller should connect as usual.
+ */
+am_net_t *am_net_pool_get(unsigned long instance_id, const char *url) {
+    static const char *thisfunc = "am_net_pool_get():";
+    struct net_pool_entry *e, *t, *prev = NULL, *stale = NULL;
+    am_net_t *n = NULL;
+    time_t now = time(NULL);
+
+    if (!net_pool_enabled || ISINVALID(url)) {
+        return NULL;
+    }
+
+    AM_MUTEX_LOCK(&net_pool_mutex);
+
+    AM_LIST_FOR_EACH(net_pool, e, t) {
+        if (difftime(now, e->ts) >= e->timeout) {
+            /* idle for too long - unlink and close it later */
+            if (prev == NULL) {
+                net_pool = t;
+            } else {
+                prev->next = t;
+            }
+            e->next = stale;
+            stale = e;
+            continue;
+        }
+        if (n == NULL && e->instance_id == instance_id && strcmp(e->url, url) == 0) {
+            if (prev == NULL) {
+                net_pool = t;
+            } else {
+                prev->next = t;
+            }
+            if (net_pool_is_alive(e->n)) {
+                n = e->n;
+                e->n = NULL;
+                net_pool_delete_entry(e);
+            } else {
+                e->next = stale;
+                stale = e;
+            }
+            continue;
+        }
+        prev = e;
+    }
+
+    AM_MUTEX_UNLOCK(&net_pool_mutex);
+
+    AM_LIST_FOR_EACH(stale, e, t) {
+        AM_LOG_DEBUG(instance_id, "%s closing idle connection to %s", thisfunc, LOGEMPTY(e->url));
+        net_pool_delete_entry(e);
+    }
+
+    if (n != NULL) {
+        /* reset per-response state */
+        delete_response_headers(n);
+        AM_FREE(n->req_headers);
+        n->req_headers = NULL;
+        n->http_status = 0;
+        n->error = 0;
+        n->recv_calls = 0;
+        n->proxy = AM_PROXY_NONE;
+        n->pooled = AM_TRUE;
+        http_parser_init(n->hp, HTTP_RESPONSE);
+        n->hp->data = n;
+        AM_LOG_DEBUG(instance_id, "%s reusing connection to %s:%d", thisfunc, n->uv.host, n->uv.port);
+    }
+    return n;
+}
+
+/**
+ * return connection to the pool, or close it when it can not be reused.
+ * The pool takes over ownership of the am_net_t (and will free it).
+ */
+void am_net_pool_put(am_net_t *n) {
+    static const char *thisfunc = "am_net_pool_put():";
+    struct net_pool_entry *e, *t, *entry = NULL;
+    int count = 0, size = AM_NET_KEEPALIVE_SIZE, timeout = AM_NET_KEEPALIVE_TIMEOUT;
+    am_bool_t reuse;
+
+    if (n == NULL) return;
+
+    if (n->options != NULL) {
+        if (n->options->keepalive_size > 0) {
+            size = n->options->keepalive_size;
+        }
+        if (n->options->keepalive_timeout > 0) {
+            timeout = n->options->keepalive_timeout;
+        }
+    }
+
+    reuse = net_pool_enabled && n->error == 0 &&
+            n->sock != INVALID_SOCKET && n->hp != NULL && ISVALID(n->url) &&
+            n->req_method != AM_REQUEST_HEAD &&
+            n->is_complete != NULL && n->data != NULL && n->is_complete(n->data) &&
+            http_should_keep_alive(n->hp) &&
+            (n->options == NULL || n->options->keepalive);
+#ifdef _WIN32
+    if (n->uv.ssl && n->options != NULL && !n->options->secure_channel_disable) {
+        reuse = AM_FALSE;
+    }
+#endif
+    if (n->ssl.on && n->ssl.error != AM_SUCCESS) {
+        reuse = AM_FALSE;
+    }
+
+    if (reuse) {
+        entry = calloc(1, sizeof (struct net_pool_entry));
+        if (entry != NULL) {
+            entry->url = strdup(n->url);
+        }
+        if (entry == NULL || entry->url == NULL) {
+            AM_FREE(entry);
+            entry = NULL;
+            reuse = AM_FALSE;
+        }
+    }
+
+    if (reuse) {
+        /* detach everything which belongs to the caller */
+        entry->instance_id = n->instance_id;
+        entry->ts = time(NULL);
+        entry->timeout = timeout;
+        entry->n = n;
+        n->data = NULL;
+        n->options = NULL;
+        n->url = NULL;
+        n->on_headers = NULL;
+
+        AM_MUTEX_LOCK(&net_pool_mutex);
+        if (net_pool_enabled) {
+            AM_LIST_FOR_EACH(net_pool, e, t) {
+                if (e->instance_id == entry->instance_id && strcmp(e->url, entry->url) == 0) {
+                    count++;
+                }
+            }
+            if (count < size) {
+                entry->next = net_pool;
+                net_pool = entry;
+                entry = NULL;
+            }
+        }
+        AM_MUTEX_UNLOCK(&net_pool_mutex);
+
+        if (entry == NULL) {
+            return;
+        }
+        AM_LOG_DEBUG(entry->instance_id, "%s connection pool for %s is full", thisfunc, entry->url);
+        net_pool_delete_entry(entry);
+        return;
+    }
+
+    am_net_close(n);
+    free(n);
+}
@@ -26,7 +26,12 @@ typedef struct {
     int local;
     int lb_enable;
     int net_timeout;
+    uint64_t deadline; /* am_timer value by which responses must have arrived, 0 - no limit */
     int keepalive;
+    int keepalive_size; /* idle connections kept per naming url, 0 - AM_NET_KEEPALIVE_SIZE */
+    int keepalive_timeout; /* seconds, 0 - AM_NET_KEEPALIVE_TIMEOUT */
+    int io_threads; /* I/O threads receiving responses, 0 - none (default), -1 - one per CPU (up to AM_NET_IO_THREADS) */
+    int pll_pipeline;
     int cert_trust;
     int hostmap_sz;
     int notif_enable;
@@ -68,7 +73,7 @@ typedef struct {
     struct ssl {
         char on;
         void *ssl_handle;
-        void *ssl_context;
+        void *ssl_context; /* shared context, see net_client_ssl.c */
         void *read_bio;
         void *write_bio;
         int error;
@@ -93,9 +98,11 @@ typedef struct {
     } proxy;
 
     struct addrinfo *ra;
+    am_bool_t ra_cached; /* ra is from the resolver cache (a single allocation), not from getaddrinfo */
 
     void *data;
     void (*on_connected)(void *udata, int status);
+    void (*on_headers)(void *udata, uint64_t content_length); /* callback when response headers with a Content-Length are read */
     void (*on_data)(void *udata, const char *data, size_t data_sz, int status);
     void (*on_complete)(void *udata, int status); /* callback when all data for the current request is read */
     void (*on_close)(void *udata, int status);
@@ -103,14 +110,21 @@ typedef struct {
     void (*reset_complete)(void *udata);
     am_bool_t(*is_complete)(void *udata);
     int error;
+    unsigned int recv_calls; /* since the connection was made (or taken from the pool) */
+    am_bool_t pooled; /* taken from the pool and not used for a request yet */
 } am_net_t;
 
 
 int am_net_sync_connect(am_net_t *n);
 int am_net_write(am_net_t *n, const char *data, size_t data_sz);
-void am_net_sync_recv(am_net_t *n, int timeout_ms);
+void am_net_sync_recv(am_net_t *n, int timeout_msec);
 int am_net_close(am_net_t *n);
 
+am_net_t *am_net_pool_get(unsigned long instance_id, const char *url);
+void am_net_pool_put(am_net_t *n);
+
+void am_net_ssl_stats(unsigned long *handshakes, unsigned long *resumed);
+
 void am_net_options_create(am_config_t *ac, am_net_options_t *options, void (*log)(const char *, ...));
 void am_net_options_delete(am_net_options_t *options);
 
@@ -127,6 +141,8 @@ int am_url_validate(unsigned long instance_id, const char *url,
         am_net_options_t *options, int *httpcode);
 int am_agent_audit_request(unsigned long instance_id, const char *openam,
         const char *logdata, am_net_options_t *options);
+int am_net_request_recv(am_net_t *conn, const char *request, size_t request_sz, int timeout,
+        size_t *body_sz, size_t *copied);
 
 void am_net_init();
 void am_net_shutdown();
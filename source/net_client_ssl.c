@@ -18,6 +18,7 @@
 #include "am.h"
 #include "utility.h"
 #include "net_client.h"
+#include "list.h"
 
 #ifdef _WIN32
 #define AM_SSL_LIB "ssleay32"
@@ -43,6 +44,31 @@ static pthread_mutex_t *ssl_mutexes = NULL;
 static void *crypto_lib = NULL;
 static void *ssl_lib = NULL;
 
+/* SSL contexts shared by all connections with the same agent instance and ssl options */
+struct ssl_context {
+    unsigned long instance_id;
+    char *fingerprint;
+    void *ctx;
+    int ref;
+    am_bool_t retired;
+    struct ssl_session *sessions;
+    struct ssl_context *next;
+};
+
+/* last session negotiated with a server, used to resume the next handshake */
+struct ssl_session {
+    char *host;
+    int port;
+    void *session;
+    struct ssl_session *next;
+};
+
+static struct ssl_context *ssl_contexts = NULL;
+static am_mutex_t ssl_context_mutex;
+static am_bool_t ssl_context_mutex_init = AM_FALSE;
+static unsigned long ssl_handshake_count = 0;
+static unsigned long ssl_resume_count = 0;
+
 struct ssl_func {
     const char *name;
     void (*ptr)(void);
@@ -84,6 +110,10 @@ static struct ssl_func ssl_sw[] = {
     {"SSL_state", NULL},
     {"SSL_load_error_strings", NULL},
     {"SSL_CTX_set_verify_depth", NULL},
+    {"SSL_ctrl", NULL},
+    {"SSL_get1_session", NULL},
+    {"SSL_set_session", NULL},
+    {"SSL_SESSION_free", NULL},
 #ifndef _WIN32
     {"BIO_s_mem", NULL},
     {"BIO_new", NULL},
@@ -143,11 +173,15 @@ static struct ssl_func crypto_sw[] = {
 #define BIO_C_SET_BUF_MEM_EOF_RETURN 130
 #define BIO_CTRL_PENDING 10
 #define SSL_SESS_CACHE_OFF 0x0000
+#define SSL_SESS_CACHE_CLIENT 0x0001
+#define SSL_SESS_CACHE_NO_INTERNAL_STORE 0x0200
 #define SSL_CTRL_SET_SESS_CACHE_MODE 44
+#define SSL_CTRL_GET_SESSION_REUSED 8
 
 typedef struct ssl_st SSL;
 typedef struct ssl_ctx_st SSL_CTX;
 typedef struct ssl_method_st SSL_METHOD;
+typedef struct ssl_session_st SSL_SESSION;
 typedef struct x509_store_ctx_st X509_STORE_CTX;
 typedef struct x509_st X509;
 #ifdef _WIN32
@@ -192,12 +226,16 @@ typedef struct bio_method_st BIO_METHOD;
 #define SSL_state (* (int (*)(const SSL *)) ssl_sw[32].ptr)
 #define SSL_load_error_strings (* (void (*)(void)) ssl_sw[33].ptr)
 #define SSL_CTX_set_verify_depth (* (void (*)(SSL_CTX *, int)) ssl_sw[34].ptr)
+#define SSL_ctrl (* (long (*)(SSL *, int, long, void *)) ssl_sw[35].ptr)
+#define SSL_get1_session (* (SSL_SESSION * (*)(SSL *)) ssl_sw[36].ptr)
+#define SSL_set_session (* (int (*)(SSL *, SSL_SESSION *)) ssl_sw[37].ptr)
+#define SSL_SESSION_free (* (void (*)(SSL_SESSION *)) ssl_sw[38].ptr)
 #ifndef _WIN32
-#define BIO_s_mem (* (BIO_METHOD * (*)(void)) ssl_sw[35].ptr)
-#define BIO_new (* (BIO * (*)(BIO_METHOD *)) ssl_sw[36].ptr)
-#define BIO_write (* (int (*)(BIO *, const void *, int)) ssl_sw[37].ptr)
-#define BIO_read (* (int (*)(BIO *, void *, int)) ssl_sw[38].ptr)
-#define BIO_ctrl (* (long (*)(BIO *, int, long, void *)) ssl_sw[39].ptr)
+#define BIO_s_mem (* (BIO_METHOD * (*)(void)) ssl_sw[39].ptr)
+#define BIO_new (* (BIO * (*)(BIO_METHOD *)) ssl_sw[40].ptr)
+#define BIO_write (* (int (*)(BIO *, const void *, int)) ssl_sw[41].ptr)
+#define BIO_read (* (int (*)(BIO *, void *, int)) ssl_sw[42].ptr)
+#define BIO_ctrl (* (long (*)(BIO *, int, long, void *)) ssl_sw[43].ptr)
 #endif
 
 #define CRYPTO_num_locks (* (int (*)(void)) crypto_sw[0].ptr)
@@ -496,6 +534,8 @@ init_ssl(
         CRYPTO_set_id_callback(ssl_id_callback);
         CRYPTO_set_locking_callback(ssl_locking_callback);
         OPENSSL_add_all_algorithms_noconf();
+        AM_MUTEX_INIT(&ssl_context_mutex);
+        ssl_context_mutex_init = AM_TRUE;
     } else {
         if (ssl_lib != NULL) close_library(ssl_lib);
         if (crypto_lib != NULL) close_library(crypto_lib);
@@ -527,8 +567,35 @@ void am_net_init_ssl_reset() {
     memcpy(&ssl_lib_initialized, &once, sizeof (ssl_lib_initialized));
 }
 
+static void delete_ssl_context(struct ssl_context *c) {
+    struct ssl_session *e, *t;
+    if (c == NULL) return;
+    AM_LIST_FOR_EACH(c->sessions, e, t) {
+        if (e->session != NULL) {
+            SSL_SESSION_free(e->session);
+        }
+        AM_FREE(e->host, e);
+    }
+    if (c->ctx != NULL) {
+        SSL_CTX_free(c->ctx);
+    }
+    AM_FREE(c->fingerprint, c);
+}
+
 void net_shutdown_ssl() {
     int i;
+    struct ssl_context *c, *t;
+    if (ssl_context_mutex_init) {
+        AM_MUTEX_LOCK(&ssl_context_mutex);
+        AM_LIST_FOR_EACH(ssl_contexts, c, t) {
+            delete_ssl_context(c);
+        }
+        ssl_contexts = NULL;
+        AM_MUTEX_UNLOCK(&ssl_context_mutex);
+        AM_MUTEX_DESTROY(&ssl_context_mutex);
+        ssl_context_mutex_init = AM_FALSE;
+    }
+    ssl_handshake_count = ssl_resume_count = 0;
     if (SSL_library_init && CRYPTO_set_locking_callback
             && CRYPTO_set_id_callback && CRYPTO_num_locks) {
         CRYPTO_set_locking_callback(NULL);
@@ -609,21 +676,6 @@ void net_close_ssl_notify(am_net_t *n) {
     }
 }
 
-void net_close_ssl(am_net_t *n) {
-    if (n->ssl.ssl_handle != NULL) {
-        SSL_shutdown(n->ssl.ssl_handle);
-        SSL_free(n->ssl.ssl_handle);
-    }
-    if (n->ssl.ssl_context != NULL) {
-        SSL_CTX_free(n->ssl.ssl_context);
-    }
-    am_free(n->ssl.request_data);
-    n->ssl.request_data = NULL;
-    n->ssl.ssl_handle = NULL;
-    n->ssl.ssl_context = NULL;
-    n->ssl.on = AM_FALSE;
-}
-
 static void net_ssl_msg_callback(int writep, int version, int content_type,
         const void *buf, size_t len, SSL *ssl, void *arg) {
     static const char *thisfunc = "net_ssl_msg_callback():";
@@ -639,125 +691,361 @@ static void net_ssl_msg_callback(int writep, int version, int content_type,
     }
 }
 
-void net_connect_ssl(am_net_t *n) {
-    static const char *thisfunc = "net_connect_ssl():";
-    int status = -1, err = 0;
+/**
+ * Options which are used to set up SSL context. Connections with the same
+ * fingerprint (and agent instance) share the context and its session cache.
+ */
+static char *ssl_context_fingerprint(am_net_options_t *o) {
+    char *fp = NULL;
+    if (o == NULL) {
+        am_asprintf(&fp, "default");
+    } else {
+        am_asprintf(&fp, "%s\n%s\n%s\n%s\n%s\n%s\n%d", NOTNULL(o->tls_opts), NOTNULL(o->ciphers),
+                NOTNULL(o->cert_ca_file), NOTNULL(o->cert_file), NOTNULL(o->cert_key_file),
+                NOTNULL(o->cert_key_pass), o->cert_trust);
+    }
+    return fp;
+}
+
+static void *create_ssl_context(am_net_t *n, int *error) {
+    static const char *thisfunc = "create_ssl_context():";
     am_bool_t cert_ca_file_loaded = AM_FALSE;
-    if (n != NULL) {
-        n->ssl.on = AM_FALSE;
-        n->ssl.error = AM_SUCCESS;
+    SSL_CTX *ctx = SSL_CTX_new(SSLv23_client_method());
+    if (ctx == NULL) {
+        AM_LOG_ERROR(n->instance_id, "%s failed to create a new SSL context, error: %s",
+                thisfunc, read_ssl_error());
+        *error = AM_ENOMEM;
+        return NULL;
+    }
 
-        /*check whether we have ssl library loaded and symbols are available*/
-        if (SSL_CTX_new == NULL || SSLv23_client_method == NULL || SSL_CTX_set_msg_callback == NULL ||
-                SSL_CTX_ctrl == NULL || BIO_new == NULL || BIO_s_mem == NULL ||
-                SSL_set_bio == NULL || SSL_set_connect_state == NULL ||
-                SSL_do_handshake == NULL || SSL_new == NULL || SSL_get_error == NULL) {
-            AM_LOG_WARNING(n->instance_id, "%s no SSL support is available", thisfunc);
-            n->ssl.error = AM_ENOSSL;
-            return;
+    SSL_CTX_ctrl(ctx, SSL_CTRL_OPTIONS, SSL_OP_NO_SSLv2, NULL);
+    SSL_CTX_ctrl(ctx, SSL_CTRL_MODE,
+            SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER, NULL);
+    /* client sessions are kept in ssl_context.sessions (see store_ssl_session) */
+    SSL_CTX_ctrl(ctx, SSL_CTRL_SET_SESS_CACHE_MODE,
+            SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE, NULL);
+    SSL_CTX_set_msg_callback(ctx, net_ssl_msg_callback);
+
+    if (n->options != NULL && ISVALID(n->options->tls_opts)) {
+        char *v, *t, *c = strdup(n->options->tls_opts);
+        if (c != NULL) {
+            for ((v = strtok_r(c, AM_SPACE_CHAR, &t)); v; (v = strtok_r(NULL, AM_SPACE_CHAR, &t))) {
+                if (strcasecmp(v, "-SSLv3") == 0) {
+                    SSL_CTX_ctrl(ctx, SSL_CTRL_OPTIONS, SSL_OP_NO_SSLv3, NULL);
+                    continue;
+                }
+                if (strcasecmp(v, "-TLSv1") == 0) {
+                    SSL_CTX_ctrl(ctx, SSL_CTRL_OPTIONS, SSL_OP_NO_TLSv1, NULL);
+                    continue;
+                }
+                if (strcasecmp(v, "-TLSv1.1") == 0) {
+                    SSL_CTX_ctrl(ctx, SSL_CTRL_OPTIONS, SSL_OP_NO_TLSv1_1, NULL);
+                    continue;
+                }
+                if (strcasecmp(v, "-TLSv1.2") == 0) {
+                    SSL_CTX_ctrl(ctx, SSL_CTRL_OPTIONS, SSL_OP_NO_TLSv1_2, NULL);
+                }
+            }
+            free(c);
         }
+    }
 
-        n->ssl.ssl_context = SSL_CTX_new(SSLv23_client_method());
-        if (n->ssl.ssl_context == NULL) {
-            AM_LOG_ERROR(n->instance_id, "%s failed to create a new SSL context, error: %s",
-                    thisfunc, read_ssl_error());
-            n->ssl.error = AM_ENOMEM;
-            return;
+    if (n->options != NULL && ISVALID(n->options->ciphers)) {
+        if (!SSL_CTX_set_cipher_list(ctx, n->options->ciphers)) {
+            AM_LOG_WARNING(n->instance_id,
+                    "%s failed to set cipher list \"%s\"",
+                    thisfunc, n->options->ciphers);
+        }
+    }
+    if (n->options != NULL && ISVALID(n->options->cert_ca_file)) {
+        if (!SSL_CTX_load_verify_locations(ctx, n->options->cert_ca_file, NULL)) {
+            AM_LOG_WARNING(n->instance_id,
+                    "%s failed to load trusted CA certificates file \"%s\"",
+                    thisfunc, n->options->cert_ca_file);
+        } else {
+            cert_ca_file_loaded = AM_TRUE;
+        }
+    }
+    if (n->options != NULL && ISVALID(n->options->cert_file)) {
+        if (!SSL_CTX_use_certificate_file(ctx, n->options->cert_file, SSL_FILETYPE_PEM)) {
+            AM_LOG_WARNING(n->instance_id,
+                    "%s failed to load client certificate file \"%s\"",
+                    thisfunc, n->options->cert_file);
         }
+    }
 
-        SSL_CTX_ctrl(n->ssl.ssl_context, SSL_CTRL_OPTIONS, SSL_OP_NO_SSLv2, NULL);
-        SSL_CTX_ctrl(n->ssl.ssl_context, SSL_CTRL_MODE,
-                SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER, NULL);
-        SSL_CTX_ctrl(n->ssl.ssl_context, SSL_CTRL_SET_SESS_CACHE_MODE, SSL_SESS_CACHE_OFF, NULL);
+    if (n->options != NULL && ISVALID(n->options->cert_key_file)) {
+        if (ISVALID(n->options->cert_key_pass)) {
+            SSL_CTX_set_default_passwd_cb_userdata(ctx, (void *) n->options->cert_key_pass);
+            SSL_CTX_set_default_passwd_cb(ctx, password_callback);
+        }
+        if (!SSL_CTX_use_PrivateKey_file(ctx, n->options->cert_key_file, SSL_FILETYPE_PEM)) {
+            AM_LOG_WARNING(n->instance_id,
+                    "%s failed to load private key file \"%s\", %s",
+                    thisfunc, n->options->cert_key_file,
+                    file_exists(n->options->cert_key_file) ? read_ssl_error() : "file is not accessible");
+        }
+        if (!SSL_CTX_check_private_key(ctx)) {
+            AM_LOG_WARNING(n->instance_id,
+                    "%s private key does not match the public certificate",
+                    thisfunc);
+        }
+        /* key password is only needed while the key is loaded - options may go away */
+        SSL_CTX_set_default_passwd_cb_userdata(ctx, NULL);
+    }
 
-        /* TODO: SSL_OP_NO_TICKET */
+    if (n->options == NULL || n->options->cert_trust) {
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+    } else if (cert_ca_file_loaded) {
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+        SSL_CTX_set_verify_depth(ctx, 100);
+    } else {
+        /* if we are going to verify the server cert, trusted ca certs file must be present */
+        AM_LOG_ERROR(n->instance_id,
+                "%s unable to verify peer: trusted CA certificates file \"%s\" not loaded",
+                thisfunc, LOGEMPTY(n->options->cert_ca_file));
+        SSL_CTX_free(ctx);
+        *error = AM_EINVAL;
+        return NULL;
+    }
+    return ctx;
+}
 
-        SSL_CTX_ctrl(n->ssl.ssl_context, SSL_CTRL_SET_MSG_CALLBACK_ARG, 0, n);
-        SSL_CTX_set_msg_callback(n->ssl.ssl_context, net_ssl_msg_callback);
+/**
+ * Get a reference to the shared SSL context for this connection, creating one when
+ * there is none yet. A context created with different options for the same agent
+ * instance (configuration change) is retired and freed once its last user is gone.
+ */
+static struct ssl_context *get_ssl_context(am_net_t *n, int *error) {
+    struct ssl_context *c, *t, *prev = NULL, *found = NULL, *retired = NULL;
+    char *fp;
 
-        if (n->options != NULL && ISVALID(n->options->tls_opts)) {
-            char *v, *t, *c = strdup(n->options->tls_opts);
-            if (c != NULL) {
-                for ((v = strtok_r(c, AM_SPACE_CHAR, &t)); v; (v = strtok_r(NULL, AM_SPACE_CHAR, &t))) {
-                    if (strcasecmp(v, "-SSLv3") == 0) {
-                        SSL_CTX_ctrl(n->ssl.ssl_context, SSL_CTRL_OPTIONS, SSL_OP_NO_SSLv3, NULL);
-                        continue;
-                    }
-                    if (strcasecmp(v, "-TLSv1") == 0) {
-                        SSL_CTX_ctrl(n->ssl.ssl_context, SSL_CTRL_OPTIONS, SSL_OP_NO_TLSv1, NULL);
-                        continue;
-                    }
-                    if (strcasecmp(v, "-TLSv1.1") == 0) {
-                        SSL_CTX_ctrl(n->ssl.ssl_context, SSL_CTRL_OPTIONS, SSL_OP_NO_TLSv1_1, NULL);
-                        continue;
-                    }
-                    if (strcasecmp(v, "-TLSv1.2") == 0) {
-                        SSL_CTX_ctrl(n->ssl.ssl_context, SSL_CTRL_OPTIONS, SSL_OP_NO_TLSv1_2, NULL);
-                    }
-                }
-                free(c);
-            }
-        }
+    if (!ssl_context_mutex_init) {
+        *error = AM_ENOSSL;
+        return NULL;
+    }
+
+    fp = ssl_context_fingerprint(n->options);
+    if (fp == NULL) {
+        *error = AM_ENOMEM;
+        return NULL;
+    }
+
+    AM_MUTEX_LOCK(&ssl_context_mutex);
 
-        if (n->options != NULL && ISVALID(n->options->ciphers)) {
-            if (!SSL_CTX_set_cipher_list(n->ssl.ssl_context, n->options->ciphers)) {
-                AM_LOG_WARNING(n->instance_id,
-                        "%s failed to set cipher list \"%s\"",
-                        thisfunc, n->options->ciphers);
+    AM_LIST_FOR_EACH(ssl_contexts, c, t) {
+        if (c->instance_id == n->instance_id) {
+            if (strcmp(c->fingerprint, fp) == 0) {
+                found = c;
+                prev = c;
+                continue;
             }
-        }
-        if (n->options != NULL && ISVALID(n->options->cert_ca_file)) {
-            if (!SSL_CTX_load_verify_locations(n->ssl.ssl_context, n->options->cert_ca_file, NULL)) {
-                AM_LOG_WARNING(n->instance_id,
-                        "%s failed to load trusted CA certificates file \"%s\"",
-                        thisfunc, n->options->cert_ca_file);
+            /* options have changed - unlink the old context */
+            if (prev == NULL) {
+                ssl_contexts = t;
             } else {
-                cert_ca_file_loaded = AM_TRUE;
+                prev->next = t;
             }
-        }
-        if (n->options != NULL && ISVALID(n->options->cert_file)) {
-            if (!SSL_CTX_use_certificate_file(n->ssl.ssl_context, n->options->cert_file, SSL_FILETYPE_PEM)) {
-                AM_LOG_WARNING(n->instance_id,
-                        "%s failed to load client certificate file \"%s\"",
-                        thisfunc, n->options->cert_file);
+            c->retired = AM_TRUE;
+            if (c->ref == 0) {
+                c->next = retired;
+                retired = c;
             }
+            continue;
         }
+        prev = c;
+    }
 
-        if (n->options != NULL && ISVALID(n->options->cert_key_file)) {
-            if (ISVALID(n->options->cert_key_pass)) {
-                SSL_CTX_set_default_passwd_cb_userdata(n->ssl.ssl_context, (void *) n->options->cert_key_pass);
-                SSL_CTX_set_default_passwd_cb(n->ssl.ssl_context, password_callback);
+    if (found == NULL) {
+        found = calloc(1, sizeof (struct ssl_context));
+        if (found == NULL) {
+            *error = AM_ENOMEM;
+        } else {
+            found->ctx = create_ssl_context(n, error);
+            if (found->ctx == NULL) {
+                free(found);
+                found = NULL;
+            } else {
+                found->instance_id = n->instance_id;
+                found->fingerprint = fp;
+                fp = NULL;
+                found->next = ssl_contexts;
+                ssl_contexts = found;
             }
-            if (!SSL_CTX_use_PrivateKey_file(n->ssl.ssl_context, n->options->cert_key_file, SSL_FILETYPE_PEM)) {
-                AM_LOG_WARNING(n->instance_id,
-                        "%s failed to load private key file \"%s\", %s",
-                        thisfunc, n->options->cert_key_file,
-                        file_exists(n->options->cert_key_file) ? read_ssl_error() : "file is not accessible");
+        }
+    }
+    if (found != NULL) {
+        found->ref++;
+    }
+
+    AM_MUTEX_UNLOCK(&ssl_context_mutex);
+
+    AM_LIST_FOR_EACH(retired, c, t) {
+        delete_ssl_context(c);
+    }
+    am_free(fp);
+    return found;
+}
+
+static void release_ssl_context(struct ssl_context *c) {
+    am_bool_t delete = AM_FALSE;
+    if (c == NULL || !ssl_context_mutex_init) return;
+    AM_MUTEX_LOCK(&ssl_context_mutex);
+    c->ref--;
+    delete = c->retired && c->ref <= 0;
+    AM_MUTEX_UNLOCK(&ssl_context_mutex);
+    if (delete) {
+        delete_ssl_context(c);
+    }
+}
+
+/**
+ * Attach the last session negotiated with this server to the new ssl handle
+ * so that the handshake can be abbreviated.
+ */
+static void restore_ssl_session(am_net_t *n, struct ssl_context *c) {
+    struct ssl_session *e, *t;
+    AM_MUTEX_LOCK(&ssl_context_mutex);
+    AM_LIST_FOR_EACH(c->sessions, e, t) {
+        if (e->port == n->uv.port && strcasecmp(e->host, n->uv.host) == 0) {
+            if (e->session != NULL) {
+                SSL_set_session(n->ssl.ssl_handle, e->session);
             }
-            if (!SSL_CTX_check_private_key(n->ssl.ssl_context)) {
-                AM_LOG_WARNING(n->instance_id,
-                        "%s private key does not match the public certificate",
-                        thisfunc);
+            break;
+        }
+    }
+    AM_MUTEX_UNLOCK(&ssl_context_mutex);
+}
+
+static void store_ssl_session(am_net_t *n, struct ssl_context *c) {
+    struct ssl_session *e, *t, *found = NULL;
+    void *session, *old = NULL;
+
+    session = SSL_get1_session(n->ssl.ssl_handle);
+    if (session == NULL) return;
+
+    AM_MUTEX_LOCK(&ssl_context_mutex);
+    AM_LIST_FOR_EACH(c->sessions, e, t) {
+        if (e->port == n->uv.port && strcasecmp(e->host, n->uv.host) == 0) {
+            found = e;
+            break;
+        }
+    }
+    if (found == NULL) {
+        found = calloc(1, sizeof (struct ssl_session));
+        if (found != NULL) {
+            found->host = strdup(n->uv.host);
+            found->port = n->uv.port;
+            if (found->host == NULL) {
+                free(found);
+                found = NULL;
+            } else {
+                found->next = c->sessions;
+                c->sessions = found;
             }
         }
+    }
+    if (found != NULL) {
+        old = found->session;
+        found->session = session;
+        session = NULL;
+    }
+    AM_MUTEX_UNLOCK(&ssl_context_mutex);
 
-        if (n->options == NULL || n->options->cert_trust) {
-            SSL_CTX_set_verify(n->ssl.ssl_context, SSL_VERIFY_NONE, NULL);
-        } else if (cert_ca_file_loaded) {
-            SSL_CTX_set_verify(n->ssl.ssl_context, SSL_VERIFY_PEER, NULL);
-            SSL_CTX_set_verify_depth(n->ssl.ssl_context, 100);
-        } else {
-            /* if we are going to verify the server cert, trusted ca certs file must be present */
-            AM_LOG_ERROR(n->instance_id,
-                    "%s unable to verify peer: trusted CA certificates file \"%s\" not loaded",
-                    thisfunc, LOGEMPTY(n->options->cert_ca_file));
+    if (old != NULL) {
+        SSL_SESSION_free(old);
+    }
+    if (session != NULL) {
+        SSL_SESSION_free(session);
+    }
+}
+
+/**
+ * Number of full and abbreviated (resumed) SSL handshakes done since the library was loaded.
+ */
+void am_net_ssl_stats(unsigned long *handshakes, unsigned long *resumed) {
+    if (ssl_context_mutex_init) {
+        AM_MUTEX_LOCK(&ssl_context_mutex);
+    }
+    if (handshakes != NULL) *handshakes = ssl_handshake_count;
+    if (resumed != NULL) *resumed = ssl_resume_count;
+    if (ssl_context_mutex_init) {
+        AM_MUTEX_UNLOCK(&ssl_context_mutex);
+    }
+}
 
-            n->ssl.error = AM_EINVAL;
+/**
+ * Count a completed handshake (see am_net_ssl_stats).
+ */
+void net_ssl_count_handshake(am_bool_t resumed) {
+    if (ssl_context_mutex_init) {
+        AM_MUTEX_LOCK(&ssl_context_mutex);
+    }
+    if (resumed) {
+        ssl_resume_count++;
+    } else {
+        ssl_handshake_count++;
+    }
+    if (ssl_context_mutex_init) {
+        AM_MUTEX_UNLOCK(&ssl_context_mutex);
+    }
+}
+
+static void ssl_handshake_done(am_net_t *n) {
+    static const char *thisfunc = "ssl_handshake_done():";
+    am_bool_t resumed = SSL_ctrl(n->ssl.ssl_handle, SSL_CTRL_GET_SESSION_REUSED, 0, NULL) != 0;
+    net_ssl_count_handshake(resumed);
+    AM_LOG_DEBUG(n->instance_id, "%s %s handshake with %s:%d", thisfunc,
+            resumed ? "resumed" : "full", LOGEMPTY(n->uv.host), n->uv.port);
+}
+
+void net_close_ssl(am_net_t *n) {
+    struct ssl_context *c = (struct ssl_context *) n->ssl.ssl_context;
+    if (n->ssl.ssl_handle != NULL) {
+        if (c != NULL && n->ssl.error == AM_SUCCESS &&
+                SSL_state(n->ssl.ssl_handle) == SSL_ST_OK) {
+            store_ssl_session(n, c);
+        }
+        SSL_shutdown(n->ssl.ssl_handle);
+        SSL_free(n->ssl.ssl_handle);
+    }
+    release_ssl_context(c);
+    am_free(n->ssl.request_data);
+    n->ssl.request_data = NULL;
+    n->ssl.ssl_handle = NULL;
+    n->ssl.ssl_context = NULL;
+    n->ssl.on = AM_FALSE;
+}
+
+void net_connect_ssl(am_net_t *n) {
+    static const char *thisfunc = "net_connect_ssl():";
+    int status = -1, err = 0, error = AM_SUCCESS;
+    struct ssl_context *c;
+    if (n != NULL) {
+        n->ssl.on = AM_FALSE;
+        n->ssl.error = AM_SUCCESS;
+
+        /*check whether we have ssl library loaded and symbols are available*/
+        if (SSL_CTX_new == NULL || SSLv23_client_method == NULL || SSL_CTX_set_msg_callback == NULL ||
+                SSL_CTX_ctrl == NULL || BIO_new == NULL || BIO_s_mem == NULL ||
+                SSL_set_bio == NULL || SSL_set_connect_state == NULL ||
+                SSL_do_handshake == NULL || SSL_new == NULL || SSL_get_error == NULL) {
+            AM_LOG_WARNING(n->instance_id, "%s no SSL support is available", thisfunc);
+            n->ssl.error = AM_ENOSSL;
+            return;
+        }
+
+        c = get_ssl_context(n, &error);
+        if (c == NULL) {
+            n->ssl.error = error;
             return;
         }
+        n->ssl.ssl_context = c;
 
-        n->ssl.ssl_handle = SSL_new(n->ssl.ssl_context);
+        n->ssl.ssl_handle = SSL_new(c->ctx);
         if (n->ssl.ssl_handle != NULL) {
+            SSL_ctrl(n->ssl.ssl_handle, SSL_CTRL_SET_MSG_CALLBACK_ARG, 0, n);
+            restore_ssl_session(n, c);
             n->ssl.read_bio = BIO_new(BIO_s_mem());
             n->ssl.write_bio = BIO_new(BIO_s_mem());
             if (n->ssl.read_bio != NULL && n->ssl.write_bio != NULL) {
@@ -784,16 +1072,10 @@ void net_connect_ssl(am_net_t *n) {
 }
 
 static int read_data_after_handshake(am_net_t *n) {
-    char *buf;
+#define AM_SSL_BUFFER_SZ 16384 /* one TLS record */
+    static AM_THREAD_LOCAL char buf[AM_SSL_BUFFER_SZ]; /* reused by all reads in this thread */
     int err, ret = 0, status = AM_SUCCESS;
 
-#define AM_SSL_BUFFER_SZ 1024
-
-    buf = malloc(AM_SSL_BUFFER_SZ);
-    if (buf == NULL) {
-        return AM_ENOMEM;
-    }
-
     do {
         ret = SSL_read(n->ssl.ssl_handle, buf, AM_SSL_BUFFER_SZ);
         if (ret == 0) {
@@ -804,7 +1086,6 @@ static int read_data_after_handshake(am_net_t *n) {
             err = SSL_get_error(n->ssl.ssl_handle, ret);
             if (!ssl_is_fatal_error(n, err)) {
                 write_bio_to_socket(n);
-                free(buf);
                 return AM_EAGAIN;
             }
             break;
@@ -813,7 +1094,6 @@ static int read_data_after_handshake(am_net_t *n) {
         http_parser_execute(n->hp, n->hs, buf, ret);
     } while (ret > 0);
 
-    free(buf);
     return status;
 }
 
@@ -856,6 +1136,7 @@ int net_read_ssl(am_net_t *n, const char *buf, int sz) {
                 write_bio_to_socket(n);
             }
         } else {
+            ssl_handshake_done(n);
             net_write_ssl(n);
         }
     } else {
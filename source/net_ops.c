@@ -23,42 +23,99 @@
 
 #define AM_LB_COOKIE "amlbcookie"
 
+struct pll_request {
+    char *post;
+    size_t post_sz;
+    int scope; /* policy request scope, -1 for a session request */
+    am_xml_stream_t *xml;
+    unsigned int http_status;
+};
+
 struct request_data {
     char *data;
     size_t data_size;
+    size_t data_capacity; /* allocated, not counting the terminating NUL; only valid when data is not NULL */
+    size_t data_moved; /* body bytes (at most) moved by growing the allocation */
+    am_xml_stream_t *xml; /* when set, response body is parsed as it is received instead of being stored in data */
+    struct pll_request *pipeline; /* when set, responses to these requests (in the order they were sent) are expected */
+    int pipeline_sz;
+    int pipeline_next; /* index of the response being received */
+    am_net_t *conn;
     int error;
     am_bool_t message_complete;
 };
 
+#define AM_NET_PRESIZE_MAX (16 * 1024 * 1024) /* do not trust a Content-Length above this */
+
 void net_connect_ssl(am_net_t *n);
 #ifdef _WIN32
 void sync_connect_win(am_net_t *n);
 #endif
 
+static void set_request_callbacks(am_net_t *conn, struct request_data *req_data,
+        unsigned long instance_id, const char *openam, am_net_options_t *options);
+static int do_net_connect(am_net_t *conn, struct request_data *req_data,
+        unsigned long instance_id, const char *openam, am_net_options_t *options);
+
+/**
+ * make room for at least size bytes of response body (plus a terminating NUL)
+ */
+static int request_data_reserve(struct request_data *ld, size_t size) {
+    char *rd_tmp;
+    if (ld->data == NULL) {
+        ld->data_size = ld->data_capacity = 0;
+    } else if (size <= ld->data_capacity) {
+        return AM_SUCCESS;
+    }
+    rd_tmp = realloc(ld->data, size + 1);
+    if (rd_tmp == NULL) {
+        am_free(ld->data);
+        ld->data = NULL;
+        ld->data_size = ld->data_capacity = 0;
+        ld->error = AM_ENOMEM;
+        return AM_ENOMEM;
+    }
+    if (ld->data == NULL) {
+        rd_tmp[0] = 0;
+    } else {
+        ld->data_moved += ld->data_size;
+    }
+    ld->data = rd_tmp;
+    ld->data_capacity = size;
+    return AM_SUCCESS;
+}
+
+static void on_agent_request_headers_cb(void *udata, uint64_t content_length) {
+    struct request_data *ld = (struct request_data *) udata;
+    if (ld->xml == NULL && ld->pipeline == NULL && content_length > 0 && content_length <= AM_NET_PRESIZE_MAX) {
+        /* the whole body in one allocation */
+        request_data_reserve(ld, (ld->data != NULL ? ld->data_size : 0) + (size_t) content_length);
+    }
+}
+
 static void on_agent_request_data_cb(void *udata, const char *data, size_t data_sz, int status) {
     struct request_data *ld = (struct request_data *) udata;
-    if (ld->data == NULL) {
-        ld->data = malloc(data_sz + 1);
-        if (ld->data == NULL) {
-            ld->error = AM_ENOMEM;
-            return;
+    size_t size = ld->data != NULL ? ld->data_size : 0;
+    if (ld->pipeline != NULL) {
+        if (ld->pipeline_next < ld->pipeline_sz) {
+            am_xml_stream_feed(ld->pipeline[ld->pipeline_next].xml, data, data_sz);
         }
-        memcpy(ld->data, data, data_sz);
-        ld->data[data_sz] = 0;
-        ld->data_size = data_sz;
-    } else {
-        char *rd_tmp = realloc(ld->data, ld->data_size + data_sz + 1);
-        if (rd_tmp == NULL) {
-            am_free(ld->data);
-            ld->error = AM_ENOMEM;
+        return;
+    }
+    if (ld->xml != NULL) {
+        am_xml_stream_feed(ld->xml, data, data_sz);
+        return;
+    }
+    if (ld->data == NULL || size + data_sz > ld->data_capacity) {
+        /* no (or a wrong) Content-Length - grow geometrically */
+        size_t capacity = ld->data != NULL ? ld->data_capacity * 2 : 0;
+        if (request_data_reserve(ld, capacity > size + data_sz ? capacity : size + data_sz) != AM_SUCCESS) {
             return;
-        } else {
-            ld->data = rd_tmp;
         }
-        memcpy(ld->data + ld->data_size, data, data_sz);
-        ld->data_size += data_sz;
-        ld->data[ld->data_size] = 0;
     }
+    memcpy(ld->data + ld->data_size, data, data_sz);
+    ld->data_size += data_sz;
+    ld->data[ld->data_size] = 0;
 }
 
 static void on_connected_cb(void *udata, int status) {
@@ -70,6 +127,13 @@ static void on_close_cb(void *udata, int status) {
 
 static void on_complete_cb(void *udata, int status) {
     struct request_data *ld = (struct request_data *) udata;
+    if (ld->pipeline != NULL && ld->pipeline_next < ld->pipeline_sz) {
+        ld->pipeline[ld->pipeline_next++].http_status = ld->conn->http_status;
+        if (ld->pipeline_next < ld->pipeline_sz) {
+            /* more responses to come */
+            return;
+        }
+    }
     ld->message_complete = AM_TRUE;
 }
 
@@ -83,6 +147,98 @@ static am_bool_t is_complete(void *udata) {
     return ld->message_complete;
 }
 
+/**
+ * replace a connection which turned out to be closed with a new one to the same url,
+ * keeping the request data and headers set up for it
+ */
+static int net_reconnect(am_net_t *conn) {
+    struct request_data *req_data = (struct request_data *) conn->data;
+    am_net_options_t *options = conn->options;
+    unsigned long instance_id = conn->instance_id;
+    const char *url = conn->url;
+    char *req_headers = conn->req_headers;
+    int status;
+
+    conn->req_headers = NULL;
+    am_net_close(conn);
+
+    status = am_net_breaker_allow(instance_id, url);
+    if (status == AM_SUCCESS) {
+        memset(conn, 0, sizeof (am_net_t));
+        status = do_net_connect(conn, req_data, instance_id, url, options);
+        am_net_breaker_report(instance_id, url, status);
+    }
+    conn->req_headers = req_headers;
+    if (status != AM_SUCCESS) {
+        conn->error = status;
+    }
+    return status;
+}
+
+/**
+ * milliseconds to wait for a response: AM_NET_POOL_TIMEOUT, or less when the request
+ * has a deadline (see am_net_options_t) which comes sooner; 0 once the deadline has passed.
+ */
+static int net_recv_timeout(am_net_t *conn) {
+    unsigned int timeout = AM_NET_POOL_TIMEOUT * 1000, left;
+    if (conn->options == NULL || conn->options->deadline == 0) {
+        return (int) timeout;
+    }
+    left = am_timer_until(conn->options->deadline);
+    return (int) (left < timeout ? left : timeout);
+}
+
+static int net_write_recv(am_net_t *conn, const char *data, size_t data_sz) {
+    static const char *thisfunc = "net_write_recv():";
+    int status, timeout = net_recv_timeout(conn);
+
+    if (timeout == 0) {
+        AM_LOG_WARNING(conn->instance_id, "%s time budget exhausted before sending a request to %s",
+                thisfunc, conn->url);
+        conn->error = AM_ETIMEDOUT;
+        return AM_ETIMEDOUT;
+    }
+    status = am_net_write(conn, data, data_sz);
+    if (status == AM_SUCCESS) {
+        am_net_sync_recv(conn, timeout);
+        if (conn->error == AM_ETIMEDOUT) {
+            status = AM_ETIMEDOUT;
+        } else if (conn->http_status != 0) {
+            /* the service is answering - this also goes for connections taken from the pool */
+            am_net_breaker_report(conn->instance_id, conn->url, AM_SUCCESS);
+        }
+    }
+    return status;
+}
+
+/**
+ * send a request and receive the response, failing with AM_ETIMEDOUT when it does not
+ * arrive in time.
+ * 
+ * The server may have closed a pooled keep-alive connection while it was idle; when
+ * the first request on such a connection gets no response at all (reset or EOF), it is
+ * sent once more on a new connection.
+ */
+static int net_send_recv(am_net_t *conn, const char *data, size_t data_sz) {
+    static const char *thisfunc = "net_send_recv():";
+    am_bool_t pooled = conn->pooled;
+    int status;
+
+    conn->pooled = AM_FALSE;
+    status = net_write_recv(conn, data, data_sz);
+    if (!pooled || conn->http_status != 0 || status == AM_ETIMEDOUT) {
+        return status;
+    }
+
+    AM_LOG_DEBUG(conn->instance_id, "%s connection to %s was closed by the server, retrying on a new one",
+            thisfunc, conn->url);
+    status = net_reconnect(conn);
+    if (status == AM_SUCCESS) {
+        status = net_write_recv(conn, data, data_sz);
+    }
+    return status;
+}
+
 static void create_cookie_header(am_net_t *conn, const char *token) {
     static const char *thisfunc = "create_cookie_header():";
     int i;
@@ -270,14 +426,10 @@ static int send_authcontext_request(am_net_t *conn, const char *realm, char **to
 #endif                
     }
 
-    status = am_net_write(conn, post, post_sz);
+    status = net_send_recv(conn, post, post_sz);
     free(post_data);
     free(post);
 
-    if (status == AM_SUCCESS) {
-        am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
-    }
-
     AM_LOG_DEBUG(conn->instance_id, "%s response status code: %d\n%s",
             thisfunc, conn->http_status, LOGEMPTY(req_data->data));
     if (conn->options != NULL && conn->options->log != NULL) {
@@ -409,16 +561,12 @@ static int send_login_request(am_net_t *conn, char **token, const char *user, co
 #endif                
     }
 
-    status = am_net_write(conn, post, post_sz);
+    status = net_send_recv(conn, post, post_sz);
     free(post_data);
     free(post);
     free(*token); /* delete pre-login/authcontext token */
     *token = NULL;
 
-    if (status == AM_SUCCESS) {
-        am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
-    }
-
     AM_LOG_DEBUG(conn->instance_id, "%s authenticate response status code: %d\n%s",
             thisfunc, conn->http_status, LOGEMPTY(req_data->data));
     if (conn->options != NULL && conn->options->log != NULL) {
@@ -500,13 +648,9 @@ static int send_attribute_request(am_net_t *conn, char **token, char **pxml, siz
 #endif                
     }
 
-    status = am_net_write(conn, post, post_sz);
+    status = net_send_recv(conn, post, post_sz);
     free(post);
 
-    if (status == AM_SUCCESS) {
-        am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
-    }
-
     AM_LOG_DEBUG(conn->instance_id, "%s response status code: %d\n%s",
             thisfunc, conn->http_status, LOGEMPTY(req_data->data));
     if (conn->options != NULL && conn->options->log != NULL) {
@@ -541,28 +685,19 @@ static int send_attribute_request(am_net_t *conn, char **token, char **pxml, siz
     return status;
 }
 
-static int send_session_request(am_net_t *conn, char **token, const char *user_token,
-        struct am_namevalue **session_list) {
+/**
+ * build a session service (PLL) request for user_token (or for the agent token when user_token is not set)
+ */
+static int session_request_create(am_net_t *conn, const char *token, const char *user_token,
+        const char *keepalive, char **post, size_t *post_sz) {
     static const char *thisfunc = "send_session_request():";
-    size_t post_sz, post_data_sz, token_sz;
-    char *post = NULL, *post_data = NULL, *token_in = NULL, *token_b64;
-    int status = AM_ERROR;
-    struct request_data *req_data;
-    char *keepalive = "Keep-Alive";
+    size_t post_data_sz, token_sz;
+    char *post_data = NULL, *token_in = NULL, *token_b64;
     char *lsnr_req = NULL;
 
-    if (conn == NULL || conn->data == NULL ||
-            token == NULL || !ISVALID(*token)) return AM_EINVAL;
-
-    token_sz = am_asprintf(&token_in, "token:%s", *token);
+    token_sz = am_asprintf(&token_in, "token:%s", token);
     token_b64 = base64_encode(token_in, &token_sz);
 
-    if (conn->options != NULL && !conn->options->keepalive) {
-        keepalive = "Close";
-    }
-
-    req_data = (struct request_data *) conn->data;
-
     if (conn->options != NULL && conn->options->notif_enable && ISVALID(conn->options->notif_url)) {
         /* add session listener request only if notification is enabled */
         am_asprintf(&lsnr_req,
@@ -576,7 +711,7 @@ static int send_session_request(am_net_t *conn, char **token, const char *user_t
                 "</Request>",
                 NOTNULL(token_b64),
                 conn->options->notif_url,
-                ISVALID(user_token) ? user_token : *token);
+                ISVALID(user_token) ? user_token : token);
     }
 
     post_data_sz = am_asprintf(&post_data,
@@ -592,7 +727,7 @@ static int send_session_request(am_net_t *conn, char **token, const char *user_t
             "%s"
             "</RequestSet>",
             NOTNULL(token_b64),
-            ISVALID(user_token) ? user_token : *token,
+            ISVALID(user_token) ? user_token : token,
             NOTNULL(lsnr_req));
 
     if (post_data == NULL) {
@@ -600,7 +735,7 @@ static int send_session_request(am_net_t *conn, char **token, const char *user_t
         return AM_ENOMEM;
     }
 
-    post_sz = am_asprintf(&post, "POST %s/sessionservice HTTP/1.1\r\n"
+    *post_sz = am_asprintf(post, "POST %s/sessionservice HTTP/1.1\r\n"
             "Host: %s:%d\r\n"
             "User-Agent: "MODINFO"\r\n"
             "Accept: text/xml\r\n"
@@ -610,59 +745,58 @@ static int send_session_request(am_net_t *conn, char **token, const char *user_t
             "Content-Length: %d\r\n\r\n"
             "%s", conn->uv.path, conn->uv.host, conn->uv.port, keepalive,
             NOTNULL(conn->req_headers), post_data_sz, post_data);
-    if (post == NULL) {
-        AM_FREE(post_data, token_b64, token_in, lsnr_req);
+    AM_FREE(post_data, token_b64, token_in, lsnr_req);
+    if (*post == NULL) {
         return AM_ENOMEM;
     }
 
 #ifdef DEBUG
     AM_LOG_DEBUG(conn->instance_id, "%s sending %d bytes to %s/sessionservice\n%s",
-            thisfunc, post_sz, conn->url, post);
+            thisfunc, *post_sz, conn->url, *post);
 #else
     AM_LOG_DEBUG(conn->instance_id, "%s sending %d bytes to %s/sessionservice",
-            thisfunc, post_sz, conn->url);
+            thisfunc, *post_sz, conn->url);
 #endif
     if (conn->options != NULL && conn->options->log != NULL) {
 #ifdef DEBUG
         conn->options->log("%s sending %d bytes to %s/sessionservice\n%s",
-                thisfunc, post_sz, conn->url, post);
+                thisfunc, *post_sz, conn->url, *post);
 #else
         conn->options->log("%s sending %d bytes to %s/sessionservice",
-                thisfunc, post_sz, conn->url);
+                thisfunc, *post_sz, conn->url);
 #endif                
     }
+    return AM_SUCCESS;
+}
 
-    status = am_net_write(conn, post, post_sz);
-    AM_FREE(post, post_data, token_b64, token_in, lsnr_req);
+/**
+ * collect the result of a session request from its (already parsed) response
+ */
+static int session_response_status(am_net_t *conn, int status, unsigned int http_status, am_xml_stream_t *xml,
+        const char *token, const char *user_token, struct am_namevalue **session_list) {
+    static const char *thisfunc = "send_session_request():";
+    char *exception = NULL;
+    struct am_namevalue *list;
+    size_t response_sz;
 
-    if (status == AM_SUCCESS) {
-        am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
-    }
+    response_sz = am_xml_stream_size(xml);
+    list = (struct am_namevalue *) am_xml_stream_finish(xml, &exception);
 
-    AM_LOG_DEBUG(conn->instance_id, "%s response status code: %d\n%s",
-            thisfunc, conn->http_status, LOGEMPTY(req_data->data));
+    AM_LOG_DEBUG(conn->instance_id, "%s response status code: %d (%lu bytes)%s%s",
+            thisfunc, http_status, (unsigned long) response_sz, exception != NULL ? "\n" : "", NOTNULL(exception));
     if (conn->options != NULL && conn->options->log != NULL) {
-        conn->options->log("%s response status code: %d\n%s", thisfunc,
-                conn->http_status, LOGEMPTY(req_data->data));
+        conn->options->log("%s response status code: %d (%lu bytes)%s%s", thisfunc,
+                http_status, (unsigned long) response_sz, exception != NULL ? "\n" : "", NOTNULL(exception));
     }
 
-    if (status == AM_SUCCESS && conn->http_status == 200 && ISVALID(req_data->data)) {
-        if (strstr(req_data->data, "<Exception>") != NULL) {
-            char *temp = strdup(req_data->data);
-            if (temp != NULL) {
-                /* we should care about the Exception in Session part only */
-                char *temp_lstnr = strstr(temp, "<AddSessionListener>");
-                if (temp_lstnr != NULL)
-                    *temp_lstnr = '\0';
-
-                status = parse_exception(temp, *token, user_token);
-                free(temp);
-            } else {
-                status = AM_ENOMEM;
-            }
+    if (status == AM_SUCCESS && http_status == 200 && response_sz > 0) {
+        /* only the Exception in Session part (the first response in the set) is captured */
+        if (exception != NULL) {
+            status = parse_exception(exception, token, user_token);
         }
         if (status == AM_SUCCESS && session_list != NULL) {
-            *session_list = am_parse_session_xml(conn->instance_id, req_data->data, req_data->data_size);
+            *session_list = list;
+            list = NULL;
             if (*session_list == NULL) {
                 status = AM_XML_ERROR;
             }
@@ -670,11 +804,48 @@ static int send_session_request(am_net_t *conn, char **token, const char *user_t
     } else {
         status = AM_EINVAL;
     }
+    delete_am_namevalue_list(&list);
+    am_free(exception);
 
     AM_LOG_DEBUG(conn->instance_id, "%s status: %s", thisfunc, am_strerror(status));
     if (conn->options != NULL && conn->options->log != NULL) {
         conn->options->log("%s status: %s", thisfunc, am_strerror(status));
     }
+    return status;
+}
+
+static int send_session_request(am_net_t *conn, char **token, const char *user_token,
+        struct am_namevalue **session_list) {
+    size_t post_sz;
+    char *post = NULL;
+    int status;
+    struct request_data *req_data;
+    am_xml_stream_t *xml;
+
+    if (conn == NULL || conn->data == NULL ||
+            token == NULL || !ISVALID(*token)) return AM_EINVAL;
+
+    req_data = (struct request_data *) conn->data;
+
+    status = session_request_create(conn, *token, user_token,
+            conn->options != NULL && !conn->options->keepalive ? "Close" : "Keep-Alive", &post, &post_sz);
+    if (status != AM_SUCCESS) {
+        return status;
+    }
+
+    /* session response is parsed while it is being received */
+    req_data->xml = am_session_xml_stream(conn->instance_id);
+    if (req_data->xml == NULL) {
+        free(post);
+        return AM_ENOMEM;
+    }
+
+    status = net_send_recv(conn, post, post_sz);
+    free(post);
+
+    xml = req_data->xml;
+    req_data->xml = NULL;
+    status = session_response_status(conn, status, conn->http_status, xml, *token, user_token, session_list);
 
     am_free(req_data->data);
     req_data->data = NULL;
@@ -688,6 +859,7 @@ static int send_policychange_request(am_net_t *conn, char **token, const char *e
     char *post = NULL, *post_data = NULL;
     int status = AM_ERROR;
     struct request_data *req_data;
+    char *keepalive = "Keep-Alive";
     char *notifyurl;
     const char *service_name = ISVALID(eval_app) ? eval_app : "iPlanetAMWebAgentService";
 
@@ -695,6 +867,10 @@ static int send_policychange_request(am_net_t *conn, char **token, const char *e
             !ISVALID(*token)) return AM_EINVAL;
 
     notifyurl = conn->options != NULL && ISVALID(conn->options->notif_url) ? conn->options->notif_url : "";
+    if (conn->options != NULL && !conn->options->keepalive) {
+        keepalive = "Close";
+    }
+
     req_data = (struct request_data *) conn->data;
 
     post_data_sz = am_asprintf(&post_data,
@@ -722,11 +898,11 @@ static int send_policychange_request(am_net_t *conn, char **token, const char *e
             "Host: %s:%d\r\n"
             "User-Agent: "MODINFO"\r\n"
             "Accept: text/xml\r\n"
-            "Connection: Close\r\n"
+            "Connection: %s\r\n"
             "Content-Type: text/xml; charset=UTF-8\r\n"
             "%s"
             "Content-Length: %d\r\n\r\n"
-            "%s", conn->uv.path, conn->uv.host, conn->uv.port,
+            "%s", conn->uv.path, conn->uv.host, conn->uv.port, keepalive,
             NOTNULL(conn->req_headers), post_data_sz, post_data);
     if (post == NULL) {
         free(post_data);
@@ -750,14 +926,10 @@ static int send_policychange_request(am_net_t *conn, char **token, const char *e
 #endif                
     }
 
-    status = am_net_write(conn, post, post_sz);
+    status = net_send_recv(conn, post, post_sz);
     free(post_data);
     free(post);
 
-    if (status == AM_SUCCESS) {
-        am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
-    }
-
     AM_LOG_DEBUG(conn->instance_id, "%s response status code: %d\n%s",
             thisfunc, conn->http_status, LOGEMPTY(req_data->data));
     if (conn->options != NULL && conn->options->log != NULL) {
@@ -772,23 +944,19 @@ static int send_policychange_request(am_net_t *conn, char **token, const char *e
     return status;
 }
 
-static int send_policy_request(am_net_t *conn, const char *token, const char *user_token,
+/**
+ * build a policy service (PLL) request for req_url
+ */
+static int policy_request_create(am_net_t *conn, const char *token, const char *user_token,
         const char *req_url, const char *scope, const char *cip, const char *pattr, const char *eval_app,
-        struct am_policy_result **policy_list) {
+        const char *keepalive, char **post, size_t *post_sz) {
     static const char *thisfunc = "send_policy_request():";
-    size_t post_sz, post_data_sz;
-    char *post = NULL, *post_data = NULL;
-    int status = AM_ERROR;
-    struct request_data *req_data;
+    size_t post_data_sz;
+    char *post_data = NULL;
     size_t req_url_sz;
     char *req_url_escaped;
     const char *service_name = ISVALID(eval_app) ? eval_app : "iPlanetAMWebAgentService";
 
-    if (conn == NULL || conn->data == NULL || !ISVALID(token) || !ISVALID(user_token) ||
-            !ISVALID(req_url) || !ISVALID(scope) || !ISVALID(cip)) return AM_EINVAL;
-
-    req_data = (struct request_data *) conn->data;
-
     /* do xml-escape */
     req_url_sz = strlen(req_url);
     req_url_escaped = malloc(req_url_sz * 6 + 1); /* worst case */
@@ -815,63 +983,73 @@ static int send_policy_request(am_net_t *conn, const char *token, const char *us
             "</Request>"
             "</RequestSet>",
             token, user_token, service_name, req_url_escaped, scope, cip, NOTNULL(pattr));
+    free(req_url_escaped);
 
     if (post_data == NULL) {
-        free(req_url_escaped);
         return AM_ENOMEM;
     }
 
-    post_sz = am_asprintf(&post, "POST %s/policyservice HTTP/1.1\r\n"
+    *post_sz = am_asprintf(post, "POST %s/policyservice HTTP/1.1\r\n"
             "Host: %s:%d\r\n"
             "User-Agent: "MODINFO"\r\n"
             "Accept: text/xml\r\n"
-            "Connection: Close\r\n"
+            "Connection: %s\r\n"
             "Content-Type: text/xml; charset=UTF-8\r\n"
             "%s"
             "Content-Length: %d\r\n\r\n"
-            "%s", conn->uv.path, conn->uv.host, conn->uv.port,
+            "%s", conn->uv.path, conn->uv.host, conn->uv.port, keepalive,
             NOTNULL(conn->req_headers), post_data_sz, post_data);
-    if (post == NULL) {
-        AM_FREE(post_data, req_url_escaped);
+    free(post_data);
+    if (*post == NULL) {
         return AM_ENOMEM;
     }
 
 #ifdef DEBUG
     AM_LOG_DEBUG(conn->instance_id, "%s sending %d bytes to %s/policyservice\n%s",
-            thisfunc, post_sz, conn->url, post);
+            thisfunc, *post_sz, conn->url, *post);
 #else
     AM_LOG_DEBUG(conn->instance_id, "%s sending %d bytes to %s/policyservice",
-            thisfunc, post_sz, conn->url);
+            thisfunc, *post_sz, conn->url);
 #endif
     if (conn->options != NULL && conn->options->log != NULL) {
 #ifdef DEBUG
         conn->options->log("%s sending %d bytes to %s/policyservice\n%s",
-                thisfunc, post_sz, conn->url, post);
+                thisfunc, *post_sz, conn->url, *post);
 #else
         conn->options->log("%s sending %d bytes to %s/policyservice",
-                thisfunc, post_sz, conn->url);
+                thisfunc, *post_sz, conn->url);
 #endif                
     }
+    return AM_SUCCESS;
+}
 
-    status = am_net_write(conn, post, post_sz);
-    AM_FREE(post_data, post, req_url_escaped);
+/**
+ * collect the result of a policy request from its (already parsed) response
+ */
+static int policy_response_status(am_net_t *conn, int status, unsigned int http_status, am_xml_stream_t *xml,
+        const char *token, const char *user_token, struct am_policy_result **policy_list) {
+    static const char *thisfunc = "send_policy_request():";
+    char *exception = NULL;
+    struct am_policy_result *list;
+    size_t response_sz;
 
-    if (status == AM_SUCCESS) {
-        am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
-    }
+    response_sz = am_xml_stream_size(xml);
+    list = (struct am_policy_result *) am_xml_stream_finish(xml, &exception);
 
-    AM_LOG_DEBUG(conn->instance_id, "%s response status code: %d\n%s",
-            thisfunc, conn->http_status, LOGEMPTY(req_data->data));
+    AM_LOG_DEBUG(conn->instance_id, "%s response status code: %d (%lu bytes)%s%s",
+            thisfunc, http_status, (unsigned long) response_sz, exception != NULL ? "\n" : "", NOTNULL(exception));
     if (conn->options != NULL && conn->options->log != NULL) {
-        conn->options->log("%s response status code: %d\n%s", thisfunc,
-                conn->http_status, LOGEMPTY(req_data->data));
+        conn->options->log("%s response status code: %d (%lu bytes)%s%s", thisfunc,
+                http_status, (unsigned long) response_sz, exception != NULL ? "\n" : "", NOTNULL(exception));
     }
 
-    if (status == AM_SUCCESS && conn->http_status == 200 && ISVALID(req_data->data)) {
-        status = parse_exception(req_data->data, token, user_token);
+    if (status == AM_SUCCESS && http_status == 200 && response_sz > 0) {
+        if (exception != NULL) {
+            status = parse_exception(exception, token, user_token);
+        }
         if (status == AM_SUCCESS && policy_list != NULL) {
-            *policy_list = am_parse_policy_xml(conn->instance_id, req_data->data, req_data->data_size,
-                    am_scope_to_num(scope));
+            *policy_list = list;
+            list = NULL;
             if (*policy_list == NULL) {
                 status = AM_XML_ERROR;
             }
@@ -879,33 +1057,215 @@ static int send_policy_request(am_net_t *conn, const char *token, const char *us
     } else {
         status = AM_EINVAL;
     }
+    delete_am_policy_result_list(&list);
+    am_free(exception);
 
     AM_LOG_DEBUG(conn->instance_id, "%s status: %s", thisfunc, am_strerror(status));
+    return status;
+}
+
+static int send_policy_request(am_net_t *conn, const char *token, const char *user_token,
+        const char *req_url, const char *scope, const char *cip, const char *pattr, const char *eval_app,
+        struct am_policy_result **policy_list) {
+    size_t post_sz;
+    char *post = NULL;
+    int status;
+    struct request_data *req_data;
+    am_xml_stream_t *xml;
+
+    if (conn == NULL || conn->data == NULL || !ISVALID(token) || !ISVALID(user_token) ||
+            !ISVALID(req_url) || !ISVALID(scope) || !ISVALID(cip)) return AM_EINVAL;
+
+    req_data = (struct request_data *) conn->data;
+
+    status = policy_request_create(conn, token, user_token, req_url, scope, cip, pattr, eval_app,
+            conn->options != NULL && !conn->options->keepalive ? "Close" : "Keep-Alive", &post, &post_sz);
+    if (status != AM_SUCCESS) {
+        return status;
+    }
+
+    /* policy response is parsed while it is being received */
+    req_data->xml = am_policy_xml_stream(conn->instance_id, am_scope_to_num(scope));
+    if (req_data->xml == NULL) {
+        free(post);
+        return AM_ENOMEM;
+    }
+
+    status = net_send_recv(conn, post, post_sz);
+    free(post);
+
+    xml = req_data->xml;
+    req_data->xml = NULL;
+    status = policy_response_status(conn, status, conn->http_status, xml, token, user_token, policy_list);
+
     am_free(req_data->data);
     req_data->data = NULL;
     req_data->data_size = 0;
     return status;
 }
 
-static int do_net_connect(am_net_t *conn, struct request_data *req_data,
-        unsigned long instance_id, const char *openam, am_net_options_t *options) {
-    static const char *thisfunc = "do_net_connect():";
-    int status;
-    char *proxy_url = NULL, *proxy_connect = NULL, *proxy_auth = NULL;
-    struct url am_url;
+/**
+ * send count requests at once and receive their responses; *received is set to the number of
+ * responses which arrived before the connection was closed (or the receive timed out)
+ */
+static int send_pipeline(am_net_t *conn, struct pll_request *req, int count, int *received) {
+    struct request_data *req_data = (struct request_data *) conn->data;
+    size_t post_sz = 0;
+    char *post;
+    int i, status;
+
+    *received = 0;
+    for (i = 0; i < count; i++) {
+        post_sz += req[i].post_sz;
+    }
+    post = malloc(post_sz + 1);
+    if (post == NULL) {
+        return AM_ENOMEM;
+    }
+    for (i = 0, post_sz = 0; i < count; i++) {
+        memcpy(post + post_sz, req[i].post, req[i].post_sz);
+        post_sz += req[i].post_sz;
+    }
+
+    req_data->pipeline = req;
+    req_data->pipeline_sz = count;
+    req_data->pipeline_next = 0;
+
+    status = net_send_recv(conn, post, post_sz);
+    free(post);
+
+    *received = req_data->pipeline_next;
+    req_data->pipeline = NULL;
+    req_data->pipeline_sz = req_data->pipeline_next = 0;
+    return status;
+}
+
+/**
+ * (re)create the response parser of a pipelined request, dropping whatever the previous
+ * one was fed, and clear its response status
+ */
+static int pll_request_reset(am_net_t *conn, struct pll_request *req) {
+    am_xml_stream_discard(req->xml);
+    req->xml = req->scope < 0 ? am_session_xml_stream(conn->instance_id) :
+            am_policy_xml_stream(conn->instance_id, req->scope);
+    req->http_status = 0;
+    return req->xml != NULL ? AM_SUCCESS : AM_ENOMEM;
+}
+
+/**
+ * send all count requests at once on the same connection, without waiting for the
+ * responses in between, and receive the responses (in the same order).
+ * Each response is parsed by its request's xml parser and its status code is set in http_status.
+ * 
+ * When the server closes the connection after answering only some of the requests, the
+ * rest are sent again on a new connection, each with a new parser (the response which was
+ * cut short might have been fed to it in part).
+ */
+static int send_pipelined_requests(am_net_t *conn, struct pll_request *req, int count) {
+    static const char *thisfunc = "send_pipelined_requests():";
+    int done = 0, received, status, i;
+
+    for (i = 0; i < count; i++) {
+        status = pll_request_reset(conn, req + i);
+        if (status != AM_SUCCESS) {
+            return status;
+        }
+    }
+
+    for (;;) {
+        status = send_pipeline(conn, req + done, count - done, &received);
+        done += received;
+        if (status != AM_SUCCESS || received == 0 || done == count) {
+            break;
+        }
+        AM_LOG_DEBUG(conn->instance_id, "%s connection to %s was closed after %d out of %d responses, "
+                "sending the rest on a new one", thisfunc, conn->url, done, count);
+        status = net_reconnect(conn);
+        for (i = done; i < count && status == AM_SUCCESS; i++) {
+            status = pll_request_reset(conn, req + i);
+        }
+        if (status != AM_SUCCESS) {
+            break;
+        }
+    }
+
+    if (status == AM_SUCCESS && done < count) {
+        AM_LOG_WARNING(conn->instance_id, "%s received %d out of %d responses from %s",
+                thisfunc, done, count, conn->url);
+    }
+    return status;
+}
+
+/**
+ * session and policy requests, pipelined on the same connection
+ */
+static int send_session_policy_request(am_net_t *conn, const char *token, const char *user_token,
+        const char *req_url, const char *scope, const char *cip, const char *pattr, const char *eval_app,
+        struct am_namevalue **session_list, struct am_policy_result **policy_list) {
+    struct pll_request req[2];
+    int status, session_status, policy_status;
+
+    if (conn == NULL || conn->data == NULL || !ISVALID(token) || !ISVALID(user_token) ||
+            !ISVALID(req_url) || !ISVALID(scope) || !ISVALID(cip)) return AM_EINVAL;
 
+    memset(req, 0, sizeof (req));
+
+    /* the session request must not close the connection, the policy request follows */
+    status = session_request_create(conn, token, user_token, "Keep-Alive", &req[0].post, &req[0].post_sz);
+    if (status == AM_SUCCESS) {
+        /* as with the sequential requests, the policy request carries the cookies (load balancer
+         * stickiness), only there are no session response cookies to add to them yet */
+        create_cookie_header(conn, NULL);
+        status = policy_request_create(conn, token, user_token, req_url, scope, cip, pattr, eval_app,
+                conn->options != NULL && !conn->options->keepalive ? "Close" : "Keep-Alive",
+                &req[1].post, &req[1].post_sz);
+    }
+    if (status == AM_SUCCESS) {
+        /* their parsers are created as they are sent */
+        req[0].scope = -1;
+        req[1].scope = am_scope_to_num(scope);
+        status = send_pipelined_requests(conn, req, 2);
+    }
+
+    /* both responses are collected (which also releases their parsers) */
+    session_status = session_response_status(conn, status, req[0].http_status, req[0].xml,
+            token, user_token, session_list);
+    policy_status = policy_response_status(conn, status, req[1].http_status, req[1].xml,
+            token, user_token, session_status == AM_SUCCESS ? policy_list : NULL);
+    if (status == AM_SUCCESS) {
+        status = session_status != AM_SUCCESS ? session_status : policy_status;
+    }
+
+    AM_FREE(req[0].post, req[1].post);
+    return status;
+}
+
+static void set_request_callbacks(am_net_t *conn, struct request_data *req_data,
+        unsigned long instance_id, const char *openam, am_net_options_t *options) {
     conn->options = options;
     conn->instance_id = instance_id;
     conn->url = openam;
 
     conn->data = req_data;
+    req_data->conn = conn;
     conn->on_connected = on_connected_cb;
+    conn->on_headers = on_agent_request_headers_cb;
     conn->on_close = on_close_cb;
     conn->on_data = on_agent_request_data_cb;
     conn->on_complete = on_complete_cb;
 
     conn->reset_complete = reset_complete_cb;
     conn->is_complete = is_complete;
+}
+
+static int do_net_connect(am_net_t *conn, struct request_data *req_data,
+        unsigned long instance_id, const char *openam, am_net_options_t *options) {
+    static const char *thisfunc = "do_net_connect():";
+    int status;
+    char *proxy_url = NULL, *proxy_connect = NULL, *proxy_auth = NULL;
+    struct url am_url;
+
+    set_request_callbacks(conn, req_data, instance_id, openam, options);
 
     if (ISINVALID(conn->options->proxy_host)) {
         status = am_net_sync_connect(conn);
@@ -960,7 +1320,7 @@ static int do_net_connect(am_net_t *conn, struct request_data *req_data,
         return status;
     }
 
-    am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
+    am_net_sync_recv(conn, net_recv_timeout(conn));
 
     if (conn->http_status == 200 && conn->proxy == AM_PROXY_CONNECTED) {
 
@@ -1007,6 +1367,57 @@ static int do_net_connect(am_net_t *conn, struct request_data *req_data,
     return status;
 }
 
+/**
+ * Get a connection to the openam url - an idle keep-alive connection from the pool
+ * when one is available, a new one otherwise. New connections are not attempted
+ * while the circuit breaker for the url is open (see am_net_breaker_allow).
+ */
+static am_net_t *net_connect(struct request_data *req_data, unsigned long instance_id,
+        const char *openam, am_net_options_t *options, int *status) {
+    am_net_t *conn = NULL;
+
+    if (options == NULL || options->keepalive) {
+        conn = am_net_pool_get(instance_id, openam);
+        if (conn != NULL) {
+            set_request_callbacks(conn, req_data, instance_id, openam, options);
+            *status = AM_SUCCESS;
+            return conn;
+        }
+    }
+
+    *status = am_net_breaker_allow(instance_id, openam);
+    if (*status != AM_SUCCESS) {
+        return NULL;
+    }
+
+    conn = calloc(1, sizeof (am_net_t));
+    if (conn == NULL) {
+        *status = AM_ENOMEM;
+        return NULL;
+    }
+
+    *status = do_net_connect(conn, req_data, instance_id, openam, options);
+    am_net_breaker_report(instance_id, openam, *status);
+    if (*status != AM_SUCCESS) {
+        free(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+/**
+ * Release connection and its request data. Connections which are still good
+ * for another request are returned to the pool (see am_net_pool_put).
+ */
+static void net_release(am_net_t *conn, struct request_data *req_data) {
+    if (conn != NULL) {
+        am_net_pool_put(conn);
+    }
+    if (req_data != NULL) {
+        AM_FREE(req_data->data, req_data);
+    }
+}
+
 int am_agent_login(unsigned long instance_id, const char *openam,
         const char *user, const char *pass, const char *realm, const char *eval_app, am_net_options_t *options,
         char **agent_token, char **pxml, size_t *pxsz, struct am_namevalue **session_list) {
@@ -1026,35 +1437,22 @@ int am_agent_login(unsigned long instance_id, const char *openam,
 
     while (state != login_done) {
 
-        conn = calloc(1, sizeof (am_net_t));
-        if (conn == NULL) {
-            AM_LOG_ERROR(instance_id, "%s memory allocation error while connecting to %s", thisfunc, openam);
-            if (options != NULL && options->log != NULL) {
-                options->log("%s memory allocation error while connecting to %s", thisfunc, openam);
-            }
-            break;
-        }
-
         req_data = calloc(1, sizeof (struct request_data));
         if (req_data == NULL) {
             AM_LOG_ERROR(instance_id, "%s memory allocation error while connecting to %s", thisfunc, openam);
             if (options != NULL && options->log != NULL) {
                 options->log("%s memory allocation error while connecting to %s", thisfunc, openam);
             }
-            free(conn);
-            conn = NULL;
             break;
         }
 
-        status = do_net_connect(conn, req_data, instance_id, openam, options);
-        if (status != AM_SUCCESS) {
+        conn = net_connect(req_data, instance_id, openam, options, &status);
+        if (conn == NULL) {
             AM_LOG_ERROR(instance_id, "%s error %d (%s) connecting to %s", thisfunc, status, am_strerror(status), openam);
             if (options != NULL && options->log != NULL) {
                 options->log("%s error %d (%s) connecting to %s", thisfunc, status, am_strerror(status), openam);
             }
-            free(conn);
             free(req_data);
-            conn = NULL;
             req_data = NULL;
             break;
         }
@@ -1156,11 +1554,7 @@ int am_agent_login(unsigned long instance_id, const char *openam,
         }
     }
 
-    am_net_close(conn);
-    if (req_data != NULL) {
-        AM_FREE(req_data->data, req_data);
-    }
-    am_free(conn);
+    net_release(conn, req_data);
     return status;
 }
 
@@ -1171,46 +1565,33 @@ int am_agent_logout(unsigned long instance_id, const char *openam, const char *t
     size_t post_sz, post_data_sz;
     char *post = NULL, *post_data = NULL;
     struct request_data *req_data = NULL;
+    char *keepalive = options == NULL || options->keepalive ? "Keep-Alive" : "Close";
 
     if (!ISVALID(token) || !ISVALID(openam)) return AM_EINVAL;
 
-    conn = calloc(1, sizeof (am_net_t));
-    if (conn == NULL) {
-        AM_LOG_ERROR(instance_id, "%s memory allocation error while connecting to %s", thisfunc, openam);
-        if (options != NULL && options->log != NULL) {
-            options->log("%s memory allocation error while connecting to %s", thisfunc, openam);
-        }
-        return AM_ENOMEM;
-    }
-
     req_data = calloc(1, sizeof (struct request_data));
     if (req_data == NULL) {
         AM_LOG_ERROR(instance_id, "%s memory allocation error while connecting to %s", thisfunc, openam);
         if (options != NULL && options->log != NULL) {
             options->log("%s memory allocation error while connecting to %s", thisfunc, openam);
         }
-        free(conn);
-        conn = NULL;
         return AM_ENOMEM;
     }
 
-    if (options != NULL && ISVALID(options->server_id)) {
-        am_asprintf(&conn->req_headers, "Cookie: amlbcookie=%s\r\n", options->server_id);
-    }
-
-    status = do_net_connect(conn, req_data, instance_id, openam, options);
-    if (status != AM_SUCCESS) {
+    conn = net_connect(req_data, instance_id, openam, options, &status);
+    if (conn == NULL) {
         AM_LOG_ERROR(instance_id, "%s error %d (%s) connecting to %s", thisfunc, status, am_strerror(status), openam);
         if (options != NULL && options->log != NULL) {
             options->log("%s error %d (%s) connecting to %s", thisfunc, status, am_strerror(status), openam);
         }
-        free(conn);
         free(req_data);
-        conn = NULL;
-        req_data = NULL;
         return status;
     }
 
+    if (options != NULL && ISVALID(options->server_id)) {
+        am_asprintf(&conn->req_headers, "Cookie: amlbcookie=%s\r\n", options->server_id);
+    }
+
     post_data_sz = am_asprintf(&post_data,
             "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
             "<RequestSet vers=\"1.0\" svcid=\"auth\" reqid=\"0\">"
@@ -1225,27 +1606,24 @@ int am_agent_logout(unsigned long instance_id, const char *openam, const char *t
                 "Host: %s:%d\r\n"
                 "User-Agent: "MODINFO"\r\n"
                 "Accept: text/xml\r\n"
-                "Connection: Close\r\n"
+                "Connection: %s\r\n"
                 "Content-Type: text/xml; charset=UTF-8\r\n"
                 "%s"
                 "Content-Length: %d\r\n\r\n"
-                "%s", conn->uv.path, conn->uv.host, conn->uv.port,
+                "%s", conn->uv.path, conn->uv.host, conn->uv.port, keepalive,
                 NOTNULL(conn->req_headers), post_data_sz, post_data);
         if (post != NULL) {
             AM_LOG_DEBUG(instance_id, "%s sending request:\n%s", thisfunc, post);
             if (options != NULL && options->log != NULL) {
                 options->log("%s sending request:\n%s", thisfunc, post);
             }
-            status = am_net_write(conn, post, post_sz);
+            status = net_send_recv(conn, post, post_sz);
             free(post);
         }
         free(post_data);
     }
 
-
-    if (status == AM_SUCCESS) {
-        am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
-    } else {
+    if (status != AM_SUCCESS) {
         AM_LOG_DEBUG(instance_id, "%s closing connection after failure", thisfunc);
         if (options != NULL && options->log != NULL) {
             options->log("%s closing connection after failure", thisfunc);
@@ -1257,11 +1635,7 @@ int am_agent_logout(unsigned long instance_id, const char *openam, const char *t
         options->log("%s response status code: %d", thisfunc, conn->http_status);
     }
 
-    am_net_close(conn);
-    if (req_data != NULL) {
-        AM_FREE(req_data->data, req_data);
-    }
-    am_free(conn);
+    net_release(conn, req_data);
     return status;
 }
 
@@ -1277,8 +1651,8 @@ int am_agent_policy_request(unsigned long instance_id, const char *openam,
     char *token_ptr = (char *) token;
 
     enum {
-        policy_session = 0, policy_request, policy_done
-    } state = policy_session;
+        policy_session = 0, policy_request, policy_pipelined, policy_done
+    } state = options != NULL && options->pll_pipeline ? policy_pipelined : policy_session;
 
     if (!ISVALID(token) || !ISVALID(user_token) || !ISVALID(scope) ||
             !ISVALID(req_url) || !ISVALID(openam) || !ISVALID(cip)) {
@@ -1287,32 +1661,28 @@ int am_agent_policy_request(unsigned long instance_id, const char *openam,
 
     while (state != policy_done) {
 
-        conn = calloc(1, sizeof (am_net_t));
-        if (conn == NULL) {
-            AM_LOG_ERROR(instance_id, "%s memory allocation error while connecting to %s", thisfunc, openam);
-            break;
-        }
-
         req_data = calloc(1, sizeof (struct request_data));
         if (req_data == NULL) {
             AM_LOG_ERROR(instance_id, "%s memory allocation error while connecting to %s", thisfunc, openam);
-            free(conn);
-            conn = NULL;
             break;
         }
 
-        status = do_net_connect(conn, req_data, instance_id, openam, options);
-        if (status != AM_SUCCESS) {
+        conn = net_connect(req_data, instance_id, openam, options, &status);
+        if (conn == NULL) {
             AM_LOG_ERROR(instance_id, "%s error %d (%s) connecting to %s", thisfunc,
                     status, am_strerror(status), openam);
-            free(conn);
             free(req_data);
-            conn = NULL;
             req_data = NULL;
             break;
         }
 
         switch (state) {
+            case policy_pipelined:
+                /* send session and policy requests (PLL endpoint) without waiting for the session response */
+                status = send_session_policy_request(conn, token, user_token, req_url, scope, cip,
+                        pattr, eval_app, session_list, policy_list);
+                state = policy_done;
+                break;
             case policy_session:
                 /* send session request (PLL endpoint)  */
                 status = send_session_request(conn, &token_ptr, user_token, session_list);
@@ -1344,6 +1714,11 @@ int am_agent_policy_request(unsigned long instance_id, const char *openam,
         }
     }
 
+    if (status != AM_SUCCESS && conn != NULL && conn->error == AM_ETIMEDOUT) {
+        /* a service which accepts connections but does not respond counts towards the circuit breaker too */
+        am_net_breaker_report(instance_id, openam, AM_ETIMEDOUT);
+    }
+
     if (status != AM_SUCCESS) {
         AM_LOG_DEBUG(instance_id, "%s closing connection after failure", thisfunc);
         if (options != NULL && options->log != NULL) {
@@ -1351,11 +1726,36 @@ int am_agent_policy_request(unsigned long instance_id, const char *openam,
         }
     }
 
-    am_net_close(conn);
-    if (req_data != NULL) {
-        AM_FREE(req_data->data, req_data);
+    net_release(conn, req_data);
+    return status;
+}
+
+/**
+ * Send a request on a connected conn and receive the response with the callbacks (and request data)
+ * the agent requests above use. *body_sz is set to the size of the response body and *copied to the
+ * body bytes copied while receiving it. Used by the receive benchmark.
+ */
+int am_net_request_recv(am_net_t *conn, const char *request, size_t request_sz, int timeout,
+        size_t *body_sz, size_t *copied) {
+    struct request_data req_data;
+    int status;
+
+    memset(&req_data, 0, sizeof (req_data));
+    set_request_callbacks(conn, &req_data, conn->instance_id, conn->url, conn->options);
+
+    status = am_net_write(conn, request, request_sz);
+    if (status == AM_SUCCESS) {
+        am_net_sync_recv(conn, timeout);
+        status = conn->error != 0 ? conn->error : req_data.error;
+        if (status == AM_SUCCESS && !req_data.message_complete) {
+            status = AM_ETIMEDOUT;
+        }
     }
-    am_free(conn);
+
+    *body_sz = req_data.data != NULL ? req_data.data_size : 0;
+    *copied = *body_sz + req_data.data_moved;
+    am_free(req_data.data);
+    conn->data = NULL;
     return status;
 }
 
@@ -1430,7 +1830,7 @@ int am_url_validate(unsigned long instance_id, const char* url, am_net_options_t
     }
 
     if (status == AM_SUCCESS) {
-        am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
+        am_net_sync_recv(conn, net_recv_timeout(conn));
     } else {
         AM_LOG_DEBUG(instance_id, "%s closing connection after failure", thisfunc);
         if (options != NULL && options->log != NULL) {
@@ -1461,46 +1861,33 @@ int am_agent_audit_request(unsigned long instance_id, const char *openam, const
     size_t post_sz, post_data_sz;
     char *post = NULL, *post_data = NULL;
     struct request_data *req_data = NULL;
+    char *keepalive = options == NULL || options->keepalive ? "Keep-Alive" : "Close";
 
     if (!ISVALID(logdata) || !ISVALID(openam)) return AM_EINVAL;
 
-    conn = calloc(1, sizeof (am_net_t));
-    if (conn == NULL) {
-        AM_LOG_ERROR(instance_id, "%s memory allocation error while connecting to %s", thisfunc, openam);
-        if (options != NULL && options->log != NULL) {
-            options->log("%s memory allocation error while connecting to %s", thisfunc, openam);
-        }
-        return AM_ENOMEM;
-    }
-
     req_data = calloc(1, sizeof (struct request_data));
     if (req_data == NULL) {
         AM_LOG_ERROR(instance_id, "%s memory allocation error while connecting to %s", thisfunc, openam);
         if (options != NULL && options->log != NULL) {
             options->log("%s memory allocation error while connecting to %s", thisfunc, openam);
         }
-        free(conn);
-        conn = NULL;
         return AM_ENOMEM;
     }
 
-    if (options != NULL && ISVALID(options->server_id)) {
-        am_asprintf(&conn->req_headers, "Cookie: amlbcookie=%s\r\n", options->server_id);
-    }
-
-    status = do_net_connect(conn, req_data, instance_id, openam, options);
-    if (status != AM_SUCCESS) {
+    conn = net_connect(req_data, instance_id, openam, options, &status);
+    if (conn == NULL) {
         AM_LOG_ERROR(instance_id, "%s error %d (%s) connecting to %s", thisfunc, status, am_strerror(status), openam);
         if (options != NULL && options->log != NULL) {
             options->log("%s error %d (%s) connecting to %s", thisfunc, status, am_strerror(status), openam);
         }
-        free(conn);
         free(req_data);
-        conn = NULL;
-        req_data = NULL;
         return status;
     }
 
+    if (options != NULL && ISVALID(options->server_id)) {
+        am_asprintf(&conn->req_headers, "Cookie: amlbcookie=%s\r\n", options->server_id);
+    }
+
     post_data_sz = am_asprintf(&post_data,
             "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
             "<RequestSet vers=\"1.0\" svcid=\"Logging\" reqid=\"0\">%s</RequestSet>",
@@ -1510,32 +1897,26 @@ int am_agent_audit_request(unsigned long instance_id, const char *openam, const
                 "Host: %s:%d\r\n"
                 "User-Agent: "MODINFO"\r\n"
                 "Accept: text/xml\r\n"
-                "Connection: Close\r\n"
+                "Connection: %s\r\n"
                 "Content-Type: text/xml; charset=UTF-8\r\n"
                 "%s"
                 "Content-Length: %d\r\n\r\n"
-                "%s", conn->uv.path, conn->uv.host, conn->uv.port,
+                "%s", conn->uv.path, conn->uv.host, conn->uv.port, keepalive,
                 NOTNULL(conn->req_headers), post_data_sz, post_data);
         if (post != NULL) {
             AM_LOG_DEBUG(instance_id, "%s sending request:\n%s", thisfunc, post);
-            status = am_net_write(conn, post, post_sz);
+            status = net_send_recv(conn, post, post_sz);
             free(post);
         }
         free(post_data);
     }
 
-    if (status == AM_SUCCESS) {
-        am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
-    } else {
+    if (status != AM_SUCCESS) {
         AM_LOG_DEBUG(instance_id, "%s closing connection after failure", thisfunc);
     }
 
     AM_LOG_DEBUG(instance_id, "%s response status code: %d", thisfunc, conn->http_status);
 
-    am_net_close(conn);
-    if (req_data != NULL) {
-        AM_FREE(req_data->data, req_data);
-    }
-    am_free(conn);
+    net_release(conn, req_data);
     return status;
 }
@@ -124,6 +124,10 @@ typedef long                gid_t;
 #ifndef AIX
 #include <sys/sendfile.h>
 #endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 #endif /* __APPLE */
 
 #define sockpoll            poll
@@ -17,8 +17,12 @@
 #include "platform.h"
 #include "am.h"
 #include "utility.h"
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
-#define URL_MATCH_FRAME_MAX 32
+#define URL_PATTERN_MAX 1024 /* characters in a wildcard pattern */
+#define POLICY_INDEX_MIN 8 /* fewer policy results than this are compared one by one */
 
 static const char *policy_fetch_scope_str[] = {
     "self",
@@ -49,110 +53,11 @@ static char compare_resource(am_request_t *r, const char *pattern, const char *r
     return status;
 }
 
-typedef struct {
-    const char *p, *u;
-    enum { multilevel, onelevel, none } skip;
-
-} url_match_frame_t;
-
 am_bool_t compare_chars(am_request_t * r, char a, char b) {
     return r->conf->url_eval_case_ignore ? tolower(a) == tolower(b) : a == b;
 
 }
 
-/*
- * algorithm for matcing URLs with patterns that have * and -*- as wildcards
- *
- * this has full backtracking.
- */
-static am_bool_t url_pattern_match_with_backtrack(am_request_t *r, url_match_frame_t * stack, int stacksize,
-                      const char * pattern, const char * url) {
-    const char           *p = pattern, *u = url;
-    url_match_frame_t    *top = stack, *const end = stack + stacksize;
-
-#define handle_overflow              AM_LOG_ERROR(r->instance_id, "unable to match with pattern %s", pattern)
-#define push_state_with_check(s)     if (++top == end) { handle_overflow; return AM_FALSE; } top->p = p; top->u = u; top->skip = s
-
-    /* only frame 0 has skip set to none */
-
-    top->skip = none; 
-
-    while (*u) {
-        if (*p == '*') {
-            p += 1; push_state_with_check(multilevel);
-
-        } else if (*p == '-' && p[1] == '*' && p[2] == '-') {
-            p += 3; push_state_with_check(onelevel);
-
-        }
-
-        if (compare_chars(r, *p, *u)) {
-            p++; u++;
-
-        } else {
-            do {
-                if (top->skip == multilevel) {
-                    if (*top->u != '?')
-                        break;
-
-                } else if (top->skip == onelevel) {
-                    if (*top->u != '?' && *top->u != '/')
-                        break;
-
-                } else {
-                    return AM_FALSE; /* frame 0 */
-
-                }
-                top--;
-
-            } while (1);
-
-            p = top->p; u = ++top->u;
-
-        }
-
-    }
-
-    while (*p)
-        if (*p == '*') {
-            p += 1; 
-
-        } else if (*p == '-' && p[1] == '*' && p[2] == '-') {
-            p += 3;
-
-        } else {
-           return AM_FALSE;
-
-        }
-
-    return AM_TRUE;
-
-}
-
-/*
- * decide whether a URL matches a pattern using a backtracking algorithm and a stack
- * allocated here.
- *
- * this uses a heap allocated stack large enough to allow 64 frames, which will suffice for
- * patterns with 32 wildcards (* or -*-).
- */
-am_bool_t compare_pattern_resource(am_request_t *r, const char * pattern, const char * url) {
-    url_match_frame_t *stack = malloc(sizeof(url_match_frame_t) * URL_MATCH_FRAME_MAX);
-    am_bool_t out;
-
-    if (stack) {
-        out = url_pattern_match_with_backtrack(r, stack, URL_MATCH_FRAME_MAX, pattern, url);
-        free(stack);
-
-    } else {
-        AM_LOG_ERROR(r->instance_id, "unable to allocate URL pattern matching stack");
-        out = AM_FALSE;
-
-    }
-    return out;
-
-}
-
 #define end_of_protocol(offsets) (offsets [0])
 #define start_of_host(offsets) (end_of_protocol(offsets) + 3)
 
@@ -245,31 +150,328 @@ char *am_normalize_pattern(const char *url) {
 }
 
 /*
- * Match sections within the pattern and resource.
+ * Wildcard patterns are compiled into a string of opcodes: literal characters (folded to lower case
+ * when the comparison is case insensitive), URL_OP_ANY for '*' (any characters but '?') and URL_OP_ONE
+ * for '-*-' (any characters but '?' and '/'); a run of wildcards becomes a single one. The offsets of
+ * the url parts (see policy_get_url_offsets) are kept as opcode offsets, so that neither the pattern
+ * nor its sections have to be parsed or copied again to match a resource.
+ *
+ * A section of the resource is matched by following all of the pattern positions it could have got
+ * to at once (a set of bits on the stack), which takes a single pass over the resource whatever the
+ * wildcards are. While there is only one position and it is not in a wildcard, the literal run is
+ * compared character by character.
  */
-static char compare_pattern_sections(am_request_t *r,
-                                     const char *pattern_base, size_t pattern_lo, size_t pattern_hi,
-                                     const char *resource_base, size_t resource_lo, size_t resource_hi) {
-    char * pattern_section = strndup(pattern_base + pattern_lo, pattern_hi - pattern_lo);
-    char * resource_section = strndup(resource_base + resource_lo, resource_hi - resource_lo);
-    
-    char c;
-    if (pattern_section && resource_section)
-        c = compare_pattern_resource(r, pattern_section, resource_section);
-    else
-        c = AM_NO_MATCH;
-    
-    AM_FREE(pattern_section, resource_section);
-    return c;
+
+#define URL_OP_ANY '*' /* never a literal in a compiled pattern: each '*' is a wildcard */
+#define URL_OP_ONE '\0'
+#define URL_OP(c) ((c) == URL_OP_ANY || (c) == URL_OP_ONE)
+
+#define URL_STATE_WORDS (URL_PATTERN_MAX / 32 + 1)
+#define URL_STATE_SET(s, k) ((s)[(k) >> 5] |= (uint32_t) 1 << ((k) & 31))
+#define URL_STATE_TEST(s, k) (((s)[(k) >> 5] >> ((k) & 31)) & 1)
+
+enum {
+    URL_PROTOCOL_END = 0,
+    URL_HOST_START,
+    URL_PORT_MARKER,
+    URL_PORT_START,
+    URL_PATH_START,
+    URL_SECTIONS
+};
+
+struct am_url_pattern {
+    am_bool_t case_ignore;
+    am_bool_t structured; /* pattern has got regular URL structure */
+    am_bool_t port;
+    int section[URL_SECTIONS];
+    int size;
+    unsigned char *code;
+};
+
+static unsigned char url_fold(am_bool_t case_ignore, char c) {
+    unsigned char u = (unsigned char) c;
+    return case_ignore && u >= 'A' && u <= 'Z' ? u + ('a' - 'A') : u;
+}
+
+/* can the wildcard match the character? */
+static am_bool_t url_op_accepts(unsigned char op, unsigned char c) {
+    return c != '?' && (c != '/' || op == URL_OP_ANY);
+}
+
+static int lowest_bit(uint32_t x) {
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return (int) i;
+#elif defined(__GNUC__)
+    return __builtin_ctz(x);
+#else
+    int i = 0;
+    while ((x & 1) == 0) {
+        x >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+/**
+ * Compile a pattern (no longer than URL_PATTERN_MAX) into the code buffer, which must be as large as the pattern.
+ */
+static am_bool_t url_pattern_compile(struct am_url_pattern *p, unsigned char *code, const char *pattern,
+        am_bool_t case_ignore) {
+    int offsets[3] = {0, 0, 0};
+    size_t at[URL_SECTIONS], i = 0, len = strlen(pattern);
+    int k, n = 0;
+
+    if (len > URL_PATTERN_MAX) {
+        return AM_FALSE;
+    }
+    memset(p, 0, sizeof (struct am_url_pattern));
+    p->case_ignore = case_ignore;
+    p->code = code;
+    p->structured = policy_get_url_offsets(pattern, offsets);
+    p->port = p->structured && port_marker(offsets) != 0;
+
+    /* in ascending order; without a port its offsets are those of the path */
+    at[URL_PROTOCOL_END] = end_of_protocol(offsets);
+    at[URL_HOST_START] = start_of_host(offsets);
+    at[URL_PORT_MARKER] = p->port ? port_marker(offsets) : start_of_path(offsets);
+    at[URL_PORT_START] = p->port ? start_of_port(offsets) : start_of_path(offsets);
+    at[URL_PATH_START] = start_of_path(offsets);
+
+    for (k = p->structured ? 0 : URL_SECTIONS;;) {
+        unsigned char op;
+
+        /* url parts start at a literal character (or at the end), never inside a run of wildcards */
+        while (k < URL_SECTIONS && i == at[k]) {
+            p->section[k++] = n;
+        }
+        if (i == len) {
+            break;
+        }
+
+        if (pattern[i] == '*') {
+            op = URL_OP_ANY;
+            i += 1;
+        } else if (pattern[i] == '-' && pattern[i + 1] == '*' && pattern[i + 2] == '-') {
+            op = URL_OP_ONE;
+            i += 3;
+        } else {
+            code[n++] = url_fold(case_ignore, pattern[i++]);
+            continue;
+        }
+        if (n > 0 && URL_OP(code[n - 1])) {
+            if (op == URL_OP_ANY) {
+                code[n - 1] = URL_OP_ANY;
+            }
+        } else {
+            code[n++] = op;
+        }
+    }
+    p->size = n;
+    return AM_TRUE;
+}
+
+/* a position, and the one after it if it is at a wildcard (which can match nothing) */
+static void url_state_add(const unsigned char *code, int hi, uint32_t *state, int k) {
+    URL_STATE_SET(state, k);
+    if (k < hi && URL_OP(code[k])) {
+        URL_STATE_SET(state, k + 1);
+    }
+}
+
+/**
+ * Does the compiled pattern between opcode offsets lo and hi match the resource section?
+ */
+static am_bool_t url_pattern_section(const struct am_url_pattern *p, int lo, int hi, const char *u, size_t u_sz) {
+    uint32_t set[2][URL_STATE_WORDS]; /* bit k: at opcode lo + k */
+    uint32_t *d = set[0], *n = set[1], *t;
+    const unsigned char *code = p->code + lo;
+    int w, words = (hi - lo) / 32 + 1, j = 0, single, prune = -1;
+    size_t i = 0;
+
+    hi -= lo;
+
+    for (;;) {
+        /* a single position: outside a wildcard follow the literal run */
+        if (j == 0 || !URL_OP(code[j - 1])) {
+            while (i < u_sz && j < hi && !URL_OP(code[j]) && code[j] == url_fold(p->case_ignore, u[i])) {
+                i++;
+                j++;
+            }
+            if (j < hi && URL_OP(code[j])) {
+                j++; /* at the wildcard, which has not matched anything yet */
+            }
+        }
+        /* inside a wildcard nothing else can happen until the next literal shows up */
+        if (j > 0 && URL_OP(code[j - 1])) {
+            unsigned char op = code[j - 1];
+            while (i < u_sz && (j == hi || code[j] != url_fold(p->case_ignore, u[i]))) {
+                if (!url_op_accepts(op, (unsigned char) u[i++])) {
+                    return AM_FALSE;
+                }
+            }
+        }
+        if (i == u_sz) {
+            return j == hi ? AM_TRUE : AM_FALSE;
+        }
+
+        for (w = 0; w < words; w++) {
+            d[w] = 0;
+        }
+        URL_STATE_SET(d, j);
+        if (prune < 0) {
+            /* without a literal '?' any position is as good as being in a later '*' */
+            prune = memchr(code, '?', hi) == NULL;
+        }
+
+        for (single = -1; i < u_sz && single < 0; i++) {
+            unsigned char c = (unsigned char) u[i], f = url_fold(p->case_ignore, u[i]);
+            int count = 0, any = 0;
+
+            for (w = 0; w < words; w++) {
+                n[w] = 0;
+            }
+            for (w = 0; w < words; w++) {
+                uint32_t x = d[w];
+                while (x != 0) {
+                    int k = (w << 5) + lowest_bit(x);
+                    x &= x - 1;
+                    if (k < hi && code[k] == f && !URL_OP(code[k])) {
+                        url_state_add(code, hi, n, k + 1);
+                        if (k + 1 < hi && code[k + 1] == URL_OP_ANY) {
+                            any = k + 2;
+                        }
+                    }
+                    if (k > 0 && URL_OP(code[k - 1]) && url_op_accepts(code[k - 1], c)) {
+                        URL_STATE_SET(n, k);
+                        if (code[k - 1] == URL_OP_ANY && k > any) {
+                            any = k;
+                        }
+                    }
+                }
+            }
+            if (prune && any > 0) {
+                for (w = 0; w < (any >> 5); w++) {
+                    n[w] = 0;
+                }
+                n[any >> 5] &= ~(((uint32_t) 1 << (any & 31)) - 1);
+            }
+            for (w = 0; w < words && count < 2; w++) {
+                if (n[w] != 0) {
+                    count += (n[w] & (n[w] - 1)) == 0 ? 1 : 2;
+                    j = (w << 5) + lowest_bit(n[w]);
+                }
+            }
+            if (count == 0) {
+                return AM_FALSE;
+            }
+            t = d;
+            d = n;
+            n = t;
+            if (count == 1) {
+                single = j;
+            }
+        }
+        if (single < 0) {
+            return URL_STATE_TEST(d, hi) ? AM_TRUE : AM_FALSE;
+        }
+    }
+}
+
+static char url_pattern_match(const struct am_url_pattern *p, const char *resource) {
+    int ri[3] = {0, 0, 0};
+    size_t len;
+
+    /* resource must have regular URL structure */
+    if (!policy_get_url_offsets(resource, ri)) {
+        return AM_NO_MATCH;
+    }
+    len = strlen(resource);
+
+    if (!p->structured) {
+        /* pattern has not got regular URL structure, so match the resource as a whole */
+        return url_pattern_section(p, 0, p->size, resource, len) ? AM_EXACT_PATTERN_MATCH : AM_NO_MATCH;
+    }
+
+    /* compare protocol */
+    if (!url_pattern_section(p, 0, p->section[URL_PROTOCOL_END], resource, end_of_protocol(ri))) {
+        return AM_NO_MATCH;
+    }
+
+    if (p->port && port_marker(ri)) {
+        /* compare hosts - up to ports */
+        if (!url_pattern_section(p, p->section[URL_HOST_START], p->section[URL_PORT_MARKER],
+                resource + start_of_host(ri), port_marker(ri) - start_of_host(ri))) {
+            return AM_NO_MATCH;
+        }
+        /* compare ports */
+        if (!url_pattern_section(p, p->section[URL_PORT_START], p->section[URL_PATH_START],
+                resource + start_of_port(ri), start_of_path(ri) - start_of_port(ri))) {
+            return AM_NO_MATCH;
+        }
+    } else {
+        /* compare hosts - up to paths */
+        if (!url_pattern_section(p, p->section[URL_HOST_START], p->section[URL_PATH_START],
+                resource + start_of_host(ri), start_of_path(ri) - start_of_host(ri))) {
+            return AM_NO_MATCH;
+        }
+    }
+
+    /* compare paths and query */
+    if (!url_pattern_section(p, p->section[URL_PATH_START], p->size,
+            resource + start_of_path(ri), len - start_of_path(ri))) {
+        return AM_NO_MATCH;
+    }
+    return AM_EXACT_PATTERN_MATCH;
+}
+
+/**
+ * Compile a (valid) wildcard pattern, to be matched against any number of resources
+ * with am_url_pattern_match; free it with free().
+ *
+ * @return compiled pattern or NULL if the pattern is too long or there is no memory for it
+ */
+am_url_pattern_t *am_url_pattern_create(const char *pattern, am_bool_t case_ignore) {
+    size_t len = strlen(pattern);
+    am_url_pattern_t *p = malloc(sizeof (am_url_pattern_t) + len + 1);
+    if (p != NULL && !url_pattern_compile(p, (unsigned char *) (p + 1), pattern, case_ignore)) {
+        free(p);
+        p = NULL;
+    }
+    return p;
+}
+
+char am_url_pattern_match(const am_url_pattern_t *p, const char *resource) {
+    if (p == NULL || resource == NULL) {
+        return AM_NO_MATCH;
+    }
+    return url_pattern_match(p, resource);
+}
+
+/*
+ * decide whether a url (as a whole) matches a pattern with * and -*- wildcards
+ */
+am_bool_t compare_pattern_resource(am_request_t *r, const char *pattern, const char *url) {
+    struct am_url_pattern p;
+    unsigned char code[URL_PATTERN_MAX];
+
+    if (!url_pattern_compile(&p, code, pattern, r->conf->url_eval_case_ignore)) {
+        AM_LOG_ERROR(r->instance_id, "unable to match with pattern %s", pattern);
+        return AM_FALSE;
+    }
+    return url_pattern_section(&p, 0, p.size, url, strlen(url));
 }
 
 char policy_compare_url(am_request_t *r, const char *pattern, const char *resource) {
     static const char *thisfunc = "policy_compare_url():";
     char has_wildcard = AM_FALSE;
-    int pi[3] = {0, 0, 0};
-    int ri[3] = {0, 0, 0};
     char match;
     unsigned long instance_id = r != NULL ? r->instance_id : 0;
+    am_bool_t case_ignore = r != NULL && r->conf != NULL ? r->conf->url_eval_case_ignore : AM_TRUE;
+    struct am_url_pattern p;
+    unsigned char code[URL_PATTERN_MAX];
 
     if (pattern == NULL || resource == NULL)
         return AM_NO_MATCH;
@@ -296,38 +498,147 @@ char policy_compare_url(am_request_t *r, const char *pattern, const char *resour
         return match ? AM_EXACT_MATCH : AM_NO_MATCH;
     }
 
-    /* resource must have regular URL structure */
-    if (! policy_get_url_offsets(resource, ri))
+    if (!url_pattern_compile(&p, code, pattern, case_ignore)) {
+        AM_LOG_ERROR(instance_id, "%s unable to match with pattern %s (longer than %d characters)",
+                thisfunc, pattern, URL_PATTERN_MAX);
         return AM_NO_MATCH;
-    
-    if (! policy_get_url_offsets(pattern, pi)) {
-        /* pattern has not got regular URL structure, so match the resource as a whole */
-        return compare_pattern_resource(r, pattern, resource) ? AM_EXACT_PATTERN_MATCH : AM_NO_MATCH;
     }
-    
-    /* compare protocol */
-    if (! compare_pattern_sections(r, pattern, 0, end_of_protocol(pi), resource, 0, end_of_protocol(ri)))
-        return AM_NO_MATCH;
-    
-    if (port_marker(pi) && port_marker(ri)) {
-        /* compare hosts - up to ports */
-        if (! compare_pattern_sections(r, pattern, start_of_host(pi), port_marker(pi), resource, start_of_host(ri), port_marker(ri)))
-            return AM_NO_MATCH;
+    return url_pattern_match(&p, resource);
+}
 
-        /* compare ports */
-        if (! compare_pattern_sections(r, pattern, start_of_port(pi), start_of_path(pi), resource, start_of_port(ri), start_of_path(ri)))
-            return AM_NO_MATCH;
+struct policy_slot {
+    uint32_t hash;
+    int id;
+};
+
+/*
+ * self mode: a resource applies only when it is the url itself (asterisk is not a wildcard here),
+ * resources are put in a hash table keyed by the whole string
+ */
+static int policy_select_self(const char *url, int scope, int count, const int *scopes,
+        const char **resources, char *status) {
+    struct policy_slot *slot;
+    unsigned int mask = 15, i;
+    uint32_t hash;
+    int j, found = 0;
+
+    while (mask + 1 < (unsigned int) count * 2) {
+        mask = mask * 2 + 1;
+    }
+    slot = malloc((mask + 1) * sizeof (struct policy_slot));
+    if (slot == NULL) {
+        return -1;
+    }
+    for (i = 0; i <= mask; i++) {
+        slot[i].id = -1;
+    }
+    for (j = 0; j < count; j++) {
+        if (scopes[j] != scope || resources[j] == NULL) {
+            continue;
+        }
+        hash = am_hash(resources[j]);
+        for (i = hash & mask; slot[i].id >= 0; i = (i + 1) & mask)
+            ;
+        slot[i].hash = hash;
+        slot[i].id = j;
+    }
+
+    hash = am_hash(url);
+    for (i = hash & mask; slot[i].id >= 0; i = (i + 1) & mask) {
+        if (slot[i].hash == hash && strcmp(resources[slot[i].id], url) == 0) {
+            status[slot[i].id] = AM_EXACT_MATCH;
+            found++;
+        }
+    }
+    free(slot);
+    return found;
+}
+
+/*
+ * subtree mode: resources are patterns, put in a trie (partitioned by scope) keyed by their literal
+ * prefix - scheme, host, port and the leading part of the path; only the patterns found along the url
+ * are matched (each compiled once). The index is kept with the session token (see am_get_policy_index),
+ * so that it is built once for the policy results cached for it and not for every request
+ */
+static int policy_select_subtree(am_request_t *r, const char *url, int scope, int count, const int *scopes,
+        const char **resources, char *status) {
+    am_bool_t case_ignore = r->conf->url_eval_case_ignore;
+    uint32_t generation = am_cache_generation();
+    struct am_policy_index *index;
+    am_url_matcher_t *m = NULL;
+    int j, found;
+
+    index = am_get_policy_index(r->token, count, scopes, resources, case_ignore, &m);
+    if (index == NULL) {
+        m = am_url_matcher_create(r->instance_id, case_ignore, AM_FALSE);
+        if (m == NULL) {
+            return -1;
+        }
+        for (j = 0; j < count; j++) {
+            if (ISVALID(resources[j]) && am_url_matcher_add_id(m, scopes[j], resources[j], j) != AM_SUCCESS) {
+                am_url_matcher_free(m);
+                return -1;
+            }
+        }
+        index = am_add_policy_index(r->token, generation, count, scopes, resources, case_ignore, m);
+    }
+    found = am_url_matcher_select(r, m, scope, url, status);
+    if (index != NULL) {
+        am_release_policy_index(index);
     } else {
-        /* compare hosts - up to paths */
-        if (! compare_pattern_sections(r, pattern, start_of_host(pi), start_of_path(pi), resource, start_of_host(ri), start_of_path(ri)))
-            return AM_NO_MATCH;
+        am_url_matcher_free(m);
     }
-    
-    /* compare paths and query */
-    if (! compare_pattern_sections(r, pattern, start_of_path(pi), strlen(pattern), resource, start_of_path(ri), strlen(resource)))
-        return AM_NO_MATCH;
-    
-    return AM_EXACT_PATTERN_MATCH;
+    for (j = 0; j < count && found > 0; j++) {
+        /* the index holds every scope, and one that is not set (-1) is taken as any of them */
+        if (scopes[j] != scope && status[j] != AM_NO_MATCH) {
+            status[j] = AM_NO_MATCH;
+            found--;
+        }
+    }
+    return found;
+}
+
+/**
+ * Decide which of the policy results (given by their scope and resource) apply to the url,
+ * setting status[i] to AM_EXACT_MATCH, AM_EXACT_PATTERN_MATCH or AM_NO_MATCH.
+ *
+ * @return the number of results which apply
+ */
+int am_policy_select(am_request_t *r, const char *url, int scope, int count,
+        const int *scopes, const char **resources, char *status) {
+    am_bool_t subtree = r->conf->policy_scope_subtree;
+    int j, found = -1;
+
+    for (j = 0; j < count; j++) {
+        status[j] = AM_NO_MATCH;
+    }
+    if (url == NULL) {
+        return 0;
+    }
+    if (count >= POLICY_INDEX_MIN) {
+        found = subtree ? policy_select_subtree(r, url, scope, count, scopes, resources, status) :
+                policy_select_self(url, scope, count, scopes, resources, status);
+    }
+    if (found >= 0) {
+        return found;
+    }
+
+    for (j = 0, found = 0; j < count; j++) {
+        if (scopes[j] != scope || resources[j] == NULL) {
+            status[j] = AM_NO_MATCH;
+            continue;
+        }
+        if (!subtree) {
+            /* exact string match so that earlier stored request url does not become a pattern to match against */
+            status[j] = strcmp(resources[j], url) == 0 ? AM_EXACT_MATCH : AM_NO_MATCH;
+        } else {
+            status[j] = policy_compare_url(r, resources[j], url);
+        }
+        if (status[j] != AM_NO_MATCH) {
+            found++;
+        }
+    }
+    return found;
 }
 
 int am_scope_to_num(const char *scope) {
@@ -360,6 +360,38 @@ void *am_parse_policy_xml(unsigned long instance_id, const char *xml, size_t xml
     return (void *) r;
 }
 
+static void *policy_xml_stream_result(void *userData, am_bool_t ok) {
+    am_xml_parser_ctx_t *ctx = (am_xml_parser_ctx_t *) userData;
+    struct am_policy_result *r = ctx->list;
+    if (!ok) {
+        delete_am_policy_result_list(&ctx->list);
+        r = NULL;
+    }
+    if (ctx->status != AM_SUCCESS) {
+        AM_LOG_ERROR(ctx->instance_id, "am_parse_policy_xml(): %s", am_strerror(ctx->status));
+    }
+    AM_FREE(ctx->data, ctx->attribute_name);
+    free(ctx);
+    return (void *) r;
+}
+
+/**
+ * Create an incremental parser for a policy service (PLL) response; the response body
+ * is fed to it with am_xml_stream_feed as it is received and am_xml_stream_finish
+ * returns the am_policy_result list.
+ */
+am_xml_stream_t *am_policy_xml_stream(unsigned long instance_id, int scope) {
+    am_xml_parser_ctx_t *ctx = calloc(1, sizeof (am_xml_parser_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->instance_id = instance_id;
+    ctx->scope = scope;
+    ctx->status = AM_SUCCESS;
+    return am_xml_stream_create(instance_id, "am_parse_policy_xml():", ctx,
+            start_element, end_element, character_data, policy_xml_stream_result);
+}
+
 static void delete_am_action_decision_list(struct am_action_decision **list) {
     struct am_action_decision *t = list != NULL ? *list : NULL;
     if (t != NULL) {
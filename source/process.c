@@ -461,12 +461,68 @@ static am_return_t validate_url(am_request_t *r) {
     return AM_OK;
 }
 
+/**
+ * answer a GET request for the status url with the shared cache statistics; the statistics are only given to
+ * clients in the com.forgerock.agents.config.status.ip address ranges (the loopback addresses when there are none)
+ * and they are the counters only, the full scans of the cache are left to agentadmin
+ */
+static am_return_t handle_status(am_request_t *r) {
+    static const char *thisfunc = "handle_status():";
+    static const char *loopback[] = { "127.0.0.0/8", "::1/128" };
+    const char *url = r->conf->override_notif_url ? r->overridden_url : r->normalized_url;
+    unsigned long patterns, compiles, matches, handshakes, resumed;
+    double compile_time, match_time;
+    char *report = NULL;
+
+    if (r->method != AM_REQUEST_GET || !ISVALID(r->conf->status_url) || url == NULL ||
+            (r->conf->url_eval_case_ignore ? strcasecmp(url, r->conf->status_url) : strcmp(url, r->conf->status_url))) {
+        return AM_FAIL;
+    }
+
+    AM_LOG_DEBUG(r->instance_id, "%s %s is the agent status url", thisfunc, url);
+
+    if (!ISVALID(r->client_ip) || (r->conf->status_ip_sz > 0 ?
+            ip_address_match(r->client_ip, (const char **) r->conf->status_ip, r->conf->status_ip_sz, r->instance_id) :
+            ip_address_match(r->client_ip, loopback, ARRAY_SIZE(loopback), r->instance_id)) != AM_SUCCESS) {
+        AM_LOG_WARNING(r->instance_id, "%s client ip address %s is not allowed to read the agent status",
+                thisfunc, LOGEMPTY(r->client_ip));
+        r->status = AM_FORBIDDEN;
+        return AM_OK;
+    }
+
+    if (am_cache_status(&report, AM_FALSE) != AM_SUCCESS) {
+        AM_LOG_WARNING(r->instance_id, "%s cache statistics are not available", thisfunc);
+        r->status = AM_ERROR;
+        return AM_OK;
+    }
+    am_regex_stats(&patterns, &compiles, &compile_time, &matches, &match_time);
+    am_net_ssl_stats(&handshakes, &resumed);
+    am_asprintf(&report, "%sregex patterns: %lu\nregex compiles: %lu\nregex compile time (us): %.0f\n"
+            "regex matches: %lu\nregex match time (us): %.0f\n"
+            "ssl handshakes: %lu\nssl handshakes resumed: %lu\n", NOTNULL(report), patterns,
+            compiles, compile_time * 1000000, matches, match_time * 1000000, handshakes, resumed);
+    if (report == NULL) {
+        r->status = AM_ENOMEM;
+        return AM_OK;
+    }
+    if (r->am_set_custom_response_f != NULL) {
+        r->am_set_custom_response_f(r, report, "text/plain");
+    }
+    free(report);
+    r->status = AM_NOTIFICATION_DONE; /* response is complete, exit as for a notification */
+    return AM_OK;
+}
+
 static am_return_t handle_notification(am_request_t *r) {
     static const char *thisfunc = "handle_notification():";
     am_return_t status = AM_FAIL;
 
     AM_LOG_DEBUG(r->instance_id, "%s", thisfunc);
 
+    if (handle_status(r) == AM_OK) {
+        return AM_OK;
+    }
+
     /* check if notifications are enabled */
     if (r->method == AM_REQUEST_POST && ISVALID(r->conf->notif_url)) {
         struct notification_worker_data *wd;
@@ -587,6 +643,82 @@ static am_return_t validate_fqdn_access(am_request_t *r) {
     return AM_FAIL;
 }
 
+/**
+ * Check the client ip, url and client ip/url pair against the (compiled) not enforced lists.
+ * Without the lists nothing matches, and the url is enforced even when the list is inverted.
+ */
+static am_bool_t in_not_enforced_lists(am_request_t *r, struct am_not_enforced *ne, const char *url) {
+    static const char *thisfunc = "handle_not_enforced():";
+    am_bool_t ip_valid;
+    am_ip_t ip;
+
+    if (ne == NULL) {
+        return AM_FALSE;
+    }
+
+    /* the client ip is parsed once, for the client ip and the extended lists */
+    ip_valid = ISVALID(r->client_ip) && am_ip_parse(r->client_ip, &ip);
+
+    /* see if the client ip is in the not enforced client ip list */
+    if (r->conf->not_enforced_ip_map_sz > 0) {
+        if (ip_valid && am_not_enforced_ip(r, ne, &ip)) {
+            AM_LOG_DEBUG(r->instance_id, "%s client ip address %s is not enforced", thisfunc, r->client_ip);
+            return AM_TRUE;
+        }
+        AM_LOG_DEBUG(r->instance_id, "%s client ip address %s is not in the not enforced client ip list",
+                thisfunc, LOGEMPTY(r->client_ip));
+    } else {
+        AM_LOG_DEBUG(r->instance_id, "%s not enforced client ip validation feature is not enabled", thisfunc);
+    }
+
+    AM_LOG_DEBUG(r->instance_id, "%s validating %s", thisfunc, url);
+
+    /* check the request url (normalized) is in not enforced url list */
+    if (r->conf->not_enforced_map_sz > 0) {
+        int compare_status;
+
+        if ((r->conf->path_info_ignore_not_enforced || r->conf->path_info_ignore) &&
+                !r->conf->not_enforced_regex_enable) {
+            /* regular [0]=not-enforced-url entries are matched without path_info or query */
+            if (ISVALID(r->normalized_url_pathinfo)) {
+                AM_LOG_DEBUG(r->instance_id, "%s validating %s ignoring path_info",
+                        thisfunc, r->normalized_url_pathinfo);
+                compare_status = am_not_enforced_match(r, ne, r->normalized_url_pathinfo,
+                        strlen(r->normalized_url_pathinfo), url);
+            } else {
+                const char *qmark = strchr(url, '?');
+                AM_LOG_DEBUG(r->instance_id, "%s validating %.*s ignoring query attributes",
+                        thisfunc, qmark != NULL ? (int) (qmark - url) : (int) strlen(url), url);
+                compare_status = am_not_enforced_match(r, ne, url,
+                        qmark != NULL ? qmark - url : strlen(url), url);
+            }
+        } else {
+            compare_status = am_not_enforced_match(r, ne, url, strlen(url), url);
+        }
+
+        if (r->conf->not_enforced_invert) {
+            AM_LOG_DEBUG(r->instance_id, "%s not enforced list is inverted, "
+                    "only not enforced list of urls will be enforced", thisfunc);
+            compare_status = !compare_status;
+        }
+        if (compare_status) {
+            return AM_TRUE;
+        }
+    } else {
+        AM_LOG_DEBUG(r->instance_id, "%s not enforced url validation feature is not enabled", thisfunc);
+    }
+
+    /* check the request url (normalized) is in not enforced url list (extended version) */
+    if (r->conf->not_enforced_ext_map_sz > 0 && ip_valid) {
+        if (am_not_enforced_ext(r, ne, &ip, url)) {
+            return AM_TRUE;
+        }
+    } else {
+        AM_LOG_DEBUG(r->instance_id, "%s extended not enforced url validation feature is not enabled", thisfunc);
+    }
+    return AM_FALSE;
+}
+
 static am_return_t handle_not_enforced(am_request_t *r) {
     static const char *thisfunc = "handle_not_enforced():";
     int i;
@@ -602,23 +734,17 @@ static am_return_t handle_not_enforced(am_request_t *r) {
             ISVALID(r->conf->pdp_uri_prefix) && r->conf->pdp_uri_prefix[0] != '/' ? "/" : "",
             NOTNULL(r->conf->pdp_uri_prefix), POST_PRESERVE_URI);
     if (ISVALID(pdp_path) && ISVALID(r->url.query) && strcmp(r->url.path, pdp_path) == 0) {
-        const char *error = NULL;
-        int erroroffset;
         /* all other query parameters, apart from the pdp key, are removed. 
          * pdp key format: %08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x 
          * generated by uuid() utility method
          */
         size_t slen = strlen(r->url.query);
-        pcre *x = pcre_compile(".+([a-z0-9]{8}-[a-z0-9]{4}-[a-z0-9]{4}-[a-z0-9]{4}-[a-z0-9]{12}).*",
-                0, &error, &erroroffset, NULL);
-        if (x != NULL) {
-            char *key = match_group(x, 1, r->url.query, &slen);
-            if (key != NULL) {
-                strncpy(r->url.query, "?", sizeof (r->url.query) - 1);
-                strcat(r->url.query, key);
-                free(key);
-            }
-            pcre_free(x);
+        char *key = match_pattern_group(".+([a-z0-9]{8}-[a-z0-9]{4}-[a-z0-9]{4}-[a-z0-9]{4}-[a-z0-9]{12}).*",
+                1, r->url.query, &slen);
+        if (key != NULL) {
+            strncpy(r->url.query, "?", sizeof (r->url.query) - 1);
+            strcat(r->url.query, key);
+            free(key);
         }
 
         AM_LOG_DEBUG(r->instance_id, "%s post preserve url is not enforced", thisfunc);
@@ -755,111 +881,18 @@ static am_return_t handle_not_enforced(am_request_t *r) {
 
     r->not_enforced = AM_FALSE;
 
-    /* see if the client ip is in the not enforced client ip list */
-    if (r->conf->not_enforced_ip_map_sz > 0) {
-        for (i = 0; i < r->conf->not_enforced_ip_map_sz; i++) {
-            am_config_map_t *m = &r->conf->not_enforced_ip_map[i];
-            char *p = strstr(m->name, AM_COMMA_CHAR);
-            if (p == NULL) {
-                const char *l[1] = {m->value};
-                if (ip_address_match(r->client_ip, l, 1, r->instance_id) == AM_SUCCESS) {
-                    r->not_enforced = AM_TRUE;
-                    if (!r->conf->not_enforced_fetch_attr) {
-                        r->status = AM_SUCCESS;
-                        return AM_QUIT;
-                    }
-                    return AM_OK;
-                }
-                AM_LOG_DEBUG(r->instance_id, "%s client ip address %s does not match %s",
-                        thisfunc, r->client_ip, LOGEMPTY(m->value));
-            } else {
-                char *pv = strndup(m->name, p - m->name);
-                if (pv != NULL) {
-                    int mtn = am_method_str_to_num(pv);
-                    free(pv);
-                    if (r->method == mtn) {
-                        const char *l[1] = {m->value};
-                        if (ip_address_match(r->client_ip, l, 1, r->instance_id) == AM_SUCCESS) {
-                            r->not_enforced = AM_TRUE;
-                            if (!r->conf->not_enforced_fetch_attr) {
-                                r->status = AM_SUCCESS;
-                                return AM_QUIT;
-                            }
-                            return AM_OK;
-                        }
-                        AM_LOG_DEBUG(r->instance_id, "%s client ip address %s does not match %s (%s)",
-                                thisfunc, r->client_ip, LOGEMPTY(m->value), am_method_num_to_str(mtn));
-                    }
-                }
-            }
-        }
-    } else {
-        AM_LOG_DEBUG(r->instance_id, "%s not enforced client ip validation feature is not enabled", thisfunc);
-    }
-
-    AM_LOG_DEBUG(r->instance_id, "%s validating %s", thisfunc, url);
-
-    /* check the request url (normalized) is in not enforced url list */
-    if (r->conf->not_enforced_map_sz > 0) {
-        int compare_status = 0;
-        for (i = 0; i < r->conf->not_enforced_map_sz; i++) {
-            am_config_map_t *m = &r->conf->not_enforced_map[i];
-            if (ISVALID(m->value)) {
-                char *p = strstr(m->name, AM_COMMA_CHAR);
-                AM_LOG_DEBUG(r->instance_id, "%s trying not enforced pattern %s", thisfunc, m->value);
-                if (p == NULL) {
-
-                    /* regular [0]=not-enforced-url option */
-
-                    if ((r->conf->path_info_ignore_not_enforced || r->conf->path_info_ignore) &&
-                            !r->conf->not_enforced_regex_enable) {
-
-                        if (ISVALID(r->normalized_url_pathinfo)) {
-                            AM_LOG_DEBUG(r->instance_id, "%s validating %s ignoring path_info",
-                                    thisfunc, r->normalized_url_pathinfo);
-                            compare_status += url_matches_pattern(r, m->value, r->normalized_url_pathinfo, AM_FALSE);
-                        } else {
-                            char *url_query_removed = strdup(url);
-                            if (url_query_removed != NULL) {
-                                char *qmark = strchr(url_query_removed, '?');
-                                if (qmark != NULL) {
-                                    *qmark = '\0';
-                                }
-                                AM_LOG_DEBUG(r->instance_id, "%s validating %s ignoring query attributes",
-                                        thisfunc, url_query_removed);
-                                compare_status += url_matches_pattern(r, m->value, url_query_removed, AM_FALSE);
-                                free(url_query_removed);
-                            }
-                        }
-                    } else {
-                        compare_status += url_matches_pattern(r, m->value, url, r->conf->not_enforced_regex_enable);
-                    }
-
-                } else {
-
-                    /* method-extended [GET,0]=not-enforced-url option */
-
-                    char *pv = strndup(m->name, p - m->name);
-                    if (pv != NULL) {
-                        int mtn = am_method_str_to_num(pv);
-                        free(pv);
-                        if (r->method != mtn) continue;
-                        compare_status += url_matches_pattern(r, m->value, url, r->conf->not_enforced_regex_enable);
-                    }
-                }
-
-                if (compare_status > 0 && !r->conf->not_enforced_invert) break;
-            }
-        }
-
-        compare_status = compare_status > 0;
-
-        if (r->conf->not_enforced_invert) {
-            AM_LOG_DEBUG(r->instance_id, "%s not enforced list is inverted, "
-                    "only not enforced list of urls will be enforced", thisfunc);
-            compare_status = !compare_status;
+    if (r->conf->not_enforced_ip_map_sz > 0 || r->conf->not_enforced_map_sz > 0 ||
+            r->conf->not_enforced_ext_map_sz > 0) {
+        am_bool_t found;
+        struct am_not_enforced *ne = am_not_enforced_get(r);
+        if (ne == NULL) {
+            AM_LOG_ERROR(r->instance_id, "%s failed to compile not enforced lists, %s is enforced",
+                    thisfunc, url);
+            return AM_OK;
         }
-        if (compare_status) {
+        found = in_not_enforced_lists(r, ne, url);
+        am_not_enforced_release(ne);
+        if (found) {
             AM_LOG_DEBUG(r->instance_id, "%s %s is not enforced", thisfunc, url);
             r->not_enforced = AM_TRUE;
             if (!r->conf->not_enforced_fetch_attr) {
@@ -868,54 +901,6 @@ static am_return_t handle_not_enforced(am_request_t *r) {
             }
             return AM_OK;
         }
-
-    } else {
-        AM_LOG_DEBUG(r->instance_id, "%s not enforced url validation feature is not enabled", thisfunc);
-    }
-
-    /* check the request url (normalized) is in not enforced url list (extended version) */
-    if (r->conf->not_enforced_ext_map_sz > 0 && ISVALID(r->client_ip)) {
-        for (i = 0; i < r->conf->not_enforced_ext_map_sz; i++) {
-            char *p, *v, *t, *is, *us, found = AM_FALSE;
-            am_config_map_t *m = &r->conf->not_enforced_ext_map[i];
-            if (!ISVALID(m->value)) continue;
-            p = strstr(m->value, AM_PIPE_CHAR); /* 10.1.1.0/24 10.1.2.1-10.1.2.7|url1 url2 */
-            if (p == NULL) continue;
-            is = strndup(m->value, p - m->value);
-            us = strdup(p + 1);
-            if (is == NULL || us == NULL) {
-                AM_FREE(is, us);
-                continue;
-            }
-            for ((v = strtok_r(is, AM_SPACE_CHAR, &t)); v; (v = strtok_r(NULL, AM_SPACE_CHAR, &t))) {
-                const char *vlist[1] = {v};
-                if (ip_address_match(r->client_ip, vlist, 1, r->instance_id) == AM_SUCCESS) {
-                    found = AM_TRUE;
-                    break;
-                }
-            }
-            if (found) {
-                found = AM_FALSE;
-                for ((v = strtok_r(us, AM_SPACE_CHAR, &t)); v; (v = strtok_r(NULL, AM_SPACE_CHAR, &t))) {
-                    if (url_matches_pattern(r, v, url, r->conf->not_enforced_ext_regex_enable)) {
-                        found = AM_TRUE;
-                        break;
-                    }
-                }
-            }
-            AM_FREE(is, us);
-            if (found) {
-                AM_LOG_DEBUG(r->instance_id, "%s %s is not enforced", thisfunc, url);
-                r->not_enforced = AM_TRUE;
-                if (!r->conf->not_enforced_fetch_attr) {
-                    r->status = AM_SUCCESS;
-                    return AM_QUIT;
-                }
-                return AM_OK;
-            }
-        }
-    } else {
-        AM_LOG_DEBUG(r->instance_id, "%s extended not enforced url validation feature is not enabled", thisfunc);
     }
 
     AM_LOG_DEBUG(r->instance_id, "%s %s is enforced", thisfunc, url);
@@ -1159,13 +1144,76 @@ static const char *get_attr_value(am_request_t *r, const char *name, int mask, c
 
 #define MAX_VALIDATE_POLICY_RETRY 3
 
+struct policy_match {
+    am_request_t *r;
+    const char *url;
+    int scope;
+};
+
+/**
+ * Select cached policy entries which apply to the request url, so that
+ * only those are copied out of the cache (see am_get_session_policy_cache_match).
+ */
+static int policy_select_cached(void *arg, int count, const int *scopes, const char **resources, char *status) {
+    struct policy_match *m = (struct policy_match *) arg;
+    return am_policy_select(m->r, m->url, m->scope, count, scopes, resources, status);
+}
+
+/**
+ * Match all of the policy results for the request against the url at once (see am_policy_select);
+ * returns status for each entry in r->pattr (allocated) or NULL if there is no memory for it.
+ */
+static char *policy_select_results(am_request_t *r, const char *url, int scope) {
+    struct am_policy_result *e, *t;
+    const char **resources;
+    int *scopes, count = 0;
+    char *status;
+
+    AM_LIST_FOR_EACH(r->pattr, e, t) {
+        count++;
+    }
+    resources = malloc(count * (sizeof (char *) + sizeof (int)) + 1);
+    if (resources == NULL) {
+        return NULL;
+    }
+    scopes = (int *) (resources + count);
+    count = 0;
+    AM_LIST_FOR_EACH(r->pattr, e, t) {
+        resources[count] = e->resource;
+        scopes[count++] = e->scope;
+    }
+    status = malloc(count + 1);
+    if (status != NULL) {
+        am_policy_select(r, url, scope, count, scopes, resources, status);
+    }
+    free(resources);
+    return status;
+}
+
+/**
+ * Keep the session and policy data a decision was made with in the process local
+ * decision cache, unless it came from there (or is stale). The entry expires no later
+ * than the cached data did (expires is 0 for data fetched just now).
+ */
+static void cache_decision(am_request_t *r, const char *url, int scope, uint32_t generation,
+        int64_t expires, char cached, char stale, struct am_policy_result *e) {
+    if (!cached && !stale) {
+        am_add_decision_cache_entry(r, url, scope, generation, expires, e, r->sattr);
+    }
+}
+
 static am_return_t validate_policy(am_request_t *r) {
     static const char *thisfunc = "validate_policy():";
     struct am_policy_result *e, *t, *policy_cache = NULL;
     struct am_namevalue *session_cache = NULL;
-    char is_valid = AM_FALSE, remote = AM_FALSE;
+    char is_valid = AM_FALSE, remote = AM_FALSE, in_flight = AM_FALSE, stale = AM_FALSE, cached = AM_FALSE;
     int status = AM_ERROR, policy_status = AM_NO_MATCH, entry_status = r->status;
-    uint64_t cache_ts = 0;
+    uint64_t flight = 0;
+    uint32_t generation = am_cache_generation(); /* read before any cached data is */
+    int64_t expires = 0; /* when the first of the cached session/policy records read expires */
+    struct policy_match match;
+    char *selected = NULL;
+    int i;
 
     char *pattrs = NULL;
     const char *url = ISVALID(r->overridden_url_pathinfo) && r->conf->path_info_ignore ?
@@ -1218,22 +1266,55 @@ static am_return_t validate_policy(am_request_t *r) {
     }
 
     /* 
-     * Look for an entry in a session cache, but only when we are not here because
-     * of a retry call of a failed cache lookup
+     * Look for an entry in the decision cache and then in a session cache, but only when
+     * we are not here because of a retry call of a failed cache lookup
      **/
-    status = entry_status == AM_EAGAIN && r->retry > 0 ?
-            AM_EAGAIN : am_get_session_policy_cache_entry(r, r->token,
-            &policy_cache, &session_cache, &cache_ts);
-    AM_LOG_DEBUG(r->instance_id, "%s get session cache status: %s",
-            thisfunc, am_strerror(status));
+    match.r = r;
+    match.url = url;
+    match.scope = scope;
+    if (entry_status == AM_EAGAIN && r->retry > 0) {
+        status = AM_EAGAIN;
+    } else if (am_get_decision_cache_entry(r->token, url, scope, &policy_cache, &session_cache) == AM_SUCCESS) {
+        status = AM_SUCCESS;
+        cached = AM_TRUE;
+    } else {
+        status = am_get_session_policy_cache_match(r, r->token,
+                policy_select_cached, &match, &policy_cache, &session_cache, &expires);
+    }
+    AM_LOG_DEBUG(r->instance_id, "%s get session cache status: %s%s",
+            thisfunc, am_strerror(status), cached ? " (decision cache)" : "");
+
+    if (status != AM_SUCCESS) {
+        /* only one session/policy request for the same token and resource is sent, 
+         * others wait for its result to land in the cache */
+        flight = am_policy_flight_key(r->token, url, scope);
+        if (am_policy_flight_begin(flight) == AM_SUCCESS) {
+            in_flight = AM_TRUE;
+        } else {
+            AM_LOG_DEBUG(r->instance_id, "%s waiting for a session/policy request in progress for '%s'",
+                    thisfunc, url);
+            if (am_policy_flight_wait(flight) == AM_SUCCESS) {
+                delete_am_policy_result_list(&policy_cache);
+                delete_am_namevalue_list(&session_cache);
+                status = am_get_session_policy_cache_match(r, r->token,
+                        policy_select_cached, &match, &policy_cache, &session_cache, &expires);
+                AM_LOG_DEBUG(r->instance_id, "%s get session cache status: %s",
+                        thisfunc, am_strerror(status));
+            }
+        }
+    }
 
-    if ((status == AM_SUCCESS && cache_ts > 0) || status != AM_SUCCESS) {
+    if (status != AM_SUCCESS) {
         struct am_policy_result *policy_cache_new = NULL;
         struct am_namevalue *session_cache_new = NULL;
         am_net_options_t net_options;
         const char *service_url = get_valid_openam_url(r);
-        int max_retry = 3;
-        unsigned int retry = 3, retry_wait = 2;
+        int max_retry = 3, attempt = 0, breaker_open = 0;
+        unsigned int retry = 3, budget_left;
+        unsigned int budget = r->conf->net_budget > 0 ? r->conf->net_budget : AM_NET_BUDGET;
+        int net_timeout = r->conf->net_timeout > 0 ? r->conf->net_timeout : AM_NET_CONNECT_TIMEOUT;
+        am_bool_t budget_exhausted = AM_FALSE;
+        am_timer_t budget_timer;
 
         am_net_options_create(r->conf, &net_options, NULL);
         net_options.server_id = r->conf->lb_enable && ISVALID(r->session_info.si) ? strdup(r->session_info.si) : NULL;
@@ -1242,11 +1323,20 @@ static am_return_t validate_policy(am_request_t *r) {
          * do a policy+session call in either way
          **/
         pattrs = create_profile_attribute_request(r);
+        am_stale_grace(r->conf->stale_grace);
         max_retry++;
+        am_timer_start(&budget_timer);
+        /* no response is waited for past the time budget */
+        net_options.deadline = am_timer_deadline(budget);
         do {
             policy_cache_new = NULL;
             session_cache_new = NULL;
 
+            /* do not let a single call run past the time budget */
+            budget_left = am_timer_budget_left(&budget_timer, budget);
+            net_options.net_timeout = (int) (budget_left + 999) / 1000 < net_timeout ?
+                    (int) (budget_left + 999) / 1000 : net_timeout;
+
             status = am_agent_policy_request(r->instance_id, service_url, r->conf->token, r->token,
                     url, am_scope_to_str(scope), r->client_ip, pattrs, r->conf->policy_eval_app,
                     &net_options, &session_cache_new, &policy_cache_new);
@@ -1269,6 +1359,9 @@ static am_return_t validate_policy(am_request_t *r) {
                 am_remove_cache_entry(r->instance_id, r->token);
                 am_net_options_delete(&net_options);
                 am_free(pattrs);
+                if (in_flight) {
+                    am_policy_flight_end(flight);
+                }
                 r->status = AM_SUCCESS;
                 return AM_OK;
             }
@@ -1285,16 +1378,43 @@ static am_return_t validate_policy(am_request_t *r) {
                 break;
             }
 
-            sleep(retry_wait);
+            if (status == AM_ENOTSTARTED && ++breaker_open >= r->conf->naming_url_sz) {
+                /* circuit breakers for all naming urls are open - fail fast */
+                break;
+            }
+
+            budget_left = am_timer_budget_left(&budget_timer, budget);
+            if (budget_left == 0) {
+                budget_exhausted = AM_TRUE;
+                break;
+            }
+
+            /* fail over to the next naming url right away, back off only once all of them were tried */
+            if (++attempt < r->conf->naming_url_sz) {
+                service_url = get_next_openam_url(r, attempt);
+            } else {
+                am_backoff(attempt - r->conf->naming_url_sz, budget_left);
+            }
         } while (--max_retry > 0);
 
+        am_timer_stop(&budget_timer);
         am_net_options_delete(&net_options);
 
-        if (max_retry == 0) {
+        if (budget_exhausted) {
+            AM_LOG_ERROR(r->instance_id,
+                    "%s remote session/policy call to validate '%s' failed (time budget of %u ms exhausted)",
+                    thisfunc, url, budget);
+            am_net_budget_exhausted();
+            status = AM_RETRY_ERROR;
+        } else if (max_retry == 0) {
             AM_LOG_ERROR(r->instance_id,
                     "%s remote session/policy call to validate '%s' failed (max %d retries exhausted)",
                     thisfunc, url, retry);
             status = AM_RETRY_ERROR;
+        } else if (status == AM_ENOTSTARTED) {
+            AM_LOG_ERROR(r->instance_id,
+                    "%s remote session/policy call to validate '%s' not made (policy service is unavailable)",
+                    thisfunc, url);
         }
 
         am_free(pattrs);
@@ -1304,20 +1424,34 @@ static am_return_t validate_policy(am_request_t *r) {
             delete_am_policy_result_list(&policy_cache);
             delete_am_namevalue_list(&session_cache);
 
-            status = am_add_session_policy_cache_entry(r, r->token,
-                    policy_cache_new, session_cache_new);
+            if (am_add_session_policy_cache_entry(r, r->token,
+                    policy_cache_new, session_cache_new) != AM_SUCCESS) {
+                /* the decision stands, it just won't be served from the cache */
+                AM_LOG_WARNING(r->instance_id, "%s failed to cache session/policy data for '%s'",
+                        thisfunc, url);
+            }
 
             policy_cache = policy_cache_new;
             session_cache = session_cache_new;
+            expires = 0;
             is_valid = AM_TRUE;
         }
 
-        if (status != AM_SUCCESS && cache_ts > 0) {
-            /* re-use earlier cached session/policy data */
-            //TODO: skew? max?
-            //AM_LOG_WARNING(instance_id, "%s retry %d (remote session/policy call failure)",
-            //        thisfunc, (retry - max_retry) + 1);
-            is_valid = AM_TRUE;
+        if (in_flight) {
+            am_policy_flight_end(flight);
+        }
+
+        if (status != AM_SUCCESS && status != AM_INVALID_SESSION && status != AM_INVALID_AGENT_SESSION) {
+            /* policy service is unavailable - re-use session/policy data which expired within the grace period */
+            delete_am_policy_result_list(&policy_cache);
+            delete_am_namevalue_list(&session_cache);
+            if (am_get_stale_session_policy_cache_entry(r, r->token, r->conf->stale_grace,
+                    &policy_cache, &session_cache) == AM_SUCCESS) {
+                AM_LOG_WARNING(r->instance_id, "%s using stale session/policy data to validate '%s' (%s)",
+                        thisfunc, url, am_strerror(status));
+                status = AM_SUCCESS;
+                is_valid = stale = AM_TRUE;
+            }
         }
 
     } else {
@@ -1389,7 +1523,15 @@ static am_return_t validate_policy(am_request_t *r) {
             r->user_temp = get_attr_value(r, r->conf->userid_param, AM_SESSION_ATTRIBUTE, NULL);
         }
 
-        AM_LIST_FOR_EACH(r->pattr, e, t) {//TODO: work on loop in 2 threads (split loop in 2; search&match in each thread)
+        /* all entries are matched against the url at once, using an index when there are many of them
+         * (in self mode the resource has to be the url itself, in subtree mode it is a pattern) */
+        selected = policy_select_results(r, url, scope);
+        if (selected == NULL) {
+            AM_LOG_WARNING(r->instance_id, "%s memory allocation error, comparing entries one by one", thisfunc);
+        }
+
+        i = 0;
+        AM_LIST_FOR_EACH(r->pattr, e, t) {
 
             if ((r->conf->debug_level & AM_LOG_LEVEL_DEBUG) != 0) {
                 AM_LOG_DEBUG(r->instance_id, "%s trying cache entry for: %s", thisfunc,
@@ -1399,14 +1541,13 @@ static am_return_t validate_policy(am_request_t *r) {
             if (e->scope == scope) {
                 const char *pattern = e->resource;
 
-                if (!r->conf->policy_scope_subtree) {
-                    /* agent is running in self mode and cached entry may or may not contain 
-                     * an asterisk character - do exact string match so that
-                     * earlier stored request url does not become a pattern to match against 
-                     **/
-                    policy_status = strcmp(pattern, url) == 0 ? AM_EXACT_MATCH : AM_NO_MATCH;
-                } else {
+                if (selected != NULL) {
+                    policy_status = selected[i];
+                } else if (r->conf->policy_scope_subtree) {
                     policy_status = policy_compare_url(r, pattern, url);
+                } else {
+                    /* as in am_policy_select, the resource has to be the url itself in self mode */
+                    policy_status = pattern != NULL && strcmp(pattern, url) == 0 ? AM_EXACT_MATCH : AM_NO_MATCH;
                 }
 
                 AM_LOG_DEBUG(r->instance_id, "%s cached entry: %s, resource: %s, status: %s", thisfunc,
@@ -1422,8 +1563,9 @@ static am_return_t validate_policy(am_request_t *r) {
                         break;
                     }
 
-                    if (remote) {
-                        /* in case its a fresh policy response, do not do policy-change cache entry validation */
+                    if (remote || cached) {
+                        /* in case its a fresh policy response, do not do policy-change cache entry validation;
+                         * a policy change invalidates the decision cache */
                         break;
                     }
 
@@ -1451,6 +1593,7 @@ static am_return_t validate_policy(am_request_t *r) {
 
                     r->status = entry_status;
                     r->retry++;
+                    am_free(selected);
                     return AM_RETRY;
                 } while (0);
 
@@ -1468,6 +1611,7 @@ static am_return_t validate_policy(am_request_t *r) {
                         r->response_attributes = e->response_attributes;
                         r->response_decisions = e->response_decisions;
                         r->status = AM_SUCCESS;
+                        cache_decision(r, url, scope, generation, expires, cached, stale, e);
 
                         /* set user parameter value */
                         if (ISVALID(r->conf->userid_param) && ISVALID(r->conf->userid_param_type)) {
@@ -1477,6 +1621,7 @@ static am_return_t validate_policy(am_request_t *r) {
                             r->user = r->user_temp;
                             r->user_password = get_attr_value(r, "sunIdentityUserPassword", AM_SESSION_ATTRIBUTE, NULL);
                         }
+                        am_free(selected);
                         return AM_OK;
                     }
 
@@ -1504,6 +1649,7 @@ static am_return_t validate_policy(am_request_t *r) {
                                 r->response_attributes = e->response_attributes; /* will be used by set header/cookie later */
                                 r->response_decisions = e->response_decisions;
                                 r->status = AM_SUCCESS;
+                                cache_decision(r, url, scope, generation, expires, cached, stale, e);
 
                                 /* set user parameter value */
                                 if (ISVALID(r->conf->userid_param) && ISVALID(r->conf->userid_param_type)) {
@@ -1516,24 +1662,29 @@ static am_return_t validate_policy(am_request_t *r) {
 
                                 AM_LOG_DEBUG(r->instance_id, "%s method: %s, decision: allow",
                                         thisfunc, am_method_num_to_str(ae->method));
+                                am_free(selected);
                                 return AM_OK;
                             }
                             /* deny */
                             /* set the pointer to the policy advice(s) if any */
                             r->policy_advice = ae->advices;
                             r->status = AM_ACCESS_DENIED;
+                            cache_decision(r, url, scope, generation, expires, cached, stale, e);
                             AM_LOG_DEBUG(r->instance_id, "%s method: %s, decision: deny, advice: %s",
                                     thisfunc, am_method_num_to_str(ae->method),
                                     ae->advices == NULL ? "n/a" : "available");
+                            am_free(selected);
                             return AM_OK;
                         }
                     }
                 }
             }
+            i++;
         }
+        am_free(selected);
 
         /* in case we haven't found anything in a policy (cached) response - redo validate_policy */
-        if (!remote && policy_status != AM_EXACT_MATCH && policy_status != AM_EXACT_PATTERN_MATCH) {
+        if (!remote && !stale && policy_status != AM_EXACT_MATCH && policy_status != AM_EXACT_PATTERN_MATCH) {
             AM_LOG_WARNING(r->instance_id, "%s validate policy did not find a match for '%s' in the cached entries, "
                     "retrying with the new request to the policy service", thisfunc, url);
             r->response_attributes = NULL;
@@ -55,7 +55,7 @@ const struct readlock                       readlock_init = { .readers = 0, .bar
  * check whether a process is dead
  *
  */
-static int process_dead(pid_t pid) {
+int process_dead(pid_t pid) {
     static const char                      *thisfunc = "process_dead():";
 #if defined _WIN32
     HANDLE                                  h;
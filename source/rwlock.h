@@ -29,6 +29,8 @@ struct readlock
 extern const struct readlock                readlock_init;
 
 
+int process_dead(pid_t pid);
+
 int read_lock(struct readlock *lock, pid_t pid);
 
 int read_lock_try(struct readlock *lock, pid_t pid, int tries);
@@ -19,39 +19,122 @@
 #include "utility.h"
 #include "list.h"
 #include "agent_cache.h"
+#include "thread.h"
 
 /*
- * Session and Policy response attribute cache
+ * Session attribute cache
  * ===============================================================
  * key: 'token value'
  * 
- * Policy Change event cache
+ * Policy response cache (one record for each resource, in the same
+ * collision list as the session record)
  * ===============================================================
- * key: AM_POLICY_CHANGE_KEY
+ * key: 'token value' AM_POLICY_KEY_SEPARATOR 'resource'
  * 
  * PDP cache:
  * ===============================================================
  * key: 'uuid value'
  * 
+ * Decision cache (process local)
+ * ===============================================================
+ * key: 'token value', scope, 'url'
+ * 
  */
 
 #define key_ln(blob)                    *(uint32_t *)(((char *)(blob)) + 1)
 #define key_addr(blob)                   (((char *)(blob)) + 1 + sizeof(uint32_t))
 
+#define AM_POLICY_KEY_SEPARATOR         "\n"                                        /* not valid in a token */
+
 #define AM_CACHE_GC_INTERVAL            "AM_CACHE_GC_INTERVAL"
 #define AM_CACHE_GC_DEFAULT_INTERVAL    3
+#define AM_CACHE_GC_BUDGET              "AM_CACHE_GC_BUDGET"                        /* milliseconds per sweep, 0 for no limit */
+#define AM_CACHE_GC_DEFAULT_BUDGET      10
+#define AM_CACHE_GC_WORKERS             "AM_CACHE_GC_WORKERS"                       /* threads sweeping at once */
+
+#define AM_CACHE_SNAPSHOT               "AM_CACHE_SNAPSHOT"                         /* snapshot file, none when not set */
+#define AM_CACHE_SNAPSHOT_INTERVAL      "AM_CACHE_SNAPSHOT_INTERVAL"                /* seconds, 0 saves at shutdown only */
+
+#define DECISION_WAYS                   4                                           /* entries a key can be stored in */
+#define POLICY_RECORDS_MAX              64                                          /* per token, as they share a bucket */
 
 static am_timer_event_t                 *cache_timer = NULL;
 
+static unsigned int                      gc_budget = AM_CACHE_GC_DEFAULT_BUDGET;
+
+static unsigned int                      gc_workers = 1;
+
+static unsigned int                      snapshot_interval = 0;
+
+static time_t                            snapshot_saved = 0;
+
+static int key_equality(void *a, void *b);
+
+/*
+ * the cache is saved to a snapshot file when the last process using it shuts down (and every
+ * AM_CACHE_SNAPSHOT_INTERVAL seconds), and loaded back when the cache is created or emptied by recovery, so that a
+ * restart does not revalidate every live session
+ *
+ */
+static void cache_snapshot_save_file() {
+
+    static const char                   *thisfunc = "cache_snapshot_save_file():";
+
+    char                                *path = getenv(AM_CACHE_SNAPSHOT);
+
+    uint32_t                             count;
+
+    if (ISVALID(path) && cache_snapshot_save(path, &count) == 0) {
+        AM_LOG_DEBUG(0, "%s %u cache entries saved to %s", thisfunc, count, path);
+    }
+    snapshot_saved = time(0);
+
+}
+
+static void cache_snapshot_load_file() {
+
+    static const char                   *thisfunc = "cache_snapshot_load_file():";
+
+    char                                *path = getenv(AM_CACHE_SNAPSHOT);
+
+    uint32_t                             count;
+
+    if (ISVALID(path) && (cache_snapshot_load(path, key_equality, &count) == 0 || count > 0)) {
+        AM_LOG_INFO(0, "%s %u cache entries loaded from %s", thisfunc, count, path);
+    }
+
+}
+
+/*
+ * purge expired cache entries, then deleted entries, for up to the gc budget; the sweeps are resumed on the next
+ * tick and workers sweeping at the same time take different parts of the cache
+ *
+ */
+static void cache_sweep_worker(void *arg) {
+    cache_purge_expired_entries(getpid(), gc_budget);
+    cache_garbage_collect(gc_budget);
+}
+
 static void cache_cleanup_event(void *arg) {
     pid_t pid;
+    unsigned int i;
 
     if (is_agent_memory_ready() == AM_SUCCESS && is_agent_cache_ready() == AM_SUCCESS) {
         pid = getpid();
         cache_readlock_total_barrier(pid); /* check that all rw locks can go past 0 locks */
-        cache_purge_expired_entries(pid); /* purge expired cache entries, then deleted entries */
-        cache_garbage_collect();
+        for (i = 1; i < gc_workers; i++) {
+            if (am_worker_dispatch(cache_sweep_worker, NULL) != 0) {
+                break;
+            }
+        }
+        cache_sweep_worker(NULL);
         cache_stats();
+
+        if (cache_take_recovered()) {
+            cache_snapshot_load_file(); /* recovery emptied the cache */
+        } else if (snapshot_interval > 0 && time(0) - snapshot_saved >= snapshot_interval) {
+            cache_snapshot_save_file();
+        }
     }
 }
 
@@ -70,6 +153,37 @@ int am_cache_worker_init() {
         }
     }
 
+    env = getenv(AM_CACHE_GC_BUDGET);
+    if (ISVALID(env)) {
+        char                            *endp = NULL;
+        unsigned int                     v = strtol(env, &endp, 0);
+
+        if (env < endp && *endp == '\0') {
+            gc_budget = v;
+        }
+    }
+
+    env = getenv(AM_CACHE_GC_WORKERS);
+    if (ISVALID(env)) {
+        char                            *endp = NULL;
+        unsigned int                     v = strtol(env, &endp, 0);
+
+        if (env < endp && *endp == '\0' && 0 < v) {
+            gc_workers = v;
+        }
+    }
+
+    env = getenv(AM_CACHE_SNAPSHOT_INTERVAL);
+    if (ISVALID(env)) {
+        char                            *endp = NULL;
+        unsigned int                     v = strtol(env, &endp, 0);
+
+        if (env < endp && *endp == '\0') {
+            snapshot_interval = v;
+        }
+    }
+    snapshot_saved = time(0);
+
     if (cache_timer != NULL) {
         return AM_SUCCESS;
     }
@@ -112,14 +226,69 @@ static int key_equality(void *a, void *b) {
 }
 
 /*
- * delete cache entry. 
+ * as key_equality, but b only has to start with the key of a
+ *
+ */
+static int key_prefix_equality(void *a, void *b) {
+
+    uint32_t                             len = ntohl(key_ln(a));
+
+    return len <= ntohl(key_ln(b)) && memcmp(key_addr(a), key_addr(b), len) == 0;
+
+}
+
+/*
+ * key of the policy record for a resource (see the layout above)
+ *
+ */
+static char *policy_key(const char *key, const char *resource) {
+
+    char                                *pkey = NULL;
+
+    am_asprintf(&pkey, "%s"AM_POLICY_KEY_SEPARATOR"%s", key, resource);
+    return pkey;
+
+}
+
+/*
+ * remove the policy records of the token (but not its session record)
+ *
+ */
+static int remove_policy_cache_entries(uint32_t hash, const char *key) {
+
+    struct cache_object_ctx              ctx;
+
+    int                                  status;
+
+    char                                *prefix = policy_key(key, "");
+
+    if (prefix == NULL) {
+        return AM_ENOMEM;
+    }
+
+    cache_object_ctx_init(&ctx);
+    cache_object_write_key(&ctx, prefix);
+    free(prefix);
+
+    status = ctx.error;
+    if (status == AM_SUCCESS) {
+        cache_delete(hash, ctx.data, key_prefix_equality);
+    }
+
+    cache_object_ctx_destroy(&ctx);
+    return status;
+
+}
+
+/*
+ * delete cache entry (and any policy records for it). 
  *
  */
 int am_remove_cache_entry(unsigned long instance, const char *key) {
 
     struct cache_object_ctx              ctx;
 
-    int                                  status = AM_SUCCESS;
+    int                                  status;
 
     uint32_t                             hash = am_hash(key);
 
@@ -130,9 +299,12 @@ int am_remove_cache_entry(unsigned long instance, const char *key) {
         status = ctx.error;
     } else {
         cache_delete(hash, ctx.data, key_equality);
+        status = remove_policy_cache_entries(hash, key);
     }
 
     cache_object_ctx_destroy(&ctx);
+
+    cache_generation_bump();
     return status;
 
 }
@@ -141,7 +313,7 @@ int am_remove_cache_entry(unsigned long instance, const char *key) {
  * get (readlocked) memory in shared cache
  *
  */
-static int cache_fetch_readable(uint32_t hash, char *key, void **data_addr, uint32_t *sz_addr) {
+static int cache_fetch_stale_readable(uint32_t hash, char *key, uint32_t grace, void **data_addr, uint32_t *sz_addr) {
 
     struct cache_object_ctx              ctx;
 
@@ -152,7 +324,9 @@ static int cache_fetch_readable(uint32_t hash, char *key, void **data_addr, uint
 
     if (ctx.error) {
         status = ctx.error;
-    } else if (cache_get_readlocked_ptr(hash, data_addr, sz_addr, ctx.data, time(0), key_equality)) {
+    } else if (grace == 0 && cache_get_readlocked_ptr(hash, data_addr, sz_addr, ctx.data, time(0), key_equality)) {
+        status = AM_NOT_FOUND;
+    } else if (grace > 0 && cache_get_stale_readlocked_ptr(hash, data_addr, sz_addr, ctx.data, time(0), grace, key_equality)) {
         status = AM_NOT_FOUND;
     }
 
@@ -161,47 +335,25 @@ static int cache_fetch_readable(uint32_t hash, char *key, void **data_addr, uint
 
 }
 
+static int cache_fetch_readable(uint32_t hash, char *key, void **data_addr, uint32_t *sz_addr) {
+
+    return cache_fetch_stale_readable(hash, key, 0, data_addr, sz_addr);
+
+}
+
 /*
- * get validation time in for all policies
+ * check a policy was created after the last policy change
  *
  */
 int am_check_policy_cache_epoch(uint64_t policy_created) {
 
-    struct cache_object_ctx              ctx;
-    int                                  status;
-
-    uint32_t                             hash = am_hash(AM_POLICY_CHANGE_KEY);
-
-    void                                *shm_data;                                    /* pointer into hash table */
-    uint32_t                             shm_data_sz;
-
-    uint64_t                             epoch_start;
-
-    if (( status = cache_fetch_readable(hash, (char *)AM_POLICY_CHANGE_KEY, &shm_data, &shm_data_sz) )) {
-        if (status == AM_NOT_FOUND) {
-            return AM_SUCCESS;                                                        /* no epoch set */
-        }
-        return status;
-    }
-
-    cache_object_ctx_init_data(&ctx, shm_data, (size_t)shm_data_sz);
-    cache_object_skip_key(&ctx);
-    am_policy_epoch_deserialise(&ctx, &epoch_start);
-
-    cache_release_readlocked_ptr(hash);
-
-    status = ctx.error;
-    cache_object_ctx_destroy(&ctx);
-
-    if (status) {
-        return status;
-    }
-
-    if (policy_created < epoch_start) {
+    if (policy_created < cache_policy_epoch()) {
+        cache_stat_lookup(CACHE_STAT_EPOCH, 0);
         return AM_ETIMEDOUT;                                                          /* policy crated before the epoch */
     }
 
-    return status;
+    cache_stat_lookup(CACHE_STAT_EPOCH, 1);
+    return AM_SUCCESS;
 
 }
 
@@ -211,25 +363,12 @@ int am_check_policy_cache_epoch(uint64_t policy_created) {
  */
 int am_set_policy_cache_epoch(uint64_t epoch_start) {
 
-    struct cache_object_ctx              ctx;
-    int                                  status;
-
-    uint32_t                             hash = am_hash(AM_POLICY_CHANGE_KEY);
-
-    cache_object_ctx_init(&ctx);
-    cache_object_write_key(&ctx, (char *)AM_POLICY_CHANGE_KEY);
-    am_policy_epoch_serialise(&ctx, epoch_start);
-
-    if (ctx.error) {
-        status = ctx.error;
-    } else if (cache_add(hash, ctx.data, ctx.data_size, ~0, key_equality)) {
-        status = AM_ERROR;                                                            /* failure here is significant */
-    } else {
-        status = AM_SUCCESS;
+    if (cache_set_policy_epoch(epoch_start)) {
+        return AM_ERROR;                                                              /* failure here is significant */
     }
 
-    cache_object_ctx_destroy(&ctx);
-    return status;
+    cache_generation_bump();
+    return AM_SUCCESS;
 
 }
 
@@ -248,8 +387,10 @@ int am_get_pdp_cache_entry(am_request_t *request, const char *key, char **url, c
     uint32_t                             shm_data_sz;
 
     if (cache_fetch_readable(hash, (char *)key, &shm_data, &shm_data_sz)) {
+        cache_stat_lookup(CACHE_STAT_PDP, 0);
         return AM_NOT_FOUND;
     }
+    cache_stat_lookup(CACHE_STAT_PDP, 1);
 
     cache_object_ctx_init_data(&ctx, shm_data, (size_t)shm_data_sz);
     cache_object_skip_key(&ctx);
@@ -316,139 +457,1060 @@ static int get_session_ttl(am_request_t *request, struct am_namevalue *session)
 
 }
 
+struct policy_fetch {
+
+    int                                  (*select)(void *, int, const int *, const char **, char *);
+    void                                *arg;
+
+    struct am_policy_result             *list;
+    int                                  error;
+
+    uint32_t                             hash;
+    int64_t                             *expires;                                     /* earliest, when not NULL */
+
+};
+
 /*
- * deserialise cached policy and session data
+ * keep the earliest expiry time of the (readlocked) records data was read from
  *
  */
-int am_get_session_policy_cache_entry(am_request_t *request, const char *key, struct am_policy_result **policy, struct am_namevalue **session, uint64_t *ts) {
+static void fetch_expires(int64_t *expires, uint32_t hash, void *data) {
 
-    uint32_t                             hash = am_hash(key);
+    int64_t                              t;
+
+    if (expires != NULL && (t = cache_readlocked_expires(hash, data)) != 0 && (*expires == 0 || t < *expires)) {
+        *expires = t;
+    }
+
+}
+
+/*
+ * deserialise policy from a policy record
+ *
+ */
+static int policy_fetch_each(void *arg, void *data, uint32_t ln) {
+
+    struct policy_fetch                 *fetch = arg;
 
     struct cache_object_ctx              ctx;
-    int                                  status;
 
-    void                                *shm_data;                                    /* pointer into hash table */
-    uint32_t                             shm_data_sz;
+    struct am_policy_result             *list;
 
-    if (cache_fetch_readable(hash, (char *)key, &shm_data, &shm_data_sz)) {
-        return AM_NOT_FOUND;
-    }
+    fetch_expires(fetch->expires, fetch->hash, data);
 
-    cache_object_ctx_init_data(&ctx, shm_data, (size_t)shm_data_sz);
+    cache_object_ctx_init_data(&ctx, data, (size_t)ln);
     cache_object_skip_key(&ctx);
-    *policy = am_policy_result_deserialise(&ctx);
-    *session = am_name_value_deserialise(&ctx);
+    list = am_policy_result_deserialise(&ctx);
 
-    cache_release_readlocked_ptr(hash);
+    if (list) {
+        struct am_policy_result         *tail;
 
-    status = ctx.error;
+        for (tail = list; tail->next; tail = tail->next)
+            ;
+        tail->next = fetch->list;                                                     /* order does not matter */
+        fetch->list = list;
+    }
+
+    fetch->error = ctx.error;
     cache_object_ctx_destroy(&ctx);
 
-    return status;
+    return fetch->error;
 
 }
 
 /*
- * cache policy and session data, add existing policies for other resources, overriding existing policies for the same resources
+ * deserialise the matching policy from all of the policy records at once, so that select() sees every policy cached
+ * for the token (and can use, and keep, an index of them - see am_policy_select)
  *
  */
-int am_add_session_policy_cache_entry(am_request_t *request, const char *key, struct am_policy_result *policy, struct am_namevalue *session) {
+static void policy_fetch_all(void *arg, int n, void **data, uint32_t *ln) {
 
-    int                                  status;
+    struct policy_fetch                 *fetch = arg;
 
-    uint32_t                             hash = am_hash(key);
+    struct cache_object_ctx             *ctx = malloc(n * sizeof(struct cache_object_ctx));
 
-    struct am_policy_result             *merged = policy;
+    int                                  i;
 
-    struct cache_object_ctx              ctx;
+    if (ctx == NULL) {
+        fetch->error = AM_ENOMEM;
+        return;
+    }
 
-    void                                *shm_data;                                    /* pointer into hash table */
-    uint32_t                             shm_data_sz;
+    for (i = 0; i < n; i++) {
+        fetch_expires(fetch->expires, fetch->hash, data[i]);
+        cache_object_ctx_init_data(ctx + i, data[i], (size_t)ln[i]);
+        cache_object_skip_key(ctx + i);
+    }
 
-    if (cache_fetch_readable(hash, (char *)key, &shm_data, &shm_data_sz) == 0) {
-        struct am_policy_result         *cached;
+    fetch->list = am_policy_result_deserialise_match_all(ctx, n, fetch->select, fetch->arg);
 
-        cache_object_ctx_init_data(&ctx, shm_data, (size_t)shm_data_sz);
-        cache_object_skip_key(&ctx);
-        cached = am_policy_result_deserialise(&ctx);                                  /* read cached policy */
+    for (i = 0; i < n; i++) {
+        if (fetch->error == 0) {
+            fetch->error = ctx[i].error;
+        }
+        cache_object_ctx_destroy(ctx + i);
+    }
+    free(ctx);
 
-        cache_release_readlocked_ptr(hash);
+}
 
-        status = ctx.error;
-        cache_object_ctx_destroy(&ctx);
+/*
+ * deserialise session data and those cached policies which select() picks (all of them if select is NULL); the
+ * policy records are looked at in place, under the read lock, so that a cache hit does not allocate (and free)
+ * the policies for other resources. when expires is not NULL it is set to the time the first of the session and
+ * policy records read expires
+ *
+ */
+static int get_session_policy_cache_entry(const char *key, uint32_t grace,
+        int (*select)(void *, int, const int *, const char **, char *), void *arg,
+        struct am_policy_result **policy, struct am_namevalue **session, int64_t *expires) {
 
-        if (status) {
-            return status;                                                            /* serialisation problem */
-        }
+    uint32_t                             hash = am_hash(key);
 
-        while (cached) {                                                              /* add existing policies, new ones override */
-            struct am_policy_result     *p;
+    struct cache_object_ctx              ctx;
+    int                                  status;
 
-            for (p = policy; p; p = p->next) {
-                if (strcmp(cached->resource, p->resource) == 0)
-                    break;
-            }
+    void                                *shm_data;                                    /* pointer into hash table */
+    uint32_t                             shm_data_sz;
 
-            struct am_policy_result     *next = cached->next;
+    struct policy_fetch                  fetch = { select, arg, NULL, 0, hash, expires };
 
-            if (p) {
-                cached->next = 0;                                                     /* discard existing policy */
-                delete_am_policy_result_list(&cached);
-            } else {
-                cached->next = merged;                                                /* merge (prepend) existing policy */
-                merged = cached;
-            }
+    char                                *prefix = policy_key(key, "");
 
-            cached = next;
-        }
+    if (prefix == NULL) {
+        return AM_ENOMEM;
     }
 
-    int                                  ttl = get_session_ttl(request, session);
+    if (expires != NULL) {
+        *expires = 0;
+    }
 
     cache_object_ctx_init(&ctx);
-    cache_object_write_key(&ctx, (char *)key);
-    am_policy_result_serialise(&ctx, merged);
-    am_name_value_serialise(&ctx, session);
+    cache_object_write_key(&ctx, prefix);
+    free(prefix);
 
-    if (ctx.error) {
-        status = ctx.error;
-    } else if (cache_add(hash, ctx.data, ctx.data_size, time(0) + ttl, key_equality)) {
-        status = AM_ERROR;
-    } else {
-        status = AM_SUCCESS;
+    if (ctx.error == 0 && select != NULL) {
+        if (cache_get_all_readlocked(hash, ctx.data, time(0), grace, key_prefix_equality, policy_fetch_all, &fetch) < 0) {
+            fetch.error = AM_E2BIG;                                                  /* not all of them, so none */
+        }
+    } else if (ctx.error == 0) {
+        cache_get_each_readlocked(hash, ctx.data, time(0), grace, key_prefix_equality, policy_fetch_each, &fetch);
     }
 
+    status = ctx.error ? ctx.error : fetch.error;
     cache_object_ctx_destroy(&ctx);
 
-    while (merged != policy) {                                                        /* free merged policy */
-        struct am_policy_result         *next = merged->next;
+    if (status == AM_SUCCESS && fetch.list == NULL) {
+        if (grace == 0) {
+            cache_stat_lookup(CACHE_STAT_SESSION, 0);
+        }
+        return AM_NOT_FOUND;                                                          /* nothing cached (for this resource) */
+    }
+
+    if (status == AM_SUCCESS && cache_fetch_stale_readable(hash, (char *)key, grace, &shm_data, &shm_data_sz)) {
+        status = AM_NOT_FOUND;
+    }
 
-        merged->next = 0;
-        delete_am_policy_result_list(&merged);
+    if (grace == 0) {
+        cache_stat_lookup(CACHE_STAT_SESSION, status == AM_SUCCESS);                 /* stale lookups are counted apart */
+    }
 
-        merged = next;
+    if (status) {
+        delete_am_policy_result_list(&fetch.list);
+        return status;
     }
 
+    fetch_expires(expires, hash, shm_data);
+
+    cache_object_ctx_init_data(&ctx, shm_data, (size_t)shm_data_sz);
+    cache_object_skip_key(&ctx);
+    *session = am_name_value_deserialise(&ctx);
+
+    cache_release_readlocked_ptr(hash);
+
+    status = ctx.error;
+    cache_object_ctx_destroy(&ctx);
+
+    *policy = fetch.list;
     return status;
 
 }
 
-int am_cache_init(int instance) {
-    return cache_initialise(instance);
+int am_get_session_policy_cache_entry(am_request_t *request, const char *key, struct am_policy_result **policy, struct am_namevalue **session, uint64_t *ts) {
+
+    return get_session_policy_cache_entry(key, 0, NULL, NULL, policy, session, NULL);
+
 }
 
-int am_cache_shutdown() {
-    cache_shutdown(AM_FALSE);
-    return 0;
+/*
+ * as am_get_session_policy_cache_entry, but only those cached policies which select() marks as matching
+ * (see am_policy_result_deserialise_match) are deserialised; expires (when not NULL) is set to the time the
+ * first of the records read expires
+ *
+ */
+int am_get_session_policy_cache_match(am_request_t *request, const char *key,
+        int (*select)(void *, int, const int *, const char **, char *), void *arg,
+        struct am_policy_result **policy, struct am_namevalue **session, int64_t *expires) {
+
+    return get_session_policy_cache_entry(key, 0, select, arg, policy, session, expires);
+
 }
 
-void am_cache_destroy() {
-    #ifdef UNIT_TEST
-    cache_initialise(0);
-    #endif
-    cache_shutdown(AM_TRUE);
+/*
+ * deserialise session and policy data, which may have expired up to grace seconds ago; used to serve decisions
+ * while the policy service is unavailable (see am_net_breaker_allow)
+ *
+ */
+int am_get_stale_session_policy_cache_entry(am_request_t *request, const char *key, int grace, struct am_policy_result **policy, struct am_namevalue **session) {
+
+    if (grace <= 0) {
+        return AM_NOT_FOUND;
+    }
+    return get_session_policy_cache_entry(key, (uint32_t) grace, NULL, NULL, policy, session, NULL);
+
+}
+
+/*
+ * cache a policy record, overriding an existing record for the same resource
+ *
+ */
+static int add_policy_cache_entry(uint32_t hash, const char *key, struct am_policy_result *policy, int64_t expires) {
+
+    int                                  status;
+
+    struct am_policy_result             *next = policy->next;
+
+    struct cache_object_ctx              ctx;
+
+    char                                *pkey = policy_key(key, policy->resource);
+
+    if (pkey == NULL) {
+        return AM_ENOMEM;
+    }
+
+    policy->next = NULL;                                                              /* just this one */
+
+    cache_object_ctx_init(&ctx);
+    cache_object_write_key(&ctx, pkey);
+    am_policy_result_serialise(&ctx, policy);
+
+    policy->next = next;
+    free(pkey);
+
+    if (ctx.error) {
+        status = ctx.error;
+    } else if (cache_add(hash, ctx.data, ctx.data_size, expires, key_equality)) {
+        status = AM_ERROR;
+    } else {
+        status = AM_SUCCESS;
+    }
+
+    cache_object_ctx_destroy(&ctx);
+    return status;
+
+}
+
+static int policy_count_each(void *arg, void *data, uint32_t ln) {
+
+    (*(int *)arg)++;
+    return 0;
+
+}
+
+/*
+ * number of policy records cached for the token
+ *
+ */
+static int count_policy_cache_entries(uint32_t hash, const char *key) {
+
+    struct cache_object_ctx              ctx;
+
+    int                                  count = 0;
+
+    char                                *prefix = policy_key(key, "");
+
+    if (prefix == NULL) {
+        return 0;
+    }
+
+    cache_object_ctx_init(&ctx);
+    cache_object_write_key(&ctx, prefix);
+    free(prefix);
+
+    if (ctx.error == 0) {
+        cache_get_each_readlocked(hash, ctx.data, time(0), 0, key_prefix_equality, policy_count_each, &count);
+    }
+
+    cache_object_ctx_destroy(&ctx);
+    return count;
+
+}
+
+/*
+ * cache policy and session data: the session record is only written when there is no (valid) one already and each
+ * policy is a record of its own, overriding an existing policy for the same resource.
+ *
+ * all of the records of a token are in the same cache bucket, so no more than POLICY_RECORDS_MAX policy records are
+ * kept for it: once there would be more, the token's policy records are dropped and the cache starts over with the new
+ * ones, and policy with more results than that is not cached at all (AM_E2BIG)
+ *
+ */
+int am_add_session_policy_cache_entry(am_request_t *request, const char *key, struct am_policy_result *policy, struct am_namevalue *session) {
+
+    int                                  status = AM_SUCCESS, added = 0;
+
+    uint32_t                             hash = am_hash(key);
+
+    int64_t                              expires = time(0) + get_session_ttl(request, session);
+
+    struct am_policy_result             *p;
+
+    struct cache_object_ctx              ctx;
+
+    void                                *shm_data;                                    /* pointer into hash table */
+    uint32_t                             shm_data_sz;
+
+    if (cache_fetch_readable(hash, (char *)key, &shm_data, &shm_data_sz) == 0) {
+        cache_release_readlocked_ptr(hash);
+    } else {
+        cache_object_ctx_init(&ctx);
+        cache_object_write_key(&ctx, (char *)key);
+        am_name_value_serialise(&ctx, session);
+
+        if (ctx.error) {
+            status = ctx.error;
+        } else if (cache_add(hash, ctx.data, ctx.data_size, expires, key_equality)) {
+            status = AM_ERROR;
+        }
+
+        cache_object_ctx_destroy(&ctx);
+    }
+
+    for (p = policy; p != NULL; p = p->next) {
+        added++;
+    }
+
+    if (status == AM_SUCCESS && added > 0) {
+        if (added > POLICY_RECORDS_MAX) {
+            remove_policy_cache_entries(hash, key);
+            return AM_E2BIG;
+        }
+        if (count_policy_cache_entries(hash, key) + added > POLICY_RECORDS_MAX) {
+            status = remove_policy_cache_entries(hash, key);
+        }
+    }
+
+    for (p = policy; p != NULL && status == AM_SUCCESS; p = p->next) {
+        status = add_policy_cache_entry(hash, key, p, expires);
+    }
+
+    return status;
+
+}
+
+/*
+ * single-flight session/policy requests: concurrent lookups for the same token and resource wait for
+ * the first one to update the cache instead of calling the policy service themselves. The key is a 64 bit
+ * hash, so that requests for different tokens or resources don't wait for each other
+ *
+ */
+uint64_t am_policy_flight_key(const char *token, const char *url, int scope) {
+
+    return am_hash64(url, am_hash64(token, 0)) ^ (uint64_t) scope;
+
+}
+
+int am_policy_flight_begin(uint64_t key) {
+
+    return cache_flight_begin(key, AM_POLICY_FLIGHT_WAIT) ? AM_EAGAIN : AM_SUCCESS;
+
+}
+
+void am_policy_flight_end(uint64_t key) {
+
+    cache_flight_end(key);
+
+}
+
+int am_policy_flight_wait(uint64_t key) {
+
+    return cache_flight_wait(key, AM_POLICY_FLIGHT_WAIT * 1000) ? AM_ETIMEDOUT : AM_SUCCESS;
+
+}
+
+/*
+ * count requests which ran out of their remote call time budget (com.forgerock.agents.config.connect.budget)
+ *
+ */
+void am_net_budget_exhausted() {
+
+    cache_stat_budget_exhausted();
+
+}
+
+/*
+ * circuit breaker for remote (naming) urls, shared by all agent processes: after AM_NET_BREAKER_FAILURES
+ * consecutive connection failures or timeouts, calls to the url fail fast (AM_ENOTSTARTED) for
+ * AM_NET_BREAKER_COOLDOWN seconds, after which a single probe call decides whether the url is back
+ *
+ */
+int am_net_breaker_allow(unsigned long instance_id, const char *url) {
+
+    static const char                   *thisfunc = "am_net_breaker_allow():";
+
+    switch (cache_breaker_allow(am_hash(url), url, AM_NET_BREAKER_COOLDOWN)) {
+        case CACHE_BREAKER_OPEN:
+            return AM_ENOTSTARTED;
+        case CACHE_BREAKER_HALF_OPEN:
+            AM_LOG_WARNING(instance_id, "%s circuit breaker for %s is half-open, probing", thisfunc, url);
+            break;
+    }
+    return AM_SUCCESS;
+
+}
+
+void am_net_breaker_report(unsigned long instance_id, const char *url, int status) {
+
+    static const char                   *thisfunc = "am_net_breaker_report():";
+
+    int                                  failed = status != AM_SUCCESS && status != AM_EINVAL && status != AM_ENOMEM;
+
+    switch (cache_breaker_report(am_hash(url), url, failed, AM_NET_BREAKER_FAILURES)) {
+        case CACHE_BREAKER_OPEN:
+            AM_LOG_ERROR(instance_id, "%s circuit breaker for %s is open (%s), calls fail fast for %d seconds",
+                    thisfunc, url, am_strerror(status), AM_NET_BREAKER_COOLDOWN);
+            break;
+        case CACHE_BREAKER_CLOSED:
+            AM_LOG_WARNING(instance_id, "%s circuit breaker for %s is closed", thisfunc, url);
+            break;
+    }
+
+}
+
+/*
+ * keep expired session/policy entries for grace seconds (com.forgerock.agents.cache.stale.grace)
+ *
+ */
+void am_stale_grace(int grace) {
+
+    cache_set_stale_grace(grace > 0 ? (uint32_t) grace : 0);
+
+}
+
+/*
+ * host name resolution cache, shared by all agent processes: resolved addresses are used for AM_NET_DNS_TTL
+ * seconds, after which they are refreshed by a single caller in the background while still being used; entries
+ * are told apart by a 64 bit hash of the host name and its length
+ *
+ */
+int am_net_resolved_get(const char *host, void *data, uint32_t *ln, int *expired) {
+
+    return cache_resolved_get(am_hash64(host, 0), (uint32_t) strlen(host), data, ln, expired);
+
+}
+
+int am_net_resolved_refresh(const char *host) {
+
+    return cache_resolved_refresh(am_hash64(host, 0), (uint32_t) strlen(host), AM_NET_CONNECT_TIMEOUT);
+
+}
+
+void am_net_resolved_set(const char *host, const void *data, uint32_t ln, uint32_t ms) {
+
+    cache_resolved_set(am_hash64(host, 0), (uint32_t) strlen(host), data, ln, AM_NET_DNS_TTL, ms);
+
+}
+
+/*
+ * the session data and the policy a decision was made with, kept in each process for a few seconds (while the shared
+ * cache generation stays the same) so that repeated requests for a url skip the shared cache altogether
+ *
+ */
+struct decision_entry {
+
+    uint32_t                             hash, generation;
+
+    int                                  scope;
+    char                                *token, *url;
+
+    time_t                               expires;
+    uint64_t                             used;
+
+    void                                *data;                                        /* serialised policy and session */
+    size_t                               data_sz;
+
+};
+
+static am_mutex_t                        decision_mutex;
+
+static struct decision_entry            *decisions = NULL;
+
+static unsigned int                      decision_sets = 0;
+
+static int                               decision_ttl = AM_DECISION_CACHE_TTL;
+
+static uint64_t                          decision_clock = 0;
+
+static am_bool_t                         decision_enabled = AM_FALSE;
+
+static int decision_env(const char *name, int default_value) {
+
+    char                                *env = getenv(name);
+
+    if (ISVALID(env)) {
+        char                            *endp = NULL;
+        long                             v = strtol(env, &endp, 0);
+
+        if (env < endp && *endp == '\0' && 0 <= v && v <= 65536) {
+            return (int) v;
+        }
+    }
+    return default_value;
+
+}
+
+static void decision_entry_clear(struct decision_entry *e) {
+
+    AM_FREE(e->token, e->url, e->data);
+    memset(e, 0, sizeof(struct decision_entry));
+
+}
+
+static void decision_cache_init() {
+
+    int                                  size;
+
+    if (decision_enabled) {
+        return;
+    }
+
+    size = decision_env("AM_DECISION_CACHE_SIZE", AM_DECISION_CACHE_SIZE);
+    decision_ttl = decision_env("AM_DECISION_CACHE_TTL", AM_DECISION_CACHE_TTL);
+    if (size < DECISION_WAYS || decision_ttl == 0) {
+        return;                                                                       /* disabled */
+    }
+
+    decision_sets = size / DECISION_WAYS;
+    decisions = calloc(decision_sets * DECISION_WAYS, sizeof(struct decision_entry));
+    if (decisions == NULL) {
+        return;
+    }
+
+    AM_MUTEX_INIT(&decision_mutex);
+    decision_enabled = AM_TRUE;
+
+}
+
+static void decision_cache_shutdown() {
+
+    unsigned int                         i;
+
+    if (!decision_enabled) {
+        return;
+    }
+
+    AM_MUTEX_LOCK(&decision_mutex);
+    decision_enabled = AM_FALSE;
+    for (i = 0; i < decision_sets * DECISION_WAYS; i++) {
+        decision_entry_clear(decisions + i);
+    }
+    AM_MUTEX_UNLOCK(&decision_mutex);
+
+    AM_MUTEX_DESTROY(&decision_mutex);
+    am_free(decisions);
+    decisions = NULL;
+
+}
+
+/*
+ * the shared cache generation, to be read before the shared cache is, and passed to am_add_decision_cache_entry
+ *
+ */
+uint32_t am_cache_generation() {
+
+    return cache_generation();
+
+}
+
+/*
+ * invalidate cached data held by the processes (see am_get_decision_cache_entry)
+ *
+ */
+void am_cache_invalidate() {
+
+    cache_generation_bump();
+
+}
+
+/*
+ * deserialise the session and policy a decision for token, scope and url was last made with
+ *
+ */
+int am_get_decision_cache_entry(const char *token, const char *url, int scope,
+        struct am_policy_result **policy, struct am_namevalue **session) {
+
+    uint32_t                             hash, generation;
+
+    struct decision_entry               *set;
+
+    struct cache_object_ctx              ctx;
+
+    int                                  status = AM_NOT_FOUND;
+
+    time_t                               now;
+
+    int                                  i;
+
+    if (!decision_enabled || token == NULL || url == NULL) {
+        return AM_NOT_FOUND;
+    }
+
+    hash = am_policy_flight_key(token, url, scope);
+    generation = cache_generation();
+    now = time(0);
+
+    AM_MUTEX_LOCK(&decision_mutex);
+
+    set = decisions + (hash % decision_sets) * DECISION_WAYS;
+
+    for (i = 0; i < DECISION_WAYS; i++) {
+        struct decision_entry           *e = set + i;
+
+        if (e->data == NULL || e->hash != hash || e->scope != scope || strcmp(e->url, url) || strcmp(e->token, token)) {
+            continue;
+        }
+        if (e->generation != generation || e->expires <= now) {
+            decision_entry_clear(e);
+            break;
+        }
+
+        cache_object_ctx_init_data(&ctx, e->data, e->data_sz);
+        *policy = am_policy_result_deserialise(&ctx);
+        *session = am_name_value_deserialise(&ctx);
+
+        status = ctx.error;
+        cache_object_ctx_destroy(&ctx);
+
+        if (status) {
+            delete_am_policy_result_list(policy);
+            delete_am_namevalue_list(session);
+        }
+        e->used = ++decision_clock;
+        break;
+    }
+
+    AM_MUTEX_UNLOCK(&decision_mutex);
+
+    cache_stat_lookup(CACHE_STAT_DECISION, status == AM_SUCCESS);
+    return status;
+
+}
+
+/*
+ * keep the session and (just the one) policy a decision was made with, for the request's token; generation is the
+ * shared cache generation read before that data was, so that anything invalidated since is not kept. the entry does
+ * not outlive the session and policy: expires is the time the first of the shared cache records the data was read from
+ * expires, 0 for data which has just been fetched (and expires as it would in the shared cache)
+ *
+ */
+void am_add_decision_cache_entry(am_request_t *request, const char *url, int scope, uint32_t generation,
+        int64_t expires, struct am_policy_result *policy, struct am_namevalue *session) {
+
+    const char                          *token = request != NULL ? request->token : NULL;
+
+    uint32_t                             hash;
+
+    struct decision_entry               *set, *e = NULL;
+
+    struct am_policy_result             *next;
+
+    struct cache_object_ctx              ctx;
+
+    char                                *token_copy, *url_copy;
+
+    int                                  i;
+
+    time_t                               now = time(0);
+
+    if (!decision_enabled || token == NULL || url == NULL || policy == NULL) {
+        return;
+    }
+
+    if (expires == 0) {
+        expires = now + get_session_ttl(request, session);
+    }
+    if (expires > now + decision_ttl) {
+        expires = now + decision_ttl;
+    } else if (expires <= now) {
+        return;                                                                       /* already expired */
+    }
+
+    hash = am_policy_flight_key(token, url, scope);
+
+    next = policy->next;
+    policy->next = NULL;
+
+    cache_object_ctx_init(&ctx);
+    am_policy_result_serialise(&ctx, policy);
+    am_name_value_serialise(&ctx, session);
+
+    policy->next = next;
+
+    token_copy = strdup(token);
+    url_copy = strdup(url);
+
+    if (ctx.error || token_copy == NULL || url_copy == NULL) {
+        cache_object_ctx_destroy(&ctx);
+        AM_FREE(token_copy, url_copy);
+        return;
+    }
+
+    AM_MUTEX_LOCK(&decision_mutex);
+
+    set = decisions + (hash % decision_sets) * DECISION_WAYS;
+
+    for (i = 0; i < DECISION_WAYS; i++) {
+        struct decision_entry           *c = set + i;
+
+        if (c->data != NULL && c->hash == hash && c->scope == scope && !strcmp(c->url, url) && !strcmp(c->token, token)) {
+            e = c;                                                                    /* replace this one */
+            break;
+        }
+        if (e == NULL || (e->data != NULL && (c->data == NULL || c->used < e->used))) {
+            e = c;                                                                    /* free or least recently used */
+        }
+    }
+
+    decision_entry_clear(e);
+    e->hash = hash;
+    e->generation = generation;
+    e->scope = scope;
+    e->token = token_copy;
+    e->url = url_copy;
+    e->expires = (time_t) expires;
+    e->used = ++decision_clock;
+    e->data = ctx.data;                                                               /* the entry owns it now */
+    e->data_sz = ctx.data_size;
+
+    AM_MUTEX_UNLOCK(&decision_mutex);
+
+}
+
+/*
+ * subtree mode policy indexes (see am_policy_select), kept next to the decisions: one for each recent token, reused for
+ * as long as the shared cache generation stays the same and the very same policy results are selected from. the request
+ * threads share them, each holding a reference while it selects with one
+ *
+ */
+struct am_policy_index {
+
+    int                                  ref;
+
+    uint32_t                             hash, generation;
+    char                                *token;
+
+    am_bool_t                            case_ignore;
+    int                                  count;
+    int                                 *scopes;
+    char                               **resources;                                   /* all in one allocation */
+
+    am_url_matcher_t                    *matcher;
+
+    uint64_t                             used;
+
+};
+
+static am_mutex_t                        index_mutex;
+
+static struct am_policy_index          **indexes = NULL;
+
+static unsigned int                      index_sets = 0;
+
+static uint64_t                          index_clock = 0;
+
+static am_bool_t                         index_enabled = AM_FALSE;
+
+static void policy_index_unref(struct am_policy_index *pi) {
+
+    if (--pi->ref == 0) {
+        am_url_matcher_free(pi->matcher);
+        free(pi);
+    }
+
+}
+
+static am_bool_t policy_index_equals(struct am_policy_index *pi, int count, const int *scopes, const char **resources,
+        am_bool_t case_ignore) {
+
+    int                                  i;
+
+    if (pi->count != count || pi->case_ignore != case_ignore) {
+        return AM_FALSE;
+    }
+    for (i = 0; i < count; i++) {
+        if (pi->scopes[i] != scopes[i] || (pi->resources[i] == NULL) != (resources[i] == NULL) ||
+                (resources[i] != NULL && strcmp(pi->resources[i], resources[i]))) {
+            return AM_FALSE;
+        }
+    }
+    return AM_TRUE;
+
+}
+
+static void policy_index_init() {
+
+    int                                  size;
+
+    if (index_enabled) {
+        return;
+    }
+
+    size = decision_env("AM_POLICY_INDEX_CACHE_SIZE", AM_POLICY_INDEX_CACHE_SIZE);
+    if (size < DECISION_WAYS) {
+        return;                                                                       /* disabled */
+    }
+
+    index_sets = size / DECISION_WAYS;
+    indexes = calloc(index_sets * DECISION_WAYS, sizeof(struct am_policy_index *));
+    if (indexes == NULL) {
+        return;
+    }
+
+    AM_MUTEX_INIT(&index_mutex);
+    index_enabled = AM_TRUE;
+
+}
+
+static void policy_index_shutdown() {
+
+    unsigned int                         i;
+
+    if (!index_enabled) {
+        return;
+    }
+
+    AM_MUTEX_LOCK(&index_mutex);
+    index_enabled = AM_FALSE;
+    for (i = 0; i < index_sets * DECISION_WAYS; i++) {
+        if (indexes[i] != NULL) {
+            policy_index_unref(indexes[i]);                                           /* or by the thread using it */
+        }
+    }
+    AM_MUTEX_UNLOCK(&index_mutex);
+
+    AM_MUTEX_DESTROY(&index_mutex);
+    am_free(indexes);
+    indexes = NULL;
+
+}
+
+/*
+ * the index kept for token, when it was built (in this shared cache generation) for the same policy results; its matcher
+ * is returned in matcher, to be used until am_release_policy_index
+ *
+ */
+struct am_policy_index *am_get_policy_index(const char *token, int count, const int *scopes, const char **resources,
+        am_bool_t case_ignore, am_url_matcher_t **matcher) {
+
+    uint32_t                             hash, generation;
+
+    struct am_policy_index             **set, *found = NULL;
+
+    int                                  i;
+
+    if (!index_enabled || token == NULL) {
+        return NULL;
+    }
+
+    hash = am_hash(token);
+    generation = cache_generation();
+
+    AM_MUTEX_LOCK(&index_mutex);
+
+    set = indexes + (hash % index_sets) * DECISION_WAYS;
+
+    for (i = 0; i < DECISION_WAYS; i++) {
+        struct am_policy_index          *pi = set[i];
+
+        if (pi == NULL || pi->hash != hash || strcmp(pi->token, token)) {
+            continue;
+        }
+        if (pi->generation != generation || !policy_index_equals(pi, count, scopes, resources, case_ignore)) {
+            policy_index_unref(pi);                                                   /* stale or policy has changed */
+            set[i] = NULL;
+            break;
+        }
+
+        pi->ref++;
+        pi->used = ++index_clock;
+        *matcher = pi->matcher;
+        found = pi;
+        break;
+    }
+
+    AM_MUTEX_UNLOCK(&index_mutex);
+
+    cache_stat_lookup(CACHE_STAT_INDEX, found != NULL);
+    return found;
+
+}
+
+/*
+ * keep the index (matcher) built for the policy results of token; generation is the shared cache generation read before
+ * the policy results were. returns the index (held, to be released with am_release_policy_index) when it is kept,
+ * NULL when it is not - the caller still owns the matcher then
+ *
+ */
+struct am_policy_index *am_add_policy_index(const char *token, uint32_t generation, int count, const int *scopes,
+        const char **resources, am_bool_t case_ignore, am_url_matcher_t *matcher) {
+
+    uint32_t                             hash;
+
+    struct am_policy_index             **set, *pi;
+
+    size_t                               size, token_sz;
+
+    char                                *strings;
+
+    int                                  i, slot = -1;
+
+    if (!index_enabled || token == NULL || count <= 0) {
+        return NULL;
+    }
+
+    token_sz = strlen(token) + 1;
+    size = sizeof(struct am_policy_index) + count * (sizeof(char *) + sizeof(int)) + token_sz;
+    for (i = 0; i < count; i++) {
+        if (resources[i] != NULL) {
+            size += strlen(resources[i]) + 1;
+        }
+    }
+
+    pi = malloc(size);
+    if (pi == NULL) {
+        return NULL;
+    }
+
+    pi->resources = (char **) (pi + 1);
+    pi->scopes = (int *) (pi->resources + count);
+    strings = (char *) (pi->scopes + count);
+
+    pi->token = strings;
+    memcpy(strings, token, token_sz);
+    strings += token_sz;
+    for (i = 0; i < count; i++) {
+        pi->scopes[i] = scopes[i];
+        pi->resources[i] = NULL;
+        if (resources[i] != NULL) {
+            size_t                       sz = strlen(resources[i]) + 1;
+
+            pi->resources[i] = strings;
+            memcpy(strings, resources[i], sz);
+            strings += sz;
+        }
+    }
+
+    hash = am_hash(token);
+    pi->ref = 2;                                                                      /* the cache's and the caller's */
+    pi->hash = hash;
+    pi->generation = generation;
+    pi->case_ignore = case_ignore;
+    pi->count = count;
+    pi->matcher = matcher;
+
+    AM_MUTEX_LOCK(&index_mutex);
+
+    set = indexes + (hash % index_sets) * DECISION_WAYS;
+
+    for (i = 0; i < DECISION_WAYS; i++) {
+        struct am_policy_index          *c = set[i];
+
+        if (c != NULL && c->hash == hash && !strcmp(c->token, token)) {
+            slot = i;                                                                 /* replace this one */
+            break;
+        }
+        if (slot == -1 || (set[slot] != NULL && (c == NULL || c->used < set[slot]->used))) {
+            slot = i;                                                                 /* free or least recently used */
+        }
+    }
+
+    if (set[slot] != NULL) {
+        policy_index_unref(set[slot]);
+    }
+    pi->used = ++index_clock;
+    set[slot] = pi;
+
+    AM_MUTEX_UNLOCK(&index_mutex);
+
+    return pi;
+
+}
+
+void am_release_policy_index(struct am_policy_index *index) {
+
+    am_bool_t                            enabled = index_enabled;
+
+    if (index == NULL) {
+        return;
+    }
+
+    if (enabled) {
+        AM_MUTEX_LOCK(&index_mutex);
+    }
+    policy_index_unref(index);
+    if (enabled) {
+        AM_MUTEX_UNLOCK(&index_mutex);
+    }
+
+}
+
+int am_cache_init(int instance) {
+    int rv;
+    decision_cache_init();
+    policy_index_init();
+    rv = cache_initialise(instance);
+    if (rv == AM_SUCCESS && cache_created()) {
+        cache_snapshot_load_file();
+    }
+    return rv;
+}
+
+int am_cache_shutdown() {
+    decision_cache_shutdown();
+    policy_index_shutdown();
+    if (cache_detach()) {
+        cache_snapshot_save_file();                                           /* only the last process to leave */
+    }
+    cache_shutdown(AM_FALSE);
+    return 0;
+}
+
+void am_cache_destroy() {
+    decision_cache_shutdown();
+    policy_index_shutdown();
+    #ifdef UNIT_TEST
+    cache_initialise(0);
+    #endif
+    cache_shutdown(AM_TRUE);
 }
 
 int am_cache_cleanup(int instance) {
     return cache_cleanup(instance);
 }
+
+/*
+ * shared cache statistics, as text, for a status response; scan adds the sections which walk the whole cache
+ *
+ */
+int am_cache_status(char **report, int scan) {
+    return cache_status(report, scan);
+}
+
+/*
+ * shared cache counters of another process's agent instance (for agentadmin), read without attaching to that cache;
+ * AM_NOT_FOUND when that instance has no cache (the agent is not running)
+ *
+ */
+int am_cache_status_instance(int instance, char **report) {
+    return cache_status_readonly(instance, report);
+}
@@ -203,3 +203,33 @@ void *am_parse_session_xml(unsigned long instance_id, const char *xml, size_t xm
 
     return (void *) r;
 }
+
+static void *session_xml_stream_result(void *userData, am_bool_t ok) {
+    am_xml_parser_ctx_t *ctx = (am_xml_parser_ctx_t *) userData;
+    struct am_namevalue *r = ctx->list;
+    if (!ok) {
+        delete_am_namevalue_list(&ctx->list);
+        r = NULL;
+    }
+    if (ctx->status != AM_SUCCESS) {
+        AM_LOG_ERROR(ctx->instance_id, "am_parse_session_xml(): %s", am_strerror(ctx->status));
+    }
+    am_free(ctx->data);
+    free(ctx);
+    return (void *) r;
+}
+
+/**
+ * Create an incremental parser for a session service (PLL) response, see am_policy_xml_stream
+ */
+am_xml_stream_t *am_session_xml_stream(unsigned long instance_id) {
+    am_xml_parser_ctx_t *ctx = calloc(1, sizeof (am_xml_parser_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->instance_id = instance_id;
+    ctx->resource_name = AM_FALSE;
+    ctx->status = AM_SUCCESS;
+    return am_xml_stream_create(instance_id, "am_parse_session_xml():", ctx,
+            start_element, end_element, character_data, session_xml_stream_result);
+}
@@ -578,6 +578,93 @@ int am_shm_delete(char *name) {
 
 }
 
+/**
+ * Map an existing shared memory area for reading only: it is not created when it does not exist, and this
+ * process is not counted as one of its users (see am_shm_create). Unmap with am_shm_close_readonly.
+ *
+ * @return NULL when there is no such area (or it cannot be mapped)
+ */
+am_shm_t *am_shm_open_readonly(const char *name) {
+    am_shm_t *ret;
+    void *area;
+#ifdef _WIN32
+    HANDLE h;
+    char shm_name[AM_PATH_SIZE];
+
+    snprintf(shm_name, sizeof (shm_name), AM_GLOBAL_PREFIX"%s_s", name);
+    h = OpenFileMappingA(FILE_MAP_READ, FALSE, shm_name);
+    if (h == NULL) {
+        return NULL;
+    }
+    area = MapViewOfFile(h, FILE_MAP_READ, 0, 0, 0);
+    if (area == NULL) {
+        CloseHandle(h);
+        return NULL;
+    }
+#else
+    int fd;
+    uint64_t size;
+    char shm_name[AM_PATH_SIZE];
+
+    snprintf(shm_name, sizeof (shm_name),
+#ifdef __sun
+            "/%s_s"
+#else
+            "%s_s"
+#endif
+            , name);
+    fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+    area = mmap(NULL, SIZEOF_mem_pool, PROT_READ, MAP_SHARED, fd, 0);
+    if (area == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    size = ((struct mem_pool *) area)->size;
+    munmap(area, SIZEOF_mem_pool);
+    area = size >= SIZEOF_mem_pool ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (area == MAP_FAILED) {
+        return NULL;
+    }
+#endif
+
+    ret = calloc(1, sizeof (am_shm_t));
+    if (ret == NULL) {
+#ifdef _WIN32
+        UnmapViewOfFile(area);
+        CloseHandle(h);
+#else
+        munmap(area, size);
+#endif
+        return NULL;
+    }
+#ifdef _WIN32
+    ret->h[2] = h;
+#else
+    ret->fd = -1;
+    ret->local_size = size;
+#endif
+    ret->pool = area;
+    ret->base_ptr = (char *) area + SIZEOF_mem_pool;
+    return ret;
+}
+
+void am_shm_close_readonly(am_shm_t *am) {
+    if (am == NULL) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(am->pool);
+    CloseHandle(am->h[2]);
+#else
+    munmap(am->pool, am->local_size);
+#endif
+    free(am);
+}
+
 /**
  * get the max pool size for shared memory
  */
@@ -0,0 +1,815 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2014 - 2016 ForgeRock AS.
+ */
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+#include "thread.h"
+
+/*
+ * Compiled URL pattern lists (not-enforced urls): patterns are split by request method
+ * and, unless they are regular expressions, put in a trie keyed by their literal prefix
+ * (everything up to the first * or -*- wildcard). A url is then matched by walking the trie
+ * once: patterns without a wildcard match when the walk ends on their node, wildcard patterns
+ * found along the way are checked against their literal suffix first and only then matched
+ * (compiled once, see am_url_pattern_create).
+ *
+ * Patterns may carry an id (policy results, see am_policy_select), in which case
+ * am_url_matcher_select reports every pattern which matches, not just the first one.
+ */
+
+#define URL_MATCHER_ANY_METHOD -1
+#define URL_MATCHER_CACHE_SIZE 16
+
+struct url_node {
+    int exact; /* first pattern without a wildcard which ends here, -1 if none */
+    int pattern; /* first wildcard pattern with this literal prefix, -1 if none */
+};
+
+struct url_edge {
+    int node;
+    int child; /* 0 if the slot is free (the root is never a child) */
+    unsigned char c;
+};
+
+struct url_pattern {
+    char *value; /* NULL for a pattern without a wildcard */
+    am_url_pattern_t *compiled;
+    int id;
+    size_t prefix; /* length of the literal text before the first wildcard */
+    size_t suffix; /* length of the literal text after the last wildcard */
+    int next;
+};
+
+struct url_partition {
+    int method;
+    struct url_node *node;
+    int node_sz;
+    int node_cap;
+    struct url_edge *edge;
+    unsigned int edge_mask;
+    int edge_sz;
+    struct url_pattern *pattern;
+    int pattern_sz;
+    char **regex;
+    int regex_sz;
+};
+
+struct am_url_matcher {
+    unsigned long instance_id;
+    am_bool_t case_ignore;
+    am_bool_t regex;
+    int size;
+    struct url_partition *partition;
+};
+
+struct not_enforced_ip {
+    int method;
+    am_ip_table_t *ip;
+};
+
+struct not_enforced_ext {
+    am_ip_table_t *ip;
+    am_url_matcher_t *url;
+};
+
+struct am_not_enforced {
+    unsigned long instance_id;
+    uint64_t ts;
+    int size;
+    int ip_size;
+    int ext_size;
+    int flags;
+    int ref;
+    am_url_matcher_t *url; /* [0]=url entries */
+    am_url_matcher_t *method_url; /* [GET,0]=url entries */
+    am_ip_table_t *ip; /* [0]=ip entries */
+    struct not_enforced_ip *method_ip; /* [GET,0]=ip entries, a table for each method */
+    int method_ip_sz;
+    struct not_enforced_ext *ext; /* [0]=ip list|url list entries */
+    int ext_sz;
+};
+
+static struct {
+    am_mutex_t lock;
+    am_bool_t init;
+    struct am_not_enforced *entry[URL_MATCHER_CACHE_SIZE];
+} not_enforced_cache;
+
+static unsigned char fold(am_bool_t case_ignore, char c) {
+    return case_ignore ? (unsigned char) tolower((unsigned char) c) : (unsigned char) c;
+}
+
+am_url_matcher_t *am_url_matcher_create(unsigned long instance_id, am_bool_t case_ignore, am_bool_t regex) {
+    am_url_matcher_t *m = calloc(1, sizeof (am_url_matcher_t));
+    if (m != NULL) {
+        m->instance_id = instance_id;
+        m->case_ignore = case_ignore;
+        m->regex = regex;
+    }
+    return m;
+}
+
+void am_url_matcher_free(am_url_matcher_t *m) {
+    int i, j;
+    if (m == NULL) {
+        return;
+    }
+    for (i = 0; i < m->size; i++) {
+        struct url_partition *part = &m->partition[i];
+        for (j = 0; j < part->pattern_sz; j++) {
+            AM_FREE(part->pattern[j].value, part->pattern[j].compiled);
+        }
+        for (j = 0; j < part->regex_sz; j++) {
+            free(part->regex[j]);
+        }
+        AM_FREE(part->node, part->edge, part->pattern, part->regex);
+    }
+    am_free(m->partition);
+    free(m);
+}
+
+static struct url_partition *get_partition(am_url_matcher_t *m, int method) {
+    struct url_partition *p;
+    int i;
+    for (i = 0; i < m->size; i++) {
+        if (m->partition[i].method == method) {
+            return &m->partition[i];
+        }
+    }
+    p = realloc(m->partition, (m->size + 1) * sizeof (struct url_partition));
+    if (p == NULL) {
+        return NULL;
+    }
+    m->partition = p;
+    p = &m->partition[m->size++];
+    memset(p, 0, sizeof (struct url_partition));
+    p->method = method;
+    return p;
+}
+
+static int add_node(struct url_partition *p) {
+    if (p->node_sz == p->node_cap) {
+        int cap = p->node_cap == 0 ? 64 : p->node_cap * 2;
+        struct url_node *n = realloc(p->node, cap * sizeof (struct url_node));
+        if (n == NULL) {
+            return -1;
+        }
+        p->node = n;
+        p->node_cap = cap;
+    }
+    p->node[p->node_sz].exact = -1;
+    p->node[p->node_sz].pattern = -1;
+    return p->node_sz++;
+}
+
+static struct url_edge *find_edge(struct url_edge *edge, unsigned int mask, int node, unsigned char c) {
+    unsigned int i = ((unsigned int) node * 31 + c) & mask;
+    while (edge[i].child != 0) {
+        if (edge[i].node == node && edge[i].c == c) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &edge[i];
+}
+
+static int grow_edges(struct url_partition *p) {
+    unsigned int i, mask = p->edge == NULL ? 63 : p->edge_mask * 2 + 1;
+    struct url_edge *edge = calloc(mask + 1, sizeof (struct url_edge));
+    if (edge == NULL) {
+        return AM_ENOMEM;
+    }
+    if (p->edge != NULL) {
+        for (i = 0; i <= p->edge_mask; i++) {
+            if (p->edge[i].child != 0) {
+                *find_edge(edge, mask, p->edge[i].node, p->edge[i].c) = p->edge[i];
+            }
+        }
+        free(p->edge);
+    }
+    p->edge = edge;
+    p->edge_mask = mask;
+    return AM_SUCCESS;
+}
+
+/**
+ * node for the (folded) literal text, created if not there yet
+ */
+static int add_prefix(am_url_matcher_t *m, struct url_partition *p, const char *text, size_t len) {
+    int node = p->node_sz == 0 ? add_node(p) : 0;
+    size_t i;
+
+    for (i = 0; i < len && node >= 0; i++) {
+        unsigned char c = fold(m->case_ignore, text[i]);
+        struct url_edge *e;
+        if (p->edge == NULL || (unsigned int) (p->edge_sz + 1) * 2 > p->edge_mask) {
+            if (grow_edges(p) != AM_SUCCESS) {
+                return -1;
+            }
+        }
+        e = find_edge(p->edge, p->edge_mask, node, c);
+        if (e->child == 0) {
+            int child = add_node(p);
+            if (child < 0) {
+                return -1;
+            }
+            e->node = node;
+            e->c = c;
+            e->child = child;
+            p->edge_sz++;
+        }
+        node = e->child;
+    }
+    return node;
+}
+
+static struct url_pattern *add_pattern(struct url_partition *p, int id) {
+    struct url_pattern *up = realloc(p->pattern, (p->pattern_sz + 1) * sizeof (struct url_pattern));
+    if (up == NULL) {
+        return NULL;
+    }
+    p->pattern = up;
+    up = &p->pattern[p->pattern_sz];
+    memset(up, 0, sizeof (struct url_pattern));
+    up->id = id;
+    return up;
+}
+
+/**
+ * Add a pattern, matched only for requests with this method (or any method if -1).
+ */
+int am_url_matcher_add(am_url_matcher_t *m, int method, const char *pattern) {
+    return am_url_matcher_add_id(m, method, pattern, -1);
+}
+
+/**
+ * Add a pattern with an id, as reported by am_url_matcher_select (ids are not kept for
+ * regular expressions).
+ */
+int am_url_matcher_add_id(am_url_matcher_t *m, int method, const char *pattern, int id) {
+    static const char *thisfunc = "am_url_matcher_add():";
+    struct url_partition *p;
+    struct url_pattern *up;
+    const char *w, *lw;
+    size_t len;
+    int node;
+
+    if (m == NULL || ISINVALID(pattern)) {
+        return AM_EINVAL;
+    }
+    if ((p = get_partition(m, method)) == NULL) {
+        return AM_ENOMEM;
+    }
+
+    if (m->regex) {
+        char **r = realloc(p->regex, (p->regex_sz + 1) * sizeof (char *));
+        if (r == NULL) {
+            return AM_ENOMEM;
+        }
+        p->regex = r;
+        if ((p->regex[p->regex_sz] = strdup(pattern)) == NULL) {
+            return AM_ENOMEM;
+        }
+        p->regex_sz++;
+        return AM_SUCCESS;
+    }
+
+    len = strlen(pattern);
+    w = strchr(pattern, '*');
+    if (w == NULL) {
+        node = add_prefix(m, p, pattern, len);
+        if (node < 0 || (up = add_pattern(p, id)) == NULL) {
+            return AM_ENOMEM;
+        }
+        up->next = p->node[node].exact;
+        p->node[node].exact = p->pattern_sz++;
+        return AM_SUCCESS;
+    }
+
+    if (len == 1 || strstr(pattern, " *") != NULL || strstr(pattern, "* ") != NULL) {
+        /* policy_compare_url would never match these */
+        AM_LOG_WARNING(m->instance_id, "%s invalid pattern '%s'", thisfunc, pattern);
+        return AM_SUCCESS;
+    }
+
+    if ((up = add_pattern(p, id)) == NULL) {
+        return AM_ENOMEM;
+    }
+
+    /* literal prefix ends at the first '*', or at the '-' of a leading "-*-" */
+    up->prefix = w - pattern;
+    if (w > pattern && w[-1] == '-' && w[1] == '-') {
+        up->prefix--;
+    }
+    /* literal suffix starts after the last '*', or after its trailing '-' if it looks like "-*-"
+     * (this might be shorter than the actual literal suffix, never longer) */
+    lw = strrchr(pattern, '*');
+    up->suffix = len - (lw - pattern) - 1;
+    if (lw > pattern && lw[-1] == '-' && lw[1] == '-') {
+        up->suffix--;
+    }
+
+    node = add_prefix(m, p, pattern, up->prefix);
+    if (node < 0 || (up->value = strdup(pattern)) == NULL) {
+        return AM_ENOMEM;
+    }
+    up->compiled = am_url_pattern_create(pattern, m->case_ignore);
+    up->next = p->node[node].pattern;
+    p->node[node].pattern = p->pattern_sz++;
+    return AM_SUCCESS;
+}
+
+static am_bool_t suffix_matches(am_url_matcher_t *m, const char *pattern, size_t suffix,
+        const char *url, size_t url_sz) {
+    const char *s = pattern + strlen(pattern) - suffix;
+    size_t i;
+    if (suffix > url_sz) {
+        return AM_FALSE;
+    }
+    url += url_sz - suffix;
+    for (i = 0; i < suffix; i++) {
+        if (fold(m->case_ignore, s[i]) != fold(m->case_ignore, url[i])) {
+            return AM_FALSE;
+        }
+    }
+    return AM_TRUE;
+}
+
+/**
+ * the url as a null terminated string (a copy when only the first url_sz characters are matched)
+ */
+static const char *url_string(const char *url, size_t url_sz, char **copy) {
+    if (url[url_sz] == '\0') {
+        return url;
+    }
+    if (*copy == NULL) {
+        *copy = strndup(url, url_sz);
+    }
+    return *copy;
+}
+
+/**
+ * walk the partition trie with the url; without status the walk stops at the first matching pattern,
+ * otherwise status[id] is set for each matching pattern (AM_EXACT_MATCH or AM_EXACT_PATTERN_MATCH)
+ * and the number of matches returned
+ */
+static int partition_matches(am_request_t *r, am_url_matcher_t *m, struct url_partition *p,
+        const char *url, size_t url_sz, char **copy, char *status) {
+    const char *s;
+    size_t i;
+    int j, node, found = 0;
+
+    if (m->regex) {
+        for (j = 0; j < p->regex_sz; j++) {
+            if ((s = url_string(url, url_sz, copy)) != NULL && match(r->instance_id, s, p->regex[j]) == AM_OK) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    if (p->node_sz == 0) {
+        return 0;
+    }
+    for (i = 0, node = 0;; i++) {
+        for (j = p->node[node].pattern; j >= 0; j = p->pattern[j].next) {
+            struct url_pattern *up = &p->pattern[j];
+            if (url_sz - i < up->suffix || !suffix_matches(m, up->value, up->suffix, url, url_sz)) {
+                continue;
+            }
+            if (status != NULL && (up->id < 0 || status[up->id] != AM_NO_MATCH)) {
+                continue;
+            }
+            if ((s = url_string(url, url_sz, copy)) != NULL && (up->compiled != NULL ?
+                    am_url_pattern_match(up->compiled, s) : policy_compare_url(r, up->value, s)) != AM_NO_MATCH) {
+                AM_LOG_DEBUG(r->instance_id, "am_url_matcher_match(): %s matches %s", s, up->value);
+                if (status == NULL) {
+                    return 1;
+                }
+                status[up->id] = AM_EXACT_PATTERN_MATCH;
+                found++;
+            }
+        }
+        if (i == url_sz) {
+            for (j = p->node[node].exact; j >= 0; j = p->pattern[j].next) {
+                if (status == NULL) {
+                    return 1;
+                }
+                if (p->pattern[j].id < 0) {
+                    continue;
+                }
+                if (status[p->pattern[j].id] == AM_NO_MATCH) {
+                    found++;
+                }
+                status[p->pattern[j].id] = AM_EXACT_MATCH;
+            }
+            return found;
+        }
+        if (p->edge == NULL) {
+            return found;
+        }
+        node = find_edge(p->edge, p->edge_mask, node, fold(m->case_ignore, url[i]))->child;
+        if (node == 0) {
+            return found;
+        }
+    }
+}
+
+/**
+ * Does any pattern (for any method, or for this method) match the first url_sz characters of the url?
+ */
+am_bool_t am_url_matcher_match(am_request_t *r, am_url_matcher_t *m, int method, const char *url, size_t url_sz) {
+    char *copy = NULL;
+    am_bool_t found = AM_FALSE;
+    int i;
+
+    if (m == NULL || url == NULL) {
+        return AM_FALSE;
+    }
+    for (i = 0; i < m->size && !found; i++) {
+        struct url_partition *p = &m->partition[i];
+        if (p->method == URL_MATCHER_ANY_METHOD || p->method == method) {
+            found = partition_matches(r, m, p, url, url_sz, &copy, NULL) > 0;
+        }
+    }
+    am_free(copy);
+    return found;
+}
+
+/**
+ * Set status[id] (initialised to AM_NO_MATCH by the caller) for every pattern with an id which
+ * matches the url; returns the number of patterns matched.
+ */
+int am_url_matcher_select(am_request_t *r, am_url_matcher_t *m, int method, const char *url, char *status) {
+    char *copy = NULL;
+    int i, found = 0;
+
+    if (m == NULL || url == NULL || status == NULL || m->regex) {
+        return 0;
+    }
+    for (i = 0; i < m->size; i++) {
+        struct url_partition *p = &m->partition[i];
+        if (p->method == URL_MATCHER_ANY_METHOD || p->method == method) {
+            found += partition_matches(r, m, p, url, strlen(url), &copy, status);
+        }
+    }
+    am_free(copy);
+    return found;
+}
+
+/*
+ * Not enforced url lists, compiled once per configuration snapshot and shared by the requests
+ * in this process.
+ */
+
+#define NOT_ENFORCED_FLAGS(c) (((c)->url_eval_case_ignore ? 1 : 0) | ((c)->not_enforced_regex_enable ? 2 : 0) | \
+    ((c)->not_enforced_ext_regex_enable ? 4 : 0))
+
+static void not_enforced_free(struct am_not_enforced *ne) {
+    int i;
+    am_url_matcher_free(ne->url);
+    am_url_matcher_free(ne->method_url);
+    am_ip_table_free(ne->ip);
+    for (i = 0; i < ne->method_ip_sz; i++) {
+        am_ip_table_free(ne->method_ip[i].ip);
+    }
+    for (i = 0; i < ne->ext_sz; i++) {
+        am_ip_table_free(ne->ext[i].ip);
+        am_url_matcher_free(ne->ext[i].url);
+    }
+    AM_FREE(ne->method_ip, ne->ext);
+    free(ne);
+}
+
+/**
+ * method of a [GET,0]= entry, -1 for a plain [0]= entry or AM_ENOMEM
+ */
+static int entry_method(am_config_map_t *m) {
+    char *p = m->name != NULL ? strstr(m->name, AM_COMMA_CHAR) : NULL;
+    char *pv;
+    int method;
+    if (p == NULL) {
+        return URL_MATCHER_ANY_METHOD;
+    }
+    if ((pv = strndup(m->name, p - m->name)) == NULL) {
+        return AM_ENOMEM;
+    }
+    method = am_method_str_to_num(pv);
+    free(pv);
+    return method;
+}
+
+/**
+ * not enforced client ip list: one address table for plain entries and one for each request method
+ */
+static int not_enforced_ip_create(am_request_t *r, struct am_not_enforced *ne) {
+    am_config_t *c = r->conf;
+    int sz = c->not_enforced_ip_map_sz;
+    const char **list = malloc(sz * sizeof (char *));
+    int *method = malloc(sz * sizeof (int));
+    int i, j, n, status = AM_SUCCESS;
+
+    if (list == NULL || method == NULL) {
+        AM_FREE(list, method);
+        return AM_ENOMEM;
+    }
+    for (i = 0; i < sz && status == AM_SUCCESS; i++) {
+        if ((method[i] = entry_method(&c->not_enforced_ip_map[i])) == AM_ENOMEM) {
+            status = AM_ENOMEM;
+        }
+    }
+
+    for (i = 0; i < sz && status == AM_SUCCESS; i++) {
+        am_ip_table_t *t;
+        for (j = 0; j < i && method[j] != method[i]; j++);
+        if (j < i) continue; /* table for this method is done already */
+
+        for (n = 0, j = i; j < sz; j++) {
+            if (method[j] == method[i] && ISVALID(c->not_enforced_ip_map[j].value)) {
+                list[n++] = c->not_enforced_ip_map[j].value;
+            }
+        }
+        if ((t = am_ip_table_create(r->instance_id, list, n)) == NULL) {
+            status = AM_ENOMEM;
+        } else if (method[i] == URL_MATCHER_ANY_METHOD) {
+            ne->ip = t;
+        } else {
+            struct not_enforced_ip *mi = realloc(ne->method_ip, (ne->method_ip_sz + 1) * sizeof (struct not_enforced_ip));
+            if (mi == NULL) {
+                am_ip_table_free(t);
+                status = AM_ENOMEM;
+            } else {
+                ne->method_ip = mi;
+                mi[ne->method_ip_sz].method = method[i];
+                mi[ne->method_ip_sz++].ip = t;
+            }
+        }
+    }
+    AM_FREE(list, method);
+    return status;
+}
+
+/**
+ * extended not enforced url list, entries are "ip ip...|url url..."
+ */
+static int not_enforced_ext_create(am_request_t *r, struct am_not_enforced *ne) {
+    am_config_t *c = r->conf;
+    int i, status = AM_SUCCESS;
+
+    if ((ne->ext = calloc(c->not_enforced_ext_map_sz, sizeof (struct not_enforced_ext))) == NULL) {
+        return AM_ENOMEM;
+    }
+    for (i = 0; i < c->not_enforced_ext_map_sz && status == AM_SUCCESS; i++) {
+        am_config_map_t *m = &c->not_enforced_ext_map[i];
+        struct not_enforced_ext *e = &ne->ext[ne->ext_sz];
+        const char **list = NULL;
+        unsigned int list_sz = 0;
+        char *is, *v, *t, *p;
+
+        if (!ISVALID(m->value)) continue;
+        p = strstr(m->value, AM_PIPE_CHAR); /* 10.1.1.0/24 10.1.2.1-10.1.2.7|url1 url2 */
+        if (p == NULL) continue;
+        if ((is = strdup(m->value)) == NULL) {
+            status = AM_ENOMEM;
+            break;
+        }
+        is[p - m->value] = '\0';
+
+        for ((v = strtok_r(is, AM_SPACE_CHAR, &t)); v; (v = strtok_r(NULL, AM_SPACE_CHAR, &t))) {
+            const char **l = realloc(list, (list_sz + 1) * sizeof (char *));
+            if (l == NULL) {
+                status = AM_ENOMEM;
+                break;
+            }
+            list = l;
+            list[list_sz++] = v;
+        }
+        if (status == AM_SUCCESS && (e->ip = am_ip_table_create(r->instance_id, list, list_sz)) == NULL) {
+            status = AM_ENOMEM;
+        }
+        if (status == AM_SUCCESS && (e->url = am_url_matcher_create(r->instance_id,
+                c->url_eval_case_ignore, c->not_enforced_ext_regex_enable)) == NULL) {
+            status = AM_ENOMEM;
+        }
+        for ((v = strtok_r(is + (p - m->value) + 1, AM_SPACE_CHAR, &t)); v && status == AM_SUCCESS;
+                (v = strtok_r(NULL, AM_SPACE_CHAR, &t))) {
+            status = am_url_matcher_add(e->url, URL_MATCHER_ANY_METHOD, v);
+        }
+        ne->ext_sz++; /* freed with the rest, even if incomplete */
+        am_free(list);
+        free(is);
+    }
+    return status;
+}
+
+static struct am_not_enforced *not_enforced_create(am_request_t *r) {
+    static const char *thisfunc = "not_enforced_create():";
+    am_config_t *c = r->conf;
+    struct am_not_enforced *ne = calloc(1, sizeof (struct am_not_enforced));
+    int i, status = AM_SUCCESS;
+
+    if (ne == NULL) {
+        return NULL;
+    }
+    ne->instance_id = r->instance_id;
+    ne->ts = c->ts;
+    ne->size = c->not_enforced_map_sz;
+    ne->ip_size = c->not_enforced_ip_map_sz;
+    ne->ext_size = c->not_enforced_ext_map_sz;
+    ne->flags = NOT_ENFORCED_FLAGS(c);
+    ne->ref = 1;
+    ne->url = am_url_matcher_create(r->instance_id, c->url_eval_case_ignore, c->not_enforced_regex_enable);
+    ne->method_url = am_url_matcher_create(r->instance_id, c->url_eval_case_ignore, c->not_enforced_regex_enable);
+    if (ne->url == NULL || ne->method_url == NULL) {
+        not_enforced_free(ne);
+        return NULL;
+    }
+
+    for (i = 0; i < c->not_enforced_map_sz && status == AM_SUCCESS; i++) {
+        am_config_map_t *m = &c->not_enforced_map[i];
+        char *p;
+        if (!ISVALID(m->value)) continue;
+        p = m->name != NULL ? strstr(m->name, AM_COMMA_CHAR) : NULL;
+        if (p == NULL) {
+            status = am_url_matcher_add(ne->url, URL_MATCHER_ANY_METHOD, m->value);
+        } else {
+            char *pv = strndup(m->name, p - m->name);
+            if (pv == NULL) {
+                status = AM_ENOMEM;
+                break;
+            }
+            status = am_url_matcher_add(ne->method_url, am_method_str_to_num(pv), m->value);
+            free(pv);
+        }
+    }
+    if (status == AM_SUCCESS && c->not_enforced_ip_map_sz > 0) {
+        status = not_enforced_ip_create(r, ne);
+    }
+    if (status == AM_SUCCESS && c->not_enforced_ext_map_sz > 0) {
+        status = not_enforced_ext_create(r, ne);
+    }
+    if (status != AM_SUCCESS) {
+        AM_LOG_ERROR(r->instance_id, "%s failed to compile not enforced lists (%s)",
+                thisfunc, am_strerror(status));
+        not_enforced_free(ne);
+        return NULL;
+    }
+    AM_LOG_DEBUG(r->instance_id, "%s compiled %d not enforced url, %d client ip and %d extended entries",
+            thisfunc, c->not_enforced_map_sz, c->not_enforced_ip_map_sz, c->not_enforced_ext_map_sz);
+    return ne;
+}
+
+void am_not_enforced_init() {
+    if (!not_enforced_cache.init) {
+        memset(&not_enforced_cache, 0, sizeof (not_enforced_cache));
+        AM_MUTEX_INIT(&not_enforced_cache.lock);
+        not_enforced_cache.init = AM_TRUE;
+    }
+}
+
+void am_not_enforced_shutdown() {
+    int i;
+    if (!not_enforced_cache.init) {
+        return;
+    }
+    AM_MUTEX_LOCK(&not_enforced_cache.lock);
+    for (i = 0; i < URL_MATCHER_CACHE_SIZE; i++) {
+        struct am_not_enforced *ne = not_enforced_cache.entry[i];
+        if (ne != NULL && --ne->ref == 0) {
+            not_enforced_free(ne);
+        }
+        not_enforced_cache.entry[i] = NULL;
+    }
+    not_enforced_cache.init = AM_FALSE;
+    AM_MUTEX_UNLOCK(&not_enforced_cache.lock);
+    AM_MUTEX_DESTROY(&not_enforced_cache.lock);
+}
+
+/**
+ * Compiled not enforced url, client ip and extended lists for the request's configuration, to be released with
+ * am_not_enforced_release. Configurations that did not come from the configuration cache
+ * (ts is not set) are compiled for each call.
+ */
+struct am_not_enforced *am_not_enforced_get(am_request_t *r) {
+    struct am_not_enforced *ne = NULL;
+    int i, slot = -1;
+
+    if (r == NULL || r->conf == NULL) {
+        return NULL;
+    }
+    if (!not_enforced_cache.init || r->instance_id == 0 || r->conf->ts == 0) {
+        return not_enforced_create(r);
+    }
+
+    AM_MUTEX_LOCK(&not_enforced_cache.lock);
+    for (i = 0; i < URL_MATCHER_CACHE_SIZE; i++) {
+        struct am_not_enforced *e = not_enforced_cache.entry[i];
+        if (e == NULL) {
+            if (slot == -1) slot = i;
+            continue;
+        }
+        if (e->instance_id == r->instance_id) {
+            if (e->ts == r->conf->ts && e->size == r->conf->not_enforced_map_sz &&
+                    e->ip_size == r->conf->not_enforced_ip_map_sz &&
+                    e->ext_size == r->conf->not_enforced_ext_map_sz &&
+                    e->flags == NOT_ENFORCED_FLAGS(r->conf)) {
+                ne = e;
+                ne->ref++;
+                break;
+            }
+            /* configuration has changed, drop the old list (once it is no longer used) */
+            if (--e->ref == 0) {
+                not_enforced_free(e);
+            }
+            not_enforced_cache.entry[i] = NULL;
+            slot = i;
+            break;
+        }
+    }
+    if (ne == NULL && (ne = not_enforced_create(r)) != NULL && slot != -1) {
+        ne->ref++;
+        not_enforced_cache.entry[slot] = ne;
+    }
+    AM_MUTEX_UNLOCK(&not_enforced_cache.lock);
+    return ne;
+}
+
+void am_not_enforced_release(struct am_not_enforced *ne) {
+    am_bool_t done;
+    if (ne == NULL) {
+        return;
+    }
+    if (not_enforced_cache.init) {
+        AM_MUTEX_LOCK(&not_enforced_cache.lock);
+        done = --ne->ref == 0;
+        AM_MUTEX_UNLOCK(&not_enforced_cache.lock);
+    } else {
+        done = --ne->ref == 0;
+    }
+    if (done) {
+        not_enforced_free(ne);
+    }
+}
+
+/**
+ * Is the url in the not enforced url list? Entries without a request method are matched against
+ * the first url_sz characters of url, method entries against the whole of method_url.
+ */
+am_bool_t am_not_enforced_match(am_request_t *r, struct am_not_enforced *ne, const char *url, size_t url_sz,
+        const char *method_url) {
+    if (ne == NULL) {
+        return AM_FALSE;
+    }
+    return am_url_matcher_match(r, ne->url, URL_MATCHER_ANY_METHOD, url, url_sz) ||
+            am_url_matcher_match(r, ne->method_url, r->method, method_url, strlen(method_url));
+}
+
+/**
+ * Is the (parsed) client ip address in the not enforced client ip list?
+ */
+am_bool_t am_not_enforced_ip(am_request_t *r, struct am_not_enforced *ne, const am_ip_t *ip) {
+    int i;
+    if (ne == NULL || ip == NULL) {
+        return AM_FALSE;
+    }
+    if (am_ip_table_match(ne->ip, ip)) {
+        return AM_TRUE;
+    }
+    for (i = 0; i < ne->method_ip_sz; i++) {
+        if (ne->method_ip[i].method == r->method) {
+            return am_ip_table_match(ne->method_ip[i].ip, ip);
+        }
+    }
+    return AM_FALSE;
+}
+
+/**
+ * Is the (parsed) client ip address and url in the extended not enforced url list?
+ */
+am_bool_t am_not_enforced_ext(am_request_t *r, struct am_not_enforced *ne, const am_ip_t *ip, const char *url) {
+    int i;
+    if (ne == NULL || ip == NULL || url == NULL) {
+        return AM_FALSE;
+    }
+    for (i = 0; i < ne->ext_sz; i++) {
+        if (am_ip_table_match(ne->ext[i].ip, ip) &&
+                am_url_matcher_match(r, ne->ext[i].url, URL_MATCHER_ANY_METHOD, url, strlen(url))) {
+            return AM_TRUE;
+        }
+    }
+    return AM_FALSE;
+}
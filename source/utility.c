@@ -236,6 +236,182 @@ char is_big_endian() {
     return b.c[0] == 1;
 }
 
+/*
+ * Compiled regular expressions, kept per process and keyed by the pattern string: every pattern
+ * is compiled and studied once, the first time it is used, and reused for as long as the process
+ * lives (configuration snapshots come and go but the set of patterns rarely changes).
+ * When the table is full (or am_regex_cache_init was not called) patterns are compiled per call.
+ *
+ * Entries are compiled outside of any lock and published into a free slot with a compare and swap;
+ * once published an entry does not change until am_regex_cache_shutdown, so lookups take no lock.
+ * The statistics are atomic counters, and only one match in AM_REGEX_SAMPLE is timed.
+ */
+
+#define AM_REGEX_CACHE_SIZE 256
+#define AM_REGEX_SAMPLE 64
+
+#if defined(_WIN32)
+#define regex_add(p, v)             InterlockedExchangeAdd64((volatile LONGLONG *) (p), (v))
+#define regex_publish(p, new)       (InterlockedCompareExchangePointer((PVOID volatile *) (p), (new), NULL) == NULL)
+#define regex_load(p)               (*(p)) /* volatile reads are acquires */
+#elif defined(__sun)
+#include <sys/atomic.h>
+#define regex_add(p, v)             (atomic_add_64_nv((p), (v)) - (v))
+#define regex_publish(p, new)       (atomic_cas_ptr((p), NULL, (new)) == NULL)
+#define regex_load(p)               atomic_cas_ptr((p), NULL, NULL)
+#else
+#define regex_add(p, v)             __sync_fetch_and_add((p), (v))
+#define regex_publish(p, new)       __sync_bool_compare_and_swap((p), NULL, (new))
+#define regex_load(p)               __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#endif
+
+struct regex_entry {
+    uint32_t hash;
+    char *pattern;
+    pcre *code; /* NULL if the pattern does not compile */
+    pcre_extra *extra;
+    const char *error;
+};
+
+static struct {
+    am_bool_t init;
+    struct regex_entry *volatile entry[AM_REGEX_CACHE_SIZE];
+    volatile uint64_t patterns;
+    volatile uint64_t compiles;
+    volatile uint64_t compile_us;
+    volatile uint64_t matches;
+    volatile uint64_t sampled; /* timed matches */
+    volatile uint64_t sampled_us;
+} regex_cache;
+
+void am_regex_cache_init() {
+    if (!regex_cache.init) {
+        memset((void *) &regex_cache, 0, sizeof (regex_cache));
+        regex_cache.init = AM_TRUE;
+    }
+}
+
+static void regex_free(pcre *x, pcre_extra *extra) {
+    if (extra != NULL) pcre_free_study(extra);
+    if (x != NULL) pcre_free(x);
+}
+
+static void regex_entry_free(struct regex_entry *e) {
+    if (e != NULL) {
+        regex_free(e->code, e->extra);
+        am_free(e->pattern);
+        free(e);
+    }
+}
+
+/**
+ * the cache is shut down when no thread is matching any more
+ */
+void am_regex_cache_shutdown() {
+    int i;
+    if (!regex_cache.init) {
+        return;
+    }
+    regex_cache.init = AM_FALSE;
+    for (i = 0; i < AM_REGEX_CACHE_SIZE; i++) {
+        regex_entry_free(regex_cache.entry[i]);
+        regex_cache.entry[i] = NULL;
+    }
+}
+
+/**
+ * Number of compiled patterns held, compilations and matches done (and the time spent on them,
+ * in seconds; the match time is estimated from the timed matches) since am_regex_cache_init.
+ */
+void am_regex_stats(unsigned long *patterns, unsigned long *compiles, double *compile_time,
+        unsigned long *matches, double *match_time) {
+    uint64_t n = regex_add(&regex_cache.matches, 0), sampled = regex_add(&regex_cache.sampled, 0);
+    if (patterns != NULL) *patterns = (unsigned long) regex_add(&regex_cache.patterns, 0);
+    if (compiles != NULL) *compiles = (unsigned long) regex_add(&regex_cache.compiles, 0);
+    if (compile_time != NULL) *compile_time = regex_add(&regex_cache.compile_us, 0) / 1000000.0;
+    if (matches != NULL) *matches = (unsigned long) n;
+    if (match_time != NULL) {
+        *match_time = sampled > 0 ? (double) regex_add(&regex_cache.sampled_us, 0) / sampled * n / 1000000.0 : 0.0;
+    }
+}
+
+/**
+ * compile and study (JIT compile, where pcre has JIT support) a pattern
+ */
+static pcre *regex_compile(const char *pattern, pcre_extra **extra, const char **error) {
+    am_timer_t tmr = {0, 0, 0, 0};
+    const char *study_error = NULL;
+    int erroroffset;
+    pcre *x;
+
+    *extra = NULL;
+    am_timer_start(&tmr);
+    x = pcre_compile(pattern, 0, error, &erroroffset, NULL);
+    if (x != NULL) {
+        *extra = pcre_study(x, PCRE_STUDY_JIT_COMPILE, &study_error);
+    }
+    am_timer_stop(&tmr);
+    regex_add(&regex_cache.compiles, 1);
+    regex_add(&regex_cache.compile_us, (uint64_t) (am_timer_elapsed(&tmr) * 1000000));
+    return x;
+}
+
+/**
+ * count a match, and start timing it when it is one of the one in AM_REGEX_SAMPLE which are timed
+ */
+static am_bool_t regex_match_start(am_timer_t *tmr) {
+    if (regex_add(&regex_cache.matches, 1) % AM_REGEX_SAMPLE != 0) {
+        return AM_FALSE;
+    }
+    am_timer_start(tmr);
+    return AM_TRUE;
+}
+
+static void regex_match_stop(am_timer_t *tmr) {
+    am_timer_stop(tmr);
+    regex_add(&regex_cache.sampled, 1);
+    regex_add(&regex_cache.sampled_us, (uint64_t) (am_timer_elapsed(tmr) * 1000000));
+}
+
+/**
+ * find (or compile and add) a pattern in the cache; NULL when there is no cache or it is full
+ */
+static struct regex_entry *regex_get(const char *pattern) {
+    struct regex_entry *e, *n = NULL;
+    uint32_t hash;
+    int i;
+
+    if (!regex_cache.init) {
+        return NULL;
+    }
+    hash = am_hash(pattern);
+    for (i = 0; i < AM_REGEX_CACHE_SIZE; i++) {
+        struct regex_entry *volatile *slot = &regex_cache.entry[(hash + i) % AM_REGEX_CACHE_SIZE];
+
+        if ((e = regex_load(slot)) == NULL) {
+            if (n == NULL) {
+                if ((n = calloc(1, sizeof (struct regex_entry))) == NULL || (n->pattern = strdup(pattern)) == NULL) {
+                    am_free(n);
+                    return NULL;
+                }
+                n->hash = hash;
+                n->code = regex_compile(pattern, &n->extra, &n->error);
+            }
+            if (regex_publish(slot, n)) {
+                regex_add(&regex_cache.patterns, 1);
+                return n;
+            }
+            e = regex_load(slot); /* another thread took the slot first, maybe with this pattern */
+        }
+        if (e->hash == hash && strcmp(e->pattern, pattern) == 0) {
+            regex_entry_free(n);
+            return e;
+        }
+    }
+    regex_entry_free(n);
+    return NULL;
+}
+
 /**
  * Match a subject against a pattern.
  * 
@@ -247,29 +423,45 @@ char is_big_endian() {
  *         AM_FAIL (1) if there is no match, or the pattern doesn't compile
  */
 am_return_t match(unsigned long instance_id, const char *subject, const char *pattern) {
-    pcre* x = NULL;
-    const char* error;
-    int erroroffset, rc = -1;
+    struct regex_entry *e;
+    pcre *x = NULL;
+    pcre_extra *extra = NULL;
+    const char *error = NULL;
+    am_timer_t tmr = {0, 0, 0, 0};
+    am_bool_t timed;
+    int rc = -1;
     int offsets[3];
     am_return_t result = AM_OK;
 
     if (subject == NULL || pattern == NULL) {
         return result;
     }
-    x = pcre_compile(pattern, 0, &error, &erroroffset, NULL);
+    if ((e = regex_get(pattern)) != NULL) {
+        x = e->code;
+        extra = e->extra;
+        error = e->error;
+    } else {
+        x = regex_compile(pattern, &extra, &error);
+    }
     if (x == NULL) {
         AM_LOG_DEBUG(instance_id, "match: pcre_compile failed on \"%s\" with error %s", pattern, (error == NULL) ? "unknown" : error);
         return AM_FAIL;
     }
 
-    rc = pcre_exec(x, NULL, subject, (int) strlen(subject), 0, 0, offsets, 3);
+    timed = regex_match_start(&tmr);
+    rc = pcre_exec(x, extra, subject, (int) strlen(subject), 0, 0, offsets, 3);
+    if (timed) {
+        regex_match_stop(&tmr);
+    }
     if (rc < 0) {
         AM_LOG_DEBUG(instance_id, "match(): '%s' does not match '%s'", subject, pattern);
         result = AM_FAIL;
     } else {
         AM_LOG_DEBUG(instance_id, "match(): '%s' matches '%s'", subject, pattern);
     }
-    pcre_free(x);
+    if (e == NULL) {
+        regex_free(x, extra);
+    }
 
     return result;
 }
@@ -286,7 +478,7 @@ am_return_t match(unsigned long instance_id, const char *subject, const char *pa
  * 
  * @return null separated matching strings
  */
-char *match_group(pcre *x, int capture_groups, const char *subject, size_t *len) {
+static char *match_group_extra(pcre *x, pcre_extra *extra, int capture_groups, const char *subject, size_t *len) {
 
     /* pcre itself needs space in the max_capture_groups */
     int max_capture_groups = (capture_groups + 1) * 3;
@@ -302,7 +494,7 @@ char *match_group(pcre *x, int capture_groups, const char *subject, size_t *len)
     if ((ovector = calloc(max_capture_groups, sizeof (int))) == NULL) {
         return NULL;
     }
-    while (offset < slen && (rc = pcre_exec(x, 0, subject, (int) slen, offset, 0, ovector, max_capture_groups)) >= 0) {
+    while (offset < slen && (rc = pcre_exec(x, extra, subject, (int) slen, offset, 0, ovector, max_capture_groups)) >= 0) {
         for (i = 1 /* skip the first pair: "identify the portion of the subject string matched by the entire pattern" */;
                 i < rc; ++i) {
             char *rslt, *ret_tmp;
@@ -333,6 +525,45 @@ char *match_group(pcre *x, int capture_groups, const char *subject, size_t *len)
     return result;
 }
 
+char *match_group(pcre *x, int capture_groups, const char *subject, size_t *len) {
+    return match_group_extra(x, NULL, capture_groups, subject, len);
+}
+
+/**
+ * As match_group, with the pattern compiled (once) through the regular expression cache.
+ */
+char *match_pattern_group(const char *pattern, int capture_groups, const char *subject, size_t *len) {
+    struct regex_entry *e;
+    pcre *x;
+    pcre_extra *extra = NULL;
+    const char *error = NULL;
+    am_timer_t tmr = {0, 0, 0, 0};
+    am_bool_t timed;
+    char *result;
+
+    if (pattern == NULL || subject == NULL) {
+        return NULL;
+    }
+    if ((e = regex_get(pattern)) != NULL) {
+        x = e->code;
+        extra = e->extra;
+    } else {
+        x = regex_compile(pattern, &extra, &error);
+    }
+    if (x == NULL) {
+        return NULL;
+    }
+    timed = regex_match_start(&tmr);
+    result = match_group_extra(x, extra, capture_groups, subject, len);
+    if (timed) {
+        regex_match_stop(&tmr);
+    }
+    if (e == NULL) {
+        regex_free(x, extra);
+    }
+    return result;
+}
+
 static void uri_normalize(struct url *url, char *path) {
 
     char *s, *o, *p = path != NULL ? strdup(path) : NULL;
@@ -1734,6 +1965,21 @@ int am_session_decode(am_request_t *r) {
     return AM_SUCCESS;
 }
 
+/**
+ * Naming url n positions after the active one (wrapping around), used to fail over
+ * to the next OpenAM server without waiting for the url validator to notice.
+ */
+const char *get_next_openam_url(am_request_t *r, int n) {
+    int valid_idx = get_valid_url_index(r->instance_id);
+    if (r->conf->naming_url_sz <= 0) {
+        return NULL;
+    }
+    if (valid_idx >= r->conf->naming_url_sz) {
+        valid_idx = 0;
+    }
+    return r->conf->naming_url[(valid_idx + n) % r->conf->naming_url_sz];
+}
+
 const char *get_valid_openam_url(am_request_t *r) {
     const char *val = NULL;
     int valid_idx = get_valid_url_index(r->instance_id);
@@ -1851,6 +2097,70 @@ void am_timer_report(unsigned long instance_id, am_timer_t *t, const char *op) {
             NOTNULL(op), am_timer_elapsed(t));
 }
 
+/**
+ * Milliseconds left of a time budget (budget_ms) measured from am_timer_start, 0 when used up.
+ */
+unsigned int am_timer_budget_left(am_timer_t *t, unsigned int budget_ms) {
+    double elapsed = am_timer_elapsed(t) * 1000.0;
+    return elapsed >= (double) budget_ms ? 0 : (unsigned int) (budget_ms - elapsed);
+}
+
+/**
+ * am_timer value budget_ms milliseconds from now.
+ */
+uint64_t am_timer_deadline(unsigned int budget_ms) {
+    uint64_t now, freq;
+#ifdef _WIN32
+    QueryPerformanceFrequency((LARGE_INTEGER *) & freq);
+#else
+    freq = AM_TIMER_USEC_PER_SEC;
+#endif
+    am_timer(&now);
+    return now + (uint64_t) budget_ms * freq / 1000;
+}
+
+/**
+ * Milliseconds left until a deadline (see am_timer_deadline), 0 once it has passed.
+ */
+unsigned int am_timer_until(uint64_t deadline) {
+    uint64_t now, freq;
+#ifdef _WIN32
+    QueryPerformanceFrequency((LARGE_INTEGER *) & freq);
+#else
+    freq = AM_TIMER_USEC_PER_SEC;
+#endif
+    am_timer(&now);
+    return now >= deadline ? 0 : (unsigned int) ((deadline - now) * 1000 / freq);
+}
+
+/**
+ * Wait before the next retry: AM_NET_BACKOFF milliseconds doubled with each attempt (up to
+ * AM_NET_BACKOFF_MAX), half of it randomised so that callers do not retry in lock-step,
+ * and never longer than max_ms.
+ */
+void am_backoff(int attempt, unsigned int max_ms) {
+    uint64_t seed;
+    unsigned int wait = AM_NET_BACKOFF << (attempt < 8 ? attempt : 8);
+    if (wait > AM_NET_BACKOFF_MAX) {
+        wait = AM_NET_BACKOFF_MAX;
+    }
+    am_timer(&seed);
+    wait = wait / 2 + (unsigned int) (seed % (wait / 2 + 1));
+    if (wait > max_ms) {
+        wait = max_ms;
+    }
+    if (wait == 0) {
+        return;
+    }
+#ifdef _WIN32
+    Sleep(wait);
+#else
+    nanosleep((const struct timespec[]) {
+        {wait / 1000, (wait % 1000) * 1000000L}
+    }, NULL);
+#endif
+}
+
 /*********************************************************************************************
  */
 static char *rc4(const char *input, size_t input_sz, const char *key, size_t key_sz) {
@@ -3033,6 +3343,25 @@ uint32_t am_hash(const void *k) {
     return i;
 }
 
+/**
+ * 64 bit FNV-1a hash of a string, continuing from hash (0 starts a new one). The terminating
+ * NUL is hashed as well, so that hashes of consecutive strings can be chained.
+ */
+uint64_t am_hash64(const void *k, uint64_t hash) {
+    const unsigned char *str = (const unsigned char *) k;
+    if (hash == 0) {
+        hash = 0xcbf29ce484222325ULL;
+    }
+    if (str == NULL) {
+        return hash;
+    }
+    do {
+        hash ^= *str;
+        hash *= 0x100000001b3ULL;
+    } while (*str++);
+    return hash;
+}
+
 uint32_t am_hash_buffer(const void *k, size_t sz) {
     void *tmp;
     uint32_t hash;
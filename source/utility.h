@@ -20,7 +20,6 @@
 #include "pcre.h"
 #include "net_client.h"
 
-#define AM_POLICY_CHANGE_KEY    "AM_POLICY_CHANGE_KEY"
 #define AM_CACHE_TIMEFORMAT     "%Y-%m-%d %H:%M:%S"
 #define ARRAY_SIZE(array)       sizeof(array) / sizeof(array[0])
 #define AM_BASE_TEN             10
@@ -185,11 +184,28 @@ void am_timer_pause(am_timer_t *t);
 void am_timer_resume(am_timer_t *t);
 double am_timer_elapsed(am_timer_t *t);
 void am_timer_report(unsigned long instance_id, am_timer_t *t, const char *op);
+unsigned int am_timer_budget_left(am_timer_t *t, unsigned int budget_ms);
+uint64_t am_timer_deadline(unsigned int budget_ms);
+unsigned int am_timer_until(uint64_t deadline);
+void am_backoff(int attempt, unsigned int max_ms);
 
 const char *get_valid_openam_url(am_request_t *r);
+const char *get_next_openam_url(am_request_t *r, int n);
 
 am_status_t ip_address_match(const char *ip, const char **list, unsigned int listsize, unsigned long instance_id);
 
+typedef struct {
+    int family; /* AF_INET or AF_INET6 */
+    uint64_t hi; /* ip v6 only: most significant 64 bits */
+    uint64_t lo;
+} am_ip_t;
+
+typedef struct am_ip_table am_ip_table_t;
+am_bool_t am_ip_parse(const char *p, am_ip_t *ip);
+am_ip_table_t *am_ip_table_create(unsigned long instance_id, const char **list, unsigned int listsize);
+am_bool_t am_ip_table_match(am_ip_table_t *t, const am_ip_t *ip);
+void am_ip_table_free(am_ip_table_t *t);
+
 am_status_t get_token_from_url(am_request_t *rq);
 am_status_t get_cookie_value(am_request_t *rq, const char *separator, const char *cookie_name,
         const char *cookie_header_val, char **value);
@@ -211,6 +227,8 @@ int am_shm_lock(am_shm_t *);
 int am_shm_lock_timeout(am_shm_t *am, int timeout_msec);
 am_shm_t *am_shm_create(const char *, uint64_t, int use_new_initialiser, uint64_t *, int *);
 void am_shm_shutdown(am_shm_t *);
+am_shm_t *am_shm_open_readonly(const char *name);
+void am_shm_close_readonly(am_shm_t *am);
 int am_shm_delete(char *name);
 void *am_shm_alloc(am_shm_t *am, uint64_t usize);
 void am_shm_free(am_shm_t *am, void *ptr);
@@ -231,6 +249,11 @@ char is_big_endian();
 uint64_t page_size(uint64_t size);
 am_return_t match(unsigned long instance_id, const char *subject, const char *pattern);
 char *match_group(pcre *x, int capture_groups, const char *subject, size_t *len);
+char *match_pattern_group(const char *pattern, int capture_groups, const char *subject, size_t *len);
+void am_regex_cache_init();
+void am_regex_cache_shutdown();
+void am_regex_stats(unsigned long *patterns, unsigned long *compiles, double *compile_time,
+        unsigned long *matches, double *match_time);
 int gzip_deflate(const char *uncompressed, size_t *uncompressed_sz, char **compressed);
 int gzip_inflate(const char *compressed, size_t *compressed_sz, char **uncompressed);
 void trim(char *a, char w);
@@ -267,6 +290,29 @@ int get_line(char **line, size_t *size, FILE *file);
 int am_session_decode(am_request_t *r);
 
 char policy_compare_url(am_request_t *r, const char *pattern, const char *resource);
+typedef struct am_url_pattern am_url_pattern_t;
+am_url_pattern_t *am_url_pattern_create(const char *pattern, am_bool_t case_ignore);
+char am_url_pattern_match(const am_url_pattern_t *p, const char *resource);
+int am_policy_select(am_request_t *r, const char *url, int scope, int count,
+        const int *scopes, const char **resources, char *status);
+
+typedef struct am_url_matcher am_url_matcher_t;
+am_url_matcher_t *am_url_matcher_create(unsigned long instance_id, am_bool_t case_ignore, am_bool_t regex);
+int am_url_matcher_add(am_url_matcher_t *m, int method, const char *pattern);
+int am_url_matcher_add_id(am_url_matcher_t *m, int method, const char *pattern, int id);
+am_bool_t am_url_matcher_match(am_request_t *r, am_url_matcher_t *m, int method, const char *url, size_t url_sz);
+int am_url_matcher_select(am_request_t *r, am_url_matcher_t *m, int method, const char *url, char *status);
+void am_url_matcher_free(am_url_matcher_t *m);
+
+struct am_not_enforced;
+void am_not_enforced_init();
+void am_not_enforced_shutdown();
+struct am_not_enforced *am_not_enforced_get(am_request_t *r);
+void am_not_enforced_release(struct am_not_enforced *ne);
+am_bool_t am_not_enforced_match(am_request_t *r, struct am_not_enforced *ne, const char *url, size_t url_sz,
+        const char *method_url);
+am_bool_t am_not_enforced_ip(am_request_t *r, struct am_not_enforced *ne, const am_ip_t *ip);
+am_bool_t am_not_enforced_ext(am_request_t *r, struct am_not_enforced *ne, const am_ip_t *ip, const char *url);
 const char *am_policy_strerror(char status);
 
 char* am_strsep(char** sp, const char* sep);
@@ -292,6 +338,18 @@ void *am_parse_session_xml(unsigned long instance_id, const char *xml, size_t xm
 void *am_parse_session_saml(unsigned long instance_id, const char *xml, size_t xml_sz);
 void *am_parse_policy_xml(unsigned long instance_id, const char *xml, size_t xml_sz, int scope);
 
+typedef struct am_xml_stream am_xml_stream_t;
+
+am_xml_stream_t *am_xml_stream_create(unsigned long instance_id, const char *name, void *ctx,
+        void (*start)(void *, const char *, const char **), void (*end)(void *, const char *),
+        void (*chars)(void *, const char *, int), void *(*result)(void *, am_bool_t));
+am_xml_stream_t *am_session_xml_stream(unsigned long instance_id);
+am_xml_stream_t *am_policy_xml_stream(unsigned long instance_id, int scope);
+void am_xml_stream_feed(am_xml_stream_t *s, const char *data, size_t data_sz);
+size_t am_xml_stream_size(am_xml_stream_t *s);
+void *am_xml_stream_finish(am_xml_stream_t *s, char **exception);
+void am_xml_stream_discard(am_xml_stream_t *s);
+
 int am_audit_init(int id);
 int am_audit_shutdown();
 int am_audit_processor_init();
@@ -331,6 +389,38 @@ int am_add_session_policy_cache_entry(am_request_t *request, const char *key,
         struct am_policy_result *policy, struct am_namevalue *session);
 int am_get_session_policy_cache_entry(am_request_t *request, const char *key,
         struct am_policy_result **policy, struct am_namevalue **session, uint64_t *ts);
+int am_get_stale_session_policy_cache_entry(am_request_t *request, const char *key, int grace,
+        struct am_policy_result **policy, struct am_namevalue **session);
+int am_get_session_policy_cache_match(am_request_t *request, const char *key,
+        int (*select)(void *, int, const int *, const char **, char *), void *arg,
+        struct am_policy_result **policy, struct am_namevalue **session, int64_t *expires);
+
+uint32_t am_cache_generation();
+void am_cache_invalidate();
+int am_get_decision_cache_entry(const char *token, const char *url, int scope,
+        struct am_policy_result **policy, struct am_namevalue **session);
+void am_add_decision_cache_entry(am_request_t *request, const char *url, int scope, uint32_t generation,
+        int64_t expires, struct am_policy_result *policy, struct am_namevalue *session);
+struct am_policy_index;
+struct am_policy_index *am_get_policy_index(const char *token, int count, const int *scopes, const char **resources,
+        am_bool_t case_ignore, am_url_matcher_t **matcher);
+struct am_policy_index *am_add_policy_index(const char *token, uint32_t generation, int count, const int *scopes,
+        const char **resources, am_bool_t case_ignore, am_url_matcher_t *matcher);
+void am_release_policy_index(struct am_policy_index *index);
+
+uint64_t am_policy_flight_key(const char *token, const char *url, int scope);
+int am_policy_flight_begin(uint64_t key);
+void am_policy_flight_end(uint64_t key);
+int am_policy_flight_wait(uint64_t key);
+
+void am_net_budget_exhausted();
+
+int am_net_breaker_allow(unsigned long instance_id, const char *url);
+void am_net_breaker_report(unsigned long instance_id, const char *url, int status);
+void am_stale_grace(int grace);
+int am_net_resolved_get(const char *host, void *data, uint32_t *ln, int *expired);
+int am_net_resolved_refresh(const char *host);
+void am_net_resolved_set(const char *host, const void *data, uint32_t ln, uint32_t ms);
 
 int am_get_cache_entry(unsigned long instance_id, int valid, const char *key);
 int am_add_cache_entry(unsigned long instance_id, const char *key);
@@ -360,6 +450,7 @@ char * property_map_write_to_buffer(property_map_t * map, size_t * data_sz);
 
 uint32_t am_hash_buffer(const void *buf, size_t len);
 uint32_t am_hash(const void *buf);
+uint64_t am_hash64(const void *buf, uint64_t hash);
 
 void cache_object_ctx_init(struct cache_object_ctx *ctx);
 void cache_object_ctx_init_data(struct cache_object_ctx *ctx, void *data, size_t sz);
@@ -369,6 +460,10 @@ int cache_object_skip_key(struct cache_object_ctx *ctx);
 int am_policy_result_serialise(struct cache_object_ctx *ctx, struct am_policy_result *list);
 int am_name_value_serialise(struct cache_object_ctx *ctx, struct am_namevalue *list);
 struct am_policy_result *am_policy_result_deserialise(struct cache_object_ctx *ctx);
+struct am_policy_result *am_policy_result_deserialise_match(struct cache_object_ctx *ctx,
+        int (*select)(void *, int, const int *, const char **, char *), void *arg);
+struct am_policy_result *am_policy_result_deserialise_match_all(struct cache_object_ctx *ctx, int n,
+        int (*select)(void *, int, const int *, const char **, char *), void *arg);
 struct am_namevalue *am_name_value_deserialise(struct cache_object_ctx *ctx);
 
 int am_pdp_entry_serialise(struct cache_object_ctx *ctx, const char *url,
@@ -376,8 +471,6 @@ int am_pdp_entry_serialise(struct cache_object_ctx *ctx, const char *url,
 int am_pdp_entry_deserialise(struct cache_object_ctx *ctx, char **url,
         char **file, char **content_type, int *method);
 
-int am_policy_epoch_deserialise(struct cache_object_ctx *ctx, uint64_t *p_time);
-int am_policy_epoch_serialise(struct cache_object_ctx *ctx, uint64_t time);
 
 int am_cache_worker_init();
 void am_cache_worker_shutdown();
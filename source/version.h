@@ -0,0 +1,35 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2014 - 2016 ForgeRock AS.
+ */
+
+#ifndef VERSION_H
+#define VERSION_H
+
+#define DESCRIPTION     "OpenAM Web Agent"
+#define BUILD_TS        __DATE__" "__TIME__
+#define VERSION         "4.1.0"
+#define CONTAINER       ""
+#define VERSION_NUM     4,1,0
+#define VERSION_VCS     "Revision: 6559614"
+#define BUILD_MACHINE   "vm"
+#define MODINFO         DESCRIPTION"/"VERSION
+
+#ifdef __sun
+#pragma ident "@(#)am.h    4.1.0    17.10.26 ForgeRock AS"
+#else
+static char const rcsid[] = "$Id: am.h     4.1.0   17.10.26 ForgeRock AS Exp $";
+#endif
+
+#endif
@@ -66,7 +66,7 @@ void notification_worker(void *arg) {
             rv = am_set_policy_cache_epoch(time(0));
             AM_LOG_DEBUG(r->instance_id, "%s policy change cache update status: %s",
                     thisfunc, am_strerror(rv));
-            policy_change_run = AM_TRUE; /* one AM_POLICY_CHANGE_KEY update per PolicyChangeNotification is enough */
+            policy_change_run = AM_TRUE; /* one policy epoch update per PolicyChangeNotification is enough */
         }
     }
 
@@ -0,0 +1,270 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2014 - 2016 ForgeRock AS.
+ */
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+#include "expat.h"
+
+/*
+ * Incremental parser for PLL (RequestSet/ResponseSet) responses: the body is fed
+ * in pieces as it is received, the first <![CDATA[...]]> section is located and
+ * handed over to expat (and so to the session/policy element handlers) without
+ * ever keeping the whole response in memory.
+ */
+
+#define AM_XML_EXCEPTION_MAX 2048 /* enough of an Exception message to tell what it is about */
+
+enum {
+    XML_STREAM_PROLOG = 0, /* looking for the start of the CDATA section */
+    XML_STREAM_CDATA, /* parsing the CDATA contents */
+    XML_STREAM_EPILOG, /* CDATA section is parsed, ignore the rest of the response */
+    XML_STREAM_ERROR
+};
+
+static const char cdata_begin[] = "<![CDATA[";
+static const char cdata_end[] = "]]>";
+
+struct am_xml_stream {
+    unsigned long instance_id;
+    const char *name;
+    XML_Parser parser;
+    int state;
+    size_t match; /* bytes of cdata_begin/cdata_end matched so far */
+    size_t size; /* total bytes fed */
+    void *ctx;
+    void (*start)(void *, const char *, const char **);
+    void (*end)(void *, const char *);
+    void (*chars)(void *, const char *, int);
+    void *(*result)(void *, am_bool_t);
+    am_bool_t in_exception;
+    char *exception;
+    size_t exception_sz;
+};
+
+static void start_element(void *userData, const char *name, const char **atts) {
+    am_xml_stream_t *s = (am_xml_stream_t *) userData;
+    if (strcmp(name, "Exception") == 0) {
+        s->in_exception = AM_TRUE;
+        if (s->exception == NULL) {
+            s->exception = strdup("<Exception>");
+            s->exception_sz = s->exception != NULL ? 11 : 0;
+        }
+    }
+    s->start(s->ctx, name, atts);
+}
+
+static void end_element(void *userData, const char *name) {
+    am_xml_stream_t *s = (am_xml_stream_t *) userData;
+    s->in_exception = AM_FALSE;
+    s->end(s->ctx, name);
+}
+
+static void character_data(void *userData, const char *val, int len) {
+    am_xml_stream_t *s = (am_xml_stream_t *) userData;
+    if (s->in_exception && s->exception != NULL && len > 0 &&
+            s->exception_sz + len <= AM_XML_EXCEPTION_MAX) {
+        char *tmp = realloc(s->exception, s->exception_sz + len + 1);
+        if (tmp != NULL) {
+            s->exception = tmp;
+            memcpy(s->exception + s->exception_sz, val, len);
+            s->exception_sz += len;
+            s->exception[s->exception_sz] = 0;
+        }
+    }
+    s->chars(s->ctx, val, len);
+}
+
+static void entity_declaration(void *userData, const XML_Char *entityName,
+        int is_parameter_entity, const XML_Char *value, int value_length, const XML_Char *base,
+        const XML_Char *systemId, const XML_Char *publicId, const XML_Char *notationName) {
+    am_xml_stream_t *s = (am_xml_stream_t *) userData;
+    XML_StopParser(s->parser, XML_FALSE);
+}
+
+am_xml_stream_t *am_xml_stream_create(unsigned long instance_id, const char *name, void *ctx,
+        void (*start)(void *, const char *, const char **), void (*end)(void *, const char *),
+        void (*chars)(void *, const char *, int), void *(*result)(void *, am_bool_t)) {
+    am_xml_stream_t *s = calloc(1, sizeof (am_xml_stream_t));
+    if (s == NULL) {
+        result(ctx, AM_FALSE);
+        return NULL;
+    }
+    s->parser = XML_ParserCreate("UTF-8");
+    if (s->parser == NULL) {
+        result(ctx, AM_FALSE);
+        free(s);
+        return NULL;
+    }
+    s->instance_id = instance_id;
+    s->name = name;
+    s->ctx = ctx;
+    s->start = start;
+    s->end = end;
+    s->chars = chars;
+    s->result = result;
+    s->state = XML_STREAM_PROLOG;
+    XML_SetUserData(s->parser, s);
+    XML_SetElementHandler(s->parser, start_element, end_element);
+    XML_SetCharacterDataHandler(s->parser, character_data);
+    XML_SetEntityDeclHandler(s->parser, entity_declaration);
+    return s;
+}
+
+static void xml_stream_parse(am_xml_stream_t *s, const char *data, size_t data_sz, am_bool_t last) {
+    if (s->state != XML_STREAM_CDATA || (data_sz == 0 && !last)) {
+        return;
+    }
+    if (XML_Parse(s->parser, data, (int) data_sz, last ? XML_TRUE : XML_FALSE) == XML_STATUS_ERROR) {
+        const char *message = XML_ErrorString(XML_GetErrorCode(s->parser));
+        XML_Size line = XML_GetCurrentLineNumber(s->parser);
+        XML_Size col = XML_GetCurrentColumnNumber(s->parser);
+        AM_LOG_ERROR(s->instance_id, "%s xml parser error (%lu:%lu) %s", s->name,
+                (unsigned long) line, (unsigned long) col, message);
+        s->state = XML_STREAM_ERROR;
+    }
+}
+
+/**
+ * pass CDATA contents on to expat, holding back any trailing ']' which might be
+ * the beginning of a cdata_end split between two pieces of the response
+ */
+static void xml_stream_cdata(am_xml_stream_t *s, const char *data, size_t data_sz) {
+    size_t held = s->match; /* ']' characters held back from the previous piece */
+    size_t i = 0;
+    long text_end;
+
+    while (i < data_sz) {
+        if (s->match == 0) {
+            const char *p = memchr(data + i, ']', data_sz - i);
+            if (p == NULL) {
+                i = data_sz;
+                break;
+            }
+            i = p - data;
+        }
+        if (data[i] == ']') {
+            if (s->match < 2) s->match++;
+        } else if (data[i] == '>' && s->match == 2) {
+            /* all of the text up to (not including) cdata_end */
+            text_end = (long) i - 2;
+            if ((long) held + (text_end < 0 ? text_end : 0) > 0) {
+                xml_stream_parse(s, cdata_end, held + (text_end < 0 ? text_end : 0), AM_FALSE);
+            }
+            xml_stream_parse(s, data, text_end > 0 ? text_end : 0, AM_TRUE);
+            if (s->state == XML_STREAM_CDATA) {
+                s->state = XML_STREAM_EPILOG;
+            }
+            s->match = 0;
+            return;
+        } else {
+            s->match = 0;
+        }
+        i++;
+    }
+
+    /* last s->match bytes of the (held + data) are ']', keep them for now */
+    text_end = (long) data_sz - (long) s->match;
+    if ((long) held + (text_end < 0 ? text_end : 0) > 0) {
+        xml_stream_parse(s, cdata_end, held + (text_end < 0 ? text_end : 0), AM_FALSE);
+    }
+    xml_stream_parse(s, data, text_end > 0 ? text_end : 0, AM_FALSE);
+}
+
+void am_xml_stream_feed(am_xml_stream_t *s, const char *data, size_t data_sz) {
+    size_t i = 0;
+
+    if (s == NULL || data == NULL) {
+        return;
+    }
+    s->size += data_sz;
+
+    while (i < data_sz && s->state == XML_STREAM_PROLOG) {
+        if (s->match == 0) {
+            const char *p = memchr(data + i, '<', data_sz - i);
+            if (p == NULL) {
+                return;
+            }
+            i = p - data;
+        }
+        if (data[i] == cdata_begin[s->match]) {
+            if (++s->match == sizeof (cdata_begin) - 1) {
+                s->state = XML_STREAM_CDATA;
+                s->match = 0;
+            }
+        } else {
+            /* cdata_begin does not overlap with itself - start over */
+            s->match = data[i] == cdata_begin[0] ? 1 : 0;
+        }
+        i++;
+    }
+
+    if (s->state == XML_STREAM_CDATA) {
+        xml_stream_cdata(s, data + i, data_sz - i);
+    }
+}
+
+size_t am_xml_stream_size(am_xml_stream_t *s) {
+    return s != NULL ? s->size : 0;
+}
+
+void *am_xml_stream_finish(am_xml_stream_t *s, char **exception) {
+    void *r;
+    am_bool_t ok;
+
+    if (exception != NULL) {
+        *exception = NULL;
+    }
+    if (s == NULL) {
+        return NULL;
+    }
+
+    switch (s->state) {
+        case XML_STREAM_PROLOG:
+            if (s->size > 0) {
+                AM_LOG_ERROR(s->instance_id, "%s no CDATA section in the response", s->name);
+            }
+            break;
+        case XML_STREAM_CDATA:
+            AM_LOG_ERROR(s->instance_id, "%s response ended inside the CDATA section", s->name);
+            break;
+    }
+
+    ok = s->state == XML_STREAM_EPILOG;
+    r = s->result(s->ctx, ok);
+    if (exception != NULL) {
+        *exception = s->exception;
+    } else {
+        am_free(s->exception);
+    }
+    XML_ParserFree(s->parser);
+    free(s);
+    return r;
+}
+
+/**
+ * release a parser along with whatever it has parsed so far, e.g. when the response
+ * it was fed is not going to be completed
+ */
+void am_xml_stream_discard(am_xml_stream_t *s) {
+    if (s == NULL) {
+        return;
+    }
+    s->result(s->ctx, AM_FALSE);
+    am_free(s->exception);
+    XML_ParserFree(s->parser);
+    free(s);
+}
@@ -498,3 +498,229 @@ void test_deny_url_notenforced_get(void **state) {
     assert_int_equal(notenforced_handler(&request), AM_OK);
     assert_int_equal(request.not_enforced, AM_TRUE);
 }
+
+
+/*
+ * The compiled url matcher must agree with policy_compare_url on every pattern.
+ */
+void test_url_matcher_compiled(void **state) {
+
+    static const char *patterns[] = {
+        "http://www.url.com:80/path",
+        "http://www.url.com:80/app/*",
+        "http://www.url.com:80/app/*/index.html",
+        "http://*.example.com:80/-*-/login.jsp",
+        "HTTP://WWW.URL.COM:80/Upper*",
+        "http://www.url.com:80/query?a=*",
+        "*.css",
+        "*.gif?*",
+        "http://www.url.com:80/a-*-",
+        "http://www.url.com:80/a-*-*-b",
+        "*",
+        "http://www.url.com:80/ *",
+    };
+    static const char *urls[] = {
+        "http://www.url.com:80/path",
+        "http://www.url.com:80/path/",
+        "http://www.url.com:80/PATH",
+        "http://www.url.com:80/app/",
+        "http://www.url.com:80/app/x/y/z",
+        "http://www.url.com:80/app/x/y/index.html",
+        "http://www.url.com:80/app/x/index.html?q",
+        "http://host.example.com:80/one/login.jsp",
+        "http://host.example.com:80/one/two/login.jsp",
+        "http://www.url.com:80/upper/x",
+        "http://www.url.com:80/query?a=1",
+        "http://www.url.com:80/query?b=1",
+        "http://www.url.com:80/style/main.css",
+        "http://www.url.com:80/style/main.CSS",
+        "http://www.url.com:80/img/x.gif?v=1",
+        "http://www.url.com:80/a-x-",
+        "http://www.url.com:80/a-/x-",
+        "http://www.url.com:80/a-x--b",
+        "http://www.url.com:80/a-x/y-b",
+        "http://www.url.com:80/",
+        "www.url.com/path",
+    };
+    am_config_t config;
+    am_request_t request;
+    int i, j, ci;
+
+    for (ci = 0; ci < 2; ci++) {
+        am_url_matcher_t *m;
+
+        memset(&config, 0, sizeof (config));
+        memset(&request, 0, sizeof (request));
+        config.url_eval_case_ignore = ci;
+        request.conf = &config;
+
+        m = am_url_matcher_create(0, ci, AM_FALSE);
+        assert_non_null(m);
+        for (i = 0; i < array_len(patterns); i++) {
+            assert_int_equal(am_url_matcher_add(m, -1, patterns[i]), AM_SUCCESS);
+        }
+
+        for (j = 0; j < array_len(urls); j++) {
+            const char *q = strchr(urls[j], '?');
+            am_bool_t expected = AM_FALSE, expected_noquery = AM_FALSE;
+            char *noquery = strndup(urls[j], q != NULL ? q - urls[j] : strlen(urls[j]));
+
+            for (i = 0; i < array_len(patterns); i++) {
+                expected |= policy_compare_url(&request, patterns[i], urls[j]) != AM_NO_MATCH;
+                expected_noquery |= policy_compare_url(&request, patterns[i], noquery) != AM_NO_MATCH;
+            }
+            assert_int_equal(am_url_matcher_match(&request, m, AM_REQUEST_GET, urls[j], strlen(urls[j])), expected);
+            assert_int_equal(am_url_matcher_match(&request, m, AM_REQUEST_GET, urls[j], strlen(noquery)), expected_noquery);
+            free(noquery);
+        }
+        am_url_matcher_free(m);
+    }
+}
+
+void test_url_notenforced_inverted_method(void **state) {
+
+    am_state_func_t const * func_array = NULL;
+    int array_len = 0;
+    am_state_func_t notenforced_handler;
+
+    struct am_config_map not_enforced_map[] = {
+        { "0",       "http://www.url.com:80/public/*" },
+        { "GET,0",   "http://www.url.com:80/images/*" },
+    };
+
+    am_config_t config = {
+        .url_eval_case_ignore       = AM_FALSE,
+        .not_enforced_fetch_attr    = AM_FALSE,
+        .not_enforced_map_sz        = array_len(not_enforced_map),
+        .not_enforced_map           = not_enforced_map,
+        .path_info_ignore_not_enforced = AM_TRUE,
+    };
+
+    am_request_t request = {
+        .conf                       = &config,
+        .method                     = AM_REQUEST_GET,
+        .overridden_url             = "http://www.url.com:80/public/page.html?x=*",
+    };
+
+    am_test_get_state_funcs(&func_array, &array_len);
+    notenforced_handler = func_array [5];
+
+    parse_url("http://www.url.com:80/path", &request.url);
+
+    /* plain entry, query ignored */
+    assert_int_equal(notenforced_handler(&request), AM_QUIT);
+    assert_int_equal(request.not_enforced, AM_TRUE);
+
+    /* method entry only for GET */
+    request.overridden_url = "http://www.url.com:80/images/a.png";
+    assert_int_equal(notenforced_handler(&request), AM_QUIT);
+    request.method = AM_REQUEST_POST;
+    assert_int_equal(notenforced_handler(&request), AM_OK);
+    assert_int_equal(request.not_enforced, AM_FALSE);
+
+    /* inverted: only the listed urls are enforced */
+    config.not_enforced_invert = AM_TRUE;
+    assert_int_equal(notenforced_handler(&request), AM_QUIT);
+    assert_int_equal(request.not_enforced, AM_TRUE);
+    request.method = AM_REQUEST_GET;
+    assert_int_equal(notenforced_handler(&request), AM_OK);
+    assert_int_equal(request.not_enforced, AM_FALSE);
+}
+
+/*
+ * Address tables built from range rules must agree with ip_address_match, also when ranges
+ * overlap or follow on from each other and are merged.
+ */
+void test_ip_table(void **state) {
+
+    static const char *rules[] = {
+        "192.168.0.0/24",
+        "192.168.1.0-192.168.1.9",
+        "192.168.1.10-192.168.1.20",
+        "192.168.0.200-192.168.1.3",
+        "10.0.0.0/8",
+        "172.18.1.10-172.17.1.1",      /* empty */
+        "172.20.0.1",                  /* not a range */
+        "2001:5c0:9168::/48",
+        "2001:5c0:9169::1-2001:5c0:9169::ff",
+        "::1-2001::",
+        "garbage/16",
+    };
+    static const char *addresses[] = {
+        "192.168.0.0", "192.168.0.255", "192.168.1.0", "192.168.1.9", "192.168.1.10",
+        "192.168.1.20", "192.168.1.21", "192.167.255.255", "10.255.255.255", "11.0.0.0",
+        "172.18.1.10", "172.20.0.1", "0.0.0.0", "255.255.255.255",
+        "2001:5c0:9168:ffff::1", "2001:5c0:9169::", "2001:5c0:9169::1", "2001:5c0:9169::100",
+        "::", "::1", "1000::", "2001::", "2001::1", "ffff::",
+    };
+    am_ip_table_t *t;
+    am_ip_t ip;
+    int i;
+
+    (void)state;
+
+    t = am_ip_table_create(0, rules, array_len(rules));
+    assert_non_null(t);
+    for (i = 0; i < array_len(addresses); i++) {
+        assert_true(am_ip_parse(addresses[i], &ip));
+        assert_int_equal(am_ip_table_match(t, &ip),
+                ip_address_match(addresses[i], rules, array_len(rules), 0) == AM_SUCCESS);
+    }
+    am_ip_table_free(t);
+
+    assert_false(am_ip_parse("192.168.0.0/24", &ip));
+    assert_false(am_ip_parse("fffff::", &ip));
+
+    /* all inclusive */
+    t = am_ip_table_create(0, array_of("0.0.0.0/0"), 1);
+    assert_true(am_ip_parse("255.255.255.255", &ip));
+    assert_true(am_ip_table_match(t, &ip));
+    assert_true(am_ip_parse("::1", &ip));
+    assert_false(am_ip_table_match(t, &ip));
+    am_ip_table_free(t);
+}
+
+void test_ext_notenforced(void **state) {
+
+    am_state_func_t const * func_array = NULL;
+    int array_len = 0;
+    am_state_func_t notenforced_handler;
+
+    struct am_config_map not_enforced_ext[] = {
+        { "0",   "10.1.1.0/24 10.1.2.1-10.1.2.7|http://www.url.com:80/public/* http://www.url.com:80/index.html" },
+        { "1",   "no pipe here" },
+        { "2",   "2001:5c0:9168::/48|http://www.url.com:80/v6/*" },
+    };
+
+    am_config_t config = {
+        .url_eval_case_ignore       = AM_FALSE,
+        .not_enforced_fetch_attr    = AM_FALSE,
+        .not_enforced_ext_map_sz    = array_len(not_enforced_ext),
+        .not_enforced_ext_map       = not_enforced_ext,
+    };
+
+    am_request_t request = {
+        .conf                       = &config,
+        .method                     = AM_REQUEST_GET,
+        .overridden_url             = "http://www.url.com:80/public/page.html",
+        .client_ip                  = "10.1.2.7",
+    };
+
+    am_test_get_state_funcs(&func_array, &array_len);
+    notenforced_handler = func_array [5];
+
+    parse_url("http://www.url.com:80/path", &request.url);
+
+    assert_int_equal(notenforced_handler(&request), AM_QUIT);
+    assert_int_equal(request.not_enforced, AM_TRUE);
+
+    request.client_ip = "10.1.2.8";
+    assert_int_equal(notenforced_handler(&request), AM_OK);
+    assert_int_equal(request.not_enforced, AM_FALSE);
+
+    request.client_ip = "2001:5c0:9168::8";
+    assert_int_equal(notenforced_handler(&request), AM_OK);
+    request.overridden_url = "http://www.url.com:80/v6/x";
+    assert_int_equal(notenforced_handler(&request), AM_QUIT);
+    assert_int_equal(request.not_enforced, AM_TRUE);
+}
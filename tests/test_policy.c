@@ -469,3 +469,162 @@ void test_am_policy_results(void **state) {
 
 }
 
+
+#define SCOPE_SELF 0
+#define SCOPE_SUBTREE 1
+
+/*
+ * the resource index used for more than a handful of policy results must pick the same
+ * results as matching each of them in turn
+ */
+void test_policy_select(void **state) {
+    am_config_t config = { .instance_id = 101, .url_eval_case_ignore = 1, .policy_scope_subtree = 1 };
+    am_request_t r = { .conf = &config, };
+    static const char *resources[] = {
+        "http://a.b.c:80/x/y/z",
+        "http://a.b.c:80/x/*",
+        "http://a.b.c:80/x/-*-/z",
+        "http://A.B.C:80/X/Y/Z",
+        "http://a.b.*/*/z",
+        "*.c*/-*-/z",
+        "http*://*example.com:*/fred/*",
+        "http://example.com:80/index.*?*",
+        "http://a.b.c:80/x/*",
+        "http://www.google.com*",
+        "http://a.b.c:80/*.gif",
+        "*",
+        "http://a.b.c:80/x/y/z"
+    };
+    static const char *urls[] = {
+        "http://a.b.c:80/x/y/z",
+        "http://a.b.c:80/x/z",
+        "http://a.b.c:80/x",
+        "http://a.b.c:90/q/z",
+        "http://www.example.com:80/fred/index.html",
+        "http://example.com:80/index.html?a=b",
+        "http://www.google.com.co.uk:80/blah",
+        "http://a.b.c:80/illegal?hack.gif",
+        "http://a.b.c:80/x/a.gif",
+        "http://other.com:80/"
+    };
+    int scopes[ARRAY_SIZE(resources)];
+    char status[ARRAY_SIZE(resources)];
+    int i, j, found, expected;
+
+    for (i = 0; i < ARRAY_SIZE(resources); i++) {
+        scopes[i] = i == 3 ? SCOPE_SELF : SCOPE_SUBTREE;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(urls); i++) {
+        found = am_policy_select(&r, urls[i], SCOPE_SUBTREE, ARRAY_SIZE(resources), scopes, resources, status);
+        for (j = 0, expected = 0; j < ARRAY_SIZE(resources); j++) {
+            char s = scopes[j] == SCOPE_SUBTREE ? policy_compare_url(&r, resources[j], urls[i]) : AM_NO_MATCH;
+            assert_int_equal(status[j], s);
+            expected += s != AM_NO_MATCH;
+        }
+        assert_int_equal(found, expected);
+    }
+
+    /* case sensitive */
+    config.url_eval_case_ignore = 0;
+    for (i = 0; i < ARRAY_SIZE(resources); i++) {
+        scopes[i] = SCOPE_SUBTREE;
+    }
+    found = am_policy_select(&r, "http://A.B.C:80/X/Y/Z", SCOPE_SUBTREE, ARRAY_SIZE(resources), scopes, resources, status);
+    assert_int_equal(found, 1);
+    assert_int_equal(status[3], AM_EXACT_MATCH);
+
+    /* self mode: the resource is the url itself, an asterisk is not a wildcard */
+    config.policy_scope_subtree = 0;
+    for (i = 0; i < ARRAY_SIZE(resources); i++) {
+        scopes[i] = SCOPE_SELF;
+    }
+    found = am_policy_select(&r, "http://a.b.c:80/x/y/z", SCOPE_SELF, ARRAY_SIZE(resources), scopes, resources, status);
+    assert_int_equal(found, 2);
+    assert_int_equal(status[0], AM_EXACT_MATCH);
+    assert_int_equal(status[12], AM_EXACT_MATCH);
+    found = am_policy_select(&r, "http://a.b.c:80/x/*", SCOPE_SELF, ARRAY_SIZE(resources), scopes, resources, status);
+    assert_int_equal(found, 2);
+    assert_int_equal(status[1], AM_EXACT_MATCH);
+    assert_int_equal(status[8], AM_EXACT_MATCH);
+    found = am_policy_select(&r, "http://a.b.c:80/x/q", SCOPE_SELF, ARRAY_SIZE(resources), scopes, resources, status);
+    assert_int_equal(found, 0);
+
+    /* a few results are compared one by one */
+    found = am_policy_select(&r, "http://a.b.c:80/x/y/z", SCOPE_SELF, 3, scopes, resources, status);
+    assert_int_equal(found, 1);
+    assert_int_equal(status[0], AM_EXACT_MATCH);
+}
+
+typedef struct {
+    const char *pattern, *resource;
+    char expect;
+} resource_exp_t;
+
+/* resource patterns as they come in OpenAM policy decisions and not enforced lists */
+static resource_exp_t resource_exps[] = {
+    { "http://www.example.com:80/*", "http://www.example.com:80/app/index.html", AM_EXACT_PATTERN_MATCH },
+    { "http://www.example.com:80/*", "http://www.other.com:80/", AM_NO_MATCH },
+    { "https://www.example.com:443/*?*", "https://www.example.com:443/app/login?goto=%2Fhome", AM_EXACT_PATTERN_MATCH },
+    { "http://*.example.com:*/-*-/index.html", "http://shop.example.com:8080/store/index.html", AM_EXACT_PATTERN_MATCH },
+    { "http://*.example.com:*/-*-/index.html", "http://shop.example.com:8080/store/a/index.html", AM_NO_MATCH },
+    { "http://www.example.com:80/app/-*-/static/*", "http://www.example.com:80/app/v2/static/css/site.css", AM_EXACT_PATTERN_MATCH },
+    { "*://*:*/*", "http://host.example.com:8080/a/b/c", AM_EXACT_PATTERN_MATCH },
+    { "*://*:*/*?*", "https://host.example.com:443/a?b=c", AM_EXACT_PATTERN_MATCH },
+    { "http://www.example.com:80/protected/*.jsp", "http://www.example.com:80/protected/admin/users.jsp", AM_EXACT_PATTERN_MATCH },
+    { "http://www.example.com:80/protected/*.jsp", "http://www.example.com:80/protected/page.html?x=a.jsp", AM_NO_MATCH },
+    { "http://www.example.com:80/app/-*-", "http://www.example.com:80/app/a/b", AM_NO_MATCH },
+    { "http://www.example.com:80/*/images/*.png", "http://www.example.com:80/a/b/c/images/logo.png", AM_EXACT_PATTERN_MATCH },
+    { "https://portal.example.com:443/openam/*", "https://portal.example.com:443/openam/XUI/#login/", AM_EXACT_PATTERN_MATCH },
+    { "http://WWW.Example.COM:80/App/*", "http://www.example.com:80/app/Index.html", AM_EXACT_PATTERN_MATCH },
+    { "http://www.example.com/*", "http://www.example.com:80/app/index.html", AM_NO_MATCH },
+    { "http://www.example.com*", "http://www.example.com:80/app/index.html", AM_NO_MATCH }
+};
+
+/*
+ * microbenchmark over realistic resource patterns
+ */
+void test_policy_compare_url_benchmark(void **state) {
+    am_config_t config = { .instance_id = 101, .url_eval_case_ignore = 1 };
+    am_request_t r = { .conf = &config, };
+    size_t len = array_len(resource_exps);
+    am_url_pattern_t *compiled[array_len(resource_exps)];
+    int i, c, max_c = 20000, errs = 0;
+    am_timer_t t;
+
+    am_timer_start(&t);
+    for (c = 0; errs == 0 && c < max_c; c++) {
+        for (i = 0; i < len; i++) {
+            if (policy_compare_url(&r, resource_exps[i].pattern, resource_exps[i].resource) != resource_exps[i].expect) {
+                printf("policy test error with pattern %s and URL %s: expected %s\n", resource_exps[i].pattern,
+                        resource_exps[i].resource, am_policy_strerror(resource_exps[i].expect));
+                errs++;
+            }
+        }
+    }
+    am_timer_stop(&t);
+    printf("test_policy_compare_url_benchmark: %lu evals took %lf seconds\n", c * len, am_timer_elapsed(&t));
+    assert_int_equal(errs, 0);
+
+    /* patterns compiled once, as in the not enforced lists */
+    for (i = 0; i < len; i++) {
+        compiled[i] = am_url_pattern_create(resource_exps[i].pattern, config.url_eval_case_ignore);
+        assert_non_null(compiled[i]);
+    }
+    am_timer_start(&t);
+    for (c = 0; errs == 0 && c < max_c; c++) {
+        for (i = 0; i < len; i++) {
+            if (am_url_pattern_match(compiled[i], resource_exps[i].resource) != resource_exps[i].expect) {
+                printf("policy test error with compiled pattern %s and URL %s: expected %s\n", resource_exps[i].pattern,
+                        resource_exps[i].resource, am_policy_strerror(resource_exps[i].expect));
+                errs++;
+            }
+        }
+    }
+    am_timer_stop(&t);
+    printf("test_policy_compare_url_benchmark: %lu compiled evals took %lf seconds\n", c * len, am_timer_elapsed(&t));
+    for (i = 0; i < len; i++) {
+        free(compiled[i]);
+    }
+    assert_int_equal(errs, 0);
+}
@@ -32,6 +32,10 @@ void am_worker_pool_init_reset();
 void am_net_init_ssl_reset();
 
 void agent_memory_print(pid_t pid);
+uint32_t agent_memory_seed();
+int agent_memory_clusters(void);
+void agent_memory_mark_damaged(unsigned cluster);
+int master_recovery_process(pid_t pid);
 
 int am_purge_caches(unsigned long instance_id, time_t expiry_time);
 void dump_cache_memory(void);
@@ -293,6 +297,45 @@ void test_policy_result_reader(void **state) {
     test_policy_structure(result);
 }
 
+/**
+ * The same response fed in pieces of any size must parse to the same result, and
+ * an Exception in the response must be reported.
+ */
+void test_policy_result_stream_reader(void **state) {
+    char *buffer = NULL, *exception = NULL;
+    size_t size, piece, i;
+    am_xml_stream_t *xml;
+
+    am_asprintf(&buffer, pll, policy_xml);
+    size = strlen(buffer);
+
+    for (piece = 1; piece <= size; piece = piece < 16 ? piece + 1 : piece * 2) {
+        xml = am_policy_xml_stream(0l, 0);
+        assert_non_null(xml);
+        for (i = 0; i < size; i += piece) {
+            am_xml_stream_feed(xml, buffer + i, size - i < piece ? size - i : piece);
+        }
+        assert_int_equal(am_xml_stream_size(xml), size);
+        test_policy_structure(am_xml_stream_finish(xml, &exception));
+        assert_null(exception);
+    }
+    free(buffer);
+    buffer = NULL;
+
+    am_asprintf(&buffer, pll, "<PolicyService version='1.0'><PolicyResponse requestId='4'>"
+            "<Exception>Application token passed in: AQIC5]]]</Exception></PolicyResponse></PolicyService>");
+    size = strlen(buffer);
+    xml = am_policy_xml_stream(0l, 0);
+    assert_non_null(xml);
+    for (i = 0; i < size; i++) {
+        am_xml_stream_feed(xml, buffer + i, 1);
+    }
+    assert_null(am_xml_stream_finish(xml, &exception));
+    assert_string_equal(exception, "<Exception>Application token passed in: AQIC5]]]");
+    free(exception);
+    free(buffer);
+}
+
 static void test_log_callback(void *arg, char *name, int error) {
     int *pcount = arg;
     (*pcount)++;
@@ -337,6 +380,515 @@ void test_policy_cache_simple(void **state) {
 }
 
 
+static int match_resource(void *arg, int count, const int *scopes, const char **resources, char *status) {
+    int i, found = 0;
+    for (i = 0; i < count; i++) {
+        status[i] = strcmp(resources[i], (const char *) arg) == 0 ? AM_EXACT_MATCH : AM_NO_MATCH;
+        found += status[i] == AM_EXACT_MATCH;
+    }
+    return found;
+}
+
+void test_policy_cache_match(void **state) {
+
+    am_config_t config = { .token_cache_valid = 100 };
+    am_request_t request = { .conf = &config } ;
+    char* buffer = NULL;
+    struct am_policy_result * result;
+    struct am_policy_result * other = calloc(1, sizeof (struct am_policy_result));
+    struct am_policy_result * r = NULL;
+    struct am_namevalue * session = NULL;
+
+    am_asprintf(&buffer, pll, policy_xml);
+    result = am_parse_policy_xml(0l, buffer, strlen(buffer), 0);
+    free(buffer);
+    assert_non_null(other);
+    other->resource = strdup("http://other.local.com:80/");
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    am_add_session_policy_cache_entry(&request, "Policy-key", result, NULL);
+    am_add_session_policy_cache_entry(&request, "Policy-key", other, NULL);
+    delete_am_policy_result_list(&result);
+    delete_am_policy_result_list(&other);
+
+    /* only the entry for the resource is copied out of the cache */
+    assert_int_equal(am_get_session_policy_cache_match(&request, "Policy-key", match_resource,
+            "http://vb2.local.com:80/testwebsite", &r, &session, NULL), AM_SUCCESS);
+    assert_non_null(r);
+    assert_null(r->next);
+    test_policy_structure(r); /* also deletes the list */
+    delete_am_namevalue_list(&session);
+
+    assert_int_equal(am_get_session_policy_cache_match(&request, "Policy-key", match_resource,
+            "http://other.local.com:80/", &r, &session, NULL), AM_SUCCESS);
+    assert_non_null(r);
+    assert_string_equal(r->resource, "http://other.local.com:80/");
+    assert_null(r->next);
+    delete_am_policy_result_list(&r);
+    delete_am_namevalue_list(&session);
+
+    r = NULL;
+    assert_int_equal(am_get_session_policy_cache_match(&request, "Policy-key", match_resource,
+            "http://none.local.com:80/", &r, &session, NULL), AM_NOT_FOUND);
+    assert_null(r);
+    assert_int_equal(am_get_session_policy_cache_match(&request, "Other-key", match_resource,
+            "http://other.local.com:80/", &r, &session, NULL), AM_NOT_FOUND);
+
+    am_cache_destroy();
+}
+
+struct index_match {
+    am_request_t *r;
+    const char *url;
+    int calls;
+    int count;
+};
+
+static int select_indexed(void *arg, int count, const int *scopes, const char **resources, char *status) {
+    struct index_match *m = arg;
+    m->calls++;
+    m->count = count;
+    return am_policy_select(m->r, m->url, 0, count, scopes, resources, status);
+}
+
+/**
+ * All of the policy records cached for a token are selected from at once, using an index which is
+ * built once and kept for the token until its policy or the shared cache generation changes.
+ */
+void test_policy_cache_index(void **state) {
+
+    am_config_t config = { .token_cache_valid = 100, .policy_scope_subtree = AM_TRUE };
+    am_request_t request = { .conf = &config, .token = "Index-key" };
+    struct index_match match = { &request, "http://host7.local.com:80/app/page", 0, 0 };
+    struct am_policy_result * p = NULL;
+    struct am_policy_result * r = NULL;
+    struct am_namevalue * session = NULL;
+    char resource[64];
+    char* report = NULL;
+    int i;
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    for (i = 0; i < 12; i++) {
+        snprintf(resource, sizeof (resource), "http://host%d.local.com:80/app/*", i);
+        assert_int_equal(create_am_policy_result_node(resource, strlen(resource), &p), 0);
+        p->scope = 0;
+        assert_int_equal(am_add_session_policy_cache_entry(&request, "Index-key", p, NULL), AM_SUCCESS);
+        delete_am_policy_result_list(&p);
+    }
+
+    for (i = 0; i < 3; i++) {
+        assert_int_equal(am_get_session_policy_cache_match(&request, "Index-key", select_indexed, &match,
+                &r, &session, NULL), AM_SUCCESS);
+        assert_non_null(r);
+        assert_string_equal(r->resource, "http://host7.local.com:80/app/*");
+        assert_null(r->next);
+        delete_am_policy_result_list(&r);
+        delete_am_namevalue_list(&session);
+    }
+    /* every record is handed to select at once */
+    assert_int_equal(match.calls, 3);
+    assert_int_equal(match.count, 12);
+
+    /* a new generation, and then another policy for the token, each need a new index */
+    am_cache_invalidate();
+    assert_int_equal(am_get_session_policy_cache_match(&request, "Index-key", select_indexed, &match,
+            &r, &session, NULL), AM_SUCCESS);
+    delete_am_policy_result_list(&r);
+    delete_am_namevalue_list(&session);
+
+    assert_int_equal(create_am_policy_result_node("http://host7.local.com:80/*", 27, &p), 0);
+    p->scope = 0;
+    assert_int_equal(am_add_session_policy_cache_entry(&request, "Index-key", p, NULL), AM_SUCCESS);
+    delete_am_policy_result_list(&p);
+    assert_int_equal(am_get_session_policy_cache_match(&request, "Index-key", select_indexed, &match,
+            &r, &session, NULL), AM_SUCCESS);
+    assert_int_equal(match.count, 13);
+    assert_non_null(r);
+    assert_non_null(r->next);
+    assert_null(r->next->next);
+    delete_am_policy_result_list(&r);
+    delete_am_namevalue_list(&session);
+
+    assert_int_equal(am_cache_status(&report, AM_FALSE), AM_SUCCESS);
+    assert_non_null(strstr(report, "index hits: 2\n"));
+    assert_non_null(strstr(report, "index misses: 3\n"));
+    free(report);
+
+    am_cache_destroy();
+}
+
+/**
+ * Decisions are kept in the process for the token, scope and url they were made for, until the
+ * shared cache generation changes.
+ */
+void test_policy_cache_decisions(void **state) {
+
+    char* buffer = NULL;
+    struct am_policy_result * result;
+    struct am_policy_result * r = NULL;
+    struct am_namevalue * session = NULL;
+    const char *url = "http://vb2.local.com:80/testwebsite";
+    uint32_t generation;
+    int64_t expires = 0;
+    am_config_t config = { .token_cache_valid = 100 };
+    am_request_t request = { .conf = &config, .token = "Policy-key" };
+
+    am_asprintf(&buffer, pll, policy_xml);
+    result = am_parse_policy_xml(0l, buffer, strlen(buffer), 0);
+    free(buffer);
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    generation = am_cache_generation();
+    assert_int_equal(am_get_decision_cache_entry("Policy-key", url, 0, &r, &session), AM_NOT_FOUND);
+    am_add_decision_cache_entry(&request, url, 0, generation, 0, result, NULL);
+
+    assert_int_equal(am_get_decision_cache_entry("Policy-key", url, 0, &r, &session), AM_SUCCESS);
+    test_policy_structure(r); /* also deletes the list */
+    delete_am_namevalue_list(&session);
+
+    assert_int_equal(am_get_decision_cache_entry("Policy-key", url, 1, &r, &session), AM_NOT_FOUND);
+    assert_int_equal(am_get_decision_cache_entry("Other-key", url, 0, &r, &session), AM_NOT_FOUND);
+
+    /* removing any session invalidates them */
+    am_remove_cache_entry(0, "Other-key");
+    assert_int_equal(am_get_decision_cache_entry("Policy-key", url, 0, &r, &session), AM_NOT_FOUND);
+
+    /* as does a policy change, even for data read before it */
+    am_add_decision_cache_entry(&request, url, 0, am_cache_generation(), 0, result, NULL);
+    assert_int_equal(am_set_policy_cache_epoch(time(NULL)), AM_SUCCESS);
+    assert_int_equal(am_get_decision_cache_entry("Policy-key", url, 0, &r, &session), AM_NOT_FOUND);
+    am_add_decision_cache_entry(&request, url, 0, generation, 0, result, NULL);
+    assert_int_equal(am_get_decision_cache_entry("Policy-key", url, 0, &r, &session), AM_NOT_FOUND);
+
+    /* a decision is not kept past the expiry of the cached data it was made with */
+    am_add_session_policy_cache_entry(&request, "Policy-key", result, NULL);
+    assert_int_equal(am_get_session_policy_cache_match(&request, "Policy-key", match_resource,
+            (void *) url, &r, &session, &expires), AM_SUCCESS);
+    assert_true(expires > time(NULL) && expires <= time(NULL) + config.token_cache_valid);
+    delete_am_policy_result_list(&r);
+    delete_am_namevalue_list(&session);
+    am_add_decision_cache_entry(&request, url, 0, am_cache_generation(), time(NULL) - 1, result, NULL);
+    assert_int_equal(am_get_decision_cache_entry("Policy-key", url, 0, &r, &session), AM_NOT_FOUND);
+    am_add_decision_cache_entry(&request, url, 0, am_cache_generation(), expires, result, NULL);
+    assert_int_equal(am_get_decision_cache_entry("Policy-key", url, 0, &r, &session), AM_SUCCESS);
+    delete_am_policy_result_list(&r);
+    delete_am_namevalue_list(&session);
+
+    /* nor is one made with data just fetched kept past the session time to live */
+    config.token_cache_valid = 0;
+    am_remove_cache_entry(0, "Other-key");
+    am_add_decision_cache_entry(&request, url, 0, am_cache_generation(), 0, result, NULL);
+    assert_int_equal(am_get_decision_cache_entry("Policy-key", url, 0, &r, &session), AM_NOT_FOUND);
+
+    delete_am_policy_result_list(&result);
+    am_cache_destroy();
+}
+
+/**
+ * The cache is saved to the snapshot file when the last process using it shuts down, and entries which are still valid
+ * are loaded back (with the policy epoch) when it is created again.
+ */
+void test_policy_cache_snapshot(void **state) {
+
+    am_config_t config = { .token_cache_valid = 100 };
+    am_request_t request = { .conf = &config } ;
+    char* buffer = NULL;
+    const char *path = "cache-snapshot-test";
+    struct am_policy_result * result;
+    struct am_policy_result * r = NULL;
+    struct am_namevalue * session = NULL;
+    struct stat st;
+
+    am_asprintf(&buffer, pll, policy_xml);
+    result = am_parse_policy_xml(0l, buffer, strlen(buffer), 0);
+    free(buffer);
+
+    unlink(path);
+    cleardown();
+    setenv("AM_CACHE_SNAPSHOT", path, 1);
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    assert_int_equal(am_add_session_policy_cache_entry(&request, "Snapshot-key", result, NULL), AM_SUCCESS);
+    assert_int_equal(am_set_policy_cache_epoch(500), AM_SUCCESS);
+    delete_am_policy_result_list(&result);
+
+    am_cache_shutdown();
+    cleardown();
+    assert_int_equal(stat(path, &st), 0);
+    assert_int_equal(st.st_mode & 0777, 0600); /* session data is readable by the owner only */
+
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+    assert_int_equal(am_get_session_policy_cache_entry(&request, "Snapshot-key", &r, &session, NULL), AM_SUCCESS);
+    test_policy_structure(r); /* also deletes the list */
+    delete_am_namevalue_list(&session);
+    assert_int_equal(am_check_policy_cache_epoch(499), AM_ETIMEDOUT);
+    assert_int_equal(am_check_policy_cache_epoch(500), AM_SUCCESS);
+
+    unsetenv("AM_CACHE_SNAPSHOT");
+    am_cache_destroy();
+    unlink(path);
+}
+
+/**
+ * Recovery of a damaged memory cluster drops the cache entries which are in it, and only those.
+ */
+void test_policy_cache_damaged_cluster(void **state) {
+
+    am_config_t config = { .token_cache_valid = 100 };
+    am_request_t request = { .conf = &config } ;
+    char* buffer = NULL;
+    char key[64];
+    struct am_policy_result * result;
+    struct am_policy_result * r = NULL;
+    struct am_namevalue * session = NULL;
+    unsigned cluster;
+    int i;
+
+    am_asprintf(&buffer, pll, policy_xml);
+    result = am_parse_policy_xml(0l, buffer, strlen(buffer), 0);
+    free(buffer);
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    /* the next entry goes to the cluster after this one, and the ones after it to the following clusters */
+    cluster = (agent_memory_seed() + 1) % agent_memory_clusters();
+    assert_int_equal(am_add_session_policy_cache_entry(&request, "Damaged-key", result, NULL), AM_SUCCESS);
+    for (i = 0; i < 4; i++) {
+        snprintf(key, sizeof(key), "Healthy-key-%d", i);
+        assert_int_equal(am_add_session_policy_cache_entry(&request, key, result, NULL), AM_SUCCESS);
+    }
+    delete_am_policy_result_list(&result);
+
+    agent_memory_mark_damaged(cluster);
+    assert_int_equal(master_recovery_process(getpid()), 0);
+
+    assert_int_equal(am_get_session_policy_cache_entry(&request, "Damaged-key", &r, &session, NULL), AM_NOT_FOUND);
+    for (i = 0; i < 4; i++) {
+        snprintf(key, sizeof(key), "Healthy-key-%d", i);
+        assert_int_equal(am_get_session_policy_cache_entry(&request, key, &r, &session, NULL), AM_SUCCESS);
+        test_policy_structure(r); /* also deletes the list */
+        delete_am_namevalue_list(&session);
+        r = NULL;
+    }
+
+    am_cache_destroy();
+}
+
+/**
+ * The status report counts lookups by type of cached data and shows where the entries are.
+ */
+void test_policy_cache_status(void **state) {
+
+    am_config_t config = { .token_cache_valid = 100 };
+    am_request_t request = { .conf = &config } ;
+    char* buffer = NULL;
+    char* report = NULL;
+    struct am_policy_result * result;
+    struct am_policy_result * r = NULL;
+    struct am_namevalue * session = NULL;
+
+    am_asprintf(&buffer, pll, policy_xml);
+    result = am_parse_policy_xml(0l, buffer, strlen(buffer), 0);
+    free(buffer);
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    assert_int_equal(am_get_session_policy_cache_entry(&request, "Status-key", &r, &session, NULL), AM_NOT_FOUND);
+    assert_int_equal(am_add_session_policy_cache_entry(&request, "Status-key", result, NULL), AM_SUCCESS);
+    assert_int_equal(am_get_session_policy_cache_entry(&request, "Status-key", &r, &session, NULL), AM_SUCCESS);
+    test_policy_structure(r); /* also deletes the list */
+    delete_am_namevalue_list(&session);
+    assert_int_equal(am_check_policy_cache_epoch(time(NULL)), AM_SUCCESS);
+    delete_am_policy_result_list(&result);
+
+    /* the counters only, without walking the cache */
+    assert_int_equal(am_cache_status(&report, AM_FALSE), AM_SUCCESS);
+    assert_non_null(strstr(report, "session hits: 1\n"));
+    assert_null(strstr(report, "slots with "));
+    assert_null(strstr(report, "memory used: "));
+    free(report);
+    report = NULL;
+
+    assert_int_equal(am_cache_status(&report, AM_TRUE), AM_SUCCESS);
+    assert_non_null(strstr(report, "session hits: 1\n"));
+    assert_non_null(strstr(report, "session misses: 1\n"));
+    assert_non_null(strstr(report, "epoch hits: 1\n"));
+    assert_non_null(strstr(report, "slots with 2 entries: 1\n"));
+    assert_non_null(strstr(report, "memory fragmentation: "));
+    free(report);
+    report = NULL;
+
+    /* as agentadmin reads it: the counters, from the stats segment only */
+    assert_int_equal(am_cache_status_instance(AM_DEFAULT_AGENT_ID, &report), AM_SUCCESS);
+    assert_non_null(strstr(report, "session hits: 1\n"));
+    assert_null(strstr(report, "slots with "));
+    free(report);
+    report = NULL;
+
+    am_cache_destroy();
+
+    /* no agent running: nothing is created for the status */
+    assert_int_equal(am_cache_status_instance(AM_DEFAULT_AGENT_ID, &report), AM_NOT_FOUND);
+    assert_null(report);
+    assert_null(am_shm_open_readonly(get_global_name("stats", AM_DEFAULT_AGENT_ID)));
+}
+
+/**
+ * Time bounded expiry sweeps carry on from where the last one stopped, so that enough of them cover the
+ * whole cache.
+ */
+void test_policy_cache_incremental_purge(void **state) {
+
+    am_config_t config = { .token_cache_valid = 0 };
+    am_request_t request = { .conf = &config } ;
+    char* buffer = NULL;
+    char* report = NULL;
+    struct am_policy_result * result;
+    int i;
+
+    am_asprintf(&buffer, pll, policy_xml);
+    result = am_parse_policy_xml(0l, buffer, strlen(buffer), 0);
+    free(buffer);
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    assert_int_equal(am_add_session_policy_cache_entry(&request, "Purge-key", result, NULL), AM_SUCCESS);
+    delete_am_policy_result_list(&result);
+    sleep(2);
+
+    assert_int_equal(am_cache_status(&report, AM_TRUE), AM_SUCCESS);
+    assert_non_null(strstr(report, "slots with 2 entries: 1\n"));
+    free(report);
+
+    /* each sweep takes at least one slice of 64 slots */
+    for (i = 0; i < 6151 / 64 + 1; i++) {
+        cache_purge_expired_entries(getpid(), 1);
+    }
+
+    assert_int_equal(am_cache_status(&report, AM_TRUE), AM_SUCCESS);
+    assert_null(strstr(report, "slots with 2 entries"));
+    assert_non_null(strstr(report, "expires: 2\n"));
+    free(report);
+
+    am_cache_destroy();
+}
+
+/**
+ * Session attributes and the policy for each resource are separate records: adding a policy for another
+ * resource leaves the session record alone, and removing the session removes its policies.
+ */
+void test_policy_cache_split_records(void **state) {
+
+    am_config_t config = { .token_cache_valid = 100 };
+    am_request_t request = { .conf = &config } ;
+    struct am_policy_result * a = NULL;
+    struct am_policy_result * b = NULL;
+    struct am_policy_result * r = NULL;
+    struct am_namevalue * first = NULL;
+    struct am_namevalue * second = NULL;
+    struct am_namevalue * session = NULL;
+
+    assert_int_equal(create_am_policy_result_node("http://a.local.com:80/", 22, &a), 0);
+    assert_int_equal(create_am_policy_result_node("http://b.local.com:80/", 22, &b), 0);
+    assert_int_equal(create_am_namevalue_node("uid", 3, "first", 5, &first), 0);
+    assert_int_equal(create_am_namevalue_node("uid", 3, "second", 6, &second), 0);
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    assert_int_equal(am_add_session_policy_cache_entry(&request, "Split-key", a, first), AM_SUCCESS);
+    assert_int_equal(am_add_session_policy_cache_entry(&request, "Split-key", b, second), AM_SUCCESS);
+    /* adding the same resource again replaces its record */
+    assert_int_equal(am_add_session_policy_cache_entry(&request, "Split-key", a, second), AM_SUCCESS);
+
+    assert_int_equal(am_get_session_policy_cache_match(&request, "Split-key", match_resource,
+            "http://b.local.com:80/", &r, &session, NULL), AM_SUCCESS);
+    assert_non_null(r);
+    assert_null(r->next);
+    assert_non_null(session);
+    assert_string_equal(session->v, "first");
+    delete_am_policy_result_list(&r);
+    delete_am_namevalue_list(&session);
+
+    r = NULL;
+    session = NULL;
+    assert_int_equal(am_get_session_policy_cache_entry(&request, "Split-key", &r, &session, NULL), AM_SUCCESS);
+    assert_non_null(r);
+    assert_non_null(r->next);
+    assert_null(r->next->next);
+    delete_am_policy_result_list(&r);
+    delete_am_namevalue_list(&session);
+
+    assert_int_equal(am_remove_cache_entry(0, "Split-key"), AM_SUCCESS);
+    r = NULL;
+    assert_int_equal(am_get_session_policy_cache_match(&request, "Split-key", match_resource,
+            "http://a.local.com:80/", &r, &session, NULL), AM_NOT_FOUND);
+    assert_null(r);
+
+    delete_am_policy_result_list(&a);
+    delete_am_policy_result_list(&b);
+    delete_am_namevalue_list(&first);
+    delete_am_namevalue_list(&second);
+    am_cache_destroy();
+}
+
+/**
+ * All of the policy records of a token share a cache bucket, so only so many of them are kept: a user with
+ * many resources starts over instead of filling the bucket, and policy with too many results is not cached.
+ */
+void test_policy_cache_many_resources(void **state) {
+
+    am_config_t config = { .token_cache_valid = 100 };
+    am_request_t request = { .conf = &config } ;
+    struct am_policy_result * p = NULL;
+    struct am_policy_result * list = NULL;
+    struct am_policy_result * r = NULL;
+    struct am_policy_result * e, * t;
+    struct am_namevalue * session = NULL;
+    char resource[64];
+    int i, count = 0, last = 0;
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    for (i = 0; i < 300; i++) {
+        snprintf(resource, sizeof (resource), "http://r%d.local.com:80/", i);
+        assert_int_equal(create_am_policy_result_node(resource, strlen(resource), &p), 0);
+        assert_int_equal(am_add_session_policy_cache_entry(&request, "Many-key", p, NULL), AM_SUCCESS);
+        delete_am_policy_result_list(&p);
+    }
+
+    assert_int_equal(am_get_session_policy_cache_entry(&request, "Many-key", &r, &session, NULL), AM_SUCCESS);
+    AM_LIST_FOR_EACH(r, e, t) {
+        count++;
+        last += strcmp(e->resource, "http://r299.local.com:80/") == 0;
+    }
+    assert_in_range(count, 1, 64);
+    assert_int_equal(last, 1);
+    delete_am_policy_result_list(&r);
+    delete_am_namevalue_list(&session);
+
+    for (i = 0; i < 65; i++) {
+        snprintf(resource, sizeof (resource), "http://s%d.local.com:80/", i);
+        assert_int_equal(create_am_policy_result_node(resource, strlen(resource), &p), 0);
+        AM_LIST_INSERT(list, p);
+    }
+    assert_int_equal(am_add_session_policy_cache_entry(&request, "Many-key", list, NULL), AM_E2BIG);
+    delete_am_policy_result_list(&list);
+    assert_int_equal(am_get_session_policy_cache_entry(&request, "Many-key", &r, &session, NULL), AM_NOT_FOUND);
+
+    am_cache_destroy();
+}
+
 const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789*";
 
 
@@ -466,6 +1018,58 @@ void test_policy_cache_many_entries(void **state) {
     am_cache_destroy();
 }
 
+void test_policy_cache_sized_for_sessions(void **state) {
+
+    const int test_size = 2048;
+    char* buffer = NULL;
+    char* report = NULL;
+    struct am_policy_result * result;
+    
+    am_config_t config;
+    am_request_t request;
+    
+    memset(&config, 0, sizeof(am_config_t));
+    config.token_cache_valid = 100;
+    memset(&request, 0, sizeof(am_request_t));
+    request.conf = &config;
+    
+    am_asprintf(&buffer, pll, policy_xml);
+    result = am_parse_policy_xml(0l, buffer, strlen(buffer), 0);
+    
+    free(buffer);
+    
+    // a cache created for more sessions has a bigger hash table and more locks, but not less memory
+    setenv("AM_SESSION_CACHE_ENTRIES", "100000", 1);
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+    
+    assert_int_equal(am_cache_status(&report, AM_FALSE), AM_SUCCESS);
+    assert_non_null(strstr(report, "slots: 25001\n"));
+    assert_non_null(strstr(report, "locks: 16384\n"));
+    assert_non_null(strstr(report, "memory size: 1073741824\n"));
+    AM_FREE(report);
+    
+    test_cache(test_size, &request, result);
+    
+    am_cache_destroy();
+    
+    // a small session count does not go below the default geometry
+    setenv("AM_SESSION_CACHE_ENTRIES", "100", 1);
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+    
+    assert_int_equal(am_cache_status(&report, AM_FALSE), AM_SUCCESS);
+    assert_non_null(strstr(report, "slots: 6151\n"));
+    assert_non_null(strstr(report, "locks: 4096\n"));
+    assert_non_null(strstr(report, "memory size: 1073741824\n"));
+    AM_FREE(report);
+    
+    am_cache_destroy();
+    unsetenv("AM_SESSION_CACHE_ENTRIES");
+    
+    delete_am_policy_result_list(&result);
+}
+
 void test_policy_cache_purge_many_entries(void **state) {
     
     const int test_size = 4096;
@@ -494,8 +1098,8 @@ void test_policy_cache_purge_many_entries(void **state) {
     assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
     
     capacity = test_cache(test_size, &request, result);
-    cache_garbage_collect();
-    cache_purge_expired_entries(getpid());
+    cache_garbage_collect(0);
+    cache_purge_expired_entries(getpid(), 0);
 
     // assert_int_equal(am_purge_caches(0, time(NULL) + cache_valid_secs + 1), capacity);
 
@@ -539,8 +1143,8 @@ void test_policy_cache_purge_during_insert(void **state) {
     loaded = test_cache(test_size, &request, result);
     elapsed = time(NULL) - t0;
 
-    cache_garbage_collect();
-    cache_purge_expired_entries(getpid());
+    cache_garbage_collect(0);
+    cache_purge_expired_entries(getpid(), 0);
 
     // assert_int_equal(am_purge_caches(0, time(NULL) + cache_valid + 1), loaded);
 
@@ -555,15 +1159,15 @@ void test_policy_cache_purge_during_insert(void **state) {
     printf("waiting for %ld + 1 secs..\n", elapsed);
     sleep( (elapsed + 4) );
     
-    cache_garbage_collect();
-    cache_purge_expired_entries(getpid());
+    cache_garbage_collect(0);
+    cache_purge_expired_entries(getpid(), 0);
     
     // this update should trigger purge 
     printf("verifying expiry during load.. \n");
     loaded = test_cache_with_seed(321213, 100, &request, result, AM_TRUE);
 
-    cache_garbage_collect();
-    cache_purge_expired_entries(getpid());
+    cache_garbage_collect(0);
+    cache_purge_expired_entries(getpid(), 0);
 
     //assert_int_equal(am_purge_caches(0, time(NULL) + elapsed + 10), loaded);
 
@@ -689,7 +1293,7 @@ static void* test_gc_procedure(void * params)
     while (*state)
     {
         printf("*************gc start\n");
-        cache_purge_expired_entries(getpid());
+        cache_purge_expired_entries(getpid(), 0);
         printf("*************gc end\n");
 #if defined _WIN32
         Sleep(500);
@@ -700,8 +1304,8 @@ static void* test_gc_procedure(void * params)
 
     printf("gc thread exiting\n");
 
-    cache_purge_expired_entries(getpid());
-    cache_garbage_collect();
+    cache_purge_expired_entries(getpid(), 0);
+    cache_garbage_collect(0);
 
     return 0;
 }
@@ -782,6 +1386,249 @@ agent_memory_print(getpid());
     am_cache_destroy();
 }
 
+/**
+ * Only the first caller gets to make a session/policy request for the same token and resource,
+ * everyone else waits for it to finish.
+ */
+void test_policy_cache_single_flight(void **state) {
+
+    uint64_t key = am_policy_flight_key("token", "http://www.example.com:80/index.html", 0);
+    uint64_t other = am_policy_flight_key("token", "http://www.example.com:80/other.html", 0);
+    /* these two have the same 32 bit am_hash */
+    uint64_t collision = am_policy_flight_key("AQIC5w036371", "http://www.example.com:80/index.html", 0);
+    uint64_t collision_other = am_policy_flight_key("AQIC5w041354", "http://www.example.com:80/index.html", 0);
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    assert_int_equal(am_policy_flight_begin(key), AM_SUCCESS);
+    assert_int_equal(am_policy_flight_begin(key), AM_EAGAIN);
+    assert_int_equal(am_policy_flight_begin(key), AM_EAGAIN);
+    if ((other & 4095) != (key & 4095)) {
+        assert_int_equal(am_policy_flight_begin(other), AM_SUCCESS);
+        am_policy_flight_end(other);
+    }
+
+    am_policy_flight_end(key);
+    assert_int_equal(am_policy_flight_wait(key), AM_SUCCESS);
+    assert_int_equal(am_policy_flight_begin(key), AM_SUCCESS);
+    am_policy_flight_end(key);
+
+    /* a different token never waits for another token's request */
+    assert_int_equal(am_hash("AQIC5w036371"), am_hash("AQIC5w041354"));
+    assert_true(collision != collision_other);
+    assert_int_equal(am_policy_flight_begin(collision), AM_SUCCESS);
+    assert_int_equal(am_policy_flight_begin(collision_other), AM_SUCCESS);
+    am_policy_flight_end(collision_other);
+    am_policy_flight_end(collision);
+
+    am_cache_destroy();
+}
+
+#define FLIGHT_THREADS 8
+
+struct flight_takeover {
+    uint64_t key;
+    volatile int go;
+    int won[FLIGHT_THREADS];
+};
+
+struct flight_takeover_thread {
+    struct flight_takeover *ft;
+    int index;
+};
+
+static void *flight_takeover_procedure(void *arg) {
+    struct flight_takeover_thread *t = (struct flight_takeover_thread *) arg;
+    while (!t->ft->go) {
+        /* start together */
+    }
+    t->ft->won[t->index] = cache_flight_begin(t->ft->key, 60) == 0;
+    return NULL;
+}
+
+/**
+ * A slot left behind by a caller which is gone is taken over by just one of the callers which find it.
+ */
+void test_policy_cache_single_flight_takeover(void **state) {
+
+    struct flight_takeover ft;
+    struct flight_takeover_thread args[FLIGHT_THREADS];
+    am_thread_t threads[FLIGHT_THREADS];
+    int i, round, won;
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+    sleep(2); /* so that a slot can have expired a second ago */
+
+    for (round = 0; round < 200; round++) {
+        memset(&ft, 0, sizeof (ft));
+        ft.key = am_policy_flight_key("token", "http://www.example.com:80/index.html", round);
+
+        assert_int_equal(cache_flight_begin(ft.key, -1), 0);                  /* expired already */
+        for (i = 0; i < FLIGHT_THREADS; i++) {
+            args[i].ft = &ft;
+            args[i].index = i;
+            AM_THREAD_CREATE(threads[i], flight_takeover_procedure, &args[i]);
+        }
+        ft.go = 1;
+        for (i = 0, won = 0; i < FLIGHT_THREADS; i++) {
+            AM_THREAD_JOIN(threads[i]);
+            won += ft.won[i];
+        }
+        assert_int_equal(won, 1);
+        assert_int_equal(cache_flight_begin(ft.key, 60), 1);
+        cache_flight_end(ft.key);
+    }
+
+    am_cache_destroy();
+}
+
+/**
+ * The circuit breaker for a url opens after a number of consecutive failures, and closes on the first success.
+ */
+void test_policy_cache_circuit_breaker(void **state) {
+
+    const char *url = "http://openam.example.com:8080/openam";
+    int i;
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    for (i = 0; i < AM_NET_BREAKER_FAILURES - 1; i++) {
+        am_net_breaker_report(0, url, AM_ETIMEDOUT);
+        assert_int_equal(am_net_breaker_allow(0, url), AM_SUCCESS);
+    }
+    am_net_breaker_report(0, url, AM_SUCCESS);
+
+    for (i = 0; i < AM_NET_BREAKER_FAILURES; i++) {
+        am_net_breaker_report(0, url, AM_ECONNREFUSED);
+    }
+    assert_int_equal(am_net_breaker_allow(0, url), AM_ENOTSTARTED);
+    assert_int_equal(am_net_breaker_allow(0, "http://other.example.com:8080/openam"), AM_SUCCESS);
+
+    am_net_breaker_report(0, url, AM_SUCCESS);
+    assert_int_equal(am_net_breaker_allow(0, url), AM_SUCCESS);
+
+    /* a url with the same hash does not share the breaker, nor take it over */
+    assert_int_equal(am_hash("AQIC5w036371"), am_hash("AQIC5w041354"));
+    for (i = 0; i < AM_NET_BREAKER_FAILURES; i++) {
+        am_net_breaker_report(0, "AQIC5w036371", AM_ECONNREFUSED);
+    }
+    assert_int_equal(am_net_breaker_allow(0, "AQIC5w036371"), AM_ENOTSTARTED);
+    assert_int_equal(am_net_breaker_allow(0, "AQIC5w041354"), AM_SUCCESS);
+    am_net_breaker_report(0, "AQIC5w041354", AM_SUCCESS);
+    assert_int_equal(am_net_breaker_allow(0, "AQIC5w036371"), AM_ENOTSTARTED);
+
+    am_cache_destroy();
+}
+
+static int string_equality(void *a, void *b) {
+    return strcmp(a, b) == 0;
+}
+
+/**
+ * Expired entries can be read for the grace period, but only with cache_get_stale_readlocked_ptr.
+ */
+void test_policy_cache_stale_grace(void **state) {
+
+    char key[] = "stale-key";
+    uint32_t hash = am_hash(key), sz;
+    void *data;
+    time_t now;
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    /* relative to "now", the entry expired 10 seconds ago */
+    now = time(0) + 20;
+    assert_int_equal(cache_add(hash, key, sizeof (key), now - 10, string_equality), 0);
+
+    assert_int_equal(cache_get_readlocked_ptr(hash, &data, &sz, key, now, string_equality), 1);
+    assert_int_equal(cache_get_stale_readlocked_ptr(hash, &data, &sz, key, now, 5, string_equality), 1);
+    assert_int_equal(cache_get_stale_readlocked_ptr(hash, &data, &sz, key, now, 60, string_equality), 0);
+    assert_string_equal(data, key);
+    cache_release_readlocked_ptr(hash);
+
+    am_cache_destroy();
+}
+
+/**
+ * Expired entries are kept for the grace period only while a circuit breaker is open.
+ */
+void test_policy_cache_stale_grace_purge(void **state) {
+
+    const char *url = "http://openam.example.com:8080/openam";
+    char key[] = "stale-key";
+    uint32_t hash = am_hash(key), sz;
+    void *data;
+    int i;
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+    sleep(2); /* so that an entry can have expired a second ago */
+    am_stale_grace(60);
+
+    assert_int_equal(cache_add(hash, key, sizeof (key), time(0) - 1, string_equality), 0);
+    cache_purge_expired_entries(getpid(), 0);
+    assert_int_equal(cache_get_stale_readlocked_ptr(hash, &data, &sz, key, time(0), 60, string_equality), 1);
+
+    for (i = 0; i < AM_NET_BREAKER_FAILURES; i++) {
+        am_net_breaker_report(0, url, AM_ECONNREFUSED);
+    }
+    assert_int_equal(cache_add(hash, key, sizeof (key), time(0) - 1, string_equality), 0);
+    cache_purge_expired_entries(getpid(), 0);
+    assert_int_equal(cache_get_stale_readlocked_ptr(hash, &data, &sz, key, time(0), 60, string_equality), 0);
+    cache_release_readlocked_ptr(hash);
+
+    am_stale_grace(0);
+    am_cache_destroy();
+}
+
+/**
+ * Resolved host addresses are shared through the cache; expired entries are still served and only
+ * one caller gets to refresh them.
+ */
+void test_policy_cache_resolved_hosts(void **state) {
+    const char addr[] = "\x10 not really a sockaddr";
+    char data[RESOLVED_DATA_SZ];
+    uint32_t ln = sizeof (data);
+    int expired = -1;
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    assert_int_equal(am_net_resolved_get("openam.example.com", data, &ln, &expired), 1);
+
+    am_net_resolved_set("openam.example.com", addr, sizeof (addr), 3);
+    assert_int_equal(am_net_resolved_get("openam.example.com", data, &ln, &expired), 0);
+    assert_int_equal(ln, sizeof (addr));
+    assert_memory_equal(data, addr, sizeof (addr));
+    assert_int_equal(expired, 0);
+    assert_int_equal(am_net_resolved_get("other.example.com", data, &ln, &expired), 1);
+
+    cache_resolved_set(am_hash64("openam.example.com", 0), (uint32_t) strlen("openam.example.com"),
+            addr, sizeof (addr), -10, 3);
+    ln = sizeof (data);
+    assert_int_equal(am_net_resolved_get("openam.example.com", data, &ln, &expired), 0);
+    assert_int_equal(expired, 1);
+    assert_int_equal(am_net_resolved_refresh("openam.example.com"), 0);
+    assert_int_not_equal(am_net_resolved_refresh("openam.example.com"), 0);
+
+    am_net_resolved_set("openam.example.com", addr, sizeof (addr), 3);
+    assert_int_equal(am_net_resolved_get("openam.example.com", data, &ln, &expired), 0);
+    assert_int_equal(expired, 0);
+
+    /* host names with the same 32 bit hash are not mixed up */
+    assert_int_equal(am_hash("AQIC5w036371"), am_hash("AQIC5w041354"));
+    am_net_resolved_set("AQIC5w036371", addr, sizeof (addr), 3);
+    ln = sizeof (data);
+    assert_int_equal(am_net_resolved_get("AQIC5w041354", data, &ln, &expired), 1);
+    assert_int_not_equal(am_net_resolved_refresh("AQIC5w041354"), 0);
+    assert_int_equal(am_net_resolved_get("AQIC5w036371", data, &ln, &expired), 0);
+
+    am_cache_destroy();
+}
 
 /**
  * This is an internal test of the mechanism for replaying a given number of randomly generated strings
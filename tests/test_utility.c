@@ -24,6 +24,7 @@
 #include "platform.h"
 #include "utility.h"
 #include "log.h"
+#include "thread.h"
 #include "cmocka.h"
 
 
@@ -170,6 +171,69 @@ void test_match(void** state) {
     assert_int_equal(match(1, richard3, "[Gg]lourio.s"), AM_FAIL);
 }
 
+/**
+ * With the regex cache in place each pattern is compiled once, however often it is matched
+ * (patterns which do not compile are remembered too).
+ */
+void test_match_cached(void** state) {
+    unsigned long patterns, compiles, matches;
+    int i;
+
+    (void)state;
+
+    am_regex_cache_init();
+    for (i = 0; i < 10; i++) {
+        assert_int_equal(match(1, richard3, "[Gg]lorio.s"), AM_OK);
+        assert_int_equal(match(1, richard3, "Aardvark,"), AM_FAIL);
+        assert_int_equal(match(1, richard3, "[Gg]lorio(.s"), AM_FAIL);
+    }
+    am_regex_stats(&patterns, &compiles, NULL, &matches, NULL);
+    assert_int_equal(patterns, 3);
+    assert_int_equal(compiles, 3);
+    assert_int_equal(matches, 20);
+    am_regex_cache_shutdown();
+
+    /* without the cache, patterns are compiled per call */
+    assert_int_equal(match(1, richard3, "[Gg]lorio.s"), AM_OK);
+}
+
+#define MATCH_THREADS 8
+#define MATCH_COUNT 1000
+
+static void *match_procedure(void *arg) {
+    int i;
+    for (i = 0; i < MATCH_COUNT; i++) {
+        assert_int_equal(match(1, richard3, "[Gg]lorio.s"), AM_OK);
+        assert_int_equal(match(1, richard3, "Aardvark,"), AM_FAIL);
+    }
+    return NULL;
+}
+
+/**
+ * Threads matching the same patterns at the same time share one cache entry for each pattern, and every
+ * match is counted.
+ */
+void test_match_cached_threads(void** state) {
+    am_thread_t threads[MATCH_THREADS];
+    unsigned long patterns, compiles, matches;
+    int i;
+
+    (void)state;
+
+    am_regex_cache_init();
+    for (i = 0; i < MATCH_THREADS; i++) {
+        AM_THREAD_CREATE(threads[i], match_procedure, NULL);
+    }
+    for (i = 0; i < MATCH_THREADS; i++) {
+        AM_THREAD_JOIN(threads[i]);
+    }
+    am_regex_stats(&patterns, &compiles, NULL, &matches, NULL);
+    assert_int_equal(patterns, 2);
+    assert_true(compiles >= 2 && compiles <= 2 * MATCH_THREADS); /* racing threads can compile a pattern each */
+    assert_int_equal(matches, 2 * MATCH_THREADS * MATCH_COUNT);
+    am_regex_cache_shutdown();
+}
+
 /**
  * Note that the match_groups function isn't tested here because it is only invoked once in the entire codebase.
  * Also I can't quite figure what the length parameters should be set to.
@@ -940,3 +1004,26 @@ void test_pathinfo_removal(void **state) {
     }
     AM_FREE(iso88591, iso88591_url);
 }
+
+/**
+ * Retry back-off must stay within the time left in the budget.
+ */
+void test_backoff_budget(void **state) {
+    am_timer_t t;
+    unsigned int left;
+    int i;
+
+    am_timer_start(&t);
+    assert_true(am_timer_budget_left(&t, 60000) > 0);
+    assert_int_equal(am_timer_budget_left(&t, 0), 0);
+
+    for (i = 0; i < 4; i++) {
+        am_backoff(i, 10);
+    }
+    am_timer_stop(&t);
+
+    /* four waits of at most 10 ms each */
+    left = am_timer_budget_left(&t, 1000);
+    assert_true(left > 0);
+    assert_true(am_timer_elapsed(&t) < 0.5);
+}